@@ -0,0 +1,47 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Exception.h"
+#include "AsyncDataStore.h"
+
+using namespace cloudblockfs;
+
+void CompletionQueue::Completion::Rethrow() const
+{
+	switch(status) {
+		case COMPLETION_OK: break;
+		case COMPLETION_NOT_FOUND: throw FileNotFoundException(error);
+		default: throw FileIOException(error);
+	}
+}
+
+void CompletionQueue::Post(const Completion& completion)
+{
+	ScopedLock lock(m_lock);
+	m_completions.push_back(completion);
+	m_cond.Signal();
+}
+
+void CompletionQueue::Wait(Completion *out_completion)
+{
+	ScopedLock lock(m_lock);
+	while(m_completions.empty()) {
+		m_cond.Wait(m_lock);
+	}
+	*out_completion = m_completions.front();
+	m_completions.pop_front();
+}
@@ -0,0 +1,132 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_AsyncDataStore_h
+#define __cloudblockfs_AsyncDataStore_h
+
+#include <string>
+#include <deque>
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * Collects the results of asynchronous data store operations.
+	 */
+	class CompletionQueue
+	{
+	public:
+		enum Status
+		{
+			COMPLETION_OK,
+			COMPLETION_NOT_FOUND, // object does not exist
+			COMPLETION_ERROR
+		};
+		
+		struct Completion
+		{
+			void *tag; // tag passed when the operation was started
+			Status status;
+			std::string error; // error message if status is not COMPLETION_OK
+			
+			/**
+			 * Throws the error of a failed operation as an exception.
+			 */
+			void Rethrow() const;
+		};
+	private:
+		std::deque<Completion> m_completions;
+		Mutex m_lock;
+		Condition m_cond;
+		
+		CompletionQueue(const CompletionQueue&);
+		CompletionQueue& operator =(const CompletionQueue&);
+	public:
+		CompletionQueue() { }
+		
+		/**
+		 * Called by data stores when an operation finishes.
+		 */
+		void Post(const Completion& completion);
+		
+		/**
+		 * Waits for the next operation to finish.
+		 * @param out_completion Receives the result.
+		 */
+		void Wait(Completion *out_completion);
+	};
+	
+	/**
+	 * Asynchronous data store interface.
+	 * Each operation returns straight away and posts its result to the given
+	 * completion queue. Buffers passed in must stay valid until then.
+	 * Errors are reported through the completion, not thrown. A store may
+	 * hold operations back until Submit() is called, to start them together.
+	 */
+	class AsyncDataStore
+	{
+	public:
+		virtual ~AsyncDataStore() { }
+		
+		/**
+		 * Starts writing the named object.
+		 * @param name Name of object.
+		 * @param data Data
+		 * @param size Size in bytes to write.
+		 * @param queue Queue to post the result to.
+		 * @param tag User defined value returned in the completion.
+		 */
+		virtual void PutObjectAsync(const std::string& name,const void *data,int size,CompletionQueue *queue,void *tag) = 0;
+		
+		/**
+		 * Starts reading the named object.
+		 * @param name Name of object.
+		 * @param data Data
+		 * @param size Size in bytes to read.
+		 * @param queue Queue to post the result to.
+		 * @param tag User defined value returned in the completion.
+		 */
+		virtual void GetObjectAsync(const std::string& name,void *data,int size,CompletionQueue *queue,void *tag) = 0;
+		
+		/**
+		 * Starts taking a view of the named object, see DataStore::GetObjectView().
+		 * @param name Name of object.
+		 * @param size Size in bytes to view.
+		 * @param out_view Receives the view, set once the operation succeeds.
+		 * @param queue Queue to post the result to.
+		 * @param tag User defined value returned in the completion.
+		 */
+		virtual void GetObjectViewAsync(const std::string& name,int size,ObjectViewPtr *out_view,CompletionQueue *queue,void *tag) = 0;
+		
+		/**
+		 * Starts removing the named object.
+		 * @param name Name of object.
+		 * @param queue Queue to post the result to.
+		 * @param tag User defined value returned in the completion.
+		 */
+		virtual void DeleteObjectAsync(const std::string& name,CompletionQueue *queue,void *tag) = 0;
+		
+		/**
+		 * Starts any operations which were held back. Must be called before
+		 * waiting on their completions.
+		 */
+		virtual void Submit() { }
+	};
+}
+
+#endif
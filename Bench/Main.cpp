@@ -0,0 +1,692 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "BlockStorageDevice.h"
+#include "CompressingDataStore.h"
+#include "DataStore.h"
+#include "Exception.h"
+#include "FileDataStore.h"
+#include "Lz4.h"
+#include "MemoryDataStore.h"
+#include "PackFileDataStore.h"
+#include "S3DataStore.h"
+#include "SimulatedCloudDataStore.h"
+#include "Thread.h"
+#include "Trace.h"
+
+using namespace cloudblockfs;
+
+// written at the start of each block of a write, so no two writes are alike
+#define STAMP_INTERVAL 4096
+
+// the disk is filled this much at a time before a workload which reads
+#define FILL_SIZE (1024 * 1024)
+
+// a timed replay counts a record as late once it is issued this long after its time
+#define LATE_THRESHOLD 0.001
+
+// latencies are histogrammed in powers of two microseconds, up to this many
+#define HISTOGRAM_BUCKETS 32
+
+// disk image like data compressed by the compression benchmark
+#define COMPRESS_IMAGE_SIZE (4 * 1024 * 1024)
+
+static double Now()
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+static uint64_t XorShift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/**
+ * Forwards to another store and totals the requests made and the bytes
+ * they move.
+ */
+class AccountingDataStore : public DataStore
+{
+public:
+	struct Totals
+	{
+		uint64_t puts, gets, deletes, lists;
+		uint64_t bytes_put, bytes_got;
+	};
+private:
+	std::auto_ptr<DataStore> m_store;
+	mutable Mutex m_lock;
+	mutable Totals m_totals;
+	
+	void Add(uint64_t Totals::*requests,uint64_t Totals::*bytes,uint64_t size) const {
+		ScopedLock lock(m_lock);
+		m_totals.*requests += 1;
+		if(bytes) m_totals.*bytes += size;
+	}
+public:
+	AccountingDataStore(DataStore *store) : m_store(store) { Reset(); }
+	
+	void Reset() { ScopedLock lock(m_lock); memset(&m_totals,0,sizeof(m_totals)); }
+	void GetTotals(Totals *out_totals) const { ScopedLock lock(m_lock); *out_totals = m_totals; }
+	
+	virtual void PutObject(const std::string& name,const void *data,int size) {
+		m_store->PutObject(name,data,size);
+		Add(&Totals::puts,&Totals::bytes_put,size);
+	}
+	virtual void GetObject(const std::string& name,void *data,int size) const {
+		m_store->GetObject(name,data,size);
+		Add(&Totals::gets,&Totals::bytes_got,size);
+	}
+	virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const {
+		m_store->GetObjectRange(name,data,offset,size);
+		Add(&Totals::gets,&Totals::bytes_got,size);
+	}
+	virtual ObjectViewPtr GetObjectView(const std::string& name,int size) const {
+		ObjectViewPtr view = m_store->GetObjectView(name,size);
+		Add(&Totals::gets,&Totals::bytes_got,view->GetSize());
+		return view;
+	}
+	virtual void DeleteObject(const std::string& name) {
+		Add(&Totals::deletes,NULL,0);
+		m_store->DeleteObject(name);
+	}
+	virtual void DeleteObjects(const std::vector<std::string>& names) {
+		for(size_t i = 0; i < names.size(); i++) Add(&Totals::deletes,NULL,0);
+		m_store->DeleteObjects(names);
+	}
+	virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const {
+		Add(&Totals::lists,NULL,0);
+		m_store->ListObjects(list_function,userdata);
+	}
+	virtual void Flush() { m_store->Flush(); }
+};
+
+struct Options
+{
+	std::string store;
+	std::string trace; // replayed instead of the pattern below
+	bool timed;
+	double speed;
+	double phase;
+	bool random;
+	int read_percent;
+	int io_size;
+	int alignment;
+	int threads;
+	uint64_t disk_size;
+	uint64_t ops;
+	double seconds;
+	bool fill;
+	int block_size;
+	int tree_depth;
+	int segment_blocks;
+	int cache;
+	int queue_depth;
+	bool dedup;
+	bool compress;
+	double latency; // of a simulated cloud store
+	double bandwidth;
+	uint64_t seed;
+};
+
+/**
+ * A read, write or flush made by the workload.
+ */
+struct Sample
+{
+	uint32_t phase;
+	uint32_t latency; // microseconds
+	Trace::Op op;
+	int size;
+};
+
+/**
+ * State shared by the threads running the workload.
+ */
+struct Workload
+{
+	const Options *options;
+	const Trace *trace; // or NULL to generate the pattern in options
+	BlockStorageDevice *device;
+	AccountingDataStore *store;
+	int buffer_size;
+	double start_time;
+	Mutex mutex; // guards the fields below
+	uint64_t issued;
+	uint64_t next_offset; // of sequential access
+	double end_time;
+	std::vector<double> phase_times; // when each phase began
+	std::vector<AccountingDataStore::Totals> phase_totals; // store totals as each phase began
+	std::string error;
+	
+	/**
+	 * Takes the next trace record, or makes up one from the pattern.
+	 * @return false once the workload is done.
+	 */
+	bool Next(uint64_t *state,Trace::Record *out_record,uint32_t *out_phase) {
+		ScopedLock lock(mutex);
+		if(!error.empty()) return false;
+		if(end_time && Now() >= end_time) return false;
+		
+		if(trace) {
+			const std::vector<Trace::Record>& records = trace->GetRecords();
+			if(issued == records.size()) return false;
+			*out_record = records[issued++];
+			*out_phase = (uint32_t)(out_record->time / options->phase);
+			while(phase_times.size() <= *out_phase) {
+				AccountingDataStore::Totals totals;
+				store->GetTotals(&totals);
+				phase_times.push_back(Now());
+				phase_totals.push_back(totals);
+			}
+			// a trace of a larger disk folds onto this one
+			if(out_record->offset + out_record->size > options->disk_size) {
+				out_record->offset = out_record->offset % (options->disk_size - out_record->size + 1) / 512 * 512;
+			}
+			return true;
+		}
+		
+		if(issued == options->ops) return false;
+		issued++;
+		out_record->time = 0;
+		out_record->size = options->io_size;
+		out_record->offset = next_offset;
+		next_offset += options->io_size;
+		if(next_offset + options->io_size > options->disk_size) next_offset = 0;
+		if(options->random) {
+			const uint64_t slots = (options->disk_size - options->io_size) / options->alignment + 1;
+			out_record->offset = XorShift(state) % slots * options->alignment;
+		}
+		const bool read = (int)(XorShift(state) % 100) < options->read_percent;
+		out_record->op = read ? Trace::OP_READ : Trace::OP_WRITE;
+		*out_phase = 0;
+		return true;
+	}
+};
+
+struct Worker
+{
+	Workload *workload;
+	uint64_t seed;
+	std::vector<Sample> samples;
+	uint64_t late;
+	
+	static void Run(void *userdata) {
+		Worker *worker = (Worker *)userdata;
+		Workload *workload = worker->workload;
+		const Options& options = *workload->options;
+		std::vector<char> buffer(workload->buffer_size);
+		uint64_t state = worker->seed;
+		for(size_t i = 0; i < buffer.size(); i++) buffer[i] = (char)XorShift(&state);
+		
+		try {
+			for(uint64_t stamp = worker->seed; ; stamp++) {
+				Trace::Record record;
+				uint32_t phase;
+				if(!workload->Next(&state,&record,&phase)) return;
+				if(workload->trace && options.timed) {
+					const double wait = workload->start_time + record.time / options.speed - Now();
+					if(wait > 0) usleep((useconds_t)(wait * 1000000));
+					else if(wait < -LATE_THRESHOLD) worker->late++;
+				}
+				
+				const double start = Now();
+				if(record.op == Trace::OP_READ) {
+					workload->device->Read(&buffer[0],record.size,record.offset);
+				} else if(record.op == Trace::OP_WRITE) {
+					for(int i = 0; i + (int)sizeof(stamp) <= record.size; i += STAMP_INTERVAL) {
+						memcpy(&buffer[i],&stamp,sizeof(stamp));
+					}
+					workload->device->Write(&buffer[0],record.size,record.offset);
+				} else {
+					workload->device->Flush();
+				}
+				Sample sample = { phase, (uint32_t)((Now() - start) * 1000000), record.op, record.size };
+				worker->samples.push_back(sample);
+			}
+		} catch(const std::runtime_error& e) {
+			ScopedLock lock(workload->mutex);
+			if(workload->error.empty()) workload->error = e.what();
+		}
+	}
+};
+
+static DataStore *OpenStore(const Options& options)
+{
+	const std::string& spec = options.store;
+	DataStore *store;
+	if(spec == "memory") {
+		store = new MemoryDataStore();
+	} else if(spec.compare(0,5,"file:") == 0) {
+		store = new FileDataStore(spec.substr(5));
+	} else if(spec.compare(0,5,"pack:") == 0) {
+		store = new PackFileDataStore(spec.substr(5));
+	} else if(spec == "cloud") {
+		SimulatedCloudDataStore *cloud = new SimulatedCloudDataStore(new MemoryDataStore(),options.seed);
+		for(int i = 0; i < SimulatedCloudDataStore::REQUEST_COUNT; i++) {
+			cloud->SetLatency((SimulatedCloudDataStore::Request)i,options.latency,0.5);
+		}
+		cloud->SetBandwidth(options.bandwidth);
+		store = cloud;
+	} else if(spec.compare(0,5,"s3://") == 0) {
+		const char *access_key = getenv("AWS_ACCESS_KEY_ID"), *secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+		const char *region = getenv("AWS_REGION");
+		const size_t slash = spec.find('/',5);
+		if(!access_key || !secret_key || slash == std::string::npos) {
+			throw InvalidArgumentException("s3 needs s3://host:port/bucket, AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY");
+		}
+		store = new S3DataStore(spec.substr(5,slash - 5),spec.substr(slash + 1),access_key,secret_key,
+			region ? region : "us-east-1",options.queue_depth);
+	} else {
+		throw InvalidArgumentException(spec + ": Unknown store");
+	}
+	if(options.compress) store = new CompressingDataStore(store);
+	return store;
+}
+
+static uint32_t Percentile(const std::vector<uint32_t>& sorted,double percentile)
+{
+	return sorted[std::min<size_t>(sorted.size() - 1,(size_t)(percentile * sorted.size()))];
+}
+
+static void PrintLatencies(const char *name,std::vector<uint32_t>& latencies,uint64_t bytes,double seconds)
+{
+	if(latencies.empty()) return;
+	std::sort(latencies.begin(),latencies.end());
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	printf("%-6s %10llu %10.1f %10.0f",name,(unsigned long long)latencies.size(),bytes / seconds / 1048576,latencies.size() / seconds);
+	for(int i = 0; i < 4; i++) printf(" %10u",Percentile(latencies,percentiles[i]));
+	printf(" %10u\n",latencies.back());
+}
+
+static void PrintHistogram(const std::vector<Sample>& samples)
+{
+	uint64_t counts[HISTOGRAM_BUCKETS][Trace::OP_COUNT];
+	memset(counts,0,sizeof(counts));
+	int first = HISTOGRAM_BUCKETS, last = -1;
+	for(size_t i = 0; i < samples.size(); i++) {
+		int bucket = 0;
+		while(bucket < HISTOGRAM_BUCKETS - 1 && (1U << bucket) < samples[i].latency) bucket++;
+		counts[bucket][samples[i].op]++;
+		first = std::min(first,bucket);
+		last = std::max(last,bucket);
+	}
+	
+	printf("\n%-10s %10s %10s %10s\n","us <=","reads","writes","flushes");
+	for(int i = first; i <= last; i++) {
+		printf("%-10u %10llu %10llu %10llu\n",1U << i,(unsigned long long)counts[i][Trace::OP_READ],
+			(unsigned long long)counts[i][Trace::OP_WRITE],(unsigned long long)counts[i][Trace::OP_FLUSH]);
+	}
+}
+
+static void PrintPhases(const Workload& workload,const std::vector<Sample>& samples,double phase)
+{
+	const size_t phases = workload.phase_times.size() - 1;
+	std::vector<std::vector<uint32_t> > latencies(phases);
+	std::vector<uint64_t> reads(phases), writes(phases), bytes_read(phases), bytes_written(phases);
+	for(size_t i = 0; i < samples.size(); i++) {
+		const Sample& sample = samples[i];
+		latencies[sample.phase].push_back(sample.latency);
+		if(sample.op == Trace::OP_READ) {
+			reads[sample.phase]++;
+			bytes_read[sample.phase] += sample.size;
+		} else if(sample.op == Trace::OP_WRITE) {
+			writes[sample.phase]++;
+			bytes_written[sample.phase] += sample.size;
+		}
+	}
+	
+	printf("\n%8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n","trace s","wall s","reads","writes","read MB/s","write MB/s",
+		"p50 us","p99 us","PUT","GET","DELETE");
+	for(size_t i = 0; i < phases; i++) {
+		if(latencies[i].empty()) continue;
+		std::sort(latencies[i].begin(),latencies[i].end());
+		const double seconds = workload.phase_times[i + 1] - workload.phase_times[i];
+		const AccountingDataStore::Totals& begin = workload.phase_totals[i], &end = workload.phase_totals[i + 1];
+		printf("%8.1f %8.2f %8llu %8llu %8.1f %8.1f %8u %8u %8llu %8llu %8llu\n",i * phase,seconds,
+			(unsigned long long)reads[i],(unsigned long long)writes[i],bytes_read[i] / seconds / 1048576,
+			bytes_written[i] / seconds / 1048576,Percentile(latencies[i],0.5),Percentile(latencies[i],0.99),
+			(unsigned long long)(end.puts - begin.puts),(unsigned long long)(end.gets - begin.gets),
+			(unsigned long long)(end.deletes - begin.deletes));
+	}
+}
+
+static void PrintRequests(const char *name,uint64_t requests,uint64_t bytes,uint64_t ops)
+{
+	printf("%-6s %10llu %14llu %10.2f %14.0f\n",name,(unsigned long long)requests,(unsigned long long)bytes,
+		ops ? (double)requests / ops : 0.0,ops ? (double)bytes / ops : 0.0);
+}
+
+static void FillImageData(std::vector<char>& data,uint64_t seed)
+{
+	// runs of zeros, noise and text, as a disk image has
+	static const char *words[] = { "the ", "block ", "device ", "store ", "object ", "cloud ", "file ", "system ", "data ", "\n" };
+	uint64_t state = seed;
+	for(size_t i = 0; i < data.size(); ) {
+		const size_t run = std::min<size_t>(data.size() - i,256 + XorShift(&state) % 4096);
+		switch(XorShift(&state) % 4) {
+			case 0: memset(&data[i],0,run); break;
+			case 1: for(size_t j = 0; j < run; j++) data[i + j] = (char)XorShift(&state); break;
+			default:
+				for(size_t j = 0; j < run; ) {
+					const char *word = words[XorShift(&state) % 10];
+					for(; *word && j < run; j++) data[i + j] = *word++;
+				}
+				break;
+		}
+		i += run;
+	}
+}
+
+static void CompressionBenchmark(const Options& options)
+{
+	// throughput and ratio of each block size up to the one given
+	std::vector<char> image(COMPRESS_IMAGE_SIZE), compressed, out;
+	FillImageData(image,options.seed);
+	printf("%8s %12s %12s %8s\n","block","compress","decompress","ratio");
+	for(int block_size = 1024; block_size <= options.block_size; block_size *= 2) {
+		const int blocks = image.size() / block_size;
+		compressed.resize(image.size());
+		std::vector<int> sizes(blocks);
+		
+		size_t stored = 0;
+		double start = Now();
+		for(int i = 0; i < blocks; i++) {
+			const char *block = &image[i * block_size];
+			sizes[i] = 0;
+			if(CompressingDataStore::IsCompressible(block,block_size)) {
+				sizes[i] = Lz4::Compress(block,block_size,&compressed[i * block_size],block_size - block_size / 8);
+			}
+			stored += sizes[i] ? sizes[i] : block_size;
+		}
+		const double compress_time = Now() - start;
+		
+		out.resize(block_size);
+		start = Now();
+		for(int i = 0; i < blocks; i++) {
+			if(sizes[i] && Lz4::Decompress(&compressed[i * block_size],sizes[i],&out[0],block_size) != block_size) {
+				throw ReadErrorException("Decompressed block does not match");
+			}
+		}
+		const double decompress_time = Now() - start;
+		
+		printf("%8d %9.0fMB/s %9.0fMB/s %8.2f\n",block_size,
+			image.size() / (1024.0 * 1024.0) / std::max(compress_time,1e-6),
+			image.size() / (1024.0 * 1024.0) / std::max(decompress_time,1e-6),
+			(double)image.size() / stored);
+	}
+}
+
+static void Usage()
+{
+	fprintf(stderr,
+		"usage: cbfs-bench [options]\n"
+		"  -s store      memory, file:PATH, pack:PATH, cloud or s3://HOST:PORT/BUCKET (memory)\n"
+		"  -p pattern    read, write, rw, randread, randwrite or randrw (randrw), or compress to\n"
+		"                time compression alone for block sizes up to -b\n"
+		"  -M percent    reads in a mixed workload (50)\n"
+		"  -i bytes      size of each read or write (4096)\n"
+		"  -a bytes      alignment of random offsets (the I/O size)\n"
+		"  -T trace      replay blkparse output or time,op,offset,size CSV instead of a pattern\n"
+		"  -F            replay records at their recorded times, rather than as fast as possible\n"
+		"  -S factor     speed up a timed replay (1)\n"
+		"  -P seconds    length of each reported phase of a replay, in trace time (10)\n"
+		"  -q threads    reads and writes in flight (1)\n"
+		"  -z megabytes  disk size (256, or enough for the trace)\n"
+		"  -n ops        reads and writes to make (10000)\n"
+		"  -t seconds    stop after this long, even short of -n or the end of the trace\n"
+		"  -E            start from an empty disk, rather than one filled before reads\n"
+		"  -b bytes      block size (65536)\n"
+		"  -d levels     block map tree depth (the least which fits the disk)\n"
+		"  -g blocks     blocks packed into each segment (0)\n"
+		"  -c megabytes  block cache (0)\n"
+		"  -Q transfers  object transfers in flight, and S3 connections (16)\n"
+		"  -D            deduplicate blocks\n"
+		"  -C            compress objects\n"
+		"  -l ms         median request latency of the cloud store (20)\n"
+		"  -w MB/s       bandwidth per connection of the cloud store (50)\n"
+		"  -r seed       seed for offsets, data and the cloud store (1)\n");
+}
+
+int main(int argc,char *argv[])
+{
+	Options options;
+	options.store = "memory";
+	options.timed = false;
+	options.speed = 1;
+	options.phase = 10;
+	options.random = true;
+	options.read_percent = 50;
+	options.io_size = 4096;
+	options.alignment = 0;
+	options.threads = 1;
+	options.disk_size = 0;
+	options.ops = 10000;
+	options.seconds = 0;
+	options.fill = true;
+	options.block_size = 65536;
+	options.tree_depth = 0;
+	options.segment_blocks = 0;
+	options.cache = 0;
+	options.queue_depth = 16;
+	options.dedup = false;
+	options.compress = false;
+	options.latency = 20;
+	options.bandwidth = 50;
+	options.seed = 1;
+	
+	std::string pattern = "randrw";
+	int c;
+	while((c = getopt(argc,argv,"s:p:M:i:a:T:FS:P:q:z:n:t:Eb:d:g:c:Q:DCl:w:r:h")) != -1) {
+		switch(c) {
+			case 's': options.store = optarg; break;
+			case 'p': pattern = optarg; break;
+			case 'M': options.read_percent = atoi(optarg); break;
+			case 'i': options.io_size = atoi(optarg); break;
+			case 'a': options.alignment = atoi(optarg); break;
+			case 'T': options.trace = optarg; break;
+			case 'F': options.timed = true; break;
+			case 'S': options.speed = atof(optarg); break;
+			case 'P': options.phase = atof(optarg); break;
+			case 'q': options.threads = atoi(optarg); break;
+			case 'z': options.disk_size = strtoull(optarg,NULL,10); break;
+			case 'n': options.ops = strtoull(optarg,NULL,10); break;
+			case 't': options.seconds = atof(optarg); break;
+			case 'E': options.fill = false; break;
+			case 'b': options.block_size = atoi(optarg); break;
+			case 'd': options.tree_depth = atoi(optarg); break;
+			case 'g': options.segment_blocks = atoi(optarg); break;
+			case 'c': options.cache = atoi(optarg); break;
+			case 'Q': options.queue_depth = atoi(optarg); break;
+			case 'D': options.dedup = true; break;
+			case 'C': options.compress = true; break;
+			case 'l': options.latency = atof(optarg); break;
+			case 'w': options.bandwidth = atof(optarg); break;
+			case 'r': options.seed = strtoull(optarg,NULL,10); break;
+			default: Usage(); return 1;
+		}
+	}
+	
+	if(pattern == "compress") {
+		if(options.block_size < 1024 || options.block_size > COMPRESS_IMAGE_SIZE || !options.seed) {
+			Usage();
+			return 1;
+		}
+		try {
+			CompressionBenchmark(options);
+		} catch(const std::runtime_error& e) {
+			fprintf(stderr,"cbfs-bench: %s\n",e.what());
+			return 1;
+		}
+		return 0;
+	}
+	
+	options.random = pattern.compare(0,4,"rand") == 0;
+	const std::string access = options.random ? pattern.substr(4) : pattern;
+	if(access == "read") options.read_percent = 100;
+	else if(access == "write") options.read_percent = 0;
+	else if(access != "rw") {
+		Usage();
+		return 1;
+	}
+	options.disk_size *= 1024 * 1024;
+	options.latency /= 1000;
+	options.bandwidth *= 1024 * 1024;
+	if(!options.alignment) options.alignment = options.io_size;
+	if(options.block_size < 64 || options.io_size <= 0 || options.alignment <= 0 || options.threads <= 0 || options.queue_depth <= 0 ||
+	   options.speed <= 0 || options.phase <= 0 || !options.seed) {
+		Usage();
+		return 1;
+	}
+	
+	try {
+		std::auto_ptr<Trace> trace;
+		int buffer_size = options.io_size;
+		bool reads = options.read_percent > 0;
+		if(!options.trace.empty()) {
+			trace.reset(new Trace(options.trace));
+			const std::vector<Trace::Record>& records = trace->GetRecords();
+			if(records.empty()) throw InvalidArgumentException(options.trace + ": No reads or writes to replay");
+			buffer_size = std::max(trace->GetMaxSize(),1);
+			reads = false;
+			for(size_t i = 0; i < records.size() && !reads; i++) reads = records[i].op == Trace::OP_READ;
+			if(!options.disk_size) options.disk_size = (trace->GetEnd() + FILL_SIZE - 1) / FILL_SIZE * FILL_SIZE;
+		}
+		if(!options.disk_size) options.disk_size = 256 * 1024 * 1024;
+		if(options.disk_size < (uint64_t)buffer_size) throw InvalidArgumentException("The disk is smaller than a single read or write");
+		
+		// each level of the block map multiplies the blocks it can address by the IDs in a block
+		int tree_depth = 1;
+		for(uint64_t capacity = (uint64_t)options.block_size * (options.block_size / 8); capacity < options.disk_size; tree_depth++) capacity *= options.block_size / 8;
+		if(!options.tree_depth) options.tree_depth = tree_depth;
+		if(options.tree_depth < tree_depth) throw InvalidArgumentException("The disk needs a deeper block map");
+		
+		AccountingDataStore *store = new AccountingDataStore(OpenStore(options));
+		BlockStorageDevice device(store);
+		device.Format(options.block_size,options.tree_depth,options.segment_blocks);
+		device.Truncate(options.disk_size);
+		device.SetQueueDepth(options.queue_depth);
+		device.SetDedup(options.dedup);
+		if(options.cache) device.SetCacheSize((size_t)options.cache * 1024 * 1024);
+		
+		// reads of a disk never written would not reach the store
+		if(reads && options.fill) {
+			std::vector<char> data(FILL_SIZE);
+			uint64_t state = options.seed;
+			for(uint64_t offset = 0; offset < options.disk_size; offset += data.size()) {
+				for(size_t i = 0; i < data.size(); i++) data[i] = (char)XorShift(&state);
+				device.Write(&data[0],std::min<uint64_t>(data.size(),options.disk_size - offset),offset);
+			}
+			device.Sync();
+		}
+		store->Reset();
+		
+		Workload workload;
+		workload.options = &options;
+		workload.trace = trace.get();
+		workload.device = &device;
+		workload.store = store;
+		workload.buffer_size = buffer_size;
+		workload.issued = 0;
+		workload.next_offset = 0;
+		
+		std::vector<Worker> workers(options.threads);
+		std::vector<Thread *> threads;
+		workload.start_time = Now();
+		workload.end_time = options.seconds > 0 ? workload.start_time + options.seconds : 0;
+		workload.phase_times.push_back(workload.start_time);
+		workload.phase_totals.push_back(AccountingDataStore::Totals());
+		store->GetTotals(&workload.phase_totals.back());
+		for(int i = 0; i < options.threads; i++) {
+			workers[i].workload = &workload;
+			workers[i].seed = options.seed * 0x9E3779B97F4A7C15ULL + i + 1;
+			workers[i].late = 0;
+			threads.push_back(new Thread(Worker::Run,&workers[i]));
+		}
+		for(int i = 0; i < options.threads; i++) delete threads[i];
+		const double run_time = Now() - workload.start_time;
+		if(!workload.error.empty()) throw ReadErrorException(workload.error);
+		workload.phase_times.push_back(workload.start_time + run_time);
+		workload.phase_totals.push_back(AccountingDataStore::Totals());
+		store->GetTotals(&workload.phase_totals.back());
+		
+		// writes are only accounted for once they reach the store
+		device.Sync();
+		const double sync_time = Now() - workload.start_time - run_time;
+		
+		std::vector<Sample> samples;
+		std::vector<uint32_t> latencies[Trace::OP_COUNT];
+		uint64_t bytes[Trace::OP_COUNT] = { 0, 0, 0 }, late = 0;
+		for(int i = 0; i < options.threads; i++) {
+			samples.insert(samples.end(),workers[i].samples.begin(),workers[i].samples.end());
+			late += workers[i].late;
+		}
+		for(size_t i = 0; i < samples.size(); i++) {
+			latencies[samples[i].op].push_back(samples[i].latency);
+			bytes[samples[i].op] += samples[i].size;
+		}
+		const uint64_t ops = samples.size();
+		const uint64_t bytes_read = bytes[Trace::OP_READ], bytes_written = bytes[Trace::OP_WRITE];
+		
+		if(trace.get()) {
+			char timing[64] = "as fast as possible";
+			if(options.timed) snprintf(timing,sizeof(timing),"at %gx speed, %llu late",options.speed,(unsigned long long)late);
+			printf("%s, replay of %s (%d skipped) %s, %d threads, %llu ops in %.2fs, sync %.2fs\n",options.store.c_str(),
+				options.trace.c_str(),trace->GetSkipped(),timing,options.threads,(unsigned long long)ops,run_time,sync_time);
+			PrintPhases(workload,samples,options.phase);
+		} else {
+			printf("%s, %s %d bytes aligned to %d, %d threads, %llu ops in %.2fs, sync %.2fs\n",options.store.c_str(),
+				pattern.c_str(),options.io_size,options.alignment,options.threads,(unsigned long long)ops,run_time,sync_time);
+		}
+		printf("\n%-6s %10s %10s %10s %10s %10s %10s %10s %10s\n","","ops","MB/s","IOPS","p50 us","p90 us","p99 us","p99.9 us","max us");
+		PrintLatencies("read",latencies[Trace::OP_READ],bytes_read,run_time);
+		PrintLatencies("write",latencies[Trace::OP_WRITE],bytes_written,run_time);
+		PrintLatencies("flush",latencies[Trace::OP_FLUSH],0,run_time);
+		PrintHistogram(samples);
+		
+		AccountingDataStore::Totals totals;
+		store->GetTotals(&totals);
+		printf("\n%-6s %10s %14s %10s %14s\n","","requests","bytes","per op","bytes per op");
+		PrintRequests("PUT",totals.puts,totals.bytes_put,ops);
+		PrintRequests("GET",totals.gets,totals.bytes_got,ops);
+		PrintRequests("DELETE",totals.deletes,0,ops);
+		PrintRequests("LIST",totals.lists,0,ops);
+		printf("\namplification: write %.2f, read %.2f\n",bytes_written ? (double)totals.bytes_put / bytes_written : 0.0,
+			bytes_read ? (double)totals.bytes_got / bytes_read : 0.0);
+	} catch(const std::runtime_error& e) {
+		fprintf(stderr,"cbfs-bench: %s\n",e.what());
+		return 1;
+	}
+	return 0;
+}
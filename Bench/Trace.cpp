@@ -0,0 +1,164 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "Exception.h"
+#include "Trace.h"
+
+// blkparse reports extents in 512 byte sectors
+#define SECTOR_SIZE 512
+
+#define MAX_LINE 1024
+
+using namespace cloudblockfs;
+
+static bool CompareTime(const Trace::Record& a,const Trace::Record& b)
+{
+	return a.time < b.time;
+}
+
+Trace::Trace(const std::string& path) : m_skipped(0)
+{
+	FILE *fp = fopen(path.c_str(),"r");
+	if(!fp) throw FileNotFoundException(path + ": Unable to open trace");
+	
+	// blkparse events by action, of which the first non-empty is replayed
+	const char actions[] = "QDC";
+	std::vector<Record> events[3];
+	int skipped[3] = { 0, 0, 0 };
+	char line[MAX_LINE];
+	int line_number = 0;
+	bool csv = false, started = false;
+	while(fgets(line,sizeof(line),fp)) {
+		line_number++;
+		const char *p = line;
+		while(isspace((unsigned char)*p)) p++;
+		if(!*p || *p == '#') continue;
+		if(!started) {
+			started = true;
+			// blkparse lines start with the device as major,minor
+			int commas = 0;
+			for(const char *q = p; *q; q++) commas += *q == ',';
+			const bool header = !isdigit((unsigned char)*p) && *p != '.';
+			csv = commas >= 3 || (header && commas);
+			if(csv && header) continue;
+		}
+		
+		Record record;
+		if(csv) {
+			if(!ParseCsv(p,&record)) {
+				fclose(fp);
+				char message[64];
+				snprintf(message,sizeof(message),":%d: Malformed trace record",line_number);
+				throw InvalidArgumentException(path + message);
+			}
+			if(record.size < 0) m_skipped++;
+			else m_records.push_back(record);
+		} else {
+			char action;
+			if(!ParseBlkparse(p,&action,&record)) continue;
+			const char *found = strchr(actions,action);
+			if(!found) continue;
+			if(record.size < 0) skipped[found - actions]++;
+			else events[found - actions].push_back(record);
+		}
+	}
+	fclose(fp);
+	
+	if(!csv) {
+		for(int i = 0; i < 3; i++) {
+			if(events[i].empty() && !skipped[i]) continue;
+			m_records.swap(events[i]);
+			m_skipped = skipped[i];
+			break;
+		}
+	}
+	
+	std::stable_sort(m_records.begin(),m_records.end(),CompareTime);
+	if(!m_records.empty()) {
+		const double start = m_records[0].time;
+		for(size_t i = 0; i < m_records.size(); i++) m_records[i].time -= start;
+	}
+}
+
+bool Trace::ParseCsv(const char *line,Record *out_record)
+{
+	char op[16];
+	unsigned long long offset = 0;
+	int size = 0;
+	const int fields = sscanf(line,"%lf , %15[^, \t] , %llu , %d",&out_record->time,op,&offset,&size);
+	if(fields < 2) return false;
+	
+	switch(toupper((unsigned char)op[0])) {
+		case 'R': out_record->op = OP_READ; break;
+		case 'W': out_record->op = OP_WRITE; break;
+		case 'F': out_record->op = OP_FLUSH; break;
+		case 'D': out_record->op = OP_FLUSH; size = -1; break;
+		default: return false;
+	}
+	if(out_record->op != OP_FLUSH && (fields < 4 || size <= 0)) return false;
+	out_record->offset = offset;
+	out_record->size = out_record->op == OP_FLUSH && size >= 0 ? 0 : size;
+	return true;
+}
+
+bool Trace::ParseBlkparse(const char *line,char *out_action,Record *out_record)
+{
+	char action[16], rwbs[16];
+	unsigned long long sector = 0;
+	int sectors = 0;
+	const int fields = sscanf(line,"%*s %*d %*u %lf %*u %15s %15s %llu + %d",
+		&out_record->time,action,rwbs,&sector,&sectors);
+	if(fields < 3 || action[1]) return false;
+	
+	*out_action = action[0];
+	out_record->offset = sector * SECTOR_SIZE;
+	out_record->size = fields == 5 ? sectors * SECTOR_SIZE : 0;
+	if(strchr(rwbs,'D')) {
+		out_record->size = -1;
+	} else if(out_record->size == 0) {
+		// a flush carries no data; anything else without an extent is not I/O
+		if(!strchr(rwbs,'F')) return false;
+		out_record->op = OP_FLUSH;
+	} else if(strchr(rwbs,'W')) {
+		out_record->op = OP_WRITE;
+	} else if(strchr(rwbs,'R')) {
+		out_record->op = OP_READ;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+uint64_t Trace::GetEnd() const
+{
+	uint64_t end = 0;
+	for(size_t i = 0; i < m_records.size(); i++) {
+		end = std::max(end,m_records[i].offset + m_records[i].size);
+	}
+	return end;
+}
+
+int Trace::GetMaxSize() const
+{
+	int size = 0;
+	for(size_t i = 0; i < m_records.size(); i++) size = std::max(size,m_records[i].size);
+	return size;
+}
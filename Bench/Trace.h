@@ -0,0 +1,88 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_Trace_h
+#define __cloudblockfs_Trace_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace cloudblockfs
+{
+	/**
+	 * A recorded block I/O trace, to replay against a device.
+	 */
+	class Trace
+	{
+	public:
+		enum Op { OP_READ, OP_WRITE, OP_FLUSH, OP_COUNT };
+		
+		struct Record
+		{
+			double time; // seconds since the first record
+			Op op;
+			uint64_t offset;
+			int size;
+		};
+	private:
+		std::vector<Record> m_records;
+		int m_skipped;
+		
+		/**
+		 * Parses time,op,offset,size. Discards are returned with a negative size.
+		 */
+		bool ParseCsv(const char *line,Record *out_record);
+		
+		/**
+		 * Parses an event of the form
+		 * "dev cpu sequence time pid action rwbs sector + sectors [process]".
+		 * Discards are returned with a negative size.
+		 */
+		bool ParseBlkparse(const char *line,char *out_action,Record *out_record);
+	public:
+		/**
+		 * Reads a trace, either the default text output of blkparse or CSV
+		 * lines of time,op,offset,size with the time in seconds, op one of
+		 * R, W or F, and offset and size in bytes. Of blkparse output only
+		 * queue events are replayed, or if there are none, issue or
+		 * complete events. Records are sorted by time.
+		 * @throws FileNotFoundException if the trace does not exist.
+		 * @throws InvalidArgumentException if a CSV line is malformed.
+		 */
+		Trace(const std::string& path);
+		
+		const std::vector<Record>& GetRecords() const { return m_records; }
+		
+		/**
+		 * @return Events which were read but are not replayed, such as discards.
+		 */
+		int GetSkipped() const { return m_skipped; }
+		
+		/**
+		 * @return End of the highest extent read or written.
+		 */
+		uint64_t GetEnd() const;
+		
+		/**
+		 * @return Largest read or write.
+		 */
+		int GetMaxSize() const;
+	};
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "BlockCache.h"
+
+using namespace cloudblockfs;
+
+BlockCache::BlockCache() : m_block_size(0), m_capacity(0), m_dirty_count(0), m_generation(0)
+{
+}
+
+void BlockCache::SetCapacity(size_t bytes)
+{
+	m_capacity = bytes;
+	if(m_block_size) EvictClean(m_capacity / m_block_size);
+}
+
+void BlockCache::EraseSlot(SlotMap::iterator it)
+{
+	if(it->second.entry.dirty) m_dirty_count--;
+	m_lru.erase(it->second.lru);
+	m_slots.erase(it);
+}
+
+void BlockCache::EvictClean(size_t max_blocks)
+{
+	// walk from the least recently used end, skipping pinned dirty blocks
+	LRUList::iterator it = m_lru.end();
+	while(m_slots.size() > max_blocks && it != m_lru.begin()) {
+		--it;
+		SlotMap::iterator slot = m_slots.find(*it);
+		if(!slot->second.entry.dirty) {
+			LRUList::iterator next = it;
+			++next;
+			EraseSlot(slot);
+			it = next;
+		}
+	}
+}
+
+BlockCache::Entry *BlockCache::Find(uint64_t blockno)
+{
+	SlotMap::iterator it = m_slots.find(blockno);
+	if(it == m_slots.end()) return NULL;
+	m_lru.splice(m_lru.begin(),m_lru,it->second.lru);
+	return &it->second.entry;
+}
+
+BlockCache::Entry *BlockCache::Insert(uint64_t blockno)
+{
+	const size_t max_blocks = m_capacity / m_block_size;
+	EvictClean(max_blocks ? max_blocks - 1 : 0);
+	
+	Slot& slot = m_slots[blockno];
+	slot.entry.data.assign(m_block_size,0);
+	slot.entry.dirty = false;
+	slot.entry.generation = 0;
+	slot.entry.dirty_since = 0;
+	m_lru.push_front(blockno);
+	slot.lru = m_lru.begin();
+	return &slot.entry;
+}
+
+void BlockCache::MarkDirty(Entry *entry)
+{
+	if(!entry->dirty) {
+		entry->dirty = true;
+		entry->dirty_since = time(NULL);
+		m_dirty_count++;
+	}
+	entry->generation = ++m_generation;
+}
+
+void BlockCache::MarkClean(uint64_t blockno,uint64_t generation)
+{
+	SlotMap::iterator it = m_slots.find(blockno);
+	if(it != m_slots.end() && it->second.entry.dirty && it->second.entry.generation == generation) {
+		it->second.entry.dirty = false;
+		m_dirty_count--;
+	}
+}
+
+void BlockCache::GetDirtyBlocks(std::vector<uint64_t>& out_blocks,time_t dirty_before) const
+{
+	out_blocks.clear();
+	out_blocks.reserve(m_dirty_count);
+	for(SlotMap::const_iterator it = m_slots.begin(); it != m_slots.end(); ++it) {
+		if(it->second.entry.dirty && it->second.entry.dirty_since <= dirty_before) {
+			out_blocks.push_back(it->first);
+		}
+	}
+}
+
+void BlockCache::Erase(uint64_t blockno)
+{
+	SlotMap::iterator it = m_slots.find(blockno);
+	if(it != m_slots.end()) EraseSlot(it);
+}
+
+void BlockCache::EraseFrom(uint64_t first_blockno)
+{
+	SlotMap::iterator it = m_slots.lower_bound(first_blockno);
+	while(it != m_slots.end()) {
+		SlotMap::iterator next = it;
+		++next;
+		EraseSlot(it);
+		it = next;
+	}
+}
+
+void BlockCache::Clear()
+{
+	m_slots.clear();
+	m_lru.clear();
+	m_dirty_count = 0;
+}
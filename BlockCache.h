@@ -0,0 +1,120 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_BlockCache_h
+#define __cloudblockfs_BlockCache_h
+
+#include <inttypes.h>
+#include <time.h>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace cloudblockfs
+{
+	/**
+	 * Memory bounded cache of data blocks by block number. Dirty blocks are
+	 * pinned until they are marked clean; clean blocks are evicted least
+	 * recently used first. The cache does no locking of its own.
+	 */
+	class BlockCache
+	{
+	public:
+		struct Entry
+		{
+			std::vector<uint8_t> data;
+			bool dirty;
+			uint64_t generation; // changes every time the block is dirtied
+			time_t dirty_since;
+		};
+	private:
+		typedef std::list<uint64_t> LRUList;
+		struct Slot
+		{
+			Entry entry;
+			LRUList::iterator lru;
+		};
+		typedef std::map<uint64_t,Slot> SlotMap;
+		
+		SlotMap m_slots;
+		LRUList m_lru; // most recently used first
+		int m_block_size;
+		size_t m_capacity; // bytes
+		size_t m_dirty_count;
+		uint64_t m_generation;
+		
+		void EvictClean(size_t max_blocks);
+		void EraseSlot(SlotMap::iterator it);
+	public:
+		BlockCache();
+		
+		void SetBlockSize(int block_size) { Clear(); m_block_size = block_size; }
+		int GetBlockSize() const { return m_block_size; }
+		
+		/**
+		 * Sets the capacity in bytes. Clean blocks beyond the capacity are evicted.
+		 */
+		void SetCapacity(size_t bytes);
+		size_t GetCapacity() const { return m_capacity; }
+		
+		size_t GetSize() const { return m_slots.size() * m_block_size; }
+		size_t GetDirtySize() const { return m_dirty_count * m_block_size; }
+		
+		/**
+		 * Finds a cached block and marks it as most recently used.
+		 * @return The entry or NULL if not cached.
+		 */
+		Entry *Find(uint64_t blockno);
+		
+		/**
+		 * Adds a clean, zero filled block, evicting clean blocks to make room.
+		 * The block must not already be cached.
+		 */
+		Entry *Insert(uint64_t blockno);
+		
+		/**
+		 * Marks a block as modified.
+		 */
+		void MarkDirty(Entry *entry);
+		
+		/**
+		 * Marks a block as written out if it has not been modified since generation.
+		 */
+		void MarkClean(uint64_t blockno,uint64_t generation);
+		
+		/**
+		 * Lists dirty blocks in block order.
+		 * @param out_blocks Receives the block numbers.
+		 * @param dirty_before Only list blocks dirtied at or before this time.
+		 */
+		void GetDirtyBlocks(std::vector<uint64_t>& out_blocks,time_t dirty_before) const;
+		
+		/**
+		 * Drops a block, dirty or not.
+		 */
+		void Erase(uint64_t blockno);
+		
+		/**
+		 * Drops all blocks starting at first_blockno.
+		 */
+		void EraseFrom(uint64_t first_blockno);
+		
+		void Clear();
+	};
+}
+
+#endif
@@ -15,7 +15,10 @@
  You should have received a copy of the GNU General Public License
  along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include "Exception.h"
 #include "DataStore.h"
@@ -23,118 +26,1063 @@
 
 using namespace cloudblockfs;
 
-BlockMeta::BlockMeta(DataStore *store) : m_store(store), m_last_id(0)
+// upper bound on superseded objects held back before the head is forced out
+#define MAX_PENDING_DELETES 4096
+
+// default number of tree nodes to cache
+#define DEFAULT_NODE_CACHE_SIZE 256
+
+// default epoch limits
+#define DEFAULT_EPOCH_INTERVAL 5
+#define DEFAULT_MAX_DIRTY_SIZE (8 * 1024 * 1024)
+
+// default seconds the journal is appended to before a checkpoint
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+
+// upper bound on log objects written between checkpoints
+#define MAX_JOURNAL_OBJECTS 256
+
+// a log object holds its sequence number, the id of the next log object,
+// the last id handed out, the number of operation words and a checksum,
+// followed by the operations
+#define JOURNAL_HEADER_WORDS 5
+
+// journal operations
+#define JOURNAL_MAP 1 // block no, id
+#define JOURNAL_INDEX 2 // hash (4 words), id
+#define JOURNAL_ACQUIRE 3 // id of an indexed object which gains a reference
+#define JOURNAL_RELEASE 4 // id of an object which loses a reference
+#define JOURNAL_DISK_SIZE 5 // size
+#define JOURNAL_DELETE 6 // id of an object queued for deletion
+
+BlockMeta::BlockMeta(DataStore *store) : m_store(store), m_head_loaded(false), m_head_dirty(false), m_freed_blocks(0), m_collecting(false),
+	m_epoch_start(0), m_epoch_interval(DEFAULT_EPOCH_INTERVAL), m_max_dirty_size(DEFAULT_MAX_DIRTY_SIZE),
+	m_node_cache(DEFAULT_NODE_CACHE_SIZE), m_dedup(store), m_journal_next(0), m_journal_sequence(1), m_journal_start(0),
+	m_checkpoint_interval(DEFAULT_CHECKPOINT_INTERVAL)
 {
+	memset(&m_head,0,sizeof(m_head));
 }
 
-BlockID BlockMeta::AllocateBlockID()
+void BlockMeta::LoadHead() const
 {
-	if(!m_last_id) {
-		BlockMeta::Head head;
-		GetHead(&head);
-		m_last_id = head.last_id;
+	// heads written before a field was added are shorter, missing fields read as 0
+	memset(&m_head,0,sizeof(m_head));
+	m_store->GetObject("0000000000000000",&m_head,sizeof(BlockMeta::Head));
+	m_dedup.Open(m_head.dedup_root,m_head.block_size);
+	
+	// the journal holds updates made since the head was written, replaying
+	// them brings back the state the volume was left in
+	const_cast<BlockMeta *>(this)->ReplayJournal();
+	m_head_loaded = true;
+}
+
+// number of arguments an operation takes, -1 if it is not known
+static int GetOpArgs(uint64_t op)
+{
+	switch(op) {
+		case JOURNAL_MAP: return 2;
+		case JOURNAL_INDEX: return 5;
+		case JOURNAL_ACQUIRE: return 1;
+		case JOURNAL_RELEASE: return 1;
+		case JOURNAL_DISK_SIZE: return 1;
+		case JOURNAL_DELETE: return 1;
 	}
+	return -1;
+}
 
-	// 64-bit LFSR
-	// x^64 + x^4 + x^3 + x^1 + 1
-	const int64_t bit = m_last_id ^
-		(m_last_id >> 60) ^
-		(m_last_id >> 61) ^
-		(m_last_id >> 63) & 1;
-	m_last_id = (bit << 63) | (m_last_id >> 1);
-	return m_last_id;
+// FNV-1a over a log object, leaving out the checksum itself
+static uint64_t JournalChecksum(const std::vector<BlockID>& record)
+{
+	const size_t count = std::min<uint64_t>(record[3],record.size() - JOURNAL_HEADER_WORDS);
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for(size_t i = 0; i < JOURNAL_HEADER_WORDS + count; i++) {
+		if(i == 4) continue;
+		const uint8_t *bytes = (const uint8_t *)&record[i];
+		for(size_t j = 0; j < sizeof(BlockID); j++) {
+			hash ^= bytes[j];
+			hash *= 0x100000001B3ULL;
+		}
+	}
+	return hash;
 }
 
-void BlockMeta::SetBlockIDForBlockNo(uint64_t no,BlockID block_id)
+void BlockMeta::ReplayJournal()
 {
-	// get head
-	BlockMeta::Head head;
-	GetHead(&head);
+	m_journal_ops.clear();
+	m_journal_objects.clear();
+	m_journal_next = m_head.journal;
+	m_journal_sequence = 1;
+	
+	const size_t words = m_head.block_size >> 3;
+	std::vector<BlockID> record;
+	char object[32];
+	try {
+		while(m_journal_next) {
+			sprintf(object,"%.16llX",m_journal_next);
+			record.assign(words,0);
+			try {
+				m_store->GetObject(object,&record[0],m_head.block_size);
+			} catch(const FileNotFoundException& ) {
+				break; // the next append goes here
+			}
+			
+			// an append cut short ends the journal too, the next append overwrites it
+			if(record[0] != m_journal_sequence || record[3] > words - JOURNAL_HEADER_WORDS ||
+			   record[4] != JournalChecksum(record)) break;
+			if(!ApplyOps(&record[JOURNAL_HEADER_WORDS],record[3])) {
+				throw ReadErrorException(std::string(object) + ": Unknown journal operation.");
+			}
+			
+			if(m_journal_objects.empty()) m_journal_start = time(NULL);
+			m_journal_objects.push_back(m_journal_next);
+			m_journal_next = record[1];
+			m_journal_sequence++;
+			
+			// ids handed out before the append must not be handed out again
+			m_head.last_id = record[2];
+			m_head_dirty = true;
+		}
+	} catch(...) {
+		// start over on the next access rather than replay twice
+		m_dirty_nodes.clear();
+		m_pending_deletes.clear();
+		m_journal_objects.clear();
+		m_dedup.Open(0,0);
+		m_head_dirty = false;
+		throw;
+	}
+}
 
-	std::vector<BlockID> delete_list;
-	delete_list.reserve(head.tree_depth + 2);
+bool BlockMeta::ApplyOps(const uint64_t *ops,size_t count)
+{
+	for(size_t i = 0; i < count; ) {
+		const int args = GetOpArgs(ops[i]);
+		if(args < 0 || i + 1 + args > count) return false;
+		
+		const uint64_t *arg = &ops[i + 1];
+		switch(ops[i]) {
+			case JOURNAL_MAP:
+				MapBlock(arg[0],arg[1]);
+				
+				// segments handed out since the head was written are only known from their blocks
+				if(IsPackedID(m_head,arg[1])) m_head.last_segment = std::max(m_head.last_segment,GetSegmentNumber(arg[1]));
+				break;
+			case JOURNAL_INDEX: {
+				DedupIndex::Hash hash;
+				memcpy(hash.words,arg,sizeof(hash.words));
+				m_dedup.Insert(hash,arg[4]);
+				break;
+			}
+			case JOURNAL_ACQUIRE:
+				m_dedup.AddReference(arg[0]);
+				break;
+			case JOURNAL_RELEASE:
+				ReleaseID(arg[0]);
+				break;
+			case JOURNAL_DISK_SIZE:
+				m_head.disk_size = arg[0];
+				break;
+			case JOURNAL_DELETE:
+				m_pending_deletes.push_back(arg[0]);
+				break;
+		}
+		i += 1 + args;
+	}
+	return true;
+}
+
+void BlockMeta::LogOp(uint64_t op,const uint64_t *args,int count)
+{
+	if(m_journal_ops.empty()) m_epoch_start = time(NULL);
+	m_journal_ops.push_back(op);
+	m_journal_ops.insert(m_journal_ops.end(),args,args + count);
+}
+
+void BlockMeta::Flush()
+{
+	ScopedLock commit(m_commit_lock);
+	FlushJournal();
+}
+
+void BlockMeta::FlushJournal()
+{
+	bool checkpoint;
+	{
+		ScopedLock lock(m_lock);
+		if(!m_head_loaded) LoadHead();
+		if(m_journal_ops.empty()) return;
+		
+		// heads written before the journal existed name none, a checkpoint starts one
+		const time_t age = m_journal_objects.empty() ? 0 : time(NULL) - m_journal_start;
+		checkpoint = !m_journal_next || age >= m_checkpoint_interval || m_journal_objects.size() >= MAX_JOURNAL_OBJECTS;
+	}
+	if(checkpoint) WriteBack();
+	else AppendJournal();
+}
+
+void BlockMeta::AppendJournal()
+{
+	// The log objects are put together under the lock and written without
+	// it. Operations logged meanwhile go after those taken and wait for
+	// the next append.
+	std::vector<std::vector<BlockID> > records;
+	std::vector<BlockID> ids; // id of each log object, then the id the next append goes to
+	std::vector<size_t> ends; // operations covered up to the end of each log object
+	int block_size;
+	{
+		ScopedLock lock(m_lock);
+		block_size = m_head.block_size;
+		const size_t words = block_size >> 3;
+		const size_t capacity = words - JOURNAL_HEADER_WORDS;
+		ids.push_back(m_journal_next);
+		for(size_t i = 0; i < m_journal_ops.size(); ) {
+			// operations are not split between log objects
+			size_t end = i;
+			while(end < m_journal_ops.size() && end + 1 + GetOpArgs(m_journal_ops[end]) - i <= capacity) {
+				end += 1 + GetOpArgs(m_journal_ops[end]);
+			}
+			
+			records.push_back(std::vector<BlockID>(words,0));
+			std::vector<BlockID>& record = records.back();
+			record[0] = m_journal_sequence + records.size() - 1;
+			record[1] = NextBlockID();
+			record[2] = m_head.last_id;
+			record[3] = end - i;
+			std::copy(m_journal_ops.begin() + i,m_journal_ops.begin() + end,record.begin() + JOURNAL_HEADER_WORDS);
+			record[4] = JournalChecksum(record);
+			ids.push_back(record[1]);
+			ends.push_back(end);
+			i = end;
+		}
+	}
+	
+	if(records.empty()) return;
+	
+	// the objects the operations refer to must be on disk before the journal
+	m_store->Flush();
 	
-	const int bk_count = head.block_size >> 3; // block count per object
-	m_table.resize(bk_count);
 	char object[32];
+	size_t written = 0;
+	try {
+		for(; written < records.size(); written++) {
+			sprintf(object,"%.16llX",ids[written]);
+			m_store->PutObject(object,&records[written][0],block_size);
+		}
+	} catch(...) {
+		// operations already in the journal must not be logged twice
+		PublishJournal(ids,ends,written);
+		throw;
+	}
+	PublishJournal(ids,ends,written);
+}
+
+void BlockMeta::PublishJournal(const std::vector<BlockID>& ids,const std::vector<size_t>& ends,size_t written)
+{
+	if(!written) return;
 	
-	// grab head object
-	sprintf(object,"%.16llX",head.head_id);
-	m_store->GetObject(object,&m_table[0],head.block_size);
+	ScopedLock lock(m_lock);
+	if(m_journal_objects.empty()) m_journal_start = time(NULL);
+	m_journal_objects.insert(m_journal_objects.end(),ids.begin(),ids.begin() + written);
+	m_journal_next = ids[written];
+	m_journal_sequence += written;
+	m_journal_ops.erase(m_journal_ops.begin(),m_journal_ops.begin() + ends[written - 1]);
+}
+
+size_t BlockMeta::Check()
+{
+	ScopedLock commit(m_commit_lock);
+	size_t folded;
+	{
+		ScopedLock lock(m_lock);
+		if(!m_head_loaded) LoadHead();
+		folded = m_journal_objects.size();
+	}
+	if(folded) WriteBack();
+	return folded;
+}
+
+bool BlockMeta::FindNode(BlockID id,std::vector<BlockID>& table) const
+{
+	ObjectMap::const_iterator it = m_staged_nodes.find(id);
+	if(it != m_staged_nodes.end()) {
+		table = it->second;
+		return true;
+	}
+	return m_node_cache.Get(id,table);
+}
+
+void BlockMeta::ReadNode(BlockID id,std::vector<BlockID>& table) const
+{
+	if(FindNode(id,table)) return;
 	
-	// allocate new id for head object
-	BlockID cur_id = AllocateBlockID();
-	delete_list.push_back(head.head_id);
-	head.head_id = cur_id;
+	char object[32];
+	sprintf(object,"%.16llX",id);
+	table.resize(m_head.block_size >> 3);
+	m_store->GetObject(object,&table[0],m_head.block_size);
+	m_node_cache.Put(id,table);
+}
+
+BlockMeta::DirtyNode& BlockMeta::GetDirtyNode(int level,uint64_t pos,BlockID id)
+{
+	const NodeKey key(level,pos);
+	DirtyNodeMap::iterator it = m_dirty_nodes.find(key);
+	if(it != m_dirty_nodes.end()) return it->second;
 	
-	// chain down the tree
-	for(int i = 1; i < head.tree_depth; i++) {
-		const BlockID new_id = AllocateBlockID(); // new id for next table
-		
-		const BlockID next = m_table[no % bk_count]; // save a copy of the next table
-		delete_list.push_back(next);
+	DirtyNode& node = m_dirty_nodes[key];
+	node.old_id = id;
+	if(id) {
+		ReadNode(id,node.table);
+	} else {
+		node.table.assign(m_head.block_size >> 3,0);
+	}
+	return node;
+}
 
-		m_table[no % bk_count] = new_id; // chain to new tree and write it
-		sprintf(object,"%.16llX",cur_id);
-		m_store->PutObject(object,&m_table[0],head.block_size);
+void BlockMeta::Commit()
+{
+	const uint64_t bk_count = m_head.block_size >> 3;
+	
+	// write the deepest nodes first so that each parent picks up the new ids
+	// of its children. A dirty node always has a dirty parent.
+	while(!m_dirty_nodes.empty()) {
+		DirtyNodeMap::iterator it = m_dirty_nodes.end();
+		--it;
+		
+		const int level = it->first.first;
+		const uint64_t pos = it->first.second;
+		const BlockID new_id = NextBlockID();
+		m_staged_nodes[new_id].swap(it->second.table);
+		if(it->second.old_id) m_pending_deletes.push_back(it->second.old_id);
 		
-		// there maybe sub-trees
-		if(next) {
-			sprintf(object,"%.16llX",next); // grab next data
-			m_store->GetObject(object,&m_table[0],head.block_size);
+		if(level == 0) {
+			m_head.head_id = new_id;
 		} else {
-			memset(&m_table[0],0,head.block_size);
+			uint64_t parent_span = 1; // positions covered by the parent level
+			for(int i = 1; i < level; i++) parent_span *= bk_count;
+			
+			DirtyNode& parent = m_dirty_nodes[NodeKey(level - 1,pos % parent_span)];
+			parent.table[pos / parent_span] = new_id;
 		}
+		m_dirty_nodes.erase(it);
+	}
+	m_head_dirty = true;
+}
+
+void BlockMeta::Sync()
+{
+	ScopedLock commit(m_commit_lock);
+	WriteBack();
+}
+
+void BlockMeta::WriteBack()
+{
+	// The checkpoint is laid out under the lock, written without it and
+	// then published, so lookups and updates go on while it is written.
+	// Updates made meanwhile belong to the next checkpoint.
+	Head head;
+	std::vector<BlockID> deletes, ops;
+	ObjectMap records;
+	{
+		ScopedLock lock(m_lock);
+		if(!m_dirty_nodes.empty()) Commit();
+		if(m_dedup.IsDirty()) {
+			m_head.dedup_root = m_dedup.Commit(m_pending_deletes,m_staged_index,AllocateIndexID,this);
+			m_head_dirty = true;
+		}
+		if(!m_head_dirty && m_pending_deletes.empty() && m_journal_objects.empty()) return;
+		
+		// the journal is folded in by this checkpoint and goes along with the
+		// objects it superseded. The new one starts under a fresh id, since an
+		// append which failed may still have written the old one.
+		deletes.swap(m_pending_deletes);
+		std::vector<BlockID> queued(deletes);
+		queued.insert(queued.end(),m_journal_objects.begin(),m_journal_objects.end());
+		const BlockID journal = NextBlockID();
+		
+		// superseded objects are queued in records which the new head links in
+		const BlockID delete_queue = queued.empty() ? m_head.delete_queue : BuildDeleteRecords(queued,m_head.delete_queue,records);
+		
+		head = m_head;
+		head.delete_queue = delete_queue;
+		head.journal = journal;
+		ops.swap(m_journal_ops);
+		m_head_dirty = false;
+	}
+	
+	try {
+		// the objects the checkpoint refers to must be on disk before it
+		m_store->Flush();
+		WriteStaged();
+		WriteObjects(records,head.block_size);
+		m_store->PutObject("0000000000000000",&head,sizeof(BlockMeta::Head));
+	} catch(...) {
+		// the next checkpoint tries again with whatever has been added since
+		ScopedLock lock(m_lock);
+		m_pending_deletes.insert(m_pending_deletes.begin(),deletes.begin(),deletes.end());
+		m_journal_ops.insert(m_journal_ops.begin(),ops.begin(),ops.end());
+		m_head_dirty = true;
+		throw;
+	}
+	
+	ScopedLock lock(m_lock);
+	m_delete_records.insert(records.begin(),records.end());
+	m_head.delete_queue = head.delete_queue;
+	m_head.journal = head.journal;
+	m_journal_objects.clear();
+	m_journal_next = head.journal;
+	m_journal_sequence = 1;
+	
+	// reclaimed records are no longer linked in now
+	m_unreferenced.insert(m_unreferenced.end(),m_retired_records.begin(),m_retired_records.end());
+	m_retired_records.clear();
+}
+
+void BlockMeta::WriteStaged()
+{
+	int block_size;
+	{
+		ScopedLock lock(m_lock);
+		if(m_staged_nodes.empty() && m_staged_index.empty()) return;
+		block_size = m_head.block_size;
+	}
+	WriteObjects(m_staged_nodes,block_size);
+	WriteObjects(m_staged_index,block_size);
+	
+	// written nodes are read through the cache like any other
+	ScopedLock lock(m_lock);
+	for(ObjectMap::iterator it = m_staged_nodes.begin(); it != m_staged_nodes.end(); ++it) {
+		m_node_cache.Put(it->first,it->second);
+	}
+	m_staged_nodes.clear();
+	m_staged_index.clear();
+	m_dedup.Written();
+}
+
+void BlockMeta::WriteObjects(const ObjectMap& objects,int block_size)
+{
+	char object[32];
+	for(ObjectMap::const_iterator it = objects.begin(); it != objects.end(); ++it) {
+		sprintf(object,"%.16llX",it->first);
+		m_store->PutObject(object,&it->second[0],block_size);
+	}
+}
+
+BlockID BlockMeta::BuildDeleteRecords(const std::vector<BlockID>& ids,BlockID next,ObjectMap& out_records)
+{
+	const size_t record_size = m_head.block_size >> 3;
+	for(size_t i = 0; i < ids.size(); i += record_size - 2) {
+		const size_t count = std::min(record_size - 2,ids.size() - i);
+		std::vector<BlockID> record(record_size,0);
+		record[0] = next;
+		record[1] = count;
+		std::copy(ids.begin() + i,ids.begin() + i + count,record.begin() + 2);
 		
-		cur_id = new_id;
+		next = NextBlockID();
+		out_records[next].swap(record);
+	}
+	return next;
+}
+
+void BlockMeta::DeleteIDs(const std::vector<BlockID>& ids)
+{
+	std::vector<std::string> names;
+	char object[32];
+	for(std::vector<BlockID>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+		sprintf(object,"%.16llX",*it);
+		names.push_back(object);
+	}
+	m_store->DeleteObjects(names);
+	
+	ScopedLock lock(m_lock);
+	for(std::vector<BlockID>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+		m_node_cache.Erase(*it);
+	}
+}
+
+bool BlockMeta::DeleteUnreferenced()
+{
+	std::vector<BlockID> unreferenced;
+	{
+		ScopedLock lock(m_lock);
+		unreferenced.swap(m_unreferenced);
+	}
+	
+	try {
+		DeleteIDs(unreferenced);
+	} catch(...) {
+		ScopedLock lock(m_lock);
+		m_unreferenced.insert(m_unreferenced.end(),unreferenced.begin(),unreferenced.end());
+		throw;
+	}
+	return !unreferenced.empty();
+}
+
+bool BlockMeta::ReclaimObjects()
+{
+	const bool unreferenced = DeleteUnreferenced();
+	BlockID queue;
+	int block_size;
+	{
+		// a checkpoint links the queue into the head it writes
+		ScopedLock commit(m_commit_lock);
+		ScopedLock lock(m_lock);
+		if(!m_head_loaded) LoadHead();
+		
+		// take the whole queue, records written from now on start a new one.
+		// Heads written meanwhile still link to it until it is done.
+		if(!m_head.reclaim_queue && m_head.delete_queue) {
+			m_head.reclaim_queue = m_head.delete_queue;
+			m_head.delete_queue = 0;
+			m_head_dirty = true;
+		}
+		queue = m_head.reclaim_queue;
+		block_size = m_head.block_size;
+	}
+	
+	// removing an object twice is harmless, so after a crash the queue is simply redone
+	std::vector<BlockID> record, records;
+	for(BlockID id = queue; id; id = record[0]) {
+		bool cached;
+		{
+			ScopedLock lock(m_lock);
+			std::map<BlockID,std::vector<BlockID> >::const_iterator it = m_delete_records.find(id);
+			cached = it != m_delete_records.end();
+			if(cached) record = it->second;
+		}
+		if(!cached) {
+			char object[32];
+			sprintf(object,"%.16llX",id);
+			record.assign(block_size >> 3,0);
+			m_store->GetObject(object,&record[0],block_size);
+		}
 		
+		const size_t count = std::min<uint64_t>(record[1],record.size() - 2);
+		DeleteIDs(std::vector<BlockID>(record.begin() + 2,record.begin() + 2 + count));
+		records.push_back(id);
+	}
+	
+	ScopedLock commit(m_commit_lock);
+	ScopedLock lock(m_lock);
+	for(std::vector<BlockID>::const_iterator it = records.begin(); it != records.end(); ++it) {
+		m_delete_records.erase(*it);
+	}
+	
+	// the records themselves can go once a head without them is written,
+	// unless the volume was formatted or reset meanwhile
+	if(m_head_loaded && queue && m_head.reclaim_queue == queue) {
+		m_head.reclaim_queue = 0;
+		m_head_dirty = true;
+		m_retired_records.insert(m_retired_records.end(),records.begin(),records.end());
+	}
+	return queue || unreferenced;
+}
+
+void BlockMeta::BeginCollection(std::vector<BlockID>& out_ids,std::vector<std::pair<int,BlockID> >& out_subtrees)
+{
+	// the collector reads the tree from the store, nodes left over from a
+	// checkpoint which failed are written first
+	ScopedLock commit(m_commit_lock);
+	WriteStaged();
+	
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	
+	m_collecting = true;
+	m_collection_ids.clear();
+	
+	// the tree as written, plus the nodes changed since which only live in memory
+	if(m_head.head_id) out_subtrees.push_back(std::make_pair(0,m_head.head_id));
+	for(DirtyNodeMap::const_iterator it = m_dirty_nodes.begin(); it != m_dirty_nodes.end(); ++it) {
+		const int level = it->first.first;
+		const std::vector<BlockID>& table = it->second.table;
+		for(std::vector<BlockID>::const_iterator entry = table.begin(); entry != table.end(); ++entry) {
+			if(!*entry) continue;
+			if(level < m_head.tree_depth - 1) out_subtrees.push_back(std::make_pair(level + 1,*entry));
+			else out_ids.push_back(*entry);
+		}
+	}
+	
+	// the dedup index, and objects it holds references to which are not mapped yet
+	m_dedup.GetObjectIDs(out_ids);
+	
+	// superseded objects the written head still refers to
+	out_ids.insert(out_ids.end(),m_pending_deletes.begin(),m_pending_deletes.end());
+	
+	// the journal, including the log object the next append writes
+	out_ids.insert(out_ids.end(),m_journal_objects.begin(),m_journal_objects.end());
+	if(m_journal_next) out_ids.push_back(m_journal_next);
+	
+	// deletion records, whether still queued or only linked from the written head
+	out_ids.insert(out_ids.end(),m_retired_records.begin(),m_retired_records.end());
+	for(std::map<BlockID,std::vector<BlockID> >::const_iterator it = m_delete_records.begin(); it != m_delete_records.end(); ++it) {
+		out_ids.push_back(it->first);
+	}
+	// blocks in segments keep the whole segment
+	for(std::vector<BlockID>::iterator it = out_ids.begin(); it != out_ids.end(); ++it) {
+		*it = GetObjectID(m_head,*it);
+	}
+	
+	const BlockID queues[] = { m_head.delete_queue, m_head.reclaim_queue };
+	std::vector<BlockID> record(m_head.block_size >> 3);
+	char object[32];
+	for(int i = 0; i < 2; i++) {
+		for(BlockID id = queues[i]; id; id = record[0]) {
+			out_ids.push_back(id);
+			std::map<BlockID,std::vector<BlockID> >::const_iterator it = m_delete_records.find(id);
+			if(it != m_delete_records.end()) {
+				record = it->second;
+			} else {
+				sprintf(object,"%.16llX",id);
+				m_store->GetObject(object,&record[0],m_head.block_size);
+			}
+		}
+	}
+}
+
+void BlockMeta::Reset()
+{
+	ScopedLock commit(m_commit_lock);
+	ScopedLock lock(m_lock);
+	memset(&m_head,0,sizeof(m_head));
+	m_head_loaded = false;
+	m_head_dirty = false;
+	m_pending_deletes.clear();
+	m_delete_records.clear();
+	m_retired_records.clear();
+	m_unreferenced.clear();
+	m_freed_segments.clear();
+	m_freed_blocks = 0;
+	m_dirty_nodes.clear();
+	m_node_cache.Clear();
+	m_staged_nodes.clear();
+	m_staged_index.clear();
+	m_dedup.Open(0,0);
+	m_journal_ops.clear();
+	m_journal_objects.clear();
+	m_journal_next = 0;
+	m_journal_sequence = 1;
+}
+
+BlockID BlockMeta::AllocateBlockID()
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	return NextBlockID();
+}
+
+static BlockID StepLFSR(BlockID last_id)
+{
+	// 64-bit LFSR
+	// x^64 + x^4 + x^3 + x^1 + 1
+	const int64_t bit = last_id ^
+		(last_id >> 60) ^
+		(last_id >> 61) ^
+		(last_id >> 63) & 1;
+	return (bit << 63) | (last_id >> 1);
+}
+
+BlockID BlockMeta::NextBlockID()
+{
+	// ids with the top bit set are left to packed blocks
+	BlockID last_id = StepLFSR(m_head.last_id);
+	while(m_head.segment_blocks && (last_id >> 63)) last_id = StepLFSR(last_id);
+	m_head.last_id = last_id;
+	m_head_dirty = true;
+	if(m_collecting) m_collection_ids.insert(last_id);
+	return last_id;
+}
+
+BlockID BlockMeta::AllocateSegmentID()
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	if(!m_head.segment_blocks) throw InvalidArgumentException("Volume does not pack blocks into segments.");
+	
+	m_head.last_segment++;
+	m_head_dirty = true;
+	const BlockID id = (1ULL << 63) | (m_head.last_segment << 16);
+	if(m_collecting) m_collection_ids.insert(id);
+	return id;
+}
+
+void BlockMeta::ForgetFreedSegments(const std::set<BlockID>& segments)
+{
+	ScopedLock lock(m_lock);
+	for(std::set<BlockID>::const_iterator it = segments.begin(); it != segments.end(); ++it) {
+		m_freed_segments.erase(*it);
+	}
+	m_freed_blocks = 0;
+}
+
+void BlockMeta::QueueDelete(BlockID id)
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	m_pending_deletes.push_back(id);
+	LogOp(JOURNAL_DELETE,&id,1);
+}
+
+BlockID BlockMeta::AllocateIndexID(void *userdata)
+{
+	return ((BlockMeta *)userdata)->NextBlockID();
+}
+
+BlockID BlockMeta::AllocateBlockID(const DedupIndex::Hash& hash)
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	
+	// skip ahead to an id in the hash's bucket, ids passed over are never used
+	const uint64_t buckets = m_dedup.GetBucketCount();
+	const uint64_t bucket = m_dedup.GetBucket(hash);
+	BlockID last_id = StepLFSR(m_head.last_id);
+	while(last_id % buckets != bucket || (m_head.segment_blocks && (last_id >> 63))) last_id = StepLFSR(last_id);
+	
+	m_head.last_id = last_id;
+	m_head_dirty = true;
+	if(m_collecting) m_collection_ids.insert(last_id);
+	return last_id;
+}
+
+BlockID BlockMeta::AcquireDuplicate(const DedupIndex::Hash& hash)
+{
+	LoadBucket(hash.words[0],false);
+	
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	
+	// References are journaled when taken, not when mapped, since the
+	// count may drop to zero in between. One held across a crash is
+	// never given back and keeps the object.
+	const BlockID id = m_dedup.Acquire(hash);
+	if(id) LogOp(JOURNAL_ACQUIRE,&id,1);
+	return id;
+}
+
+void BlockMeta::IndexBlockID(const DedupIndex::Hash& hash,BlockID block_id)
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	if(m_dedup.Insert(hash,block_id)) {
+		uint64_t args[5];
+		memcpy(args,hash.words,sizeof(hash.words));
+		args[4] = block_id;
+		LogOp(JOURNAL_INDEX,args,5);
+	}
+}
+
+void BlockMeta::ReleaseBlockID(BlockID block_id)
+{
+	LoadBucket(block_id,true);
+	
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	ReleaseID(block_id);
+	LogOp(JOURNAL_RELEASE,&block_id,1);
+}
+
+void BlockMeta::ReleaseID(BlockID id)
+{
+	// the rest of a segment may still be in use, the cleaner sees to it
+	if(IsPackedID(m_head,id)) {
+		m_freed_segments.insert(GetSegmentID(id));
+		m_freed_blocks++;
+		return;
+	}
+	
+	// shared objects stay until the last block using them lets go
+	if(m_dedup.Release(id) <= 0) m_pending_deletes.push_back(id);
+}
+
+void BlockMeta::SetBlockIDForBlockNo(uint64_t no,BlockID block_id)
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	MapBlock(no,block_id);
+	const uint64_t args[] = { no, block_id };
+	LogOp(JOURNAL_MAP,args,2);
+}
+
+bool BlockMeta::IsEpochFull() const
+{
+	ScopedLock lock(m_lock);
+	return m_dirty_nodes.size() * m_head.block_size + m_dedup.GetDirtySize() >= (size_t)m_max_dirty_size ||
+		m_pending_deletes.size() >= MAX_PENDING_DELETES;
+}
+
+void BlockMeta::LoadBlockNo(uint64_t no) const
+{
+	const BlockID id = GetBlockIDForBlockNo(no);
+	if(id) LoadBucket(id,true);
+}
+
+void BlockMeta::LoadBucket(uint64_t key,bool id) const
+{
+	// key is an object id, or the first word of a hash
+	size_t bucket;
+	BlockID first;
+	{
+		ScopedLock lock(m_lock);
+		if(!m_head_loaded) LoadHead();
+		if(id && IsPackedID(m_head,key)) return;
+		bucket = key % m_dedup.GetBucketCount();
+		first = m_dedup.GetUnloadedBucket(bucket);
+	}
+	if(!first) return;
+	
+	DedupIndex::Bucket read;
+	try {
+		m_dedup.ReadBucket(first,read);
+	} catch(const FileNotFoundException& ) {
+		return; // rewritten and reclaimed meanwhile, it is loaded under the lock when needed
+	}
+	
+	ScopedLock lock(m_lock);
+	m_dedup.AddBucket(bucket,first,read);
+}
+
+void BlockMeta::SetDiskSize(int64_t size)
+{
+	ScopedLock lock(m_lock);
+	if(!m_head_loaded) LoadHead();
+	if(size == m_head.disk_size) return;
+	
+	m_head.disk_size = size;
+	m_head_dirty = true;
+	const uint64_t args[] = { (uint64_t)size };
+	LogOp(JOURNAL_DISK_SIZE,args,1);
+}
+
+void BlockMeta::MapBlock(uint64_t no,BlockID block_id)
+{
+	const uint64_t bk_count = m_head.block_size >> 3; // block count per object
+	
+	// make sure the block fits before touching the tree
+	uint64_t leaf_index = no;
+	for(int i = 1; i < m_head.tree_depth; i++) leaf_index /= bk_count;
+	if(leaf_index >= bk_count) throw OutOfDiskSpaceException("No space left on device.");
+	
+	// chain down the tree, pulling each node on the path into the epoch
+	BlockID id = m_head.head_id;
+	uint64_t pos = 0, span = 1;
+	for(int i = 0; i < m_head.tree_depth - 1; i++) {
+		DirtyNode& node = GetDirtyNode(i,pos,id);
+		const uint64_t index = no % bk_count;
+		id = node.table[index];
+		pos += index * span;
+		span *= bk_count;
 		no /= bk_count;
 	}
 	
-	if(no >= bk_count) throw OutOfDiskSpaceException("No space left on device.");
-	delete_list.push_back(m_table[no]);
-	m_table[no] = block_id;
-	sprintf(object,"%.16llX",cur_id);
-	m_store->PutObject(object,&m_table[0],head.block_size);
+	DirtyNode& leaf = GetDirtyNode(m_head.tree_depth - 1,pos,id);
+	if(leaf.table[no]) ReleaseID(leaf.table[no]);
+	leaf.table[no] = block_id;
+}
+
+BlockMeta::DirtyNode& BlockMeta::GetDirtyPath(int level,uint64_t pos,const std::vector<BlockID>& path)
+{
+	// a dirty node needs dirty parents for Commit() to link in its new id
+	const uint64_t bk_count = m_head.block_size >> 3;
+	uint64_t span = 1;
+	for(int i = 0; i < level; i++) {
+		GetDirtyNode(i,pos % span,path[i]);
+		span *= bk_count;
+	}
+	return GetDirtyNode(level,pos,path[level]);
+}
+
+void BlockMeta::DropSubtree(int level,uint64_t pos,BlockID id)
+{
+	const uint64_t bk_count = m_head.block_size >> 3;
+	std::vector<BlockID> table;
+	
+	DirtyNodeMap::iterator it = m_dirty_nodes.find(NodeKey(level,pos));
+	if(it != m_dirty_nodes.end()) {
+		if(it->second.old_id) m_pending_deletes.push_back(it->second.old_id);
+		table.swap(it->second.table);
+		m_dirty_nodes.erase(it);
+	} else if(id) {
+		ReadNode(id,table);
+		m_pending_deletes.push_back(id);
+	} else {
+		return;
+	}
+	
+	if(level == m_head.tree_depth - 1) {
+		for(uint64_t i = 0; i < bk_count; i++) {
+			if(table[i]) ReleaseID(table[i]);
+		}
+		return;
+	}
 	
-	// finally write head
-	PutHead(head);
+	uint64_t span = 1;
+	for(int i = 0; i < level; i++) span *= bk_count;
+	for(uint64_t i = 0; i < bk_count; i++) {
+		DropSubtree(level + 1,pos + i * span,table[i]);
+	}
+}
+
+bool BlockMeta::PruneNode(int level,uint64_t pos,std::vector<BlockID>& path,uint64_t first,uint64_t capacity)
+{
+	const uint64_t bk_count = m_head.block_size >> 3;
+	uint64_t span = 1; // distance between the positions of adjacent children
+	for(int i = 0; i < level; i++) span *= bk_count;
 	
-	// remove objects
-	for(std::vector<BlockID>::const_iterator it = delete_list.begin(); it != delete_list.end(); ++it) {
-		if(*it) {
-			sprintf(object,"%.16llX",*it);
-			m_store->DeleteObject(object);
+	// nothing in this subtree reaches the cut
+	if(pos + (capacity - span) < first) return false;
+	
+	std::vector<BlockID> node;
+	const std::vector<BlockID> *table;
+	DirtyNodeMap::iterator it = m_dirty_nodes.find(NodeKey(level,pos));
+	if(it != m_dirty_nodes.end()) {
+		table = &it->second.table;
+	} else if(path[level]) {
+		ReadNode(path[level],node);
+		table = &node;
+	} else {
+		return false; // sub-tree was never written
+	}
+	
+	DirtyNode *dirty = it != m_dirty_nodes.end() ? &it->second : NULL;
+	bool empty = true;
+	if(level == m_head.tree_depth - 1) {
+		for(uint64_t i = 0; i < bk_count; i++) {
+			if(!(*table)[i]) continue;
+			if(pos + i * span < first) {
+				empty = false;
+				continue;
+			}
+			if(!dirty) {
+				dirty = &GetDirtyPath(level,pos,path);
+				table = &dirty->table;
+			}
+			ReleaseID(dirty->table[i]);
+			dirty->table[i] = 0;
+		}
+	} else {
+		for(uint64_t i = 0; i < bk_count; i++) {
+			const uint64_t child_pos = pos + i * span;
+			const BlockID child_id = (*table)[i];
+			if(!child_id && !m_dirty_nodes.count(NodeKey(level + 1,child_pos))) continue;
+			
+			path[level + 1] = child_id;
+			if(child_pos >= first || PruneNode(level + 1,child_pos,path,first,capacity)) {
+				// every block below this child is past the cut, or it was emptied
+				if(!dirty) {
+					dirty = &GetDirtyPath(level,pos,path);
+					table = &dirty->table;
+				}
+				DropSubtree(level + 1,child_pos,child_id);
+				dirty->table[i] = 0;
+			} else {
+				empty = false;
+			}
 		}
 	}
+	
+	// report a rewritten node left with no entries so the parent can drop it too
+	return dirty && empty;
 }
 
-BlockID BlockMeta::GetBlockIDForBlockNo(uint64_t no) const
+void BlockMeta::TruncateBlocks(uint64_t first)
 {
-	// get head
-	BlockMeta::Head head;
-	GetHead(&head);
+	// no append may come between the pruning and its checkpoint
+	ScopedLock commit(m_commit_lock);
+	{
+		ScopedLock lock(m_lock);
+		if(!m_head_loaded) LoadHead();
+		
+		const uint64_t bk_count = m_head.block_size >> 3;
+		uint64_t capacity = 1; // blocks addressable by the tree
+		for(int i = 0; i < m_head.tree_depth; i++) capacity *= bk_count;
+		if(first >= capacity) return;
+		
+		// Block numbers are taken apart lowest digit first on the way down, so
+		// a node at level L holds the blocks congruent to its position modulo
+		// (entries per node)^L. A child whose position is already past the cut
+		// holds nothing but blocks past the cut and is dropped whole.
+		std::vector<BlockID> path(m_head.tree_depth,0);
+		path[0] = m_head.head_id;
+		PruneNode(0,0,path,first,capacity);
+	}
+	
+	// the pruned nodes go out together in a single checkpoint, which folds
+	// in the journal so it never needs to replay a truncation
+	WriteBack();
+}
 
-	const int bk_count = head.block_size >> 3; // block count per object
-	m_table.resize(bk_count);
-	char object[32];
+bool BlockMeta::FindBlockID(uint64_t no,const ObjectMap& read,BlockID *out_id) const
+{
+	std::vector<BlockID> node;
+	const uint64_t bk_count = m_head.block_size >> 3; // block count per object
 	
-	// grab head object
-	sprintf(object,"%.16llX",head.head_id);
-	m_store->GetObject(object,&m_table[0],head.block_size);
-	
-	// chain down the tree
-	for(int i = 1; i < head.tree_depth; i++) {
-		// there maybe sub-trees
-		BlockID obj = m_table[no % bk_count];
-		if(obj) {
-			sprintf(object,"%.16llX",obj);
-			m_store->GetObject(object,&m_table[0],head.block_size);
+	// chain down the tree, nodes changed in this epoch come from memory
+	BlockID id = m_head.head_id;
+	uint64_t pos = 0, span = 1;
+	for(int i = 0; i < m_head.tree_depth; i++) {
+		const std::vector<BlockID> *table;
+		DirtyNodeMap::const_iterator it = m_dirty_nodes.find(NodeKey(i,pos));
+		ObjectMap::const_iterator found;
+		if(it != m_dirty_nodes.end()) {
+			table = &it->second.table;
+		} else if(!id) {
+			break; // sub-tree was never written
+		} else if((found = read.find(id)) != read.end()) {
+			table = &found->second;
+		} else if(FindNode(id,node)) {
+			table = &node;
 		} else {
-			memset(&m_table[0],0,head.block_size);
+			*out_id = id;
+			return false;
+		}
+		
+		if(i == m_head.tree_depth - 1) {
+			*out_id = no < bk_count ? (*table)[no] : 0;
+			return true;
 		}
+		
+		const uint64_t index = no % bk_count;
+		id = (*table)[index];
+		pos += index * span;
+		span *= bk_count;
 		no /= bk_count;
 	}
 	
-	return m_table[no];
+	*out_id = 0;
+	return true;
+}
+
+BlockID BlockMeta::GetBlockIDForBlockNo(uint64_t no) const
+{
+	// Nodes missing from memory are read without the lock, one at a time
+	// since each names the next. Written nodes never change, so those read
+	// stay good for the rest of the walk. One which has gone missing was
+	// superseded and reclaimed meanwhile, unless the walk comes back to it.
+	ObjectMap read;
+	BlockID last_read = 0, missing = 0;
+	for(;;) {
+		BlockID id;
+		int block_size;
+		{
+			ScopedLock lock(m_lock);
+			if(!m_head_loaded) LoadHead();
+			if(last_read) m_node_cache.Put(last_read,read[last_read]);
+			if(FindBlockID(no,read,&id)) return id;
+			block_size = m_head.block_size;
+		}
+		
+		char object[32];
+		sprintf(object,"%.16llX",id);
+		std::vector<BlockID> table(block_size >> 3);
+		try {
+			m_store->GetObject(object,&table[0],block_size);
+		} catch(const FileNotFoundException& ) {
+			if(id == missing) throw;
+			missing = id;
+			last_read = 0;
+			continue;
+		}
+		read[id].swap(table);
+		last_read = id;
+	}
 }
@@ -19,8 +19,15 @@
 #define __cloudblockfs_BlockMeta_h
 
 #include <inttypes.h>
+#include <time.h>
+#include <map>
+#include <set>
+#include <utility>
 #include <vector>
 #include "DataStore.h"
+#include "DedupIndex.h"
+#include "LRUCache.h"
+#include "Thread.h"
 
 namespace cloudblockfs 
 {
@@ -30,14 +37,60 @@ namespace cloudblockfs
 	 * Class for reading block meta data. Block meta data is a table which 
 	 * maps block numbers to block ids. Block IDs are unique 64-bit integers
 	 * handed out to each block.
+	 *
+	 * Updates are batched into epochs. Tree nodes touched by an update are
+	 * held in memory and modified in place; at the end of the epoch every
+	 * changed node is written under a fresh id and the head is written once.
+	 * An epoch ends on Sync(). The caller checks IsEpochFull() after
+	 * updates, which reports when the dirty nodes exceed the dirty size
+	 * limit or too many objects wait to be queued for deletion.
+	 *
+	 * Between those checkpoints updates are made durable more cheaply by
+	 * the journal. Each update is also recorded as a small operation, and
+	 * Flush() appends the operations recorded since the last flush to the
+	 * journal as log objects. Every log object carries the id of the next
+	 * one, allocated in advance, so appending never rewrites the head; the
+	 * head only names the first object of the journal. When the head is
+	 * read the journal is replayed on top of the tree, and the next
+	 * checkpoint folds it in and starts a new one. IsEpochExpired() tells
+	 * the caller when updates have waited an epoch interval to be flushed,
+	 * and once the journal is older than the checkpoint interval a flush
+	 * checkpoints instead.
+	 *
+	 * Objects superseded by a commit are not removed straight away. Their ids
+	 * are written to deletion records, which the head links into a queue, and
+	 * ReclaimObjects() removes them later. The queue is on the store, so
+	 * objects queued before a crash are still removed afterwards.
+	 *
+	 * Data objects may be shared between blocks through the dedup index,
+	 * which counts their references. A shared object is only queued for
+	 * deletion once its last reference is gone. The index is committed
+	 * along with the tree.
+	 *
+	 * A volume formatted with a segment size may pack several blocks into
+	 * one segment object. A packed block id has the top bit set, the
+	 * segment number in the middle and the block's slot in the low 16
+	 * bits; masking off the slot gives the id the segment is stored under.
+	 * Ids handed out for anything else never have the top bit set on such
+	 * a volume. A segment is not queued for deletion when its blocks are
+	 * unmapped, it is only noted as freed. The cleaner moves what is left
+	 * of it elsewhere and queues it with QueueDelete().
+	 *
+	 * All methods may be called from any thread. The lock guarding the
+	 * state is not held across store access where it can be helped: nodes
+	 * missing from memory are read without it, and a checkpoint or journal
+	 * append is laid out under it, written without it and then published.
+	 * Checkpoints and appends take a second lock which keeps them in order.
+	 * Nodes of a checkpoint are looked up in memory until they are written.
+	 * LoadBlockNo() reads ahead what an update needs, so the update itself
+	 * can be made without going to the store.
 	 */
 	class BlockMeta
 	{
 	private:
 		DataStore *m_store;
-		BlockID m_last_id;
-		
-		mutable std::vector<BlockID> m_table; // tmp data
+		mutable Mutex m_commit_lock; // held by checkpoints and journal appends, taken before m_lock
+		mutable Mutex m_lock; // guards everything below
 	public:
 		
 		struct Head
@@ -47,35 +100,351 @@ namespace cloudblockfs
 			int32_t tree_depth;
 			int64_t disk_size;
 			BlockID last_id;
+			BlockID delete_queue; // newest deletion record, 0 if none
+			BlockID reclaim_queue; // deletion records being reclaimed, 0 if none
+			BlockID dedup_root; // root of the dedup index, 0 if none
+			BlockID journal; // first log object of the journal, written once there is something to log
+			int64_t segment_blocks; // blocks packed into a segment object, 0 if every block has its own
+			uint64_t last_segment; // number of the last segment handed out
 		};
 		
+		/**
+		 * Returns true if a block id is a slot in a segment rather than an object of its own.
+		 */
+		static bool IsPackedID(const Head& head,BlockID id) { return head.segment_blocks && (id >> 63); }
+		
+		/**
+		 * Returns the id of the segment object a packed block id is stored in.
+		 */
+		static BlockID GetSegmentID(BlockID id) { return id & ~0xFFFFULL; }
+		static uint64_t GetSegmentNumber(BlockID id) { return (id >> 16) & 0x7FFFFFFFFFFFULL; }
+		static int GetSegmentSlot(BlockID id) { return id & 0xFFFF; }
+		
+		/**
+		 * Returns the id of the object a block id is stored in.
+		 */
+		static BlockID GetObjectID(const Head& head,BlockID id) { return IsPackedID(head,id) ? GetSegmentID(id) : id; }
+		
+	private:
+		mutable Head m_head; // in-memory copy of the head object
+		mutable bool m_head_loaded;
+		bool m_head_dirty;
+		
+		// objects superseded since the head was last written, these are
+		// still referenced by the head on the store so they can only be
+		// queued for deletion along with the new head
+		std::vector<BlockID> m_pending_deletes;
+		
+		// Deletion records are laid out like tree nodes: the id of the next
+		// (older) record, the number of ids which follow, then the ids.
+		// Records written by this handle are kept here to save reading them back.
+		std::map<BlockID,std::vector<BlockID> > m_delete_records;
+		std::vector<BlockID> m_retired_records; // reclaimed records the stored head still links to
+		std::vector<BlockID> m_unreferenced; // objects no stored head links to
+		
+		// segments which had blocks unmapped since the cleaner last looked
+		std::set<BlockID> m_freed_segments;
+		uint64_t m_freed_blocks;
+		
+		// ids handed out while a garbage collection runs
+		bool m_collecting;
+		std::set<BlockID> m_collection_ids;
+		
+		// a tree node modified in the current epoch
+		struct DirtyNode
+		{
+			std::vector<BlockID> table;
+			BlockID old_id; // id the node was read from, 0 if new
+		};
+		
+		// dirty nodes keyed by (level,position). The position of a node at level L
+		// is the block number modulo (entries per node)^L, ie. the table indices
+		// taken on the way down to it. Ordering puts the deepest levels last.
+		typedef std::pair<int,uint64_t> NodeKey;
+		typedef std::map<NodeKey,DirtyNode> DirtyNodeMap;
+		DirtyNodeMap m_dirty_nodes;
+		
+		time_t m_epoch_start; // time of the first update in this epoch
+		int m_epoch_interval; // seconds
+		int m_max_dirty_size; // bytes
+		
+		// tree nodes by id. Nodes are copy-on-write so a cached node never goes stale.
+		mutable LRUCache<BlockID,std::vector<BlockID> > m_node_cache;
+		
+		// Objects of a checkpoint which may not be on the store yet, tree
+		// nodes and dedup index objects by id. They are only changed with
+		// m_commit_lock held as well, so a checkpoint writes them without m_lock.
+		typedef std::map<BlockID,std::vector<BlockID> > ObjectMap;
+		ObjectMap m_staged_nodes;
+		ObjectMap m_staged_index;
+		
+		mutable DedupIndex m_dedup;
+		
+		// Operations not yet flushed to the journal. Each is an operation
+		// code followed by its arguments.
+		std::vector<uint64_t> m_journal_ops;
+		std::vector<BlockID> m_journal_objects; // log objects written since the last checkpoint
+		BlockID m_journal_next; // id the next log object is written under, 0 if none is allocated
+		uint64_t m_journal_sequence; // sequence number of the next log object
+		time_t m_journal_start; // time the first log object since the last checkpoint was written
+		int m_checkpoint_interval; // seconds
+		
+		void LoadHead() const;
+		bool FindNode(BlockID id,std::vector<BlockID>& table) const;
+		void ReadNode(BlockID id,std::vector<BlockID>& table) const;
+		bool FindBlockID(uint64_t no,const ObjectMap& read,BlockID *out_id) const;
+		void LoadBucket(uint64_t key,bool id) const;
+		DirtyNode& GetDirtyNode(int level,uint64_t pos,BlockID id);
+		DirtyNode& GetDirtyPath(int level,uint64_t pos,const std::vector<BlockID>& path);
+		bool PruneNode(int level,uint64_t pos,std::vector<BlockID>& path,uint64_t first,uint64_t capacity);
+		void DropSubtree(int level,uint64_t pos,BlockID id);
+		void Commit();
+		void WriteBack();
+		void WriteStaged();
+		void WriteObjects(const ObjectMap& objects,int block_size);
+		BlockID BuildDeleteRecords(const std::vector<BlockID>& ids,BlockID next,ObjectMap& out_records);
+		void DeleteIDs(const std::vector<BlockID>& ids);
+		BlockID NextBlockID();
+		static BlockID AllocateIndexID(void *userdata);
+		void ReleaseID(BlockID id);
+		void MapBlock(uint64_t no,BlockID block_id);
+		void LogOp(uint64_t op,const uint64_t *args,int count);
+		void FlushJournal();
+		void AppendJournal();
+		void PublishJournal(const std::vector<BlockID>& ids,const std::vector<size_t>& ends,size_t written);
+		void ReplayJournal();
+		bool ApplyOps(const uint64_t *ops,size_t count);
+	public:
 		/**
 		 * Construct a new meta handler for data store.
 		 */
 		BlockMeta(DataStore *store);
 		
 		/**
-		 * Retrieves the meta header file.
+		 * Retrieves the meta header. The head is read from the store
+		 * the first time it is needed and served from memory afterwards.
+		 */
+		void GetHead(Head *out_head) const { 
+			ScopedLock lock(m_lock);
+			if(!m_head_loaded) LoadHead();
+			*out_head = m_head; 
+		}
+		
+		/**
+		 * Replaces the meta header. The head is only written to the store on Sync().
 		 */
-		void GetHead(Head *out_head) const { m_store->GetObject("0000000000000000",out_head,sizeof(BlockMeta::Head)); }
 		void PutHead(const Head& head) { 
-			Head head_copy = head;
-			if(m_last_id) head_copy.last_id = m_last_id;
-			m_store->PutObject("0000000000000000",&head_copy,sizeof(BlockMeta::Head)); 
+			ScopedLock lock(m_lock);
+			if(!m_head_loaded) {
+				m_dedup.Open(head.dedup_root,head.block_size);
+				m_journal_next = head.journal;
+			}
+			m_head = head;
+			m_head_loaded = true;
+			m_head_dirty = true;
 		}
 		
+		/**
+		 * Changes the disk size recorded in the head. The change is journaled
+		 * like a block update.
+		 */
+		void SetDiskSize(int64_t size);
+		
+		/**
+		 * Returns true if there are changes which have not been checkpointed.
+		 */
+		bool IsDirty() const { ScopedLock lock(m_lock); return m_head_dirty || !m_dirty_nodes.empty() || m_dedup.IsDirty(); }
+		
+		/**
+		 * Returns true if the epoch has grown large enough to be checkpointed.
+		 */
+		bool IsEpochFull() const;
+		
+		/**
+		 * Returns true if updates have waited longer than the epoch interval to be flushed.
+		 */
+		bool IsEpochExpired() const { ScopedLock lock(m_lock); return !m_journal_ops.empty() && time(NULL) - m_epoch_start >= m_epoch_interval; }
+		
+		/**
+		 * Makes the updates so far durable by appending them to the journal.
+		 * Checkpoints instead if the journal has grown too old or too long,
+		 * or the head does not name a journal yet.
+		 */
+		void Flush();
+		
+		/**
+		 * Checkpoints. Writes out all modified tree nodes, queues the objects
+		 * they replace and the journal for deletion and writes the head.
+		 */
+		void Sync();
+		
+		/**
+		 * Reads the head, which replays the journal, and checkpoints to fold
+		 * the journal into the tree.
+		 * @return Number of log objects folded in.
+		 */
+		size_t Check();
+		
+		/**
+		 * Removes the objects queued for deletion by earlier commits. The
+		 * store is accessed without holding the lock, so other calls are not
+		 * held up meanwhile.
+		 * @return True if anything was queued.
+		 */
+		bool ReclaimObjects();
+		
+		/**
+		 * Removes the deletion records which a written head no longer links
+		 * to. Nothing on the store names them, so any left when the volume is
+		 * closed would stay until the next garbage collection.
+		 * @return True if there were any.
+		 */
+		bool DeleteUnreferenced();
+		
+		/**
+		 * Starts a garbage collection. Reports every object the volume refers
+		 * to at this point and records the ids handed out from now on, which
+		 * count as referenced too. No object may be written under an id that
+		 * is not mapped yet while this is called, and the deletion queue must
+		 * not be reclaimed until EndCollection().
+		 * @param out_ids Receives ids of referenced objects.
+		 * @param out_subtrees Receives tree nodes as (level,id) whose whole subtree is referenced.
+		 */
+		void BeginCollection(std::vector<BlockID>& out_ids,std::vector<std::pair<int,BlockID> >& out_subtrees);
+		
+		/**
+		 * Returns true if the id was handed out since BeginCollection().
+		 */
+		bool IsAllocatedSinceCollection(BlockID id) const { ScopedLock lock(m_lock); return m_collection_ids.count(id) != 0; }
+		
+		/**
+		 * Stops recording the ids handed out.
+		 */
+		void EndCollection() { ScopedLock lock(m_lock); m_collecting = false; m_collection_ids.clear(); }
+		
+		/**
+		 * Drops the in-memory head without writing it. The head will be
+		 * re-read from the store on next access.
+		 */
+		void Reset();
+		
+		/**
+		 * Sets the maximum number of tree nodes kept in memory.
+		 * @param nodes Number of nodes, 0 disables the cache.
+		 */
+		void SetNodeCacheSize(int nodes) { ScopedLock lock(m_lock); m_node_cache.SetCapacity(nodes); }
+		int GetNodeCacheSize() const { ScopedLock lock(m_lock); return m_node_cache.GetCapacity(); }
+		
+		/**
+		 * Sets the longest time updates are held in memory before the
+		 * journal is flushed.
+		 * @param seconds Interval in seconds, 0 flushes every update.
+		 */
+		void SetEpochInterval(int seconds) { ScopedLock lock(m_lock); m_epoch_interval = seconds; }
+		int GetEpochInterval() const { ScopedLock lock(m_lock); return m_epoch_interval; }
+		
+		/**
+		 * Sets how many bytes of dirty tree nodes may accumulate before the
+		 * epoch is committed.
+		 */
+		void SetMaxDirtySize(int bytes) { ScopedLock lock(m_lock); m_max_dirty_size = bytes; }
+		int GetMaxDirtySize() const { ScopedLock lock(m_lock); return m_max_dirty_size; }
+		
+		/**
+		 * Sets how long the journal may grow before a flush checkpoints.
+		 * @param seconds Interval in seconds, 0 checkpoints on every flush.
+		 */
+		void SetCheckpointInterval(int seconds) { ScopedLock lock(m_lock); m_checkpoint_interval = seconds; }
+		int GetCheckpointInterval() const { ScopedLock lock(m_lock); return m_checkpoint_interval; }
+		
 		/**
 		 * Returns a unique 64-bit id.
 		 */
 		BlockID AllocateBlockID();
 		
 		/**
-		 * Sets the mapping for block no to be block id.
+		 * Returns the id of a new segment object. Its blocks are addressed
+		 * by adding their slot to the id.
+		 */
+		BlockID AllocateSegmentID();
+		
+		/**
+		 * Retrieves the segments which had blocks unmapped since they were
+		 * last forgotten.
+		 * @param out_segments Receives the ids of the segment objects.
+		 */
+		void GetFreedSegments(std::set<BlockID>& out_segments) const { ScopedLock lock(m_lock); out_segments = m_freed_segments; }
+		
+		/**
+		 * Drops segments the cleaner has dealt with from the freed segments,
+		 * and restarts the count of unmapped blocks.
+		 */
+		void ForgetFreedSegments(const std::set<BlockID>& segments);
+		
+		/**
+		 * Returns the number of packed blocks unmapped since ForgetFreedSegments() was last called.
+		 */
+		uint64_t GetFreedBlocks() const { ScopedLock lock(m_lock); return m_freed_blocks; }
+		
+		/**
+		 * Queues an object no block refers to any more for deletion along
+		 * with the next checkpoint.
+		 */
+		void QueueDelete(BlockID id);
+		
+		/**
+		 * Returns a unique 64-bit id which the dedup index can hold for
+		 * contents with the given hash.
+		 */
+		BlockID AllocateBlockID(const DedupIndex::Hash& hash);
+		
+		/**
+		 * Looks up an object with the same contents in the dedup index and
+		 * takes a reference to it. The reference passes to the block the id
+		 * is then mapped to, or must be given back with ReleaseBlockID().
+		 * @return Id of the object, or 0 if there is none.
+		 */
+		BlockID AcquireDuplicate(const DedupIndex::Hash& hash);
+		
+		/**
+		 * Adds an object allocated with AllocateBlockID(hash) to the dedup
+		 * index, after it has been mapped to a block. Nothing is done if the
+		 * contents are indexed already.
+		 */
+		void IndexBlockID(const DedupIndex::Hash& hash,BlockID block_id);
+		
+		/**
+		 * Drops a reference taken by AcquireDuplicate() which was not mapped.
+		 * The object is queued for deletion if it was the last one.
+		 */
+		void ReleaseBlockID(BlockID block_id);
+		
+		/**
+		 * Reads what SetBlockIDForBlockNo() needs for block no without
+		 * holding the lock: the tree nodes on its path, which go to the node
+		 * cache, and the dedup bucket of the object it is mapped to.
+		 */
+		void LoadBlockNo(uint64_t no) const;
+		
+		/**
+		 * Sets the mapping for block no to be block id. The object the block
+		 * was mapped to before loses a reference. Anything not in memory is
+		 * read from the store under the lock, see LoadBlockNo().
 		 */
 		void SetBlockIDForBlockNo(uint64_t no,BlockID block_id);
 		
 		/**
-		 * Retrives the block id given the block no.
+		 * Unmaps every block from block no first onwards. Subtrees which lie
+		 * wholly past the cut are unlinked from their parent in one step and
+		 * everything in them is queued for deletion; only the nodes which
+		 * straddle the cut are rewritten, and those left empty are dropped
+		 * as well. The changes are committed at once.
+		 */
+		void TruncateBlocks(uint64_t first);
+		
+		/**
+		 * Retrives the block id given the block no. Tree nodes which are not
+		 * in memory are read without holding the lock.
 		 */
 		BlockID GetBlockIDForBlockNo(uint64_t no) const;
 	};
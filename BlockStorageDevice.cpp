@@ -16,15 +16,582 @@
  along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdexcept>
+#include <algorithm>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "Exception.h"
 #include "DataStore.h"
+#include "AsyncDataStore.h"
+#include "ThreadPoolDataStore.h"
 #include "BlockStorageDevice.h"
+#include "Sha256.h"
+#include "ZeroBlock.h"
 
 using namespace cloudblockfs;
 
-BlockStorageDevice::BlockStorageDevice(DataStore *store) : m_store(store), m_meta(store)
+// the flusher wakes up at least this often, in milliseconds
+#define FLUSHER_INTERVAL 1000
+
+// percentage of the cache which may be dirty before the flusher starts draining it
+#define DIRTY_BACKGROUND_RATIO 25
+
+// percentage of the cache which may be dirty before writers have to wait
+#define DIRTY_RATIO 75
+
+// number of sequential readers tracked at once
+#define READAHEAD_STREAMS 8
+
+// read ahead window of a newly detected stream, in blocks
+#define READAHEAD_MIN_WINDOW 4
+
+// threads fetching blocks for read ahead
+#define READAHEAD_THREADS 8
+
+// object transfers in flight at once for multi-block reads, writes and flushes
+#define DEFAULT_QUEUE_DEPTH 16
+
+// the reclaimer looks for queued deletions at least this often, in milliseconds
+#define RECLAIM_INTERVAL 5000
+
+// percentage of a segment which must be live for the cleaner to leave it alone
+#define DEFAULT_CLEAN_THRESHOLD 50
+
+// the reclaimer runs the cleaner at most this often, in seconds
+#define CLEAN_INTERVAL 60
+
+class BlockStorageDevice::PrefetchJob : public ThreadPool::Job
+{
+private:
+	BlockStorageDevice *m_device;
+	uint64_t m_blockno;
+public:
+	PrefetchJob(BlockStorageDevice *device,uint64_t blockno) : m_device(device), m_blockno(blockno) { }
+	virtual void Run() { m_device->Prefetch(m_blockno); }
+};
+
+BlockStorageDevice::BlockStorageDevice(DataStore *store) : m_store(store), m_meta(store), 
+	m_async_store(dynamic_cast<AsyncDataStore *>(store)), m_queue_depth(DEFAULT_QUEUE_DEPTH), m_dedup(false),
+	m_stream_clock(0), m_readahead(0), m_shutdown(false), m_reclaimer_shutdown(false),
+	m_clean_threshold(DEFAULT_CLEAN_THRESHOLD), m_last_clean(time(NULL)), m_gc_rate_limit(0), m_gc_progress_function(NULL), m_gc_progress_userdata(NULL)
+{
+	ReadStream stream;
+	memset(&stream,0,sizeof(stream));
+	m_streams.resize(READAHEAD_STREAMS,stream);
+	m_reclaimer.reset(new Thread(ReclaimerThread,this));
+}
+
+BlockStorageDevice::~BlockStorageDevice()
+{
+	SetReadAhead(0);
+	StopFlusher();
+	try {
+		Sync();
+	} catch(const std::runtime_error& ) {
+	}
+	StopReclaimer();
+	
+	// records the reclaimer finished with are unlinked by the last head, nothing else would remove them
+	try {
+		m_meta.DeleteUnreferenced();
+	} catch(const std::runtime_error& ) {
+	}
+}
+
+int BlockStorageDevice::GetBlockSize() const
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	return head.block_size; 
+}
+
+int BlockStorageDevice::GetTreeDepth() const
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	return head.tree_depth; 
+}
+
+int64_t BlockStorageDevice::GetDiskSize() const
 {
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	return head.disk_size; 
+}
+
+int BlockStorageDevice::GetSegmentBlocks() const
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	return head.segment_blocks;
+}
+
+void BlockStorageDevice::SetCacheSize(size_t bytes)
+{
+	if(!bytes) {
+		// back to write-through, everything cached has to go out first
+		ScopedRangeLock range(m_range_lock,0,~0ULL,true);
+		StopFlusher();
+		FlushBlocks(time(NULL));
+		ScopedLock lock(m_lock);
+		m_cache.SetCapacity(0);
+		m_cache.Clear();
+		return;
+	}
+	
+	{
+		ScopedLock lock(m_lock);
+		m_cache.SetCapacity(bytes);
+	}
+	if(!m_flusher.get()) {
+		m_shutdown = false;
+		m_flusher.reset(new Thread(FlusherThread,this));
+	}
+}
+
+void BlockStorageDevice::SetQueueDepth(int depth)
+{
+	if(depth < 1) throw InvalidArgumentException("Queue depth must be at least 1");
+	
+	// transfers only run under one of these locks
+	ScopedRangeLock range(m_range_lock,0,~0ULL,true);
+	ScopedLock flush(m_flush_lock);
+	ScopedLock async(m_async_lock);
+	m_queue_depth = depth;
+	if(m_async_adapter.get()) {
+		// recreated with the new number of threads on next use
+		m_async_adapter.reset();
+		m_async_store = NULL;
+	}
+}
+
+void BlockStorageDevice::SetReadAhead(int blocks)
+{
+	if(!blocks) {
+		{
+			ScopedLock lock(m_lock);
+			m_readahead = 0;
+		}
+		m_prefetch_pool.reset(); // queued jobs are dropped
+		
+		ScopedLock lock(m_lock);
+		m_inflight.clear();
+		m_inflight_cond.Broadcast();
+		return;
+	}
+	
+	ScopedLock lock(m_lock);
+	m_readahead = blocks;
+}
+
+void BlockStorageDevice::ReadAhead(uint64_t start_block,uint64_t end_block) const
+{
+	if(!m_readahead || !m_cache.GetCapacity()) return;
+	
+	// find the stream this read continues, or one it is close to
+	ReadStream *stream = NULL, *near = NULL, *oldest = &m_streams[0];
+	for(std::vector<ReadStream>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+		if(it->next_block == start_block && it->last_used) {
+			stream = &*it;
+			break;
+		}
+		if(it->last_used && start_block + it->window >= it->next_block && start_block <= it->next_block + it->window) {
+			near = &*it;
+		}
+		if(it->last_used < oldest->last_used) oldest = &*it;
+	}
+	
+	if(stream) {
+		// sequential, read further ahead
+		if(stream->confirmed) {
+			stream->window = std::min(stream->window * 2,m_readahead);
+		}
+		stream->confirmed = true;
+	} else if(near) {
+		// skipped around, read less ahead
+		stream = near;
+		stream->window = std::max(stream->window / 2,1);
+	} else {
+		// new stream, only read ahead once it turns out to be sequential
+		stream = oldest;
+		stream->window = std::min(READAHEAD_MIN_WINDOW,m_readahead);
+		stream->confirmed = false;
+		stream->prefetched = end_block;
+	}
+	stream->next_block = end_block + 1;
+	stream->last_used = ++m_stream_clock;
+	if(!stream->confirmed) return;
+	
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	const uint64_t disk_blocks = (head.disk_size + head.block_size - 1) / head.block_size;
+	
+	uint64_t first = end_block + 1;
+	const uint64_t last = std::min(end_block + stream->window,disk_blocks - 1);
+	if(stream->prefetched > end_block && stream->prefetched <= last) first = stream->prefetched + 1;
+	if(first <= last && !m_prefetch_pool.get()) m_prefetch_pool.reset(new ThreadPool(READAHEAD_THREADS));
+	for(uint64_t i = first; i <= last && i < disk_blocks; i++) {
+		if(m_inflight.count(i) || m_cache.Find(i)) continue;
+		m_inflight[i] = true;
+		m_prefetch_pool->Queue(new PrefetchJob(const_cast<BlockStorageDevice *>(this),i));
+	}
+	if(last >= first) stream->prefetched = last;
+}
+
+void BlockStorageDevice::Prefetch(uint64_t blockno)
+{
+	BlockMeta::Head head;
+	BlockID block_id = 0;
+	bool valid;
+	{
+		ScopedLock lock(m_lock);
+		std::map<uint64_t,bool>::iterator it = m_inflight.find(blockno);
+		valid = it != m_inflight.end() && it->second && !m_cache.Find(blockno);
+	}
+	
+	// a write meanwhile marks the entry stale, so what is read here is discarded
+	if(valid) {
+		m_meta.GetHead(&head);
+		try {
+			// also brings the path to the block into the node cache
+			block_id = m_meta.GetBlockIDForBlockNo(blockno);
+		} catch(const std::runtime_error& ) {
+			valid = false;
+		}
+	}
+	
+	std::vector<uint8_t> data;
+	if(valid) {
+		data.resize(head.block_size,0);
+		if(block_id) {
+			try {
+				GetBlock(head,block_id,&data[0]);
+			} catch(const std::runtime_error& ) {
+				valid = false; // the demand read will report it
+			}
+		}
+	}
+	
+	ScopedLock lock(m_lock);
+	std::map<uint64_t,bool>::iterator it = m_inflight.find(blockno);
+	if(it == m_inflight.end()) return;
+	if(valid && it->second && !m_cache.Find(blockno)) {
+		m_cache.Insert(blockno)->data.swap(data);
+	}
+	m_inflight.erase(it);
+	m_inflight_cond.Broadcast();
+}
+
+void BlockStorageDevice::InvalidatePrefetch(uint64_t first_blockno,uint64_t last_blockno)
+{
+	std::map<uint64_t,bool>::iterator it = m_inflight.lower_bound(first_blockno);
+	for(; it != m_inflight.end() && it->first <= last_blockno; ++it) {
+		it->second = false;
+	}
+}
+
+void BlockStorageDevice::StopFlusher()
+{
+	{
+		ScopedLock lock(m_lock);
+		m_shutdown = true;
+		m_flush_cond.Broadcast();
+		m_throttle_cond.Broadcast();
+	}
+	m_flusher.reset();
+}
+
+void BlockStorageDevice::FlusherThread(void *userdata)
+{
+	BlockStorageDevice *device = (BlockStorageDevice *)userdata;
+	
+	bool idle = true;
+	device->m_lock.Lock();
+	while(!device->m_shutdown) {
+		// keep going without waiting while writers are filling the cache
+		const size_t dirty_background = device->m_cache.GetCapacity() * DIRTY_BACKGROUND_RATIO / 100;
+		if(idle || device->m_cache.GetDirtySize() <= dirty_background) {
+			device->m_flush_cond.TimedWait(device->m_lock,FLUSHER_INTERVAL);
+			if(device->m_shutdown) break;
+		}
+		
+		// write out blocks which have been dirty for longer than an epoch,
+		// or everything once the background ratio is exceeded
+		const time_t now = time(NULL);
+		time_t dirty_before = now - device->m_meta.GetEpochInterval();
+		if(device->m_cache.GetDirtySize() > dirty_background) {
+			dirty_before = now;
+		}
+		
+		device->m_lock.Unlock();
+		try {
+			device->FlushBlocks(dirty_before);
+			if(device->EndEpoch()) {
+				ScopedLock lock(device->m_lock);
+				device->m_reclaim_cond.Signal();
+			}
+			idle = false;
+		} catch(const std::runtime_error& ) {
+			// blocks stay dirty and are retried on the next pass, Sync() reports the error
+			idle = true;
+		}
+		device->m_lock.Lock();
+	}
+	device->m_lock.Unlock();
+}
+
+void BlockStorageDevice::FlushBlocks(time_t dirty_before)
+{
+	ScopedLock flush(m_flush_lock);
+	
+	std::vector<uint64_t> blocks;
+	int block_size;
+	{
+		ScopedLock lock(m_lock);
+		m_cache.GetDirtyBlocks(blocks,dirty_before);
+		block_size = m_cache.GetBlockSize();
+	}
+	if(blocks.empty()) return;
+	
+	// write out up to a queue depth of blocks at a time, or a segment's worth when packing
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	const int batch_size = head.segment_blocks ? (int)head.segment_blocks : m_queue_depth;
+	std::vector<uint64_t> batch, generations;
+	std::vector<Placement> placements;
+	std::vector<void *> block_data;
+	std::vector<uint8_t> data;
+	std::vector<uint64_t>::const_iterator it = blocks.begin();
+	while(it != blocks.end()) {
+		batch.clear();
+		generations.clear();
+		placements.clear();
+		block_data.clear();
+		data.resize(batch_size * block_size);
+		{
+			ScopedLock lock(m_lock);
+			for(; it != blocks.end() && (int)batch.size() < batch_size; ++it) {
+				BlockCache::Entry *entry = m_cache.Find(*it);
+				if(!entry || !entry->dirty) continue;
+				
+				memcpy(&data[batch.size() * block_size],&entry->data[0],block_size);
+				batch.push_back(*it);
+				generations.push_back(entry->generation);
+			}
+		}
+		
+		// the copies are hashed and uploaded without the lock, the new objects are not referenced yet
+		for(size_t i = 0; i < batch.size(); i++) {
+			Placement placement;
+			PlaceBlock(&data[i * block_size],block_size,head.segment_blocks != 0,&placement);
+			placements.push_back(placement);
+			block_data.push_back(&data[i * block_size]);
+		}
+		try {
+			UploadBlocks(placements,block_data,block_size);
+		} catch(...) {
+			ReleasePlacements(placements);
+			throw;
+		}
+		
+		// the tree nodes are read ahead, so the lock is not held across store reads
+		for(size_t i = 0; i < batch.size(); i++) m_meta.LoadBlockNo(batch[i]);
+		
+		// link in the blocks which are still dirty, under the lock so a
+		// truncate or direct write cannot slip in between check and update
+		std::vector<BlockID> orphans;
+		{
+			ScopedLock lock(m_lock);
+			for(size_t i = 0; i < batch.size(); i++) {
+				BlockCache::Entry *entry = m_cache.Find(batch[i]);
+				const Placement& placement = placements[i];
+				if(entry && entry->dirty) {
+					m_meta.SetBlockIDForBlockNo(batch[i],placement.block_id);
+					if(placement.index) m_meta.IndexBlockID(placement.hash,placement.block_id);
+					m_cache.MarkClean(batch[i],generations[i]);
+				} else if(BlockMeta::IsPackedID(head,placement.block_id)) {
+					// the segment is shared with blocks which were linked in, the cleaner sees to the slot
+					m_meta.ReleaseBlockID(placement.block_id);
+				} else if(placement.upload) {
+					// block was overwritten directly or truncated away meanwhile
+					orphans.push_back(placement.block_id);
+				} else if(placement.block_id) {
+					m_meta.ReleaseBlockID(placement.block_id);
+				}
+			}
+			m_throttle_cond.Broadcast();
+		}
+		
+		char object[32];
+		for(std::vector<BlockID>::const_iterator orphan = orphans.begin(); orphan != orphans.end(); ++orphan) {
+			sprintf(object,"%.16llX",*orphan);
+			m_store->DeleteObject(object);
+		}
+		EndEpoch();
+	}
+}
+
+bool BlockStorageDevice::EndEpoch()
+{
+	// called without m_lock, the meta data is written while reads go on
+	if(m_meta.IsEpochFull()) {
+		m_meta.Sync();
+	} else if(m_meta.IsEpochExpired()) {
+		m_meta.Flush();
+	} else {
+		return false;
+	}
+	return true;
+}
+
+AsyncDataStore *BlockStorageDevice::GetAsyncStore() const
+{
+	ScopedLock lock(m_async_lock);
+	if(!m_async_store) {
+		m_async_adapter.reset(new ThreadPoolDataStore(m_store.get(),m_queue_depth));
+		m_async_store = m_async_adapter.get();
+	}
+	return m_async_store;
+}
+
+void BlockStorageDevice::TransferObjects(const std::vector<Transfer>& transfers,bool put,int block_size) const
+{
+	char object[32];
+	if(transfers.empty()) return;
+	
+	// nothing to overlap with a single object
+	if(transfers.size() == 1 || m_queue_depth <= 1) {
+		for(std::vector<Transfer>::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+			sprintf(object,"%.16llX",it->block_id);
+			if(put) m_store->PutObject(object,it->data,block_size);
+			else if(it->view) *it->view = m_store->GetObjectView(object,block_size);
+			else m_store->GetObject(object,it->data,block_size);
+		}
+		return;
+	}
+	
+	AsyncDataStore *store = GetAsyncStore();
+	CompletionQueue queue;
+	CompletionQueue::Completion completion, error;
+	error.status = CompletionQueue::COMPLETION_OK;
+	
+	// keep the queue full, but stop issuing once something failed
+	size_t next = 0, pending = 0;
+	while(pending || (next < transfers.size() && error.status == CompletionQueue::COMPLETION_OK)) {
+		while(next < transfers.size() && (int)pending < m_queue_depth && error.status == CompletionQueue::COMPLETION_OK) {
+			sprintf(object,"%.16llX",transfers[next].block_id);
+			if(put) store->PutObjectAsync(object,transfers[next].data,block_size,&queue,NULL);
+			else if(transfers[next].view) store->GetObjectViewAsync(object,block_size,transfers[next].view,&queue,NULL);
+			else store->GetObjectAsync(object,transfers[next].data,block_size,&queue,NULL);
+			next++;
+			pending++;
+		}
+		store->Submit();
+		
+		queue.Wait(&completion);
+		pending--;
+		if(completion.status != CompletionQueue::COMPLETION_OK && error.status == CompletionQueue::COMPLETION_OK) {
+			error = completion;
+		}
+	}
+	error.Rethrow();
+}
+
+bool BlockStorageDevice::CompareBlockIDs(const Transfer& a,const Transfer& b)
+{
+	return a.block_id < b.block_id;
+}
+
+void BlockStorageDevice::FetchBlocks(const std::vector<Transfer>& transfers,int block_size) const
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	
+	// objects of their own are fetched in parallel, neighbouring slots of a
+	// segment with a single ranged read
+	std::vector<Transfer> objects, packed;
+	for(std::vector<Transfer>::const_iterator it = transfers.begin(); it != transfers.end(); ++it) {
+		if(BlockMeta::IsPackedID(head,it->block_id)) packed.push_back(*it);
+		else objects.push_back(*it);
+	}
+	TransferObjects(objects,false,block_size);
+	
+	std::sort(packed.begin(),packed.end(),CompareBlockIDs);
+	std::vector<uint8_t> buffer;
+	char object[32];
+	for(size_t i = 0; i < packed.size(); ) {
+		const BlockID segment_id = BlockMeta::GetSegmentID(packed[i].block_id);
+		size_t end = i + 1;
+		while(end < packed.size() && packed[end].block_id == packed[end - 1].block_id + 1 &&
+		      BlockMeta::GetSegmentID(packed[end].block_id) == segment_id) end++;
+		
+		sprintf(object,"%.16llX",segment_id);
+		const uint64_t offset = (uint64_t)BlockMeta::GetSegmentSlot(packed[i].block_id) * block_size;
+		if(end - i == 1) {
+			m_store->GetObjectRange(object,packed[i].data,offset,block_size);
+		} else {
+			buffer.resize((end - i) * block_size);
+			m_store->GetObjectRange(object,&buffer[0],offset,buffer.size());
+			for(size_t j = i; j < end; j++) {
+				memcpy(packed[j].data,&buffer[(j - i) * block_size],block_size);
+			}
+		}
+		i = end;
+	}
+}
+
+void BlockStorageDevice::GetBlock(const BlockMeta::Head& head,BlockID block_id,void *data) const
+{
+	char object[32];
+	sprintf(object,"%.16llX",BlockMeta::GetObjectID(head,block_id));
+	if(BlockMeta::IsPackedID(head,block_id)) {
+		m_store->GetObjectRange(object,data,(uint64_t)BlockMeta::GetSegmentSlot(block_id) * head.block_size,head.block_size);
+	} else {
+		m_store->GetObject(object,data,head.block_size);
+	}
+}
+
+void BlockStorageDevice::UploadBlocks(std::vector<Placement>& placements,const std::vector<void *>& data,int block_size)
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	
+	// blocks placed for packing fill segments in turn, a lone block is not
+	// worth a segment and gets an object of its own
+	std::vector<size_t> packed;
+	for(size_t i = 0; i < placements.size(); i++) {
+		if(placements[i].upload && !placements[i].block_id) packed.push_back(i);
+	}
+	if(packed.size() == 1) {
+		placements[packed[0]].block_id = m_meta.AllocateBlockID();
+		packed.clear();
+	}
+	
+	std::vector<Transfer> transfers;
+	for(size_t i = 0; i < placements.size(); i++) {
+		if(!placements[i].upload || !placements[i].block_id) continue;
+		Transfer transfer;
+		transfer.block_id = placements[i].block_id;
+		transfer.data = data[i];
+		transfers.push_back(transfer);
+	}
+	
+	std::vector<uint8_t> segment;
+	char object[32];
+	for(size_t i = 0; i < packed.size(); i += head.segment_blocks) {
+		const size_t count = std::min<size_t>(head.segment_blocks,packed.size() - i);
+		const BlockID segment_id = m_meta.AllocateSegmentID();
+		segment.resize(count * block_size);
+		for(size_t slot = 0; slot < count; slot++) {
+			memcpy(&segment[slot * block_size],data[packed[i + slot]],block_size);
+			placements[packed[i + slot]].block_id = segment_id | slot;
+		}
+		sprintf(object,"%.16llX",segment_id);
+		m_store->PutObject(object,&segment[0],segment.size());
+	}
+	TransferObjects(transfers,true,block_size);
 }
 
 bool BlockStorageDevice::IsValid() const
@@ -38,13 +605,82 @@ bool BlockStorageDevice::IsValid() const
 
 void BlockStorageDevice::Check()
 {
+	// reading the head replays the journal, the checkpoint after it queues the log for deletion
+	if(m_meta.Check()) {
+		ScopedLock lock(m_lock);
+		m_reclaim_cond.Signal();
+	}
+}
+
+void BlockStorageDevice::Flush()
+{
+	// the metadata flushes the objects before the journal which refers to
+	// them, the last flush makes the journal itself durable
+	FlushBlocks(time(NULL));
+	m_meta.Flush();
+	m_store->Flush();
 }
 
 void BlockStorageDevice::Sync()
 {
+	FlushBlocks(time(NULL));
+	m_meta.Sync();
+	m_store->Flush();
+	
+	ScopedLock lock(m_lock);
+	m_reclaim_cond.Signal();
+}
+
+void BlockStorageDevice::Reclaim()
+{
+	ScopedLock reclaim(m_reclaim_lock);
+	m_meta.ReclaimObjects();
+}
+
+void BlockStorageDevice::StopReclaimer()
+{
+	{
+		ScopedLock lock(m_lock);
+		m_reclaimer_shutdown = true;
+		m_reclaim_cond.Broadcast();
+	}
+	m_reclaimer.reset();
 }
 
-void BlockStorageDevice::Format(int block_size,int tree_depth)
+void BlockStorageDevice::ReclaimerThread(void *userdata)
+{
+	BlockStorageDevice *device = (BlockStorageDevice *)userdata;
+	
+	device->m_lock.Lock();
+	while(!device->m_reclaimer_shutdown) {
+		device->m_reclaim_cond.TimedWait(device->m_lock,RECLAIM_INTERVAL);
+		if(device->m_reclaimer_shutdown) break;
+		
+		device->m_lock.Unlock();
+		try {
+			device->Reclaim();
+			
+			// once a segment's worth of packed blocks has been overwritten, empty the sparse segments
+			BlockMeta::Head head;
+			device->m_meta.GetHead(&head);
+			time_t last_clean;
+			{
+				ScopedLock reclaim(device->m_reclaim_lock);
+				last_clean = device->m_last_clean;
+			}
+			if(head.segment_blocks && device->m_meta.GetFreedBlocks() >= (uint64_t)head.segment_blocks &&
+			   time(NULL) - last_clean >= CLEAN_INTERVAL) {
+				device->Clean();
+			}
+		} catch(const std::runtime_error& ) {
+			// whatever is left stays queued on the store and is retried on the next pass
+		}
+		device->m_lock.Lock();
+	}
+	device->m_lock.Unlock();
+}
+
+void BlockStorageDevice::Format(int block_size,int tree_depth,int segment_blocks)
 {
 	BlockMeta::Head head;
 	memset(&head,0,sizeof(head));
@@ -59,10 +695,18 @@ void BlockStorageDevice::Format(int block_size,int tree_depth)
 		case 65536: break;
 		default: throw InvalidArgumentException("Invalid block size. Must be: 1024, 2048, 4096, 8192, 16384, 32768, 65536");
 	}
+	if(segment_blocks < 0 || segment_blocks > 65536) {
+		throw InvalidArgumentException("Invalid segment size. Must be up to 65536 blocks");
+	}
 	
+	ScopedLock reclaim(m_reclaim_lock);
+	ScopedRangeLock range(m_range_lock,0,~0ULL,true);
+	ScopedLock flush(m_flush_lock);
+	ScopedLock lock(m_lock);
 	head.block_size = block_size;
 	head.tree_depth = tree_depth;
 	head.disk_size = 0;
+	head.segment_blocks = segment_blocks;
 	srand(time(NULL));
 	head.head_id = rand() + 1;
 	head.last_id = head.head_id;
@@ -72,31 +716,43 @@ void BlockStorageDevice::Format(int block_size,int tree_depth)
 	sprintf(object,"%.16llX",head.head_id);
 	m_store->PutObject(object,&table[0],head.block_size);
 
+	m_cache.SetBlockSize(block_size);
+	InvalidatePrefetch(0,~0ULL);
+	m_meta.Reset();
 	m_meta.PutHead(head);
+	m_meta.Sync();
 }
 
-void BlockStorageDevice::Truncate(int size)
+void BlockStorageDevice::Truncate(int64_t size)
 {
+	ScopedRangeLock range(m_range_lock,0,~0ULL,true);
 	BlockMeta::Head head;
 	m_meta.GetHead(&head);
-	if(size < head.disk_size) {
-		const uint64_t erase_start_block = ((size + head.block_size - 1) / head.block_size);
-		const uint64_t erase_end_block = (head.disk_size / head.block_size);
-		for(uint64_t i = erase_start_block; i <= erase_end_block; i++) {
-			m_meta.SetBlockIDForBlockNo(i,0);
-			/*
-			BlockID block = m_meta.GetBlockIDForBlockNo(i);
-			if(block) {
-				char object[32];
-				sprintf(object,"%.16llX",block);
-				m_store->DeleteObject(object);
-				m_meta.SetBlockIDForBlockNo(i,0);
-			}*/
+	
+	// the part of the new last block past the end must read back as zeros if the disk grows again
+	const int tail = size % head.block_size;
+	if(size < head.disk_size && tail) {
+		const uint64_t blockno = size / head.block_size;
+		std::vector<uint8_t> buffer(head.block_size);
+		if(GetCacheSize()) {
+			CacheWrite(blockno,&buffer[0],tail,head.block_size - tail);
+		} else {
+			LoadBlock(blockno,&buffer[0]);
+			memset(&buffer[tail],0,head.block_size - tail);
+			StoreBlock(blockno,&buffer[0]);
 		}
 	}
+	
+	ScopedLock lock(m_lock);
 	m_meta.GetHead(&head);
-	head.disk_size = size;
-	m_meta.PutHead(head);
+	const int64_t old_size = head.disk_size;
+	m_meta.SetDiskSize(size);
+	if(size < old_size) {
+		const uint64_t erase_start_block = ((size + head.block_size - 1) / head.block_size);
+		m_cache.EraseFrom(erase_start_block);
+		InvalidatePrefetch(erase_start_block,~0ULL);
+		m_meta.TruncateBlocks(erase_start_block);
+	}
 }
 
 static void DeleteObjects(const std::string& name,void *userdata)
@@ -107,114 +763,509 @@ static void DeleteObjects(const std::string& name,void *userdata)
 
 void BlockStorageDevice::Delete()
 {
+	ScopedLock reclaim(m_reclaim_lock);
+	ScopedRangeLock range(m_range_lock,0,~0ULL,true);
+	ScopedLock flush(m_flush_lock);
+	ScopedLock lock(m_lock);
+	m_cache.Clear();
+	InvalidatePrefetch(0,~0ULL);
+	m_meta.Reset();
 	m_store->ListObjects(DeleteObjects,m_store.get());
 }
 
-void BlockStorageDevice::GC()
+uint64_t BlockStorageDevice::GC()
 {
+	// objects the collector saw referenced must stay in place until it is done
+	ScopedLock reclaim(m_reclaim_lock);
+	
+	GarbageCollector collector(m_store.get(),&m_meta);
+	collector.SetThreads(m_queue_depth);
+	collector.SetRateLimit(m_gc_rate_limit);
+	collector.SetProgressCallback(m_gc_progress_function,m_gc_progress_userdata);
+	{
+		// with no request or flush running, every uploaded object is mapped
+		ScopedRangeLock range(m_range_lock,0,~0ULL,true);
+		ScopedLock flush(m_flush_lock);
+		collector.Begin();
+	}
+	return collector.Collect();
 }
 
-void BlockStorageDevice::WriteBlock(uint64_t blockno,const void *data)
+uint64_t BlockStorageDevice::Clean()
 {
-	const BlockID block_id = m_meta.AllocateBlockID();
-	char object[32];
-	sprintf(object,"%.16llX",block_id);
-	m_store->PutObject(object,data,GetBlockSize());
-	m_meta.SetBlockIDForBlockNo(blockno,block_id);
+	ScopedLock reclaim(m_reclaim_lock);
+	m_last_clean = time(NULL);
+	
+	// With no request or flush running every segment handed out so far has
+	// all its blocks linked in. From then on those segments only lose
+	// blocks, so a walk of the block map afterwards finds all that is left
+	// of them. Segments handed out later are left for the next run.
+	BlockMeta::Head head;
+	std::set<BlockID> freed;
+	{
+		ScopedRangeLock range(m_range_lock,0,~0ULL,true);
+		ScopedLock flush(m_flush_lock);
+		m_meta.GetHead(&head);
+		m_meta.GetFreedSegments(freed);
+	}
+	if(!head.segment_blocks) return 0;
+	const uint64_t blocks = (head.disk_size + head.block_size - 1) / head.block_size;
+	const int threshold = GetCleanThreshold();
+	
+	// count what is left of each segment
+	std::map<BlockID,uint64_t> live;
+	for(uint64_t blockno = 0; blockno < blocks; blockno++) {
+		const BlockID block_id = m_meta.GetBlockIDForBlockNo(blockno);
+		if(BlockMeta::IsPackedID(head,block_id) && BlockMeta::GetSegmentNumber(block_id) <= head.last_segment) {
+			live[BlockMeta::GetSegmentID(block_id)]++;
+		}
+	}
+	
+	// segments with nothing left, and those which are mostly dead
+	std::set<BlockID> segments, done;
+	for(std::set<BlockID>::const_iterator it = freed.begin(); it != freed.end(); ++it) {
+		if(BlockMeta::GetSegmentNumber(*it) > head.last_segment) continue;
+		if(!live.count(*it)) segments.insert(*it);
+		done.insert(*it);
+	}
+	std::vector<BlockID> sparse;
+	uint64_t sparse_blocks = 0;
+	for(std::map<BlockID,uint64_t>::const_iterator it = live.begin(); it != live.end(); ++it) {
+		if(it->second * 100 < (uint64_t)head.segment_blocks * threshold) {
+			sparse.push_back(it->first);
+			sparse_blocks += it->second;
+		}
+	}
+	
+	// moving blocks is only worth it if they end up in fewer segments,
+	// a partly filled segment written by the last run stays as it is
+	const bool moving = (sparse_blocks + head.segment_blocks - 1) / head.segment_blocks < sparse.size();
+	if(moving) segments.insert(sparse.begin(),sparse.end());
+	
+	// find the blocks still in them, in segment order so they are read a run at a time
+	std::vector<std::pair<BlockID,uint64_t> > moves;
+	for(uint64_t blockno = 0; moving && blockno < blocks; blockno++) {
+		const BlockID block_id = m_meta.GetBlockIDForBlockNo(blockno);
+		if(BlockMeta::IsPackedID(head,block_id) && segments.count(BlockMeta::GetSegmentID(block_id))) {
+			moves.push_back(std::make_pair(block_id,blockno));
+		}
+	}
+	std::sort(moves.begin(),moves.end());
+	
+	// pack them into new segments, a block rewritten meanwhile keeps its old segment around
+	std::set<BlockID> kept;
+	std::vector<uint8_t> data;
+	for(size_t i = 0; i < moves.size(); i += head.segment_blocks) {
+		const size_t count = std::min<size_t>(head.segment_blocks,moves.size() - i);
+		data.resize(count * head.block_size);
+		std::vector<Transfer> transfers(count);
+		std::vector<Placement> placements(count);
+		std::vector<void *> block_data(count);
+		for(size_t j = 0; j < count; j++) {
+			transfers[j].block_id = moves[i + j].first;
+			transfers[j].data = block_data[j] = &data[j * head.block_size];
+			placements[j].block_id = 0;
+			placements[j].upload = true;
+			placements[j].index = false;
+		}
+		FetchBlocks(transfers,head.block_size);
+		UploadBlocks(placements,block_data,head.block_size);
+		
+		for(size_t j = 0; j < count; j++) {
+			if(!MoveBlock(moves[i + j].second,moves[i + j].first,placements[j].block_id)) {
+				kept.insert(BlockMeta::GetSegmentID(moves[i + j].first));
+			}
+		}
+	}
+	
+	uint64_t cleaned = 0;
+	for(std::set<BlockID>::const_iterator it = segments.begin(); it != segments.end(); ++it) {
+		if(kept.count(*it)) continue;
+		m_meta.QueueDelete(*it);
+		cleaned++;
+	}
+	
+	// moving blocks out frees their slots again, which needs no further look
+	done.insert(segments.begin(),segments.end());
+	m_meta.ForgetFreedSegments(done);
+	return cleaned;
 }
 
-void BlockStorageDevice::ReadBlock(uint64_t blockno,void *data) const
+bool BlockStorageDevice::MoveBlock(uint64_t blockno,BlockID old_id,BlockID new_id)
 {
-	const BlockID block_id = m_meta.GetBlockIDForBlockNo(blockno);
-	char object[32];
+	ScopedRangeLock range(m_range_lock,blockno,blockno,true);
+	m_meta.LoadBlockNo(blockno);
+	{
+		ScopedLock lock(m_lock);
+		
+		// a block which was rewritten meanwhile, or is about to be, keeps its
+		// new mapping and the copy is not needed
+		const BlockCache::Entry *entry = m_cache.Find(blockno);
+		const BlockID block_id = m_meta.GetBlockIDForBlockNo(blockno);
+		if(block_id != old_id || (entry && entry->dirty)) {
+			m_meta.ReleaseBlockID(new_id);
+			return block_id != old_id;
+		}
+		m_meta.SetBlockIDForBlockNo(blockno,new_id);
+	}
+	EndEpoch();
+	return true;
+}
+
+void BlockStorageDevice::Extend(int64_t size)
+{
+	ScopedLock lock(m_lock);
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	if(size > head.disk_size) {
+		m_meta.SetDiskSize(size);
+	}
+}
+
+void BlockStorageDevice::StoreBlock(uint64_t blockno,const void *data)
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	
+	Placement placement;
+	PlaceBlock(data,head.block_size,false,&placement);
+	if(placement.upload) {
+		char object[32];
+		sprintf(object,"%.16llX",placement.block_id);
+		m_store->PutObject(object,data,head.block_size);
+	}
+	
+	m_meta.LoadBlockNo(blockno);
+	{
+		ScopedLock lock(m_lock);
+		m_cache.Erase(blockno); // a direct write replaces any cached copy
+		InvalidatePrefetch(blockno,blockno);
+		m_meta.SetBlockIDForBlockNo(blockno,placement.block_id);
+		if(placement.index) m_meta.IndexBlockID(placement.hash,placement.block_id);
+	}
+	EndEpoch();
+}
+
+void BlockStorageDevice::PlaceBlock(const void *data,int block_size,bool pack,Placement *out_placement)
+{
+	// an all-zero block is left as a hole, which reads back as zeros
+	out_placement->block_id = 0;
+	out_placement->upload = false;
+	out_placement->index = false;
+	if(IsZeroBlock(data,block_size)) return;
 	
+	// a block to be packed gets its slot once the segment is put together
+	if(!GetDedup()) {
+		out_placement->block_id = pack ? 0 : m_meta.AllocateBlockID();
+		out_placement->upload = true;
+		return;
+	}
+	
+	// The dedup index finds objects by their id, so deduplicated blocks
+	// are never packed. Contents stored already are referenced, this holds the object until the block is mapped
+	uint8_t digest[Sha256::DIGEST_SIZE];
+	Sha256::Hash(data,block_size,digest);
+	memcpy(out_placement->hash.words,digest,sizeof(digest));
+	out_placement->block_id = m_meta.AcquireDuplicate(out_placement->hash);
+	if(!out_placement->block_id) {
+		out_placement->block_id = m_meta.AllocateBlockID(out_placement->hash);
+		out_placement->upload = true;
+		out_placement->index = true;
+	}
+}
+
+void BlockStorageDevice::ReleasePlacements(const std::vector<Placement>& placements)
+{
+	// give back the references taken on existing objects which were never mapped
+	for(std::vector<Placement>::const_iterator it = placements.begin(); it != placements.end(); ++it) {
+		if(it->block_id && !it->upload) m_meta.ReleaseBlockID(it->block_id);
+	}
+}
+
+bool BlockStorageDevice::ReadCachedBlock(uint64_t blockno,void *data) const
+{
+	const BlockCache::Entry *entry = m_cache.Find(blockno);
+	if(entry) {
+		memcpy(data,&entry->data[0],entry->data.size());
+		return true;
+	}
+	return false;
+}
+
+void BlockStorageDevice::LoadBlock(uint64_t blockno,void *data) const
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	
+	{
+		ScopedLock lock(m_lock);
+		
+		// a block being read ahead is on its way, wait for it rather than fetching it twice
+		while(m_inflight.count(blockno)) {
+			m_inflight_cond.Wait(m_lock);
+		}
+		if(ReadCachedBlock(blockno,data)) return;
+	}
+	
+	// the block is locked, it cannot be remapped or become dirty until we are done
+	const BlockID block_id = m_meta.GetBlockIDForBlockNo(blockno);
 	if(block_id == 0) {
-		memset(data,0,GetBlockSize());
+		memset(data,0,head.block_size);
 	} else {
-		sprintf(object,"%.16llX",block_id);
-		m_store->GetObject(object,data,GetBlockSize());
+		GetBlock(head,block_id,data);
+	}
+	
+	ScopedLock lock(m_lock);
+	if(m_cache.GetCapacity() && m_cache.GetBlockSize() == head.block_size && !m_cache.Find(blockno)) {
+		memcpy(&m_cache.Insert(blockno)->data[0],data,head.block_size);
 	}
 }
 
-void BlockStorageDevice::Write(const void *data,int size,uint64_t offset)
+void BlockStorageDevice::WriteBlock(uint64_t blockno,const void *data)
+{
+	ScopedRangeLock range(m_range_lock,blockno,blockno,true);
+	StoreBlock(blockno,data);
+}
+
+void BlockStorageDevice::ReadBlock(uint64_t blockno,void *data) const
+{
+	ScopedRangeLock range(m_range_lock,blockno,blockno,false);
+	LoadBlock(blockno,data);
+}
+
+void BlockStorageDevice::CacheWrite(uint64_t blockno,const void *data,int offset,int size)
 {
 	const int block_size = GetBlockSize();
+	std::vector<uint8_t> buffer;
+	BlockCache::Entry *entry;
+	
+	m_lock.Lock();
+	if(m_cache.GetBlockSize() != block_size) m_cache.SetBlockSize(block_size);
+	for(;;) {
+		// a block which is not dirty yet adds to the dirty size, wait for the flusher if that is too high
+		entry = m_cache.Find(blockno);
+		if(!entry || !entry->dirty) {
+			const size_t dirty_limit = m_cache.GetCapacity() * DIRTY_RATIO / 100;
+			while(m_cache.GetDirtySize() && m_cache.GetDirtySize() + block_size > dirty_limit && !m_shutdown) {
+				m_flush_cond.Signal();
+				m_throttle_cond.Wait(m_lock);
+			}
+			entry = m_cache.Find(blockno);
+		}
+		if(entry || size == block_size || !buffer.empty()) break;
+		
+		// we must issue a read if this is a partial write, the store is read without the lock
+		m_lock.Unlock();
+		buffer.resize(block_size);
+		LoadBlock(blockno,&buffer[0]);
+		m_lock.Lock();
+	}
+	
+	if(!entry) {
+		entry = m_cache.Insert(blockno);
+		if(!buffer.empty()) entry->data.swap(buffer);
+	}
+	
+	InvalidatePrefetch(blockno,blockno);
+	memcpy(&entry->data[offset],data,size);
+	m_cache.MarkDirty(entry);
+	if(m_cache.GetDirtySize() > m_cache.GetCapacity() * DIRTY_BACKGROUND_RATIO / 100) {
+		m_flush_cond.Signal();
+	}
+	m_lock.Unlock();
+}
+
+void BlockStorageDevice::Write(const void *data,int size,uint64_t offset)
+{
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	const int block_size = head.block_size;
 	uint64_t i, start_block, end_block;
-	int bytes_to_write, remaining;
+	int bytes_to_write;
 	const unsigned long offset_mask = block_size - 1;
-	
-	m_block.resize(block_size);
+	if(size <= 0) return;
 	
 	start_block = offset / block_size;
 	end_block = (offset + size - 1) / block_size;
 	
-	remaining = size;
-	if(start_block == end_block) {
-		// we must issue a read if this is not a partial write
-		if(size != block_size) {
-			ReadBlock(start_block,&m_block[0]);
-		}
-		memcpy(&m_block[offset & offset_mask],data,size);
-		WriteBlock(start_block,&m_block[0]);
-	} else {
-		bytes_to_write = block_size - (offset & offset_mask);
-		if(bytes_to_write != block_size) {
-			ReadBlock(start_block,&m_block[0]);
-		}
-		memcpy(&m_block[offset & offset_mask],data,bytes_to_write);
-		WriteBlock(start_block,&m_block[0]);
-		
-        (char *&)data += bytes_to_write;
-		remaining -= bytes_to_write;
-		for(i = start_block + 1; i < end_block; i++) {
-			WriteBlock(i,data);
-			(char *&)data += block_size;
-			remaining -= block_size;
+	// writers to the same blocks go one at a time, others go ahead
+	ScopedRangeLock range(m_range_lock,start_block,end_block,true);
+	
+	if(GetCacheSize()) {
+		// split into blocks and let the cache absorb them
+		while(size > 0) {
+			const int block_offset = offset & offset_mask;
+			bytes_to_write = std::min(size,block_size - block_offset);
+			CacheWrite(offset / block_size,data,block_offset,bytes_to_write);
+			(const char *&)data += bytes_to_write;
+			size -= bytes_to_write;
+			offset += bytes_to_write;
 		}
+		return;
+	}
+	
+	const int first_offset = offset & offset_mask;
+	const int last_size = (offset + size - 1) % block_size + 1;
+	
+	// we must issue a read for partial first and last blocks
+	std::vector<uint8_t> first, last;
+	if(first_offset || (start_block == end_block && size != block_size)) {
+		first.resize(block_size);
+		LoadBlock(start_block,&first[0]);
+		memcpy(&first[first_offset],data,std::min(size,block_size - first_offset));
+	}
+	if(end_block != start_block && last_size != block_size) {
+		last.resize(block_size);
+		LoadBlock(end_block,&last[0]);
+		memcpy(&last[0],(const char *)data + size - last_size,last_size);
+	}
+	
+	// upload every new object at once, then link them in
+	std::vector<Placement> placements;
+	std::vector<void *> block_data;
+	for(i = start_block; i <= end_block; i++) {
+		void *block;
+		if(i == start_block && !first.empty()) block = &first[0];
+		else if(i == end_block && !last.empty()) block = &last[0];
+		else block = (char *)data + (i - start_block) * block_size - first_offset;
 		
-		if(remaining != block_size) {
-			ReadBlock(end_block,&m_block[0]);
+		Placement placement;
+		PlaceBlock(block,block_size,head.segment_blocks != 0,&placement);
+		placements.push_back(placement);
+		block_data.push_back(block);
+	}
+	try {
+		UploadBlocks(placements,block_data,block_size);
+	} catch(...) {
+		ReleasePlacements(placements);
+		throw;
+	}
+	
+	for(i = start_block; i <= end_block; i++) m_meta.LoadBlockNo(i);
+	{
+		ScopedLock lock(m_lock);
+		InvalidatePrefetch(start_block,end_block);
+		for(i = start_block; i <= end_block; i++) {
+			const Placement& placement = placements[i - start_block];
+			m_cache.Erase(i); // a direct write replaces any cached copy
+			m_meta.SetBlockIDForBlockNo(i,placement.block_id);
+			if(placement.index) m_meta.IndexBlockID(placement.hash,placement.block_id);
 		}
-		memcpy(&m_block[0],data,remaining);
-		WriteBlock(end_block,&m_block[0]);
 	}
+	EndEpoch();
 }
 
 void BlockStorageDevice::Read(void *data,int size,uint64_t offset) const
 {
-	const int block_size = GetBlockSize();
+	BlockMeta::Head head;
+	m_meta.GetHead(&head);
+	const int block_size = head.block_size;
 	uint64_t i, start_block, end_block;
-	int bytes_to_read, remaining;
 	const unsigned long offset_mask = block_size - 1;
-	
-	m_block.resize(block_size);
+	if(size <= 0) return;
 	
 	// compute start and end block
 	start_block = offset / block_size;
 	end_block = (offset + size - 1) / block_size;
-
-	remaining = size;
-	if(start_block == end_block) {
-		ReadBlock(start_block,&m_block[0]);
-		memcpy(data,&m_block[offset & offset_mask],size);
-	} else {
-		// copy start block portion
-		bytes_to_read = block_size - (offset & offset_mask);
-		ReadBlock(start_block,&m_block[0]);
-		memcpy(data,&m_block[offset & offset_mask],bytes_to_read);
+	
+	// readers run alongside each other, but not alongside writers of the same blocks
+	ScopedRangeLock range(m_range_lock,start_block,end_block,false);
+	
+	// partial first and last blocks are read into a buffer, whole blocks in place
+	const int first_offset = offset & offset_mask;
+	const int last_size = (offset + size - 1) % block_size + 1;
+	std::vector<uint8_t> first, last;
+	if(first_offset || (start_block == end_block && size != block_size)) first.resize(block_size);
+	if(end_block != start_block && last_size != block_size) last.resize(block_size);
+	
+	// take what the cache has
+	std::vector<Transfer> missed, transfers;
+	std::vector<uint64_t> missed_blocks;
+	{
+		ScopedLock lock(m_lock);
+		ReadAhead(start_block,end_block);
 		
-		(char *&)data += bytes_to_read;
-		remaining -= bytes_to_read;
+		// blocks being read ahead are on their way, wait for them rather than fetching them twice
+		std::map<uint64_t,bool>::const_iterator inflight;
+		while((inflight = m_inflight.lower_bound(start_block)) != m_inflight.end() && inflight->first <= end_block) {
+			m_inflight_cond.Wait(m_lock);
+		}
 		
-		// copy each block in between
-		for(i = start_block + 1; i < end_block; i++) {
-			ReadBlock(i,data);
-			(char *&)data += block_size;
-			remaining -= block_size;
+		for(i = start_block; i <= end_block; i++) {
+			Transfer transfer;
+			if(i == start_block && !first.empty()) transfer.data = &first[0];
+			else if(i == end_block && !last.empty()) transfer.data = &last[0];
+			else transfer.data = (char *)data + (i - start_block) * block_size - first_offset;
+			if(!ReadCachedBlock(i,transfer.data)) {
+				missed.push_back(transfer);
+				missed_blocks.push_back(i);
+			}
+		}
+	}
+	
+	// Fetch the rest at once, the blocks are locked so their ids stay
+	// valid. Whole blocks are read in place. A partial block of its own
+	// object is viewed in the same batch and copied from straight to the
+	// caller.
+	std::vector<ObjectViewPtr> views(missed.size());
+	bool first_copied = false, last_copied = false;
+	for(size_t j = 0; j < missed.size(); j++) {
+		missed[j].block_id = m_meta.GetBlockIDForBlockNo(missed_blocks[j]);
+		const bool partial = (!first.empty() && missed[j].data == &first[0]) || (!last.empty() && missed[j].data == &last[0]);
+		if(!missed[j].block_id) {
+			memset(missed[j].data,0,block_size);
+			continue;
+		}
+		if(partial && !BlockMeta::IsPackedID(head,missed[j].block_id)) missed[j].view = &views[j];
+		transfers.push_back(missed[j]);
+	}
+	FetchBlocks(transfers,block_size);
+	
+	for(size_t j = 0; j < views.size(); j++) {
+		if(!views[j]) continue;
+		const char *view = (const char *)views[j]->GetData();
+		const int view_size = views[j]->GetSize();
+		int from, length;
+		char *to;
+		if(!first.empty() && missed[j].data == &first[0]) {
+			from = first_offset;
+			length = std::min(size,block_size - first_offset);
+			to = (char *)data;
+			first_copied = true;
+		} else {
+			from = 0;
+			length = last_size;
+			to = (char *)data + size - last_size;
+			last_copied = true;
 		}
 		
-		// copy end block portion
-		ReadBlock(end_block,&m_block[0]);
-		memcpy(data,&m_block[0],remaining);
+		// a short object reads as zeros past its end
+		const int available = std::max(0,std::min(length,view_size - from));
+		memcpy(to,view + from,available);
+		memset(to + available,0,length - available);
+	}
+	
+	if(!missed.empty()) {
+		ScopedLock lock(m_lock);
+		if(m_cache.GetCapacity() && m_cache.GetBlockSize() == block_size) {
+			for(size_t j = 0; j < missed.size(); j++) {
+				if(m_cache.Find(missed_blocks[j])) continue;
+				uint8_t *entry = &m_cache.Insert(missed_blocks[j])->data[0];
+				if(views[j]) {
+					const int view_size = std::min(views[j]->GetSize(),block_size);
+					memcpy(entry,views[j]->GetData(),view_size);
+					memset(entry + view_size,0,block_size - view_size);
+				} else {
+					memcpy(entry,missed[j].data,block_size);
+				}
+			}
+		}
+	}
+	
+	if(!first.empty() && !first_copied) {
+		memcpy(data,&first[first_offset],std::min(size,block_size - first_offset));
+	}
+	if(!last.empty() && !last_copied) {
+		memcpy((char *)data + size - last_size,&last[0],last_size);
 	}
 }
@@ -21,14 +21,31 @@
 #include <string>
 #include <inttypes.h>
 #include <memory>
+#include <map>
+#include <vector>
+#include "BlockCache.h"
 #include "BlockMeta.h"
+#include "GarbageCollector.h"
+#include "Thread.h"
 
 namespace cloudblockfs
 {
 	class DataStore;
+	class AsyncDataStore;
+	class ThreadPoolDataStore;
 
 	/**
 	 * Block device represents the 
+	 *
+	 * All methods may be called from multiple threads. Reads run in
+	 * parallel, and writes only wait for requests touching the same blocks.
+	 *
+	 * A volume formatted with a segment size packs the blocks uploaded
+	 * together by a flush or a multi-block write into segment objects, so
+	 * many blocks cost a single put. Blocks are read back with ranged reads
+	 * of their segment, one per run of neighbouring slots. Overwritten
+	 * blocks leave dead slots behind, and Clean() moves the live blocks out
+	 * of segments which are mostly dead so the segments can be removed.
 	 */
 	class BlockStorageDevice
 	{
@@ -36,30 +53,169 @@ namespace cloudblockfs
 		std::auto_ptr<DataStore> m_store; // storage backend
 		BlockMeta m_meta;
 		
-		mutable std::vector<uint8_t> m_block; // tmp storage
+		// asynchronous access to m_store, used to overlap object transfers
+		mutable AsyncDataStore *m_async_store;
+		mutable std::auto_ptr<ThreadPoolDataStore> m_async_adapter; // if m_store is not asynchronous itself
+		int m_queue_depth; // most object transfers in flight at once
+		mutable Mutex m_async_lock; // guards creation of the adapter
+		
+		// an object to transfer, data must be a whole block. A fetch with a
+		// view set takes a view of the object there instead of reading it.
+		struct Transfer
+		{
+			BlockID block_id;
+			void *data;
+			ObjectViewPtr *view;
+			
+			Transfer() : block_id(0), data(NULL), view(NULL) { }
+		};
+		
+		// how a block of data is stored, see PlaceBlock()
+		struct Placement
+		{
+			BlockID block_id; // 0 for a block of zeros, or for one waiting for a slot in a segment
+			bool upload; // a new object which must be written
+			bool index; // a new object to add to the dedup index once mapped
+			DedupIndex::Hash hash;
+		};
+		bool m_dedup; // share objects between blocks with the same contents
+		
+		// write-back cache, disabled while its capacity is 0
+		mutable BlockCache m_cache;
+		
+		// a sequential reader, read ahead grows while it keeps reading where it left off
+		struct ReadStream
+		{
+			uint64_t next_block; // block expected to be read next
+			uint64_t prefetched; // last block queued for read ahead
+			int window; // blocks to read ahead
+			bool confirmed; // read sequentially at least once
+			uint64_t last_used;
+		};
+		mutable std::vector<ReadStream> m_streams;
+		mutable uint64_t m_stream_clock;
+		int m_readahead; // maximum window, 0 disables read ahead
+		
+		// blocks queued for read ahead, false once a write makes the read stale
+		mutable std::map<uint64_t,bool> m_inflight;
+		mutable Condition m_inflight_cond;
+		mutable std::auto_ptr<ThreadPool> m_prefetch_pool; // started by the first read ahead
+		
+		// Requests lock the blocks they touch, shared to read and exclusive to write.
+		// While a block is locked shared its mapping and cached copy cannot change
+		// underneath the reader, so object transfers run without any other lock.
+		// Locks are taken in the order m_reclaim_lock, m_range_lock, m_flush_lock, m_lock.
+		mutable RangeLock m_range_lock;
+		mutable Mutex m_lock; // guards m_cache, m_streams and m_inflight, held briefly
+		Mutex m_flush_lock; // held for a whole flush pass
+		Condition m_flush_cond; // wakes the flusher
+		Condition m_throttle_cond; // wakes writers waiting on the flusher
+		std::auto_ptr<Thread> m_flusher;
+		bool m_shutdown;
+		
+		Mutex m_reclaim_lock; // held while removing queued objects, or collecting garbage
+		Condition m_reclaim_cond; // wakes the reclaimer
+		std::auto_ptr<Thread> m_reclaimer;
+		bool m_reclaimer_shutdown;
+		
+		int m_clean_threshold; // percent of a segment which must be live for it to be left alone
+		time_t m_last_clean; // guarded by m_reclaim_lock
+		
+		int m_gc_rate_limit;
+		GarbageCollector::ProgressFunction m_gc_progress_function;
+		void *m_gc_progress_userdata;
 		
 		BlockStorageDevice(const BlockStorageDevice&);
 		BlockStorageDevice& operator =(const BlockStorageDevice&);
+		
+		class PrefetchJob;
+		friend class PrefetchJob;
+		
+		static void FlusherThread(void *userdata);
+		void StopFlusher();
+		static void ReclaimerThread(void *userdata);
+		void StopReclaimer();
+		void FlushBlocks(time_t dirty_before);
+		bool EndEpoch();
+		AsyncDataStore *GetAsyncStore() const;
+		void TransferObjects(const std::vector<Transfer>& transfers,bool put,int block_size) const;
+		static bool CompareBlockIDs(const Transfer& a,const Transfer& b);
+		void FetchBlocks(const std::vector<Transfer>& transfers,int block_size) const;
+		void GetBlock(const BlockMeta::Head& head,BlockID block_id,void *data) const;
+		void UploadBlocks(std::vector<Placement>& placements,const std::vector<void *>& data,int block_size);
+		bool MoveBlock(uint64_t blockno,BlockID old_id,BlockID new_id);
+		bool ReadCachedBlock(uint64_t blockno,void *data) const;
+		void LoadBlock(uint64_t blockno,void *data) const;
+		void StoreBlock(uint64_t blockno,const void *data);
+		void PlaceBlock(const void *data,int block_size,bool pack,Placement *out_placement);
+		void ReleasePlacements(const std::vector<Placement>& placements);
+		void CacheWrite(uint64_t blockno,const void *data,int offset,int size);
+		void ReadAhead(uint64_t start_block,uint64_t end_block) const;
+		void Prefetch(uint64_t blockno);
+		void InvalidatePrefetch(uint64_t first_blockno,uint64_t last_blockno);
 	public:
 		// getters & setters
-		int GetBlockSize() const { 
-			BlockMeta::Head head;
-			m_meta.GetHead(&head);
-			return head.block_size; 
-		}
+		int GetBlockSize() const;
+		int GetTreeDepth() const;
+		int64_t GetDiskSize() const;
+		int GetSegmentBlocks() const;
 		
-		int GetTreeDepth() const
-		{
-			BlockMeta::Head head;
-			m_meta.GetHead(&head);
-			return head.tree_depth; 
-		}
+		/**
+		 * Sets the number of block map tree nodes to cache in memory.
+		 */
+		void SetNodeCacheSize(int nodes) { m_meta.SetNodeCacheSize(nodes); }
 		
-		int64_t GetDiskSize() const { 
-			BlockMeta::Head head;
-			m_meta.GetHead(&head);
-			return head.disk_size; 
-		}
+		/**
+		 * Sets how long block map changes and dirty blocks may be held in
+		 * memory before they are written out, in seconds.
+		 */
+		void SetEpochInterval(int seconds) { m_meta.SetEpochInterval(seconds); }
+		
+		/**
+		 * Sets how long the journal is appended to before it is folded into
+		 * the block map, in seconds.
+		 */
+		void SetCheckpointInterval(int seconds) { m_meta.SetCheckpointInterval(seconds); }
+		
+		/**
+		 * Sets the size of the write-back cache. Writes are absorbed by the cache
+		 * and written out by a background thread, or by Flush() and Sync().
+		 * Once dirty data reaches a quarter of the cache the flusher starts writing
+		 * it out; writers are held back while it exceeds three quarters.
+		 * @param bytes Cache size in bytes, 0 to write through.
+		 */
+		void SetCacheSize(size_t bytes);
+		size_t GetCacheSize() const { ScopedLock lock(m_lock); return m_cache.GetCapacity(); }
+		
+		/**
+		 * Enables read ahead. Sequential readers are detected and the blocks
+		 * after each read are fetched in the background into the cache. The
+		 * window starts small, doubles while the reader stays sequential and
+		 * halves when it skips. Requires the cache to be enabled. The
+		 * threads fetching the blocks start with the first read ahead, so a
+		 * process may still fork after enabling it.
+		 * @param blocks Largest number of blocks to read ahead, 0 disables read ahead.
+		 */
+		void SetReadAhead(int blocks);
+		int GetReadAhead() const { ScopedLock lock(m_lock); return m_readahead; }
+		
+		/**
+		 * Sets how many objects a multi-block read or write, or a flush, may
+		 * transfer at once. Stores which are not asynchronous are driven by
+		 * this many threads.
+		 * @param depth Number of transfers in flight, 1 transfers one object at a time.
+		 */
+		void SetQueueDepth(int depth);
+		int GetQueueDepth() const { ScopedLock lock(m_lock); return m_queue_depth; }
+		
+		/**
+		 * Turns deduplication of written blocks on or off. When on, a block
+		 * whose contents are stored already is mapped to the existing object
+		 * and nothing is uploaded. Objects stay shared after it is turned
+		 * off and are removed once no block uses them.
+		 */
+		void SetDedup(bool dedup) { ScopedLock lock(m_lock); m_dedup = dedup; }
+		bool GetDedup() const { ScopedLock lock(m_lock); return m_dedup; }
 		
 		/**
 		 * Create a handle to a block device using the provided storage backend.
@@ -67,6 +223,11 @@ namespace cloudblockfs
 		 */
 		BlockStorageDevice(DataStore *store);
 		
+		/**
+		 * Writes back any pending metadata before closing the store.
+		 */
+		~BlockStorageDevice();
+		
 		/**
 		 * Checks whether the data storage is a valid block device.
 		 * Notice that this is a weak check.
@@ -75,21 +236,39 @@ namespace cloudblockfs
 		bool IsValid() const;
 		
 		/**
-		 * Checks if our data store head is synchronized with the journal.
+		 * Brings the head up to date with the journal. Updates journaled
+		 * before the volume was last closed are replayed and folded into the
+		 * block map. Call this on mount.
 		 */
 		void Check();
 		
 		/**
-		 * Synchronizes all metadata to the data store
+		 * Writes out all cached blocks and makes the block map changes
+		 * durable by appending them to the journal. Cheaper than Sync(),
+		 * which rewrites the changed parts of the block map.
+		 */
+		void Flush();
+		
+		/**
+		 * Writes out all cached blocks and checkpoints the metadata, folding
+		 * the journal into the block map.
 		 */
 		void Sync();
 		
+		/**
+		 * Removes the objects which earlier commits queued for deletion.
+		 * This is done by a background thread as well, calling it only
+		 * makes sure the queue is drained now.
+		 */
+		void Reclaim();
+		
 		/**
 		 * Initializes the block storage device.
 		 * @param block_size Size of each block. May be one of 1024, 2048, 4096, 8192, 16384, 32768.
 		 * @param tree_level The depth of the meta trees.
+		 * @param segment_blocks Most blocks packed into one segment object, up to 65536. 0 stores every block in an object of its own.
 		 */
-		void Format(int block_size,int tree_depth = 1);
+		void Format(int block_size,int tree_depth = 1,int segment_blocks = 0);
 		
 		/**
 		 * Deletes all files in the block storage.
@@ -100,17 +279,63 @@ namespace cloudblockfs
 		/**
 		 * Analyses the data storage and remove all unlinked objects.
 		 * This operation is expensive. Use with caution.
+		 * The device may be used meanwhile, only the removal of objects
+		 * queued for deletion is held off until it is done.
+		 * @return Number of objects removed.
+		 */
+		uint64_t GC();
+		
+		/**
+		 * Moves the live blocks out of segments which are mostly dead, and
+		 * queues those segments and any left with no blocks for deletion.
+		 * The background thread which reclaims objects runs this as well,
+		 * at most once a minute, once a segment's worth of packed blocks has
+		 * been overwritten. Walks the whole block map.
+		 * @return Number of segments queued for deletion.
+		 */
+		uint64_t Clean();
+		
+		/**
+		 * Sets how much of a segment must be live for Clean() to leave it alone.
+		 * @param percent Percentage of the segment size.
+		 */
+		void SetCleanThreshold(int percent) { ScopedLock lock(m_lock); m_clean_threshold = percent; }
+		int GetCleanThreshold() const { ScopedLock lock(m_lock); return m_clean_threshold; }
+		
+		/**
+		 * Limits how fast GC() removes objects.
+		 * @param objects_per_second Objects per second, 0 for no limit.
+		 */
+		void SetGCRateLimit(int objects_per_second) { m_gc_rate_limit = objects_per_second; }
+		
+		/**
+		 * Sets a function GC() reports its progress to.
+		 * @param progress_function Function to call, or NULL.
+		 * @param userdata User defined data that is passed to progress_function.
+		 */
+		void SetGCProgressCallback(GarbageCollector::ProgressFunction progress_function,void *userdata) {
+			m_gc_progress_function = progress_function;
+			m_gc_progress_userdata = userdata;
+		}
+		
+		/**
+		 * Resize the disk file. Shrinking unmaps the blocks past the new end
+		 * and commits the block map straight away.
+		 * @param size Size in bytes.
 		 */
-		void GC();
+		void Truncate(int64_t size);
 		
 		/**
-		 * Resize the disk file.
+		 * Grows the disk to at least size bytes. Unlike Truncate() it never
+		 * shrinks the disk, so concurrent writers extending it cannot undo
+		 * each other.
 		 * @param size Size in bytes.
 		 */
-		void Truncate(int size);
+		void Extend(int64_t size);
 		
 		/**
-		 * Low level block writer. Writes a block to the data store.
+		 * Low level block writer. Writes a block to the data store. A block
+		 * of zeros is not stored; it is unmapped and reads back as a hole.
 		 * @param blockno Block number.
 		 * @param data A block of data. Data must be of the same size as a block size.
 		 */
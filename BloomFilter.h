@@ -0,0 +1,81 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_BloomFilter_h
+#define __cloudblockfs_BloomFilter_h
+
+#include <inttypes.h>
+#include <vector>
+
+namespace cloudblockfs
+{
+	/**
+	 * A set of 64-bit keys which answers membership queries in a fixed
+	 * amount of memory. It never reports an added key as missing, but may
+	 * report a missing key as present.
+	 */
+	class BloomFilter
+	{
+	private:
+		std::vector<uint64_t> m_bits;
+		uint64_t m_bit_count;
+		int m_hash_count;
+		
+		static uint64_t Mix(uint64_t key) {
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdULL;
+			key ^= key >> 33;
+			key *= 0xc4ceb9fe1a85ec53ULL;
+			key ^= key >> 33;
+			return key;
+		}
+	public:
+		/**
+		 * Create a filter sized for a number of keys.
+		 * @param keys Expected number of keys.
+		 * @param bits_per_key Bits of memory per key. 10 bits give about 1% false positives.
+		 */
+		BloomFilter(uint64_t keys,int bits_per_key = 10) {
+			m_bit_count = keys * bits_per_key;
+			if(m_bit_count < 1024) m_bit_count = 1024;
+			m_bits.resize((m_bit_count + 63) / 64,0);
+			m_hash_count = bits_per_key * 69 / 100; // bits_per_key * ln 2
+			if(m_hash_count < 1) m_hash_count = 1;
+		}
+		
+		void Add(uint64_t key) {
+			const uint64_t h1 = Mix(key), h2 = Mix(h1) | 1;
+			for(int i = 0; i < m_hash_count; i++) {
+				const uint64_t bit = (h1 + i * h2) % m_bit_count;
+				m_bits[bit >> 6] |= 1ULL << (bit & 63);
+			}
+		}
+		
+		bool MayContain(uint64_t key) const {
+			const uint64_t h1 = Mix(key), h2 = Mix(h1) | 1;
+			for(int i = 0; i < m_hash_count; i++) {
+				const uint64_t bit = (h1 + i * h2) % m_bit_count;
+				if(!(m_bits[bit >> 6] & (1ULL << (bit & 63)))) return false;
+			}
+			return true;
+		}
+		
+		size_t GetMemorySize() const { return m_bits.size() * sizeof(uint64_t); }
+	};
+}
+
+#endif
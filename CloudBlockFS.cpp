@@ -17,14 +17,21 @@
  */
 
 #include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdexcept>
 #include <memory>
 #include "Exception.h"
+#include "CompressingDataStore.h"
 #include "DataStore.h"
 #include "FileDataStore.h"
+#include "PackFileDataStore.h"
+#include "S3DataStore.h"
+#include "UringFileDataStore.h"
 #include "BlockStorageDevice.h"
 
 using namespace cloudblockfs;
@@ -32,6 +39,58 @@ using namespace cloudblockfs;
 static std::auto_ptr<BlockStorageDevice> blockstore;
 #define CLOUDBLOCK_DEVICE_NAME "cloudblockdisk"
 
+// -o options
+struct cloudblockfs_config
+{
+	char *store;
+	int node_cache;
+	int epoch;
+	int checkpoint; // seconds the journal is appended to before it is folded in
+	int cache; // megabytes
+	int readahead; // blocks
+	int queue_depth; // object transfers in flight
+	int gc; // collect garbage before mounting
+	int gc_rate; // objects removed per second
+	int dedup; // share objects between blocks with the same contents
+	int compress; // compress objects before storing them
+	int pack; // keep objects in append-only segment files rather than a file each
+	int fanout; // levels of directories a file per object store spreads objects over
+	int uring; // transfer objects of a file per object store through io_uring
+	int segment_blocks; // blocks packed into each object of a newly formatted volume
+	int clean_threshold; // percentage of a segment which must be live for the cleaner to skip it
+	char *region; // of an s3:// store, which requests are signed for
+};
+
+#define CLOUDBLOCKFS_OPT(t, p) { t, offsetof(struct cloudblockfs_config, p), 0 }
+
+static struct fuse_opt cloudblockfs_opts[] = {
+	CLOUDBLOCKFS_OPT("store=%s", store),
+	CLOUDBLOCKFS_OPT("node_cache=%d", node_cache),
+	CLOUDBLOCKFS_OPT("epoch=%d", epoch),
+	CLOUDBLOCKFS_OPT("checkpoint=%d", checkpoint),
+	CLOUDBLOCKFS_OPT("cache=%d", cache),
+	CLOUDBLOCKFS_OPT("readahead=%d", readahead),
+	CLOUDBLOCKFS_OPT("queue_depth=%d", queue_depth),
+	{ "gc", offsetof(struct cloudblockfs_config, gc), 1 },
+	CLOUDBLOCKFS_OPT("gc_rate=%d", gc_rate),
+	{ "dedup", offsetof(struct cloudblockfs_config, dedup), 1 },
+	{ "compress", offsetof(struct cloudblockfs_config, compress), 1 },
+	{ "pack", offsetof(struct cloudblockfs_config, pack), 1 },
+	CLOUDBLOCKFS_OPT("fanout=%d", fanout),
+	{ "uring", offsetof(struct cloudblockfs_config, uring), 1 },
+	CLOUDBLOCKFS_OPT("segment_blocks=%d", segment_blocks),
+	CLOUDBLOCKFS_OPT("clean_threshold=%d", clean_threshold),
+	CLOUDBLOCKFS_OPT("region=%s", region),
+	FUSE_OPT_END
+};
+
+static void cloudblockfs_gc_progress(const GarbageCollector::Progress& progress,void *userdata)
+{
+	fprintf(stderr,"gc: %llu nodes marked, %llu objects listed, %llu removed, %.0fs\n",
+		(unsigned long long)progress.nodes_marked,(unsigned long long)progress.objects_listed,
+		(unsigned long long)progress.objects_deleted,progress.seconds);
+}
+
 static int cloudblockfs_fgetattr(const char *path, struct stat *stbuf,
                   struct fuse_file_info *fi) 
 {
@@ -43,6 +102,7 @@ static int cloudblockfs_fgetattr(const char *path, struct stat *stbuf,
 		return 0;
 	}
 	if (strcmp(path, "/" CLOUDBLOCK_DEVICE_NAME) == 0) { /* The root directory of our file system. */
+		if(!blockstore.get()) return -EIO; // failed to open in init
 		stbuf->st_dev = 1;
 		stbuf->st_ino = 1;
 		stbuf->st_mode = S_IFREG | 0644;
@@ -113,10 +173,7 @@ static int cloudblockfs_write(const char *path, const char *buf, size_t size,
                off_t offset, struct fuse_file_info *fi) {
 	if(strcmp(path, "/" CLOUDBLOCK_DEVICE_NAME) == 0) {
 		try {		
-			if(size + offset > blockstore->GetDiskSize()) {
-				blockstore->Truncate(size + offset);
-			}
-			
+			blockstore->Extend(size + offset);
 			blockstore->Write(buf,size,offset);
 		} catch(const OutOfDiskSpaceException&) {
 			return -ENOSPC;
@@ -152,6 +209,13 @@ static int cloudblockfs_chown(const char *path, uid_t uid, gid_t gid)
 
 int cloudblockfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+	if(strcmp(path, "/" CLOUDBLOCK_DEVICE_NAME) == 0) {
+		try {
+			blockstore->Flush();
+		} catch(const std::runtime_error& ) {
+			return -EIO;
+		}
+	}
 	return 0;
 }
 
@@ -215,14 +279,121 @@ int cloudblockfs_listxattr(const char *path, char *namebuf, size_t size)
 	return 0;
 }
 
+static void cloudblockfs_destroy(void *)
+{
+	if(!blockstore.get()) return;
+	try {
+		blockstore->Sync();
+	} catch(const std::runtime_error& ) {
+	}
+}
+
+// opens the store named by the options, or says why it cannot and returns NULL
+static DataStore *cloudblockfs_open_store(const struct cloudblockfs_config& config)
+{
+	const char *store_path = config.store ? config.store : "/Users/sound/Desktop/store";
+	DataStore *store;
+	if(strncmp(store_path,"s3://",5) == 0) {
+		// s3://host:port/bucket/prefix, with the credentials from the environment
+		const char *access_key = getenv("AWS_ACCESS_KEY_ID"), *secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+		const char *region = config.region ? config.region : getenv("AWS_REGION");
+		const char *bucket = strchr(store_path + 5,'/');
+		if(!access_key || !secret_key || !bucket) {
+			fprintf(stderr,"s3: needs s3://host:port/bucket, AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY\n");
+			return NULL;
+		}
+		store = new S3DataStore(std::string(store_path + 5,bucket),bucket + 1,access_key,secret_key,
+			region ? region : "us-east-1",config.queue_depth > 0 ? config.queue_depth : 16);
+	}
+	else if(config.pack) store = new PackFileDataStore(store_path);
+	else if(config.uring) store = new UringFileDataStore(store_path,config.fanout);
+	else store = new FileDataStore(store_path,config.fanout);
+	if(config.compress) store = new CompressingDataStore(store);
+	return store;
+}
+
+static void cloudblockfs_configure(BlockStorageDevice *device,const struct cloudblockfs_config& config)
+{
+	if(config.node_cache >= 0)
+		device->SetNodeCacheSize(config.node_cache);
+	if(config.epoch >= 0)
+		device->SetEpochInterval(config.epoch);
+	if(config.checkpoint >= 0)
+		device->SetCheckpointInterval(config.checkpoint);
+	if(config.cache > 0)
+		device->SetCacheSize((size_t)config.cache * 1024 * 1024);
+	if(config.cache > 0 && config.readahead > 0)
+		device->SetReadAhead(config.readahead);
+	if(config.queue_depth > 0)
+		device->SetQueueDepth(config.queue_depth);
+	if(config.dedup)
+		device->SetDedup(true);
+	if(config.clean_threshold > 0)
+		device->SetCleanThreshold(config.clean_threshold);
+}
+
+static void *cloudblockfs_init(struct fuse_conn_info *)
+{
+	// threads do not survive the fork fuse_main daemonizes with, so the
+	// device and its flusher, read ahead and transfer threads start here
+	struct fuse_context *context = fuse_get_context();
+	const struct cloudblockfs_config& config = *(const struct cloudblockfs_config *)context->private_data;
+	try {
+		DataStore *store = cloudblockfs_open_store(config);
+		if(store) {
+			blockstore.reset(new BlockStorageDevice(store));
+			cloudblockfs_configure(blockstore.get(),config);
+		}
+	} catch(const std::runtime_error& e) {
+		fprintf(stderr,"init: %s\n",e.what());
+		blockstore.reset();
+	}
+	if(!blockstore.get()) fuse_exit(context->fuse);
+	return context->private_data;
+}
+
 int main(int argc, char* argv[], char* envp[], char** exec_path) 
 {
 	umask(0);
 	
-	// initialize blockstore
-	blockstore.reset(new BlockStorageDevice(new FileDataStore("/Users/sound/Desktop/store")));
-	if(!blockstore->IsValid()) 
-		blockstore->Format(65536,1);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct cloudblockfs_config config;
+	memset(&config,0,sizeof(config));
+	config.node_cache = -1;
+	config.epoch = -1;
+	config.checkpoint = -1;
+	config.cache = 32;
+	config.readahead = 32;
+	config.fanout = -1;
+	if(fuse_opt_parse(&args,&config,cloudblockfs_opts,NULL) == -1)
+		return 1;
+	
+	// format, check and collect garbage while errors still reach the
+	// terminal, then close the device again, joining its threads
+	{
+		DataStore *store = cloudblockfs_open_store(config);
+		if(!store)
+			return 1;
+		BlockStorageDevice device(store);
+		if(!device.IsValid()) 
+			device.Format(65536,1,config.segment_blocks);
+		try {
+			device.Check();
+		} catch(const std::runtime_error& e) {
+			fprintf(stderr,"check: %s\n",e.what());
+			return 1;
+		}
+		cloudblockfs_configure(&device,config);
+		if(config.gc) {
+			device.SetGCRateLimit(config.gc_rate);
+			device.SetGCProgressCallback(cloudblockfs_gc_progress,NULL);
+			try {
+				device.GC();
+			} catch(const std::runtime_error& e) {
+				fprintf(stderr,"gc: %s\n",e.what());
+			}
+		}
+	}
 	
 	struct fuse_operations ops;
 	memset(&ops,0,sizeof(ops));
@@ -245,6 +416,10 @@ int main(int argc, char* argv[], char* envp[], char** exec_path)
 	ops.ftruncate = cloudblockfs_ftruncate;
 	ops.getxattr = cloudblockfs_getxattr;
 	ops.listxattr = cloudblockfs_listxattr;
+	ops.init = cloudblockfs_init;
+	ops.destroy = cloudblockfs_destroy;
 	
-	return fuse_main(argc, argv, &ops, NULL);
+	int ret = fuse_main(args.argc, args.argv, &ops, &config);
+	fuse_opt_free_args(&args);
+	return ret;
 }
@@ -0,0 +1,148 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "Exception.h"
+#include "Lz4.h"
+#include "CompressingDataStore.h"
+
+using namespace cloudblockfs;
+
+static const char magic[4] = { 'C', 'B', 'Z', '1' };
+
+// bytes looked at to judge whether data is compressible
+#define SAMPLE_SIZE 1024
+
+// sampled data above this many bits of entropy per byte is stored raw
+#define MAX_ENTROPY 7.5
+
+CompressingDataStore::CompressingDataStore(DataStore *store) : m_store(store)
+{
+	memset(&m_stats,0,sizeof(m_stats));
+}
+
+void CompressingDataStore::ResetStats()
+{
+	ScopedLock lock(m_lock);
+	memset(&m_stats,0,sizeof(m_stats));
+}
+
+bool CompressingDataStore::IsCompressible(const void *data,int size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	if(size <= 0) return false;
+	
+	// bytes spread evenly over the data, which catches random or compressed
+	// blocks without looking at all of them
+	const int samples = size < SAMPLE_SIZE ? size : SAMPLE_SIZE;
+	const int step = size / samples;
+	int histogram[256];
+	memset(histogram,0,sizeof(histogram));
+	for(int i = 0; i < samples; i++) histogram[p[i * step]]++;
+	
+	double entropy = 0;
+	for(int i = 0; i < 256; i++) {
+		if(!histogram[i]) continue;
+		const double probability = (double)histogram[i] / samples;
+		entropy -= probability * log(probability);
+	}
+	entropy /= log(2.0);
+	
+	// a small sample cannot show more bits than it has values
+	const double max_entropy = log((double)samples) / log(2.0);
+	return entropy < MAX_ENTROPY && entropy < max_entropy - 0.5;
+}
+
+void CompressingDataStore::PutObject(const std::string& name,const void *data,int size)
+{
+	if(size < 0) throw InvalidArgumentException(name + ": object size must be known");
+	
+	std::vector<uint8_t> buffer(sizeof(Header) + size);
+	Header header;
+	memcpy(header.magic,magic,sizeof(magic));
+	memset(header.reserved,0,sizeof(header.reserved));
+	header.size = size;
+	
+	// keep the compressed form only if it saves at least an eighth
+	int compressed = 0;
+	if(IsCompressible(data,size)) {
+		compressed = Lz4::Compress(data,size,&buffer[sizeof(Header)],size - size / 8);
+	}
+	if(compressed > 0) {
+		header.codec = CODEC_LZ4;
+		header.stored_size = compressed;
+	} else {
+		header.codec = CODEC_NONE;
+		header.stored_size = size;
+		memcpy(&buffer[sizeof(Header)],data,size);
+	}
+	memcpy(&buffer[0],&header,sizeof(Header));
+	m_store->PutObject(name,&buffer[0],sizeof(Header) + header.stored_size);
+	
+	ScopedLock lock(m_lock);
+	if(compressed > 0) m_stats.objects_compressed++;
+	else m_stats.objects_raw++;
+	m_stats.bytes_in += size;
+	m_stats.bytes_stored += sizeof(Header) + header.stored_size;
+}
+
+void CompressingDataStore::GetObject(const std::string& name,void *data,int size) const
+{
+	if(size < 0) throw InvalidArgumentException(name + ": object size must be known");
+	
+	// the stored form is never larger than the original plus the header
+	std::vector<uint8_t> buffer(sizeof(Header) + size,0);
+	m_store->GetObject(name,&buffer[0],buffer.size());
+	
+	Header header;
+	memcpy(&header,&buffer[0],sizeof(Header));
+	if(memcmp(header.magic,magic,sizeof(magic))) {
+		memcpy(data,&buffer[0],size); // not written through this store
+		return;
+	}
+	
+	// a prefix of a compressed object still needs all of it
+	if(header.stored_size > (uint32_t)size) {
+		buffer.assign(sizeof(Header) + header.stored_size,0);
+		m_store->GetObject(name,&buffer[0],buffer.size());
+	}
+	
+	const int wanted = (uint32_t)size < header.size ? size : (int)header.size;
+	switch(header.codec) {
+		case CODEC_NONE:
+			memcpy(data,&buffer[sizeof(Header)],wanted);
+			break;
+		case CODEC_LZ4: {
+			// decompress in place unless only part of the object is wanted
+			std::vector<uint8_t> original;
+			uint8_t *out = (uint8_t *)data;
+			if(wanted < (int)header.size) {
+				original.resize(header.size);
+				out = &original[0];
+			}
+			if(Lz4::Decompress(&buffer[sizeof(Header)],header.stored_size,out,header.size) != (int)header.size) {
+				throw ReadErrorException(name + ": corrupt compressed object");
+			}
+			if(out != data) memcpy(data,out,wanted);
+			break;
+		}
+		default:
+			throw ReadErrorException(name + ": unknown codec");
+	}
+}
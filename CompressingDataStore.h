@@ -0,0 +1,93 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_CompressingDataStore_h
+#define __cloudblockfs_CompressingDataStore_h
+
+#include <inttypes.h>
+#include <memory>
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * Compresses objects on their way to another data store.
+	 *
+	 * Each stored object starts with a small header giving the codec and the
+	 * original size. Data which looks random from a sample of its bytes is
+	 * stored raw without trying, and so is data which LZ4 does not shrink by
+	 * at least an eighth, so already compressed blocks cost little CPU.
+	 * Objects without a header, written before the store was wrapped, are
+	 * read back as they are.
+	 */
+	class CompressingDataStore : public DataStore
+	{
+	public:
+		enum Codec
+		{
+			CODEC_NONE,
+			CODEC_LZ4
+		};
+		
+		struct Stats
+		{
+			uint64_t objects_compressed;
+			uint64_t objects_raw; // judged incompressible
+			uint64_t bytes_in; // before compression
+			uint64_t bytes_stored; // after compression, headers included
+		};
+	private:
+		struct Header
+		{
+			char magic[4];
+			uint8_t codec;
+			uint8_t reserved[3];
+			uint32_t size; // original size
+			uint32_t stored_size; // size of the data after the header
+		};
+		
+		std::auto_ptr<DataStore> m_store;
+		mutable Mutex m_lock; // guards m_stats
+		Stats m_stats;
+	public:
+		/**
+		 * @param store Store to keep the compressed objects in, owned by this object.
+		 */
+		CompressingDataStore(DataStore *store);
+		
+		/**
+		 * Returns true if a sample of the data has enough redundancy to be worth compressing.
+		 */
+		static bool IsCompressible(const void *data,int size);
+		
+		/**
+		 * Retrieves the totals of the objects written so far.
+		 */
+		void GetStats(Stats *out_stats) const { ScopedLock lock(m_lock); *out_stats = m_stats; }
+		void ResetStats();
+		
+		virtual void PutObject(const std::string& name,const void *data,int size);
+		virtual void GetObject(const std::string& name,void *data,int size) const;
+		virtual void DeleteObject(const std::string& name) { m_store->DeleteObject(name); }
+		virtual void DeleteObjects(const std::vector<std::string>& names) { m_store->DeleteObjects(names); }
+		virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const { m_store->ListObjects(list_function,userdata); }
+		virtual void Flush() { m_store->Flush(); }
+	};
+}
+
+#endif
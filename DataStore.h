@@ -18,15 +18,57 @@
 #ifndef __cloudblockfs_DataStore_h
 #define __cloudblockfs_DataStore_h
 
+#include <inttypes.h>
+#include <string.h>
 #include <string>
+#include <vector>
+#include <tr1/memory>
+#include "Exception.h"
 
 namespace cloudblockfs
 {
+	/**
+	 * A read-only view of the contents of an object, see
+	 * DataStore::GetObjectView(). The contents stay valid for as long as
+	 * the view is held, even if the object is deleted meanwhile.
+	 */
+	class ObjectView
+	{
+	public:
+		virtual ~ObjectView() { }
+		virtual const void *GetData() const = 0;
+		
+		/**
+		 * Returns the number of bytes in view, which may be less than
+		 * asked for if the object is shorter.
+		 */
+		virtual int GetSize() const = 0;
+	};
+	
+	typedef std::tr1::shared_ptr<ObjectView> ObjectViewPtr;
+	
+	/**
+	 * An object view holding a copy of the contents.
+	 */
+	class BufferObjectView : public ObjectView
+	{
+	private:
+		std::vector<char> m_buffer;
+	public:
+		BufferObjectView(int size) : m_buffer(size) { }
+		
+		void *GetBuffer() { return m_buffer.empty() ? NULL : &m_buffer[0]; }
+		void Resize(int size) { m_buffer.resize(size); }
+		virtual const void *GetData() const { return m_buffer.empty() ? NULL : &m_buffer[0]; }
+		virtual int GetSize() const { return m_buffer.size(); }
+	};
+	
 	/**
 	 * Data store interface.
 	 * A data storage is basic storage system which operates mainly on fixed size
 	 * put and get operations. Implementors only need to implement 4 methods to define their
 	 * storage system: PutObject, GetObject, DeleteObject, ListObjects
+	 * Methods may be called concurrently from several threads on different objects.
 	 */
 	class DataStore
 	{
@@ -52,12 +94,58 @@ namespace cloudblockfs
 		 */
 		virtual void GetObject(const std::string& name,void *data,int size) const = 0;
 		
+		/**
+		 * Retrieves part of the named object. The default reads the object
+		 * up to the end of the range and copies the range out, stores which
+		 * can read a range by itself should override this.
+		 * @param name Name of object
+		 * @param data Data
+		 * @param offset Offset in the object to read from
+		 * @param size Size in bytes to read
+		 */
+		virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const {
+			std::vector<char> buffer(offset + size);
+			GetObject(name,&buffer[0],buffer.size());
+			memcpy(data,&buffer[offset],size);
+		}
+		
+		/**
+		 * Retrieves a read-only view of the named object, which the caller
+		 * can copy what it needs from. The default reads the object into a
+		 * buffer, stores which can map an object should override this. An
+		 * object must not be rewritten while a view of it is held.
+		 * @param name Name of object
+		 * @param size Size in bytes to view
+		 * @return Reference counted view.
+		 */
+		virtual ObjectViewPtr GetObjectView(const std::string& name,int size) const {
+			BufferObjectView *view = new BufferObjectView(size);
+			ObjectViewPtr ptr(view);
+			GetObject(name,view->GetBuffer(),size);
+			return ptr;
+		}
+		
 		/**
 		 * Removes the named object.
 		 * @param name Name of object
 		 */
 		virtual void DeleteObject(const std::string& name) = 0;
 		
+		/**
+		 * Removes several objects. Objects which do not exist are skipped.
+		 * The default removes them one at a time, stores with a bulk delete
+		 * request should override this.
+		 * @param names Names of objects
+		 */
+		virtual void DeleteObjects(const std::vector<std::string>& names) {
+			for(std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+				try {
+					DeleteObject(*it);
+				} catch(const FileNotFoundException& ) {
+				}
+			}
+		}
+		
 		/**
 		 * Obtain's a list of objects.
 		 * @param list_function A callback function.
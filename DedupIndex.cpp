@@ -0,0 +1,317 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "DedupIndex.h"
+
+using namespace cloudblockfs;
+
+// default number of clean buckets kept in memory
+#define DEFAULT_BUCKET_CACHE_SIZE 64
+
+DedupIndex::DedupIndex(DataStore *store) : m_store(store), m_block_size(0), m_root_id(0),
+	m_root_loaded(false), m_max_buckets(DEFAULT_BUCKET_CACHE_SIZE)
+{
+}
+
+void DedupIndex::Open(BlockID root,int block_size)
+{
+	m_block_size = block_size;
+	m_root_id = root;
+	m_root.clear();
+	m_root_loaded = false;
+	m_buckets.clear();
+}
+
+void DedupIndex::ReadObject(BlockID id,std::vector<uint64_t>& data) const
+{
+	char object[32];
+	sprintf(object,"%.16llX",id);
+	data.resize(m_block_size >> 3);
+	m_store->GetObject(object,&data[0],m_block_size);
+}
+
+void DedupIndex::LoadRoot()
+{
+	if(m_root_loaded) return;
+	if(m_root_id) ReadObject(m_root_id,m_root);
+	else m_root.assign(GetBucketCount(),0);
+	m_root_loaded = true;
+}
+
+void DedupIndex::ReadBucket(BlockID first,Bucket& out_bucket) const
+{
+	out_bucket.object_ids.clear();
+	out_bucket.objects.clear();
+	out_bucket.dirty_objects.clear();
+	out_bucket.dirty = false;
+	out_bucket.unwritten = false;
+	for(BlockID id = first; id; id = out_bucket.objects.back()[0]) {
+		out_bucket.object_ids.push_back(id);
+		out_bucket.objects.push_back(std::vector<uint64_t>());
+		ReadObject(id,out_bucket.objects.back());
+	}
+}
+
+DedupIndex::Bucket& DedupIndex::LoadBucket(size_t bucket)
+{
+	std::map<size_t,Bucket>::iterator it = m_buckets.find(bucket);
+	if(it != m_buckets.end()) return it->second;
+	
+	MakeRoom();
+	LoadRoot();
+	Bucket loaded;
+	ReadBucket(m_root[bucket],loaded);
+	
+	Bucket& entry = m_buckets[bucket];
+	entry = loaded;
+	return entry;
+}
+
+void DedupIndex::MakeRoom()
+{
+	// drop buckets without changes, keeping those whose objects are still being written
+	for(std::map<size_t,Bucket>::iterator it = m_buckets.begin(); it != m_buckets.end() && m_buckets.size() >= m_max_buckets; ) {
+		if(!it->second.dirty && !it->second.unwritten) m_buckets.erase(it++);
+		else ++it;
+	}
+}
+
+BlockID DedupIndex::GetUnloadedBucket(size_t bucket)
+{
+	if(!m_root_id && m_buckets.empty()) return 0;
+	if(m_buckets.count(bucket)) return 0;
+	LoadRoot();
+	return m_root[bucket];
+}
+
+void DedupIndex::AddBucket(size_t bucket,BlockID first,Bucket& read_bucket)
+{
+	if(m_buckets.count(bucket) || !m_root_loaded || m_root[bucket] != first) return;
+	MakeRoom();
+	Bucket& entry = m_buckets[bucket];
+	entry.object_ids.swap(read_bucket.object_ids);
+	entry.objects.swap(read_bucket.objects);
+	entry.dirty = false;
+	entry.unwritten = false;
+}
+
+uint64_t *DedupIndex::FindRecord(Bucket& bucket,const Hash *hash,BlockID id,size_t *out_object)
+{
+	const size_t records = GetRecordCount();
+	for(size_t i = 0; i < bucket.objects.size(); i++) {
+		for(size_t j = 0; j < records; j++) {
+			uint64_t *record = &bucket.objects[i][HEADER_WORDS + j * RECORD_WORDS];
+			if(!record[4]) continue;
+			if(hash ? !memcmp(record,hash->words,sizeof(hash->words)) : record[4] == id) {
+				*out_object = i;
+				return record;
+			}
+		}
+	}
+	return NULL;
+}
+
+BlockID DedupIndex::Acquire(const Hash& hash)
+{
+	if(!m_root_id && m_buckets.empty()) return 0;
+	
+	Bucket& bucket = LoadBucket(GetBucket(hash));
+	size_t object;
+	uint64_t *record = FindRecord(bucket,&hash,0,&object);
+	if(!record) return 0;
+	
+	record[5]++;
+	bucket.dirty_objects.insert(object);
+	bucket.dirty = true;
+	return record[4];
+}
+
+bool DedupIndex::Insert(const Hash& hash,BlockID id)
+{
+	const size_t bucket_no = GetBucket(hash);
+	if(id % GetBucketCount() != bucket_no) return false;
+	
+	Bucket& bucket = LoadBucket(bucket_no);
+	size_t object;
+	if(FindRecord(bucket,&hash,0,&object)) return false;
+	
+	// take a free record from an object in the bucket, or add an object to its end
+	const size_t records = GetRecordCount();
+	uint64_t *record = NULL;
+	for(size_t i = 0; i < bucket.objects.size() && !record; i++) {
+		for(size_t j = 0; j < records; j++) {
+			if(!bucket.objects[i][HEADER_WORDS + j * RECORD_WORDS + 4]) {
+				record = &bucket.objects[i][HEADER_WORDS + j * RECORD_WORDS];
+				object = i;
+				break;
+			}
+		}
+	}
+	if(!record) {
+		object = bucket.objects.size();
+		bucket.object_ids.push_back(0);
+		bucket.objects.push_back(std::vector<uint64_t>(m_block_size >> 3,0));
+		record = &bucket.objects[object][HEADER_WORDS];
+	}
+	
+	memcpy(record,hash.words,sizeof(hash.words));
+	record[4] = id;
+	record[5] = 1;
+	bucket.dirty_objects.insert(object);
+	bucket.dirty = true;
+	return true;
+}
+
+bool DedupIndex::AddReference(BlockID id)
+{
+	if(!m_root_id && m_buckets.empty()) return false;
+	
+	Bucket& bucket = LoadBucket(id % GetBucketCount());
+	size_t object;
+	uint64_t *record = FindRecord(bucket,NULL,id,&object);
+	if(!record) return false;
+	
+	record[5]++;
+	bucket.dirty_objects.insert(object);
+	bucket.dirty = true;
+	return true;
+}
+
+int64_t DedupIndex::Release(BlockID id)
+{
+	if(!m_root_id && m_buckets.empty()) return -1;
+	
+	Bucket& bucket = LoadBucket(id % GetBucketCount());
+	size_t object;
+	uint64_t *record = FindRecord(bucket,NULL,id,&object);
+	if(!record) return -1;
+	
+	const int64_t refs = --record[5];
+	if(!refs) memset(record,0,RECORD_WORDS * 8);
+	bucket.dirty_objects.insert(object);
+	bucket.dirty = true;
+	return refs;
+}
+
+bool DedupIndex::IsDirty() const
+{
+	for(std::map<size_t,Bucket>::const_iterator it = m_buckets.begin(); it != m_buckets.end(); ++it) {
+		if(it->second.dirty) return true;
+	}
+	return false;
+}
+
+size_t DedupIndex::GetDirtySize() const
+{
+	// an object is rewritten along with every object before it in its bucket
+	size_t size = 0;
+	for(std::map<size_t,Bucket>::const_iterator it = m_buckets.begin(); it != m_buckets.end(); ++it) {
+		if(it->second.dirty) size += (*it->second.dirty_objects.rbegin() + 1) * m_block_size;
+	}
+	return size ? size + m_block_size : 0;
+}
+
+BlockID DedupIndex::Commit(std::vector<BlockID>& superseded,std::map<BlockID,std::vector<uint64_t> >& out_objects,
+						   BlockID (*allocate)(void *userdata),void *userdata)
+{
+	if(!IsDirty()) return m_root_id;
+	LoadRoot();
+	
+	for(std::map<size_t,Bucket>::iterator it = m_buckets.begin(); it != m_buckets.end(); ++it) {
+		Bucket& bucket = it->second;
+		if(!bucket.dirty) continue;
+		
+		// Work back from the end of the bucket. Emptied objects are dropped
+		// and an object is rewritten when it changed or the one after it
+		// moved, since it holds that one's id.
+		const size_t records = GetRecordCount();
+		BlockID next = 0;
+		bool moved = false;
+		for(size_t i = bucket.objects.size(); i-- > 0; ) {
+			std::vector<uint64_t>& data = bucket.objects[i];
+			const bool dirty = bucket.dirty_objects.count(i) || moved || !bucket.object_ids[i];
+			if(dirty) {
+				bool empty = true;
+				for(size_t j = 0; j < records && empty; j++) empty = !data[HEADER_WORDS + j * RECORD_WORDS + 4];
+				if(bucket.object_ids[i]) superseded.push_back(bucket.object_ids[i]);
+				if(empty) {
+					moved = moved || bucket.object_ids[i];
+					bucket.object_ids.erase(bucket.object_ids.begin() + i);
+					bucket.objects.erase(bucket.objects.begin() + i);
+					continue;
+				}
+				data[0] = next;
+				bucket.object_ids[i] = allocate(userdata);
+				out_objects[bucket.object_ids[i]] = data;
+				moved = true;
+			}
+			next = bucket.object_ids[i];
+		}
+		m_root[it->first] = next;
+		
+		bucket.dirty_objects.clear();
+		bucket.dirty = false;
+		bucket.unwritten = true;
+	}
+	
+	bool empty = true;
+	for(size_t i = 0; i < m_root.size() && empty; i++) empty = !m_root[i];
+	if(m_root_id) superseded.push_back(m_root_id);
+	m_root_id = empty ? 0 : allocate(userdata);
+	if(m_root_id) out_objects[m_root_id] = m_root;
+	return m_root_id;
+}
+
+void DedupIndex::Written()
+{
+	for(std::map<size_t,Bucket>::iterator it = m_buckets.begin(); it != m_buckets.end(); ++it) {
+		it->second.unwritten = false;
+	}
+}
+
+void DedupIndex::GetObjectIDs(std::vector<BlockID>& out_ids)
+{
+	if(!m_root_id && m_buckets.empty()) return;
+	LoadRoot();
+	if(m_root_id) out_ids.push_back(m_root_id);
+	
+	// buckets with changes come from memory, the rest are read without caching them
+	const size_t records = GetRecordCount();
+	Bucket loaded;
+	for(size_t i = 0; i < GetBucketCount(); i++) {
+		const Bucket *bucket;
+		std::map<size_t,Bucket>::const_iterator it = m_buckets.find(i);
+		if(it != m_buckets.end()) {
+			bucket = &it->second;
+		} else if(m_root[i]) {
+			ReadBucket(m_root[i],loaded);
+			bucket = &loaded;
+		} else {
+			continue;
+		}
+		
+		for(size_t j = 0; j < bucket->objects.size(); j++) {
+			if(bucket->object_ids[j]) out_ids.push_back(bucket->object_ids[j]);
+			for(size_t k = 0; k < records; k++) {
+				const BlockID id = bucket->objects[j][HEADER_WORDS + k * RECORD_WORDS + 4];
+				if(id) out_ids.push_back(id);
+			}
+		}
+	}
+}
@@ -0,0 +1,196 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_DedupIndex_h
+#define __cloudblockfs_DedupIndex_h
+
+#include <inttypes.h>
+#include <map>
+#include <set>
+#include <vector>
+#include "DataStore.h"
+
+namespace cloudblockfs
+{
+	typedef uint64_t BlockID;
+	
+	/**
+	 * Persistent index from block contents to the object holding them, with
+	 * a count of the references to each object.
+	 *
+	 * The index is split into buckets by the content hash, one per entry of
+	 * a tree node. The root object lists the first record object of each
+	 * bucket and every record object holds the id of the next one in its
+	 * bucket followed by records of (hash, id, references). An id is only
+	 * indexed in the bucket its own low bits select, so the record of an id
+	 * is found from the id alone and the ids which are not indexed are plain
+	 * objects referenced once. Looking up a bucket which is not loaded
+	 * costs one GET until it outgrows its first object.
+	 *
+	 * Buckets are loaded as they are needed and changes are kept in memory
+	 * until Commit(), which lays out the changed objects under new ids like
+	 * the block map does and leaves writing them to the caller. The class
+	 * does no locking of its own; ReadBucket() only reads the store, so a
+	 * caller can read a bucket ahead without holding its lock.
+	 */
+	class DedupIndex
+	{
+	public:
+		// SHA-256 of a block's contents
+		struct Hash
+		{
+			uint64_t words[4];
+		};
+		
+		// record objects of a bucket
+		struct Bucket
+		{
+			std::vector<BlockID> object_ids; // record objects as written, 0 if new
+			std::vector<std::vector<uint64_t> > objects; // contents of each object
+			std::set<size_t> dirty_objects;
+			bool dirty;
+			bool unwritten; // committed, but the objects may not be on the store yet
+		};
+	private:
+		// a record object is the id of the next one, then records of the
+		// hash, the id and the reference count
+		enum { HEADER_WORDS = 1, RECORD_WORDS = 6 };
+		
+		DataStore *m_store;
+		int m_block_size;
+		BlockID m_root_id; // as written, 0 if there is no index
+		std::vector<BlockID> m_root; // first record object of each bucket
+		bool m_root_loaded;
+		std::map<size_t,Bucket> m_buckets; // loaded buckets
+		size_t m_max_buckets; // clean buckets kept loaded
+		
+		void LoadRoot();
+		Bucket& LoadBucket(size_t bucket);
+		void MakeRoom();
+		void ReadObject(BlockID id,std::vector<uint64_t>& data) const;
+		size_t GetRecordCount() const { return (m_block_size / 8 - HEADER_WORDS) / RECORD_WORDS; }
+		uint64_t *FindRecord(Bucket& bucket,const Hash *hash,BlockID id,size_t *out_object);
+	public:
+		/**
+		 * Creates an index on a store. Open() must be called before use.
+		 */
+		DedupIndex(DataStore *store);
+		
+		/**
+		 * Drops the in-memory state and starts on the index written under root.
+		 * @param root Id of the root object, 0 for an empty index.
+		 * @param block_size Object size of the volume.
+		 */
+		void Open(BlockID root,int block_size);
+		
+		/**
+		 * Returns the number of buckets. Ids indexed in a bucket leave this
+		 * number as the remainder when divided by it.
+		 */
+		size_t GetBucketCount() const { return m_block_size >> 3; }
+		
+		/**
+		 * Returns the bucket a hash is indexed in.
+		 */
+		size_t GetBucket(const Hash& hash) const { return hash.words[0] % GetBucketCount(); }
+		
+		/**
+		 * Sets how many buckets are kept in memory when they have no changes.
+		 */
+		void SetCacheSize(size_t buckets) { m_max_buckets = buckets; }
+		
+		/**
+		 * Returns the id of the first object of a bucket which has to be read
+		 * before the bucket can be used, or 0 if it is loaded or empty.
+		 */
+		BlockID GetUnloadedBucket(size_t bucket);
+		
+		/**
+		 * Reads the objects of a bucket without touching the index.
+		 * @param first Id returned by GetUnloadedBucket().
+		 * @param out_bucket Receives the bucket, to be passed to AddBucket().
+		 */
+		void ReadBucket(BlockID first,Bucket& out_bucket) const;
+		
+		/**
+		 * Loads a bucket read by ReadBucket(), unless it was loaded or
+		 * rewritten meanwhile. The contents of out_bucket are taken.
+		 */
+		void AddBucket(size_t bucket,BlockID first,Bucket& read_bucket);
+		
+		/**
+		 * Looks up an object with the contents hashed and takes a reference to it.
+		 * @return Id of the object, or 0 if there is none.
+		 */
+		BlockID Acquire(const Hash& hash);
+		
+		/**
+		 * Adds an object with one reference to the index.
+		 * @param hash Hash of the object's contents.
+		 * @param id Object id, which must be in the hash's bucket.
+		 * @return False if the contents are indexed already.
+		 */
+		bool Insert(const Hash& hash,BlockID id);
+		
+		/**
+		 * Takes another reference to an indexed object.
+		 * @return False if the id is not indexed.
+		 */
+		bool AddReference(BlockID id);
+		
+		/**
+		 * Drops a reference to an object. The record goes with the last one.
+		 * @return References left, or -1 if the id is not indexed.
+		 */
+		int64_t Release(BlockID id);
+		
+		/**
+		 * Returns true if there are changes which have not been committed.
+		 */
+		bool IsDirty() const;
+		
+		/**
+		 * Returns the bytes Commit() would write.
+		 */
+		size_t GetDirtySize() const;
+		
+		/**
+		 * Lays out the changed objects under new ids. The caller writes them
+		 * and then calls Written(); until then the buckets they belong to
+		 * stay loaded, so they are never read back.
+		 * @param superseded Receives ids of the objects replaced.
+		 * @param out_objects Receives the objects to write by id.
+		 * @param allocate Returns a new id.
+		 * @param userdata Passed to allocate.
+		 * @return Id of the new root, 0 if the index is empty.
+		 */
+		BlockID Commit(std::vector<BlockID>& superseded,std::map<BlockID,std::vector<uint64_t> >& out_objects,
+					   BlockID (*allocate)(void *userdata),void *userdata);
+		
+		/**
+		 * Notes that the objects of every Commit() so far are on the store.
+		 */
+		void Written();
+		
+		/**
+		 * Lists the objects of the index and the objects it refers to.
+		 */
+		void GetObjectIDs(std::vector<BlockID>& out_ids);
+	};
+}
+
+#endif
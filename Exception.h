@@ -35,6 +35,7 @@ namespace cloudblockfs
 	DEFINE_EXCEPTION(WriteErrorException);
 	DEFINE_EXCEPTION(ReadErrorException);
 	DEFINE_EXCEPTION(InvalidArgumentException);
+	DEFINE_EXCEPTION(ThreadException);
 	
 #undef DEFINE_EXCEPTION
 }
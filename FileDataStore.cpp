@@ -16,30 +16,244 @@
  along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
 #include "Exception.h"
 #include "FileDataStore.h"
 
 using namespace cloudblockfs;
 
-FileDataStore::FileDataStore(const std::string& path) : m_path(path)
+// records the number of directory levels, absent for a flat store
+#define LAYOUT_FILE ".fanout"
+
+// present while objects are moved to a new layout
+#define MIGRATING_FILE ".migrating"
+
+#define MAX_LEVELS 4
+#define DEFAULT_LIST_THREADS 8
+
+// files from which a flush syncs the whole file system, and threads syncing files one by one
+#define DEFAULT_SYNCFS_THRESHOLD 64
+#define SYNC_THREADS 8
+
+// objects from this size are mapped by GetObjectView(), below it a read is cheaper than setting up a mapping
+#define DEFAULT_MAP_THRESHOLD 32768
+
+// a view of a mapped object file
+class MappedObjectView : public ObjectView
+{
+private:
+	void *m_data;
+	int m_size;
+public:
+	MappedObjectView(void *data,int size) : m_data(data), m_size(size) { }
+	virtual ~MappedObjectView() { munmap(m_data,m_size); }
+	
+	virtual const void *GetData() const { return m_data; }
+	virtual int GetSize() const { return m_size; }
+};
+
+// how far ListObjects() has got, shared by the threads reading directories
+struct FileDataStore::ListState
+{
+	void (*list_function)(const std::string& name,void *userdata);
+	void *userdata;
+	Mutex lock; // list_function is called with this held
+	ThreadPool *pool; // NULL to read every directory on the calling thread
+	std::string error;
+};
+
+// syncs the data of a file written since the last flush
+class FileDataStore::SyncJob : public ThreadPool::Job
+{
+private:
+	std::string m_path;
+	Mutex *m_lock;
+	std::string *m_error;
+public:
+	SyncJob(const std::string& path,Mutex *lock,std::string *error) : m_path(path), m_lock(lock), m_error(error) { }
+	virtual void Run() {
+		// a file removed since has nothing left to sync
+		int fd = open(m_path.c_str(),O_RDONLY);
+		if(fd < 0 && errno == ENOENT) return;
+#ifdef __linux__
+		if(fd < 0 || fdatasync(fd) != 0) {
+#else
+		if(fd < 0 || fsync(fd) != 0) {
+#endif
+			ScopedLock lock(*m_lock);
+			if(m_error->empty()) *m_error = m_path + ": " + strerror(errno);
+		}
+		if(fd >= 0) close(fd);
+	}
+};
+
+class FileDataStore::ListJob : public ThreadPool::Job
+{
+private:
+	const FileDataStore *m_store;
+	std::string m_path;
+	int m_level;
+	ListState *m_state;
+public:
+	ListJob(const FileDataStore *store,const std::string& path,int level,ListState *state) :
+		m_store(store), m_path(path), m_level(level), m_state(state) { }
+	virtual void Run() {
+		try {
+			m_store->ListDirectory(m_path,m_level,m_state);
+		} catch(const std::runtime_error& e) {
+			ScopedLock lock(m_state->lock);
+			if(m_state->error.empty()) m_state->error = e.what();
+		}
+	}
+};
+
+// FNV-1a, each level of directories is named after one byte of it
+static uint32_t HashName(const std::string& name)
+{
+	uint32_t hash = 2166136261U;
+	for(size_t i = 0; i < name.size(); i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// a directory of objects is named with two hex digits
+static bool IsShard(const std::string& path,const struct dirent *dp)
 {
+	if(!isxdigit(dp->d_name[0]) || !isxdigit(dp->d_name[1]) || dp->d_name[2]) return false;
+#ifdef DT_DIR
+	if(dp->d_type != DT_UNKNOWN) return dp->d_type == DT_DIR;
+#endif
+	struct stat st;
+	return stat((path + "/" + dp->d_name).c_str(),&st) == 0 && S_ISDIR(st.st_mode);
+}
+
+FileDataStore::FileDataStore(const std::string& path,int levels) : m_path(path), m_levels(0), m_list_threads(DEFAULT_LIST_THREADS),
+	m_map_threshold(DEFAULT_MAP_THRESHOLD), m_syncfs_pending(false), m_open_batch(1), m_synced_batch(0), m_failed_batch(0),
+	m_syncing(false), m_syncfs_threshold(DEFAULT_SYNCFS_THRESHOLD)
+{
+	FILE *fp = fopen((m_path + "/" LAYOUT_FILE).c_str(),"r");
+	if(fp) {
+		const bool valid = fscanf(fp,"%d",&m_levels) == 1 && m_levels >= 0 && m_levels <= MAX_LEVELS;
+		fclose(fp);
+		if(!valid) throw FileIOException(m_path + ": Invalid " LAYOUT_FILE " file.");
+	}
+	
+	// carry on with a move which was interrupted
+	const int wanted = levels >= 0 ? levels : m_levels;
+	if(wanted != m_levels || access((m_path + "/" MIGRATING_FILE).c_str(),F_OK) == 0) {
+		Migrate(wanted);
+	}
+}
+
+std::string FileDataStore::GetShardPath(const std::string& name,int levels) const
+{
+	const uint32_t hash = HashName(name);
+	std::string path = m_path;
+	for(int i = 0; i < levels; i++) {
+		char shard[4];
+		sprintf(shard,"/%.2X",(hash >> (i * 8)) & 0xFF);
+		path += shard;
+	}
+	return path;
+}
+
+std::string FileDataStore::GetObjectPath(const std::string& name) const
+{
+	return GetShardPath(name,m_levels) + "/" + name;
+}
+
+void FileDataStore::MakeShards(const std::string& name)
+{
+	for(int i = 1; i <= m_levels; i++) {
+		const std::string path = GetShardPath(name,i);
+		if(mkdir(path.c_str(),0700) == 0) {
+			ScopedLock lock(m_sync_lock);
+			NoteDirectory(GetShardPath(name,i - 1));
+		} else if(errno != EEXIST) {
+			throw FileIOException(path + ": " + strerror(errno));
+		}
+	}
+}
+
+void FileDataStore::AddUnsynced(const std::string& name,bool removed)
+{
+	ScopedLock lock(m_sync_lock);
+	
+	// a removed file has nothing left to sync, only its directory
+	if(removed) m_unsynced_files.erase(GetObjectPath(name));
+	else NoteFile(GetObjectPath(name));
+	NoteDirectory(GetShardPath(name,m_levels));
+}
+
+void FileDataStore::NoteFile(const std::string& path)
+{
+	if(m_syncfs_pending) return;
+	m_unsynced_files.insert(path);
+	
+	// past the threshold the batch goes to syncfs(), which needs no paths
+#ifdef __linux__
+	if(m_syncfs_threshold && m_unsynced_files.size() >= (size_t)m_syncfs_threshold) {
+		m_unsynced_files.clear();
+		m_unsynced_dirs.clear();
+		m_syncfs_pending = true;
+	}
+#endif
+}
+
+void FileDataStore::NoteDirectory(const std::string& path)
+{
+	if(m_syncfs_pending) return;
+	m_unsynced_dirs.insert(path);
+#ifdef __linux__
+	if(m_syncfs_threshold && m_unsynced_dirs.size() >= (size_t)m_syncfs_threshold) {
+		m_unsynced_files.clear();
+		m_unsynced_dirs.clear();
+		m_syncfs_pending = true;
+	}
+#endif
 }
 
 void FileDataStore::PutObject(const std::string& name,const void *data,int size)
 {
-	int fd = open((m_path + "/" + name).c_str(),O_WRONLY | O_CREAT | O_TRUNC,0600);
+	const std::string path = GetObjectPath(name);
+	int fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0600);
+	if(fd < 0 && errno == ENOENT && m_levels) {
+		// directories are made the first time an object hashes to them
+		MakeShards(name);
+		fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0600);
+	}
 	if(fd < 0) throw FileIOException(name + ": " + strerror(errno));
-	write(fd,data,size);
-	close(fd);
+	
+	// a full disk shows up as a short write
+	const char *p = (const char *)data;
+	for(int left = size; left > 0; ) {
+		const ssize_t written = write(fd,p,left);
+		if(written < 0 && errno == EINTR) continue;
+		if(written <= 0) {
+			const std::string error = name + ": " + strerror(written < 0 ? errno : ENOSPC);
+			close(fd);
+			throw WriteErrorException(error);
+		}
+		p += written;
+		left -= written;
+	}
+	if(close(fd) != 0) throw WriteErrorException(name + ": " + strerror(errno));
+	AddUnsynced(name,false);
 }
 
 void FileDataStore::GetObject(const std::string& name,void *data,int size) const
 {
-	int fd = open((m_path + "/" + name).c_str(),O_RDONLY);
+	int fd = open(GetObjectPath(name).c_str(),O_RDONLY);
 	if(fd < 0) {
 		switch(errno) {
 			case ENOENT: throw FileNotFoundException(name + ": " + strerror(errno)); break;
@@ -51,28 +265,284 @@ void FileDataStore::GetObject(const std::string& name,void *data,int size) const
 	}
 }
 
+void FileDataStore::GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	int fd = open(GetObjectPath(name).c_str(),O_RDONLY);
+	if(fd < 0) {
+		switch(errno) {
+			case ENOENT: throw FileNotFoundException(name + ": " + strerror(errno)); break;
+			default: throw FileIOException(name + ": " + strerror(errno)); break;
+		}
+	} else {
+		pread(fd,data,size,offset);
+		close(fd);
+	}
+}
+
+ObjectViewPtr FileDataStore::GetObjectView(const std::string& name,int size) const
+{
+	int fd = open(GetObjectPath(name).c_str(),O_RDONLY);
+	if(fd < 0) {
+		switch(errno) {
+			case ENOENT: throw FileNotFoundException(name + ": " + strerror(errno)); break;
+			default: throw FileIOException(name + ": " + strerror(errno)); break;
+		}
+	}
+	
+	// a mapping may not reach past the end of the file
+	struct stat st;
+	if(fstat(fd,&st) != 0) {
+		const std::string error = name + ": " + strerror(errno);
+		close(fd);
+		throw FileIOException(error);
+	}
+	const int length = std::min<off_t>(size,st.st_size);
+	
+	if(length > 0 && length >= m_map_threshold) {
+		void *data = mmap(NULL,length,PROT_READ,MAP_SHARED,fd,0);
+		if(data != MAP_FAILED) {
+			close(fd);
+			return ObjectViewPtr(new MappedObjectView(data,length));
+		}
+	}
+	
+	BufferObjectView *view = new BufferObjectView(length);
+	ObjectViewPtr ptr(view);
+	const ssize_t result = length > 0 ? pread(fd,view->GetBuffer(),length,0) : 0;
+	close(fd);
+	if(result < 0) throw FileIOException(name + ": " + strerror(errno));
+	view->Resize(result);
+	return ptr;
+}
+
 void FileDataStore::DeleteObject(const std::string& name)
 {
-	if(unlink((m_path + "/" + name).c_str()) != 0) {
+	if(unlink(GetObjectPath(name).c_str()) != 0) {
 		switch(errno) {
 			case ENOENT: throw FileNotFoundException(name + ": " + strerror(errno));
 			default: throw FileIOException(name + ": " + strerror(errno));
 		}
 	}
+	AddUnsynced(name,true);
+}
+
+void FileDataStore::ListDirectory(const std::string& path,int level,ListState *state) const
+{
+	DIR *dirp = opendir(path.c_str());
+	if(!dirp) throw FileIOException(path + ": " + strerror(errno));
+	try {
+		struct dirent *dp;
+		while((dp = readdir(dirp)) != NULL) {
+			// skips ".", ".." and the layout files
+			if(dp->d_name[0] == '.') continue;
+			if(level < m_levels && IsShard(path,dp)) {
+				const std::string shard = path + "/" + dp->d_name;
+				if(state->pool) state->pool->Queue(new ListJob(this,shard,level + 1,state));
+				else ListDirectory(shard,level + 1,state);
+			} else {
+				ScopedLock lock(state->lock);
+				state->list_function(dp->d_name,state->userdata);
+			}
+		}
+	} catch(...) {
+		closedir(dirp);
+		throw;
+	}
+	closedir(dirp);
 }
 
 void FileDataStore::ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const
 {
-	DIR *dirp;
+	ListState state;
+	state.list_function = list_function;
+	state.userdata = userdata;
+	state.pool = NULL;
+	
+	// directories are read in parallel, each shard by a job of its own
+	if(m_levels && m_list_threads > 1) {
+		ThreadPool pool(m_list_threads);
+		state.pool = &pool;
+		ListDirectory(m_path,0,&state);
+		pool.Wait();
+	} else {
+		ListDirectory(m_path,0,&state);
+	}
+	if(!state.error.empty()) throw FileIOException(state.error);
+}
+
+void FileDataStore::WriteLayout(int levels)
+{
+	const std::string path = m_path + "/" LAYOUT_FILE;
+	if(!levels) {
+		if(unlink(path.c_str()) != 0 && errno != ENOENT) throw FileIOException(path + ": " + strerror(errno));
+		return;
+	}
+	
+	// replaced in one step, so it never reads back half written
+	FILE *fp = fopen((path + ".tmp").c_str(),"w");
+	if(!fp) throw FileIOException(path + ": " + strerror(errno));
+	fprintf(fp,"%d\n",levels);
+	if(fclose(fp) != 0 || rename((path + ".tmp").c_str(),path.c_str()) != 0) {
+		throw FileIOException(path + ": " + strerror(errno));
+	}
+}
+
+void FileDataStore::MigrateDirectory(const std::string& path,int level)
+{
+	DIR *dirp = opendir(path.c_str());
+	if(!dirp) throw FileIOException(path + ": " + strerror(errno));
+	
+	// Objects are renamed out of the directory while it is read. An object
+	// renamed into it may be read again, and is then where it belongs.
+	std::vector<std::string> shards;
 	struct dirent *dp;
-	dirp = opendir(m_path.c_str());
 	while((dp = readdir(dirp)) != NULL) {
-		if(strcmp(dp->d_name,".") && strcmp(dp->d_name,".."))
-			list_function(dp->d_name,userdata);
+		if(dp->d_name[0] == '.') continue;
+		if(level < MAX_LEVELS && IsShard(path,dp)) {
+			shards.push_back(path + "/" + dp->d_name);
+			continue;
+		}
+		
+		const std::string from = path + "/" + dp->d_name;
+		const std::string to = GetObjectPath(dp->d_name);
+		if(from == to) continue;
+		int result = rename(from.c_str(),to.c_str());
+		if(result != 0 && errno == ENOENT) {
+			try {
+				MakeShards(dp->d_name);
+			} catch(...) {
+				closedir(dirp);
+				throw;
+			}
+			result = rename(from.c_str(),to.c_str());
+		}
+		if(result != 0) {
+			const std::string error = from + ": " + strerror(errno);
+			closedir(dirp);
+			throw FileIOException(error);
+		}
+		
+		ScopedLock lock(m_sync_lock);
+		NoteDirectory(path);
+		NoteDirectory(GetShardPath(dp->d_name,m_levels));
 	}
 	closedir(dirp);
+	
+	// a directory still in use by the new layout is not empty and stays
+	for(std::vector<std::string>::const_iterator it = shards.begin(); it != shards.end(); ++it) {
+		MigrateDirectory(*it,level + 1);
+		if(rmdir(it->c_str()) == 0) {
+			ScopedLock lock(m_sync_lock);
+			m_unsynced_dirs.erase(*it);
+			NoteDirectory(path);
+		}
+	}
+}
+
+void FileDataStore::Migrate(int levels)
+{
+	if(levels < 0 || levels > MAX_LEVELS) {
+		throw InvalidArgumentException("Invalid number of directory levels. Must be up to 4");
+	}
+	
+	// the new layout is recorded first, so a store opened after a crash
+	// looks for objects where they are going and finishes the move
+	const std::string migrating = m_path + "/" MIGRATING_FILE;
+	int fd = open(migrating.c_str(),O_WRONLY | O_CREAT,0600);
+	if(fd < 0) throw FileIOException(migrating + ": " + strerror(errno));
+	close(fd);
+	WriteLayout(levels);
+	m_levels = levels;
+	
+	MigrateDirectory(m_path,0);
+	
+	// the move is only done once it is on disk
+	Flush();
+	unlink(migrating.c_str());
+}
+
+void FileDataStore::SyncBatch(const std::set<std::string>& files,const std::set<std::string>& dirs,bool whole_fs)
+{
+	if(files.empty() && dirs.empty() && !whole_fs) return;
+	
+#ifdef __linux__
+	// one call covers everything once there are many files, and the directories with them
+	if(whole_fs) {
+		int fd = open(m_path.c_str(),O_RDONLY);
+		if(fd < 0 || syncfs(fd) != 0) {
+			const std::string error = m_path + ": " + strerror(errno);
+			if(fd >= 0) close(fd);
+			throw WriteErrorException(error);
+		}
+		close(fd);
+		return;
+	}
+#endif
+	
+	// files in parallel, then the directories which name them
+	Mutex lock;
+	std::string error;
+	if(!files.empty()) {
+		ThreadPool pool(std::min<size_t>(files.size(),SYNC_THREADS));
+		for(std::set<std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+			pool.Queue(new SyncJob(*it,&lock,&error));
+		}
+		pool.Wait();
+	}
+	for(std::set<std::string>::const_iterator it = dirs.begin(); it != dirs.end() && error.empty(); ++it) {
+		int fd = open(it->c_str(),O_RDONLY);
+		if(fd < 0 && errno == ENOENT) continue;
+		if(fd < 0 || fsync(fd) != 0) error = *it + ": " + strerror(errno);
+		if(fd >= 0) close(fd);
+	}
+	if(!error.empty()) throw WriteErrorException(error);
 }
 
 void FileDataStore::Flush()
 {
+	ScopedLock lock(m_sync_lock);
+	
+	// everything written before the call is noted in the open batch. The
+	// first caller to find no batch being synced closes it and syncs it,
+	// the others wait, and whoever comes along meanwhile joins the next.
+	const uint64_t batch = m_open_batch;
+	while(m_synced_batch < batch) {
+		if(m_syncing) {
+			m_sync_cond.Wait(m_sync_lock);
+			continue;
+		}
+		
+		std::set<std::string> files, dirs;
+		files.swap(m_unsynced_files);
+		dirs.swap(m_unsynced_dirs);
+		const bool whole_fs = m_syncfs_pending;
+		m_syncfs_pending = false;
+		const uint64_t syncing = m_open_batch++;
+		m_syncing = true;
+		m_sync_lock.Unlock();
+		std::string error;
+		try {
+			SyncBatch(files,dirs,whole_fs);
+		} catch(const std::runtime_error& e) {
+			error = e.what();
+		}
+		m_sync_lock.Lock();
+		
+		// a batch which failed is tried again with the next one
+		if(!error.empty()) {
+			if(whole_fs) {
+				m_unsynced_files.clear();
+				m_unsynced_dirs.clear();
+				m_syncfs_pending = true;
+			}
+			for(std::set<std::string>::const_iterator it = files.begin(); it != files.end(); ++it) NoteFile(*it);
+			for(std::set<std::string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) NoteDirectory(*it);
+			m_failed_batch = syncing;
+			m_sync_error = error;
+		}
+		m_synced_batch = syncing;
+		m_syncing = false;
+		m_sync_cond.Broadcast();
+	}
+	if(m_failed_batch == batch) throw WriteErrorException(m_sync_error);
 }
@@ -19,25 +19,141 @@
 #define __cloudblockfs_FileDataStore_h
 
 #include "DataStore.h"
+#include "Thread.h"
+#include <set>
 #include <string>
 
 namespace cloudblockfs
 {
 	/**
 	 * A data store based on plain files.
+	 *
+	 * Objects may be spread over levels of directories so no directory
+	 * grows too large, each level named after a byte of a hash of the
+	 * object name, as in 3F/A2/<name>. The number of levels is recorded in
+	 * the store, and opening a store with a different number moves the
+	 * objects over. A move which was interrupted is finished on the next
+	 * open.
+	 *
+	 * Views of objects at least as large as the map threshold map the file
+	 * rather than copying it, smaller ones are read into a buffer.
+	 *
+	 * Writes are not synced as they are made. The files and directories
+	 * written are noted, and Flush() syncs everything noted so far in one
+	 * batch: with syncfs() once there are many files, otherwise with an
+	 * fdatasync() of each file in parallel followed by the directories.
+	 * Once a batch is bound for syncfs() nothing more is noted for it, so
+	 * the notes never grow past the syncfs threshold. Flushes called while
+	 * a batch is being synced wait for it and then share the next one.
 	 */
 	class FileDataStore : public DataStore
 	{
 	private:
 		std::string m_path; // path to store
+		int m_levels; // levels of directories objects are spread over, 0 for none
+		int m_list_threads;
+		int m_map_threshold;
+		
+		// what the next batch syncs, see Flush()
+		mutable Mutex m_sync_lock;
+		Condition m_sync_cond; // signalled when a batch is done
+		std::set<std::string> m_unsynced_files;
+		std::set<std::string> m_unsynced_dirs;
+		bool m_syncfs_pending; // the batch syncs the whole file system, nothing is noted
+		uint64_t m_open_batch; // batch writes are noted in
+		uint64_t m_synced_batch; // last batch done
+		uint64_t m_failed_batch; // last batch which could not be synced
+		std::string m_sync_error;
+		bool m_syncing;
+		int m_syncfs_threshold;
+		
+		class ListJob;
+		class SyncJob;
+		struct ListState;
+		
+		std::string GetShardPath(const std::string& name,int levels) const;
+		void ListDirectory(const std::string& path,int level,ListState *state) const;
+		void MigrateDirectory(const std::string& path,int level);
+		void WriteLayout(int levels);
+		void NoteFile(const std::string& path);
+		void NoteDirectory(const std::string& path);
+		void SyncBatch(const std::set<std::string>& files,const std::set<std::string>& dirs,bool whole_fs);
+	protected:
+		std::string GetObjectPath(const std::string& name) const;
+		
+		/**
+		 * Makes the directories an object goes in.
+		 */
+		void MakeShards(const std::string& name);
+		
+		/**
+		 * Notes a written or removed object for the next Flush().
+		 * @param name Name of object.
+		 * @param removed True if the object was removed, which only changes its directory.
+		 */
+		void AddUnsynced(const std::string& name,bool removed);
 	public:
-		FileDataStore(const std::string& path);
+		/**
+		 * Opens a store.
+		 * @param path Directory of the store.
+		 * @param levels Levels of directories to spread objects over, up to
+		 * 4. -1 keeps the layout the store has, which is flat for a new one.
+		 */
+		FileDataStore(const std::string& path,int levels = -1);
 		virtual ~FileDataStore() { }
 		
+		int GetLevels() const { return m_levels; }
+		
+		/**
+		 * Sets how many directories ListObjects() reads at once. The list
+		 * function is then called from those threads, one call at a time.
+		 * @param threads Number of threads, 1 to read on the calling thread.
+		 */
+		void SetListThreads(int threads) { m_list_threads = threads; }
+		int GetListThreads() const { return m_list_threads; }
+		
+		/**
+		 * Sets the size from which GetObjectView() maps objects.
+		 * @param bytes Size in bytes, 0 to always map.
+		 */
+		void SetMapThreshold(int bytes) { m_map_threshold = bytes; }
+		int GetMapThreshold() const { return m_map_threshold; }
+		
+		/**
+		 * Sets from how many files Flush() syncs the whole file system
+		 * rather than each file.
+		 * @param files Number of files, 0 to never sync the file system.
+		 */
+		void SetSyncfsThreshold(int files) { m_syncfs_threshold = files; }
+		int GetSyncfsThreshold() const { return m_syncfs_threshold; }
+		
+		/**
+		 * Returns the number of batches Flush() has synced.
+		 */
+		uint64_t GetBatchesSynced() const { ScopedLock lock(m_sync_lock); return m_synced_batch; }
+		
+		/**
+		 * Returns the number of written files the next Flush() syncs one by one.
+		 */
+		size_t GetUnsyncedFiles() const { ScopedLock lock(m_sync_lock); return m_unsynced_files.size(); }
+		
+		/**
+		 * Moves every object to where it belongs with the given number of
+		 * levels, and removes directories left empty.
+		 * @param levels Levels of directories, 0 for a flat store.
+		 */
+		void Migrate(int levels);
+		
 		virtual void PutObject(const std::string& name,const void *data,int size);
 		virtual void GetObject(const std::string& name,void *data,int size) const;
+		virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const;
+		virtual ObjectViewPtr GetObjectView(const std::string& name,int size) const;
 		virtual void DeleteObject(const std::string& name);
 		virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const;
+		
+		/**
+		 * Makes every object written or removed before the call durable.
+		 */
 		virtual void Flush();
 	};
 }
@@ -0,0 +1,249 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdexcept>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "Exception.h"
+#include "GarbageCollector.h"
+
+using namespace cloudblockfs;
+
+// default number of tree nodes read at once
+#define DEFAULT_GC_THREADS 16
+
+// default memory for the live set, 8 bytes per id while it is exact
+#define DEFAULT_GC_MEMORY_LIMIT (64 * 1024 * 1024)
+
+// objects removed with one request
+#define GC_DELETE_BATCH 256
+
+// the mark phase reports progress every so many nodes
+#define GC_PROGRESS_NODES 1024
+
+static double Now()
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+class GarbageCollector::MarkJob : public ThreadPool::Job
+{
+private:
+	GarbageCollector *m_collector;
+	ThreadPool *m_pool;
+	int m_level;
+	BlockID m_id;
+public:
+	MarkJob(GarbageCollector *collector,ThreadPool *pool,int level,BlockID id) :
+		m_collector(collector), m_pool(pool), m_level(level), m_id(id) { }
+	virtual void Run() { m_collector->MarkNode(m_pool,m_level,m_id); }
+};
+
+GarbageCollector::GarbageCollector(DataStore *store,BlockMeta *meta) : m_store(store), m_meta(meta),
+	m_threads(DEFAULT_GC_THREADS), m_rate_limit(0), m_memory_limit(DEFAULT_GC_MEMORY_LIMIT),
+	m_progress_function(NULL), m_progress_userdata(NULL), m_begun(false), m_live_estimate(0),
+	m_start_time(0), m_sweep_start_time(0)
+{
+	memset(&m_head,0,sizeof(m_head));
+	memset(&m_progress,0,sizeof(m_progress));
+}
+
+void GarbageCollector::Begin()
+{
+	m_roots.clear();
+	m_root_subtrees.clear();
+	m_meta->GetHead(&m_head);
+	m_meta->BeginCollection(m_roots,m_root_subtrees);
+	m_begun = true;
+	
+	memset(&m_progress,0,sizeof(m_progress));
+	m_start_time = Now();
+}
+
+uint64_t GarbageCollector::Collect()
+{
+	if(!m_begun) throw InvalidArgumentException("Garbage collection was not begun");
+	m_begun = false;
+	
+	try {
+		Mark();
+		Sweep();
+	} catch(...) {
+		m_meta->EndCollection();
+		m_live_ids.clear();
+		m_live_filter.reset();
+		throw;
+	}
+	m_meta->EndCollection();
+	std::vector<BlockID>().swap(m_live_ids);
+	m_live_filter.reset();
+	
+	ReportProgress(GC_DONE);
+	return m_progress.objects_deleted;
+}
+
+void GarbageCollector::Mark()
+{
+	// expect every block of the disk and the tree above it to be live
+	const uint64_t bk_count = m_head.block_size >> 3;
+	const uint64_t blocks = m_head.disk_size / m_head.block_size + 1;
+	m_live_estimate = blocks + blocks / (bk_count - 1) + m_head.tree_depth + m_roots.size();
+	m_live_ids.clear();
+	m_live_filter.reset();
+	
+	for(std::vector<BlockID>::const_iterator it = m_roots.begin(); it != m_roots.end(); ++it) {
+		AddLive(*it);
+	}
+	m_progress.ids_marked = m_roots.size();
+	m_error.clear();
+	
+	{
+		ThreadPool pool(m_threads);
+		for(std::vector<std::pair<int,BlockID> >::const_iterator it = m_root_subtrees.begin(); it != m_root_subtrees.end(); ++it) {
+			pool.Queue(new MarkJob(this,&pool,it->first,it->second));
+		}
+		pool.Wait();
+	}
+	
+	// a subtree which could not be read may hold live objects, do not sweep
+	if(!m_error.empty()) throw ReadErrorException(m_error);
+	
+	std::sort(m_live_ids.begin(),m_live_ids.end());
+}
+
+void GarbageCollector::AddLive(BlockID id)
+{
+	if(m_live_filter.get()) {
+		m_live_filter->Add(id);
+		return;
+	}
+	
+	m_live_ids.push_back(id);
+	if(m_live_ids.size() * sizeof(BlockID) > m_memory_limit) {
+		// too many to keep exactly, spread the memory over the ids still expected
+		const uint64_t keys = std::max<uint64_t>(m_live_estimate,m_live_ids.size() * 2);
+		const int bits_per_key = (int)std::min<uint64_t>(16,std::max<uint64_t>(1,m_memory_limit * 8 / keys));
+		m_live_filter.reset(new BloomFilter(keys,bits_per_key));
+		for(std::vector<BlockID>::const_iterator it = m_live_ids.begin(); it != m_live_ids.end(); ++it) {
+			m_live_filter->Add(*it);
+		}
+		std::vector<BlockID>().swap(m_live_ids);
+	}
+}
+
+bool GarbageCollector::IsLive(BlockID id) const
+{
+	if(m_live_filter.get()) return m_live_filter->MayContain(id);
+	return std::binary_search(m_live_ids.begin(),m_live_ids.end(),id);
+}
+
+void GarbageCollector::MarkNode(ThreadPool *pool,int level,BlockID id)
+{
+	{
+		ScopedLock lock(m_lock);
+		if(!m_error.empty()) return;
+	}
+	
+	std::vector<BlockID> table(m_head.block_size >> 3);
+	char object[32];
+	sprintf(object,"%.16llX",id);
+	try {
+		m_store->GetObject(object,&table[0],m_head.block_size);
+	} catch(const std::runtime_error& e) {
+		ScopedLock lock(m_lock);
+		if(m_error.empty()) m_error = e.what();
+		return;
+	}
+	
+	// children which are nodes themselves are read by further jobs
+	const bool leaf = level >= m_head.tree_depth - 1;
+	uint64_t marked = 1;
+	{
+		ScopedLock lock(m_lock);
+		AddLive(id);
+		for(std::vector<BlockID>::const_iterator it = table.begin(); it != table.end(); ++it) {
+			if(!*it) continue;
+			if(leaf) {
+				AddLive(BlockMeta::GetObjectID(m_head,*it)); // a packed block keeps its segment
+				marked++;
+			} else {
+				pool->Queue(new MarkJob(this,pool,level + 1,*it));
+			}
+		}
+		m_progress.ids_marked += marked;
+		m_progress.nodes_marked++;
+		if(m_progress.nodes_marked % GC_PROGRESS_NODES == 0) ReportProgress(GC_MARK);
+	}
+}
+
+void GarbageCollector::Sweep()
+{
+	m_garbage.clear();
+	m_sweep_start_time = Now();
+	m_store->ListObjects(SweepObject,this);
+	DeleteGarbage();
+}
+
+void GarbageCollector::SweepObject(const std::string& name,void *userdata)
+{
+	GarbageCollector *collector = (GarbageCollector *)userdata;
+	collector->m_progress.objects_listed++;
+	
+	// only objects named after an id belong to the volume, id 0 is the head
+	if(name.size() != 16 || strspn(name.c_str(),"0123456789ABCDEF") != 16) return;
+	const BlockID id = strtoull(name.c_str(),NULL,16);
+	if(id == 0) return;
+	
+	// an id the mark has not seen is garbage, unless it was handed out
+	// after the collection started
+	if(collector->IsLive(id)) return;
+	if(collector->m_meta->IsAllocatedSinceCollection(id)) return;
+	
+	collector->m_garbage.push_back(name);
+	if(collector->m_garbage.size() >= GC_DELETE_BATCH ||
+	   (collector->m_rate_limit && (int)collector->m_garbage.size() >= collector->m_rate_limit)) {
+		collector->DeleteGarbage();
+	}
+}
+
+void GarbageCollector::DeleteGarbage()
+{
+	if(m_garbage.empty()) return;
+	m_store->DeleteObjects(m_garbage);
+	m_progress.objects_deleted += m_garbage.size();
+	m_garbage.clear();
+	
+	// hold back until the removal rate is down to the limit
+	if(m_rate_limit) {
+		const double ahead = (double)m_progress.objects_deleted / m_rate_limit - (Now() - m_sweep_start_time);
+		if(ahead > 0) usleep((useconds_t)(ahead * 1000000));
+	}
+	ReportProgress(GC_SWEEP);
+}
+
+void GarbageCollector::ReportProgress(Phase phase)
+{
+	m_progress.phase = phase;
+	m_progress.seconds = Now() - m_start_time;
+	if(m_progress_function) m_progress_function(m_progress,m_progress_userdata);
+}
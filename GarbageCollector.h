@@ -0,0 +1,159 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_GarbageCollector_h
+#define __cloudblockfs_GarbageCollector_h
+
+#include <inttypes.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "BlockMeta.h"
+#include "BloomFilter.h"
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * Mark and sweep collector for objects a volume no longer refers to.
+	 *
+	 * The mark phase walks the block map tree from the head, reading the
+	 * subtrees in parallel, and adds every id it finds to the live set. The
+	 * sweep phase streams the store's object list against the live set. An
+	 * object which is not in it is checked once more against the ids handed
+	 * out since the collection started and then removed in batches.
+	 *
+	 * The live set is a sorted list of ids while it fits the memory limit.
+	 * Past that it turns into a Bloom filter, which never loses a live id
+	 * but mistakes the odd garbage object for a live one. Those are left for
+	 * a later run.
+	 *
+	 * The volume may be used while the collector runs, as long as the
+	 * deletion queue is not reclaimed meanwhile.
+	 */
+	class GarbageCollector
+	{
+	public:
+		enum Phase
+		{
+			GC_MARK,
+			GC_SWEEP,
+			GC_DONE
+		};
+		
+		struct Progress
+		{
+			Phase phase;
+			uint64_t nodes_marked; // tree nodes read
+			uint64_t ids_marked; // ids added to the live set
+			uint64_t objects_listed; // objects seen by the sweep
+			uint64_t objects_deleted;
+			double seconds; // since the collection started
+		};
+		
+		typedef void (*ProgressFunction)(const Progress& progress,void *userdata);
+	private:
+		DataStore *m_store;
+		BlockMeta *m_meta;
+		int m_threads;
+		int m_rate_limit; // objects deleted per second, 0 for no limit
+		size_t m_memory_limit; // bytes for the live set
+		ProgressFunction m_progress_function;
+		void *m_progress_userdata;
+		
+		BlockMeta::Head m_head;
+		std::vector<BlockID> m_roots; // referenced ids reported by Begin()
+		std::vector<std::pair<int,BlockID> > m_root_subtrees;
+		bool m_begun;
+		std::vector<BlockID> m_live_ids; // exact live set, sorted once the mark is done
+		std::auto_ptr<BloomFilter> m_live_filter; // replaces m_live_ids once that outgrows the memory limit
+		uint64_t m_live_estimate; // expected size of the live set
+		std::vector<std::string> m_garbage; // batch waiting to be removed
+		
+		Mutex m_lock; // guards the live set, m_progress and m_error during the mark
+		Progress m_progress;
+		std::string m_error; // first error of the mark phase
+		double m_start_time;
+		double m_sweep_start_time;
+		
+		GarbageCollector(const GarbageCollector&);
+		GarbageCollector& operator =(const GarbageCollector&);
+		
+		class MarkJob;
+		friend class MarkJob;
+		
+		void Mark();
+		void MarkNode(ThreadPool *pool,int level,BlockID id);
+		void AddLive(BlockID id);
+		bool IsLive(BlockID id) const;
+		void Sweep();
+		static void SweepObject(const std::string& name,void *userdata);
+		void DeleteGarbage();
+		void ReportProgress(Phase phase);
+	public:
+		/**
+		 * @param store Store holding the volume.
+		 * @param meta Block map of the volume.
+		 */
+		GarbageCollector(DataStore *store,BlockMeta *meta);
+		
+		/**
+		 * Sets how many tree nodes are read at once during the mark phase.
+		 */
+		void SetThreads(int threads) { m_threads = threads; }
+		
+		/**
+		 * Limits how fast garbage is removed.
+		 * @param objects_per_second Objects per second, 0 for no limit.
+		 */
+		void SetRateLimit(int objects_per_second) { m_rate_limit = objects_per_second; }
+		
+		/**
+		 * Sets how much memory the live set may take before it turns into a Bloom filter.
+		 * @param bytes Size in bytes.
+		 */
+		void SetMemoryLimit(size_t bytes) { m_memory_limit = bytes; }
+		
+		/**
+		 * Sets a function to call as the collection progresses. During the
+		 * mark phase it is called from the collector's threads.
+		 * @param progress_function Function to call, or NULL.
+		 * @param userdata User defined data that is passed to progress_function.
+		 */
+		void SetProgressCallback(ProgressFunction progress_function,void *userdata) {
+			m_progress_function = progress_function;
+			m_progress_userdata = userdata;
+		}
+		
+		/**
+		 * Takes note of what the volume refers to. No object may be written
+		 * under an id which is not mapped yet while this runs.
+		 */
+		void Begin();
+		
+		/**
+		 * Runs the collection started by Begin(). Nothing is removed if the
+		 * mark phase fails.
+		 * @return Number of objects removed.
+		 */
+		uint64_t Collect();
+	};
+}
+
+#endif
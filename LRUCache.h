@@ -0,0 +1,106 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_LRUCache_h
+#define __cloudblockfs_LRUCache_h
+
+#include <list>
+#include <map>
+#include <utility>
+
+namespace cloudblockfs
+{
+	/**
+	 * A bounded key/value cache which evicts the least recently used entry
+	 * once it holds more than its capacity.
+	 */
+	template<typename Key,typename Value>
+	class LRUCache
+	{
+	private:
+		typedef std::list<std::pair<Key,Value> > EntryList;
+		typedef std::map<Key,typename EntryList::iterator> EntryMap;
+
+		EntryList m_entries; // most recently used first
+		EntryMap m_map;
+		size_t m_capacity;
+
+		void Trim() {
+			while(m_map.size() > m_capacity) {
+				m_map.erase(m_entries.back().first);
+				m_entries.pop_back();
+			}
+		}
+	public:
+		/**
+		 * Create a cache holding at most capacity entries.
+		 */
+		LRUCache(size_t capacity) : m_capacity(capacity) { }
+
+		size_t GetCapacity() const { return m_capacity; }
+		void SetCapacity(size_t capacity) { m_capacity = capacity; Trim(); }
+		size_t GetSize() const { return m_map.size(); }
+
+		/**
+		 * Looks up a key and marks it as most recently used.
+		 * @param key Key to look up.
+		 * @param out_value Receives a copy of the value if found.
+		 * @return True if the key was in the cache.
+		 */
+		bool Get(const Key& key,Value& out_value) {
+			typename EntryMap::iterator it = m_map.find(key);
+			if(it == m_map.end()) return false;
+			m_entries.splice(m_entries.begin(),m_entries,it->second);
+			out_value = it->second->second;
+			return true;
+		}
+
+		/**
+		 * Inserts or replaces a value.
+		 */
+		void Put(const Key& key,const Value& value) {
+			if(!m_capacity) return;
+			typename EntryMap::iterator it = m_map.find(key);
+			if(it != m_map.end()) {
+				it->second->second = value;
+				m_entries.splice(m_entries.begin(),m_entries,it->second);
+			} else {
+				m_entries.push_front(std::make_pair(key,value));
+				m_map[key] = m_entries.begin();
+				Trim();
+			}
+		}
+
+		/**
+		 * Removes a key if present.
+		 */
+		void Erase(const Key& key) {
+			typename EntryMap::iterator it = m_map.find(key);
+			if(it != m_map.end()) {
+				m_entries.erase(it->second);
+				m_map.erase(it);
+			}
+		}
+
+		void Clear() {
+			m_entries.clear();
+			m_map.clear();
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <inttypes.h>
+#include "Lz4.h"
+
+using namespace cloudblockfs;
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the block ends with at least this many literals
+#define MATCH_LIMIT 12 // no match starts this close to the end
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+
+static inline uint32_t Read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static inline uint32_t Hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// writes a length in the 255 byte continuation form used past a nibble of 15
+static inline uint8_t *WriteLength(uint8_t *op,const uint8_t *oend,size_t length)
+{
+	for(; length >= 255; length -= 255) {
+		if(op >= oend) return NULL;
+		*op++ = 255;
+	}
+	if(op >= oend) return NULL;
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+// writes a sequence of literals followed by a match, or just literals if match_length is 0
+static uint8_t *WriteSequence(uint8_t *op,const uint8_t *oend,const uint8_t *literals,size_t literal_length,size_t offset,size_t match_length)
+{
+	if(op >= oend) return NULL;
+	uint8_t *token = op++;
+	*token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+	if(literal_length >= 15 && !(op = WriteLength(op,oend,literal_length - 15))) return NULL;
+	if((size_t)(oend - op) < literal_length) return NULL;
+	memcpy(op,literals,literal_length);
+	op += literal_length;
+	if(!match_length) return op;
+	
+	if(oend - op < 2) return NULL;
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+	match_length -= MIN_MATCH;
+	*token |= (uint8_t)(match_length >= 15 ? 15 : match_length);
+	if(match_length >= 15 && !(op = WriteLength(op,oend,match_length - 15))) return NULL;
+	return op;
+}
+
+int Lz4::Compress(const void *src,int size,void *dst,int capacity)
+{
+	const uint8_t *base = (const uint8_t *)src;
+	const uint8_t *ip = base, *anchor = base;
+	const uint8_t *end = base + size;
+	uint8_t *op = (uint8_t *)dst;
+	const uint8_t *oend = op + capacity;
+	
+	// last position each hashed sequence of 4 bytes was seen at
+	int32_t table[1 << HASH_LOG];
+	for(int i = 0; i < (1 << HASH_LOG); i++) table[i] = -1;
+	
+	if(size > MATCH_LIMIT) {
+		const uint8_t *match_limit = end - MATCH_LIMIT;
+		const uint8_t *match_end = end - LAST_LITERALS;
+		while(ip < match_limit) {
+			const uint32_t sequence = Read32(ip);
+			const uint32_t h = Hash(sequence);
+			const int32_t candidate = table[h];
+			table[h] = (int32_t)(ip - base);
+			
+			if(candidate < 0 || ip - (base + candidate) > MAX_OFFSET || Read32(base + candidate) != sequence) {
+				// step further the longer nothing matches, so incompressible data goes quickly
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			
+			const uint8_t *ref = base + candidate;
+			while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *mp = ip + MIN_MATCH, *mr = ref + MIN_MATCH;
+			while(mp < match_end && *mp == *mr) {
+				mp++;
+				mr++;
+			}
+			
+			op = WriteSequence(op,oend,anchor,ip - anchor,ip - ref,mp - ip);
+			if(!op) return 0;
+			ip = anchor = mp;
+			if(ip < match_limit) table[Hash(Read32(ip - 2))] = (int32_t)(ip - 2 - base);
+		}
+	}
+	
+	op = WriteSequence(op,oend,anchor,end - anchor,0,0);
+	if(!op) return 0;
+	return (int)(op - (uint8_t *)dst);
+}
+
+int Lz4::Decompress(const void *src,int size,void *dst,int capacity)
+{
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *end = ip + size;
+	uint8_t *op = (uint8_t *)dst;
+	uint8_t *const ostart = op;
+	const uint8_t *oend = op + capacity;
+	
+	while(ip < end) {
+		const uint8_t token = *ip++;
+		
+		// a length runs until a byte under 255, the bounds checks after it stop runaways
+		size_t length = token >> 4;
+		if(length == 15) {
+			uint8_t b;
+			do {
+				if(ip >= end) return -1;
+				b = *ip++;
+				length += b;
+			} while(b == 255);
+		}
+		if(length > (size_t)(end - ip) || length > (size_t)(oend - op)) return -1;
+		memcpy(op,ip,length);
+		ip += length;
+		op += length;
+		if(ip == end) break; // the last sequence has no match
+		
+		if(end - ip < 2) return -1;
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(!offset || offset > (size_t)(op - ostart)) return -1;
+		
+		length = token & 15;
+		if(length == 15) {
+			uint8_t b;
+			do {
+				if(ip >= end) return -1;
+				b = *ip++;
+				length += b;
+			} while(b == 255);
+		}
+		length += MIN_MATCH;
+		if(length > (size_t)(oend - op)) return -1;
+		
+		// the match may overlap what it is copying, which repeats the pattern
+		const uint8_t *ref = op - offset;
+		if(offset >= length) {
+			memcpy(op,ref,length);
+			op += length;
+		} else {
+			while(length--) *op++ = *ref++;
+		}
+	}
+	return (int)(op - ostart);
+}
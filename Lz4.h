@@ -0,0 +1,46 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_Lz4_h
+#define __cloudblockfs_Lz4_h
+
+namespace cloudblockfs
+{
+	/**
+	 * LZ4 block compression. The output is a raw LZ4 block as described in
+	 * the LZ4 block format, without a frame around it, so it can be decoded
+	 * by any LZ4 implementation given the original size.
+	 */
+	class Lz4
+	{
+	public:
+		/**
+		 * Compresses size bytes of src into dst.
+		 * @return Compressed size, or 0 if it does not fit in capacity bytes.
+		 */
+		static int Compress(const void *src,int size,void *dst,int capacity);
+		
+		/**
+		 * Decompresses a block. Corrupt input is detected rather than read
+		 * or written out of bounds.
+		 * @return Decompressed size, or -1 if the input is corrupt or does not fit in capacity bytes.
+		 */
+		static int Decompress(const void *src,int size,void *dst,int capacity);
+	};
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <algorithm>
+#include "Exception.h"
+#include "MemoryDataStore.h"
+
+using namespace cloudblockfs;
+
+// chunks are powers of two from MIN_CHUNK to MAX_CHUNK bytes, carved from slabs of SLAB_SIZE
+#define MIN_CHUNK_SHIFT 6
+#define MAX_CHUNK_SHIFT 16
+#define SLAB_SIZE (1024 * 1024)
+
+MemoryDataStore::SlabAllocator::SlabAllocator() : m_classes(MAX_CHUNK_SHIFT - MIN_CHUNK_SHIFT + 1), m_slab_bytes(0)
+{
+	for(size_t i = 0; i < m_classes.size(); i++) {
+		m_classes[i].next = m_classes[i].end = NULL;
+	}
+}
+
+MemoryDataStore::SlabAllocator::~SlabAllocator()
+{
+	for(std::vector<char *>::iterator it = m_slabs.begin(); it != m_slabs.end(); ++it) {
+		delete [] *it;
+	}
+}
+
+int MemoryDataStore::SlabAllocator::GetSizeClass(int size)
+{
+	int size_class = 0;
+	while((1 << (size_class + MIN_CHUNK_SHIFT)) < size) size_class++;
+	return size_class + MIN_CHUNK_SHIFT <= MAX_CHUNK_SHIFT ? size_class : -1;
+}
+
+char *MemoryDataStore::SlabAllocator::Allocate(int size_class)
+{
+	SizeClass& chunks = m_classes[size_class];
+	if(!chunks.free.empty()) {
+		char *chunk = chunks.free.back();
+		chunks.free.pop_back();
+		return chunk;
+	}
+	
+	const int chunk_size = 1 << (size_class + MIN_CHUNK_SHIFT);
+	if(chunks.next == chunks.end) {
+		char *slab = new char[SLAB_SIZE];
+		m_slabs.push_back(slab);
+		m_slab_bytes += SLAB_SIZE;
+		chunks.next = slab;
+		chunks.end = slab + SLAB_SIZE / chunk_size * chunk_size;
+	}
+	char *chunk = chunks.next;
+	chunks.next += chunk_size;
+	return chunk;
+}
+
+void MemoryDataStore::SlabAllocator::Free(char *chunk,int size_class)
+{
+	m_classes[size_class].free.push_back(chunk);
+}
+
+void MemoryDataStore::Shard::Release(const Object& object)
+{
+	if(object.size_class < 0) delete [] object.data;
+	else allocator.Free(object.data,object.size_class);
+	bytes -= object.size;
+}
+
+MemoryDataStore::MemoryDataStore(int shards)
+{
+	for(int i = 0; i < std::max(shards,1); i++) {
+		m_shards.push_back(new Shard());
+	}
+}
+
+MemoryDataStore::~MemoryDataStore()
+{
+	for(std::vector<Shard *>::iterator it = m_shards.begin(); it != m_shards.end(); ++it) {
+		Shard *shard = *it;
+		for(ObjectMap::iterator object = shard->objects.begin(); object != shard->objects.end(); ++object) {
+			if(object->second.size_class < 0) delete [] object->second.data;
+		}
+		delete shard;
+	}
+}
+
+MemoryDataStore::Shard& MemoryDataStore::GetShard(const std::string& name) const
+{
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+	for(size_t i = 0; i < name.size(); i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619U;
+	}
+	return *m_shards[hash % m_shards.size()];
+}
+
+void MemoryDataStore::GetStats(Stats *out_stats) const
+{
+	memset(out_stats,0,sizeof(Stats));
+	for(std::vector<Shard *>::const_iterator it = m_shards.begin(); it != m_shards.end(); ++it) {
+		ScopedLock lock((*it)->lock);
+		out_stats->objects += (*it)->objects.size();
+		out_stats->bytes += (*it)->bytes;
+		out_stats->slab_bytes += (*it)->allocator.GetSlabBytes();
+	}
+}
+
+void MemoryDataStore::PutObject(const std::string& name,const void *data,int size)
+{
+	Shard& shard = GetShard(name);
+	ScopedLock lock(shard.lock);
+	
+	Object object;
+	object.size = std::max(size,0);
+	object.size_class = SlabAllocator::GetSizeClass(object.size);
+	object.data = object.size_class < 0 ? new char[object.size] : shard.allocator.Allocate(object.size_class);
+	memcpy(object.data,data,object.size);
+	
+	std::pair<ObjectMap::iterator,bool> inserted = shard.objects.insert(std::make_pair(name,object));
+	if(!inserted.second) {
+		shard.Release(inserted.first->second);
+		inserted.first->second = object;
+	}
+	shard.bytes += object.size;
+}
+
+void MemoryDataStore::GetObject(const std::string& name,void *data,int size) const
+{
+	GetObjectRange(name,data,0,size);
+}
+
+void MemoryDataStore::GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	Shard& shard = GetShard(name);
+	ScopedLock lock(shard.lock);
+	ObjectMap::const_iterator it = shard.objects.find(name);
+	if(it == shard.objects.end()) throw FileNotFoundException(name + ": No such object");
+	
+	// like a file, reading past the end returns what there is
+	if(offset < (uint64_t)it->second.size) {
+		memcpy(data,it->second.data + offset,std::min<uint64_t>(size,it->second.size - offset));
+	}
+}
+
+ObjectViewPtr MemoryDataStore::GetObjectView(const std::string& name,int size) const
+{
+	// a copy, the chunk is reused once the object is rewritten or deleted
+	Shard& shard = GetShard(name);
+	ScopedLock lock(shard.lock);
+	ObjectMap::const_iterator it = shard.objects.find(name);
+	if(it == shard.objects.end()) throw FileNotFoundException(name + ": No such object");
+	
+	BufferObjectView *view = new BufferObjectView(std::min(size,it->second.size));
+	ObjectViewPtr ptr(view);
+	memcpy(view->GetBuffer(),it->second.data,view->GetSize());
+	return ptr;
+}
+
+void MemoryDataStore::DeleteObject(const std::string& name)
+{
+	Shard& shard = GetShard(name);
+	ScopedLock lock(shard.lock);
+	ObjectMap::iterator it = shard.objects.find(name);
+	if(it == shard.objects.end()) throw FileNotFoundException(name + ": No such object");
+	shard.Release(it->second);
+	shard.objects.erase(it);
+}
+
+void MemoryDataStore::ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const
+{
+	// names are taken a shard at a time, the list function may delete what it is given
+	std::vector<std::string> names;
+	for(std::vector<Shard *>::const_iterator it = m_shards.begin(); it != m_shards.end(); ++it) {
+		names.clear();
+		{
+			ScopedLock lock((*it)->lock);
+			for(ObjectMap::const_iterator object = (*it)->objects.begin(); object != (*it)->objects.end(); ++object) {
+				names.push_back(object->first);
+			}
+		}
+		for(std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); ++name) {
+			list_function(*name,userdata);
+		}
+	}
+}
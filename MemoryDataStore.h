@@ -0,0 +1,128 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_MemoryDataStore_h
+#define __cloudblockfs_MemoryDataStore_h
+
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * A data store which keeps objects in memory, for benchmarks and tests
+	 * which should measure or exercise the code above the store rather than
+	 * file I/O. Nothing survives the store.
+	 *
+	 * Objects are spread over shards by a hash of their name, each with a
+	 * lock and a hash map of its own, so operations on different objects
+	 * rarely wait for each other. Object data is carved out of slabs, one
+	 * set of slabs per power of two size up to 64KB, and freed chunks are
+	 * reused by the next object of their size. Larger objects are
+	 * allocated on their own.
+	 */
+	class MemoryDataStore : public DataStore
+	{
+	public:
+		struct Stats
+		{
+			uint64_t objects;
+			uint64_t bytes; // sum of object sizes
+			uint64_t slab_bytes; // memory taken by slabs
+		};
+	private:
+		/**
+		 * Hands out chunks of power of two sizes from slabs. Not thread-safe,
+		 * each shard has its own.
+		 */
+		class SlabAllocator
+		{
+		private:
+			struct SizeClass
+			{
+				std::vector<char *> free; // chunks given back
+				char *next; // next unused chunk in the newest slab
+				char *end;
+			};
+			std::vector<SizeClass> m_classes;
+			std::vector<char *> m_slabs;
+			uint64_t m_slab_bytes;
+			
+			SlabAllocator(const SlabAllocator&);
+			SlabAllocator& operator =(const SlabAllocator&);
+		public:
+			SlabAllocator();
+			~SlabAllocator();
+			
+			/**
+			 * Returns the size class for an allocation, -1 if it is too large for a slab.
+			 */
+			static int GetSizeClass(int size);
+			
+			char *Allocate(int size_class);
+			void Free(char *chunk,int size_class);
+			uint64_t GetSlabBytes() const { return m_slab_bytes; }
+		};
+		
+		struct Object
+		{
+			char *data;
+			int size;
+			int size_class; // -1 if allocated on its own
+		};
+		typedef std::tr1::unordered_map<std::string,Object> ObjectMap;
+		
+		struct Shard
+		{
+			Mutex lock;
+			ObjectMap objects;
+			SlabAllocator allocator;
+			uint64_t bytes;
+			
+			Shard() : bytes(0) { }
+			void Release(const Object& object);
+		};
+		
+		std::vector<Shard *> m_shards;
+		
+		MemoryDataStore(const MemoryDataStore&);
+		MemoryDataStore& operator =(const MemoryDataStore&);
+		
+		Shard& GetShard(const std::string& name) const;
+	public:
+		/**
+		 * @param shards Number of independently locked shards.
+		 */
+		MemoryDataStore(int shards = 64);
+		virtual ~MemoryDataStore();
+		
+		void GetStats(Stats *out_stats) const;
+		
+		virtual void PutObject(const std::string& name,const void *data,int size);
+		virtual void GetObject(const std::string& name,void *data,int size) const;
+		virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const;
+		virtual ObjectViewPtr GetObjectView(const std::string& name,int size) const;
+		virtual void DeleteObject(const std::string& name);
+		virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const;
+		virtual void Flush() { }
+	};
+}
+
+#endif
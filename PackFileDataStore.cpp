@@ -0,0 +1,806 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Exception.h"
+#include "PackFileDataStore.h"
+
+using namespace cloudblockfs;
+
+static const char record_magic[4] = { 'C', 'B', 'P', 'R' };
+static const char index_magic[4] = { 'C', 'B', 'P', 'I' };
+
+// set on records which delete an object
+#define RECORD_TOMBSTONE 1
+
+// longest name a record may have, anything longer is taken for garbage when scanning
+#define MAX_NAME_SIZE 4096
+
+// appends are written out once this many bytes have gathered
+#define WRITE_BATCH_SIZE (1024 * 1024)
+
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_COMPACTION_THRESHOLD 50
+
+// buckets in a new index, and the share of them which may be taken before it grows
+#define INITIAL_BUCKET_COUNT 65536
+#define MAX_LOAD_PERCENT 70
+
+// milliseconds between looks for segments to compact
+#define COMPACTION_INTERVAL 10000
+
+// bytes read at a time when scanning a segment
+#define SCAN_BUFFER_SIZE (1024 * 1024)
+
+static void WriteFully(int fd,const void *data,size_t size,uint64_t offset,const std::string& name)
+{
+	const char *p = (const char *)data;
+	while(size) {
+		const ssize_t written = pwrite(fd,p,size,offset);
+		if(written < 0) {
+			if(errno == EINTR) continue;
+			throw WriteErrorException(name + ": " + strerror(errno));
+		}
+		p += written;
+		size -= written;
+		offset += written;
+	}
+}
+
+// reads up to size bytes, fewer only at the end of the file
+static size_t ReadFully(int fd,void *data,size_t size,uint64_t offset,const std::string& name)
+{
+	char *p = (char *)data;
+	size_t total = 0;
+	while(total < size) {
+		const ssize_t bytes = pread(fd,p + total,size - total,offset + total);
+		if(bytes < 0) {
+			if(errno == EINTR) continue;
+			throw ReadErrorException(name + ": " + strerror(errno));
+		}
+		if(!bytes) break;
+		total += bytes;
+	}
+	return total;
+}
+
+// FNV-1a
+static uint64_t Hash(uint64_t hash,const void *data,size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	for(size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Reads the records of a segment in order. Stops at the end of the file
+ * or at the first record which is cut short or damaged.
+ */
+class PackFileDataStore::RecordScanner
+{
+private:
+	int m_fd;
+	std::vector<char> m_buffer;
+	uint64_t m_buffer_start; // file offset of the buffer
+	size_t m_buffer_size; // bytes held
+	uint64_t m_offset; // of the next record
+	
+	// gets size bytes from the next record into the buffer
+	bool Fill(size_t size) {
+		if(m_offset + size <= m_buffer_start + m_buffer_size) return true;
+		if(m_buffer.size() < size) m_buffer.resize(size);
+		m_buffer_start = m_offset;
+		m_buffer_size = ReadFully(m_fd,&m_buffer[0],m_buffer.size(),m_offset,"segment");
+		return size <= m_buffer_size;
+	}
+public:
+	RecordScanner(int fd) : m_fd(fd), m_buffer(SCAN_BUFFER_SIZE), m_buffer_start(0), m_buffer_size(0), m_offset(0) { }
+	
+	/**
+	 * Returns the offset after the last record read.
+	 */
+	uint64_t GetOffset() const { return m_offset; }
+	
+	/**
+	 * Reads the next record. The name and data point into the scanner's
+	 * buffer and stay valid until the next call.
+	 * @return False if there are no more good records.
+	 */
+	bool Next(RecordHeader *out_header,const char **out_name,const char **out_data,uint64_t *out_offset) {
+		if(!Fill(sizeof(RecordHeader))) return false;
+		memcpy(out_header,&m_buffer[m_offset - m_buffer_start],sizeof(RecordHeader));
+		if(memcmp(out_header->magic,record_magic,sizeof(record_magic)) || out_header->name_size > MAX_NAME_SIZE) return false;
+		
+		// the check covers the header and the name, so the data size can be trusted after it
+		if(!Fill(sizeof(RecordHeader) + out_header->name_size)) return false;
+		if(CheckRecord(*out_header,&m_buffer[m_offset - m_buffer_start + sizeof(RecordHeader)]) != out_header->check) return false;
+		const size_t size = sizeof(RecordHeader) + out_header->name_size + out_header->data_size;
+		if(!Fill(size)) return false;
+		
+		*out_name = &m_buffer[m_offset - m_buffer_start + sizeof(RecordHeader)];
+		*out_data = *out_name + out_header->name_size;
+		*out_offset = m_offset;
+		m_offset += size;
+		return true;
+	}
+};
+
+PackFileDataStore::SegmentFile::~SegmentFile()
+{
+	close(fd);
+}
+
+PackFileDataStore::PackFileDataStore(const std::string& path) : m_path(path), m_dir_fd(-1), m_index_fd(-1), m_index(NULL),
+	m_buckets(NULL), m_index_size(0), m_active(0), m_buffer_offset(~0ULL), m_segment_size(DEFAULT_SEGMENT_SIZE),
+	m_compaction_threshold(DEFAULT_COMPACTION_THRESHOLD), m_batches_written(0), m_segments_compacted(0), m_shutdown(false)
+{
+	m_dir_fd = open(path.c_str(),O_RDONLY);
+	if(m_dir_fd < 0) throw FileIOException(path + ": " + strerror(errno));
+	if(flock(m_dir_fd,LOCK_EX | LOCK_NB) != 0) {
+		close(m_dir_fd);
+		throw FileIOException(path + ": Store is open elsewhere.");
+	}
+	
+	try {
+		OpenSegments();
+		OpenIndex();
+		
+		// carry on appending to the newest segment unless it is full
+		if(m_segments.empty() || m_segments.rbegin()->second.size >= m_segment_size) {
+			StartSegment();
+		} else {
+			m_active = m_segments.rbegin()->first;
+			m_buffer_offset = m_segments.rbegin()->second.size;
+		}
+	} catch(...) {
+		UnmapIndex();
+		m_segments.clear();
+		close(m_dir_fd);
+		throw;
+	}
+	
+	m_compactor.reset(new Thread(CompactorThread,this));
+}
+
+PackFileDataStore::~PackFileDataStore()
+{
+	{
+		ScopedLock lock(m_lock);
+		m_shutdown = true;
+		m_compact_cond.Broadcast();
+	}
+	m_compactor.reset();
+	
+	try {
+		Flush();
+	} catch(const std::runtime_error& ) {
+		// the index stays unclean and is rebuilt on the next open
+	}
+	UnmapIndex();
+	m_segments.clear();
+	close(m_dir_fd);
+}
+
+uint64_t PackFileDataStore::HashName(const std::string& name)
+{
+	// 0 and 1 mark free and removed buckets
+	const uint64_t hash = Hash(0xCBF29CE484222325ULL,name.data(),name.size());
+	return hash < 2 ? hash + 2 : hash;
+}
+
+uint64_t PackFileDataStore::CheckRecord(const RecordHeader& header,const char *name)
+{
+	const uint64_t hash = Hash(0xCBF29CE484222325ULL,&header,offsetof(RecordHeader,check));
+	return Hash(hash,name,header.name_size);
+}
+
+std::string PackFileDataStore::GetSegmentPath(uint32_t id) const
+{
+	char name[32];
+	sprintf(name,"/%.8X.pack",id);
+	return m_path + name;
+}
+
+void PackFileDataStore::OpenSegments()
+{
+	DIR *dirp = opendir(m_path.c_str());
+	if(!dirp) throw FileIOException(m_path + ": " + strerror(errno));
+	
+	struct dirent *dp;
+	while((dp = readdir(dirp)) != NULL) {
+		unsigned int id;
+		char suffix[8];
+		if(strlen(dp->d_name) != 13 || sscanf(dp->d_name,"%8X%5s",&id,suffix) != 2 || strcmp(suffix,".pack")) continue;
+		
+		const int fd = open(GetSegmentPath(id).c_str(),O_RDWR);
+		if(fd < 0) {
+			closedir(dirp);
+			throw FileIOException(GetSegmentPath(id) + ": " + strerror(errno));
+		}
+		struct stat st;
+		fstat(fd,&st);
+		Segment& segment = m_segments[id];
+		segment.file.reset(new SegmentFile(fd));
+		segment.size = st.st_size;
+		segment.live = 0;
+	}
+	closedir(dirp);
+}
+
+void PackFileDataStore::OpenIndex()
+{
+	const std::string path = m_path + "/index";
+	const int fd = open(path.c_str(),O_RDWR | O_CREAT,0600);
+	if(fd < 0) throw FileIOException(path + ": " + strerror(errno));
+	
+	struct stat st;
+	IndexHeader header;
+	memset(&header,0,sizeof(header));
+	fstat(fd,&st);
+	ReadFully(fd,&header,sizeof(header),0,path);
+	
+	if(!memcmp(header.magic,index_magic,sizeof(index_magic)) && header.clean &&
+	   (uint64_t)st.st_size == sizeof(IndexHeader) + header.bucket_count * sizeof(Bucket)) {
+		MapIndex(fd,header.bucket_count,false);
+		
+		// the live bytes of each segment are what the index points to
+		bool consistent = true;
+		for(uint64_t i = 0; i < m_index->bucket_count && consistent; i++) {
+			const Bucket& bucket = m_buckets[i];
+			if(bucket.hash < 2) continue;
+			SegmentMap::iterator it = m_segments.find(bucket.segment);
+			consistent = it != m_segments.end() && bucket.offset + bucket.size <= it->second.size;
+			if(consistent) it->second.live += bucket.size;
+		}
+		if(consistent) return;
+	} else {
+		close(fd);
+	}
+	Rebuild();
+}
+
+void PackFileDataStore::MapIndex(int fd,uint64_t bucket_count,bool create)
+{
+	const size_t size = sizeof(IndexHeader) + bucket_count * sizeof(Bucket);
+	if(create && ftruncate(fd,size) != 0) {
+		close(fd);
+		throw FileIOException(m_path + "/index: " + strerror(errno));
+	}
+	void *mapping = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if(mapping == MAP_FAILED) {
+		close(fd);
+		throw FileIOException(m_path + "/index: " + strerror(errno));
+	}
+	
+	UnmapIndex();
+	m_index_fd = fd;
+	m_index = (IndexHeader *)mapping;
+	m_buckets = (Bucket *)(m_index + 1);
+	m_index_size = size;
+	if(create) {
+		// the file was zero filled, so every bucket is free
+		memcpy(m_index->magic,index_magic,sizeof(index_magic));
+		m_index->clean = 0;
+		m_index->bucket_count = bucket_count;
+	}
+}
+
+void PackFileDataStore::UnmapIndex()
+{
+	if(m_index) munmap(m_index,m_index_size);
+	if(m_index_fd >= 0) close(m_index_fd);
+	m_index = NULL;
+	m_buckets = NULL;
+	m_index_fd = -1;
+}
+
+void PackFileDataStore::Rebuild()
+{
+	const std::string path = m_path + "/index";
+	const int fd = open(path.c_str(),O_RDWR | O_CREAT | O_TRUNC,0600);
+	if(fd < 0) throw FileIOException(path + ": " + strerror(errno));
+	MapIndex(fd,INITIAL_BUCKET_COUNT,true);
+	
+	// replay every record, oldest segment first, so the latest version of an object wins
+	for(SegmentMap::iterator it = m_segments.begin(); it != m_segments.end(); ++it) it->second.live = 0;
+	for(SegmentMap::iterator it = m_segments.begin(); it != m_segments.end(); ++it) {
+		RecordScanner scanner(it->second.file->fd);
+		RecordHeader header;
+		const char *name, *data;
+		uint64_t offset;
+		while(scanner.Next(&header,&name,&data,&offset)) {
+			const std::string object(name,header.name_size);
+			const uint64_t hash = HashName(object);
+			Bucket *bucket = FindBucket(object,hash,true);
+			if(bucket) Remove(bucket);
+			if(!(header.flags & RECORD_TOMBSTONE)) {
+				Insert(hash,it->first,offset,sizeof(RecordHeader) + header.name_size + header.data_size);
+			}
+		}
+		
+		// a record cut short by a crash is dropped so appends carry on after the last good one
+		if(scanner.GetOffset() < it->second.size) {
+			if(ftruncate(it->second.file->fd,scanner.GetOffset()) != 0) {
+				throw FileIOException(GetSegmentPath(it->first) + ": " + strerror(errno));
+			}
+			it->second.size = scanner.GetOffset();
+		}
+	}
+}
+
+void PackFileDataStore::Resize(uint64_t bucket_count)
+{
+	// build the new table beside the old one and move it into place
+	const std::string path = m_path + "/index.new";
+	const int fd = open(path.c_str(),O_RDWR | O_CREAT | O_TRUNC,0600);
+	if(fd < 0) throw FileIOException(path + ": " + strerror(errno));
+	const size_t size = sizeof(IndexHeader) + bucket_count * sizeof(Bucket);
+	if(ftruncate(fd,size) != 0) {
+		close(fd);
+		throw FileIOException(path + ": " + strerror(errno));
+	}
+	void *mapping = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if(mapping == MAP_FAILED) {
+		close(fd);
+		throw FileIOException(path + ": " + strerror(errno));
+	}
+	
+	IndexHeader *index = (IndexHeader *)mapping;
+	Bucket *buckets = (Bucket *)(index + 1);
+	memcpy(index->magic,index_magic,sizeof(index_magic));
+	index->clean = 0;
+	index->bucket_count = bucket_count;
+	for(uint64_t i = 0; i < m_index->bucket_count; i++) {
+		if(m_buckets[i].hash < 2) continue;
+		uint64_t j = m_buckets[i].hash % bucket_count;
+		while(buckets[j].hash) j = (j + 1) % bucket_count;
+		buckets[j] = m_buckets[i];
+		index->used++;
+	}
+	
+	if(rename(path.c_str(),(m_path + "/index").c_str()) != 0) {
+		munmap(mapping,size);
+		close(fd);
+		throw FileIOException(path + ": " + strerror(errno));
+	}
+	UnmapIndex();
+	m_index_fd = fd;
+	m_index = index;
+	m_buckets = buckets;
+	m_index_size = size;
+}
+
+void PackFileDataStore::MarkDirty()
+{
+	// the flag must be on disk before any bucket it vouches for changes
+	if(m_index->clean) {
+		m_index->clean = 0;
+		msync(m_index,sizeof(IndexHeader),MS_SYNC);
+	}
+}
+
+PackFileDataStore::Bucket *PackFileDataStore::FindBucket(const std::string& name,uint64_t hash,bool verify) const
+{
+	const uint64_t count = m_index->bucket_count;
+	std::string stored;
+	for(uint64_t i = hash % count, n = 0; n < count; i = (i + 1) % count, n++) {
+		Bucket& bucket = m_buckets[i];
+		if(!bucket.hash) break;
+		if(bucket.hash != hash) continue;
+		if(!verify || (ReadName(bucket,stored) && stored == name)) return &bucket;
+	}
+	return NULL;
+}
+
+bool PackFileDataStore::ReadName(const Bucket& bucket,std::string& out_name) const
+{
+	// most names fit in one read along with the header
+	char record[sizeof(RecordHeader) + 64];
+	size_t size;
+	if(bucket.segment == m_active && bucket.offset >= m_buffer_offset) {
+		size = std::min<uint64_t>(sizeof(record),bucket.size);
+		memcpy(record,&m_buffer[bucket.offset - m_buffer_offset],size);
+	} else {
+		SegmentMap::const_iterator it = m_segments.find(bucket.segment);
+		if(it == m_segments.end()) return false;
+		size = ReadFully(it->second.file->fd,record,std::min<uint64_t>(sizeof(record),bucket.size),bucket.offset,GetSegmentPath(bucket.segment));
+	}
+	if(size < sizeof(RecordHeader)) return false;
+	
+	RecordHeader header;
+	memcpy(&header,record,sizeof(header));
+	if(sizeof(RecordHeader) + header.name_size <= size) {
+		out_name.assign(record + sizeof(RecordHeader),header.name_size);
+		return true;
+	}
+	
+	std::vector<char> name(header.name_size);
+	SegmentMap::const_iterator it = m_segments.find(bucket.segment);
+	if(bucket.segment == m_active && bucket.offset >= m_buffer_offset) {
+		memcpy(&name[0],&m_buffer[bucket.offset - m_buffer_offset + sizeof(RecordHeader)],name.size());
+	} else if(ReadFully(it->second.file->fd,&name[0],name.size(),bucket.offset + sizeof(RecordHeader),GetSegmentPath(bucket.segment)) != name.size()) {
+		return false;
+	}
+	out_name.assign(name.begin(),name.end());
+	return true;
+}
+
+void PackFileDataStore::Insert(uint64_t hash,uint32_t segment,uint64_t offset,uint32_t size)
+{
+	// grow well before probes get long, which also clears out removed buckets
+	if((m_index->used + m_index->removed + 1) * 100 > m_index->bucket_count * MAX_LOAD_PERCENT) {
+		uint64_t count = m_index->bucket_count;
+		while((m_index->used + 1) * 100 > count * MAX_LOAD_PERCENT / 2) count *= 2;
+		Resize(count);
+	}
+	
+	const uint64_t count = m_index->bucket_count;
+	uint64_t i = hash % count;
+	while(m_buckets[i].hash >= 2) i = (i + 1) % count;
+	if(m_buckets[i].hash) m_index->removed--;
+	m_buckets[i].hash = hash;
+	m_buckets[i].segment = segment;
+	m_buckets[i].offset = offset;
+	m_buckets[i].size = size;
+	m_index->used++;
+	m_segments[segment].live += size;
+}
+
+void PackFileDataStore::Remove(Bucket *bucket)
+{
+	m_segments[bucket->segment].live -= bucket->size;
+	bucket->hash = 1;
+	m_index->used--;
+	m_index->removed++;
+}
+
+void PackFileDataStore::Append(const std::string& name,uint32_t flags,const void *data,uint32_t size,uint32_t *out_segment,uint64_t *out_offset)
+{
+	const uint64_t record_size = sizeof(RecordHeader) + name.size() + size;
+	if(m_segments[m_active].size && m_segments[m_active].size + record_size > m_segment_size) StartSegment();
+	
+	RecordHeader header;
+	memcpy(header.magic,record_magic,sizeof(record_magic));
+	header.flags = flags;
+	header.name_size = name.size();
+	header.data_size = size;
+	header.check = CheckRecord(header,name.data());
+	
+	Segment& segment = m_segments[m_active];
+	*out_segment = m_active;
+	*out_offset = segment.size;
+	m_buffer.insert(m_buffer.end(),(const char *)&header,(const char *)(&header + 1));
+	m_buffer.insert(m_buffer.end(),name.begin(),name.end());
+	m_buffer.insert(m_buffer.end(),(const char *)data,(const char *)data + size);
+	segment.size += record_size;
+	
+	if(m_buffer.size() >= WRITE_BATCH_SIZE) WriteBuffer();
+}
+
+void PackFileDataStore::WriteBuffer()
+{
+	if(m_buffer.empty()) return;
+	
+	// a failed write keeps the buffer, which is retried on the next one
+	WriteFully(m_segments[m_active].file->fd,&m_buffer[0],m_buffer.size(),m_buffer_offset,GetSegmentPath(m_active));
+	m_unsynced.insert(m_active);
+	m_buffer_offset += m_buffer.size();
+	m_buffer.clear();
+	m_batches_written++;
+}
+
+void PackFileDataStore::StartSegment()
+{
+	WriteBuffer();
+	
+	const uint32_t id = m_segments.empty() ? 0 : m_segments.rbegin()->first + 1;
+	const int fd = open(GetSegmentPath(id).c_str(),O_RDWR | O_CREAT | O_TRUNC,0600);
+	if(fd < 0) throw FileIOException(GetSegmentPath(id) + ": " + strerror(errno));
+	
+	Segment& segment = m_segments[id];
+	segment.file.reset(new SegmentFile(fd));
+	segment.size = 0;
+	segment.live = 0;
+	m_active = id;
+	m_buffer_offset = 0;
+}
+
+void PackFileDataStore::SyncSegments()
+{
+	WriteBuffer();
+	while(!m_unsynced.empty()) {
+		SegmentMap::iterator it = m_segments.find(*m_unsynced.begin());
+		if(it != m_segments.end() && fsync(it->second.file->fd) != 0) {
+			throw WriteErrorException(GetSegmentPath(it->first) + ": " + strerror(errno));
+		}
+		m_unsynced.erase(m_unsynced.begin());
+	}
+}
+
+void PackFileDataStore::PutObject(const std::string& name,const void *data,int size)
+{
+	if(size < 0) throw InvalidArgumentException(name + ": Object size must be given.");
+	const uint64_t hash = HashName(name);
+	
+	ScopedLock lock(m_lock);
+	MarkDirty();
+	uint32_t segment;
+	uint64_t offset;
+	Append(name,0,data,size,&segment,&offset);
+	
+	const uint32_t record_size = sizeof(RecordHeader) + name.size() + size;
+	Bucket *bucket = FindBucket(name,hash,true);
+	if(bucket) {
+		m_segments[bucket->segment].live -= bucket->size;
+		m_segments[segment].live += record_size;
+		bucket->segment = segment;
+		bucket->offset = offset;
+		bucket->size = record_size;
+	} else {
+		Insert(hash,segment,offset,record_size);
+	}
+}
+
+void PackFileDataStore::GetObject(const std::string& name,void *data,int size) const
+{
+	ReadObject(name,data,0,size);
+}
+
+void PackFileDataStore::GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	ReadObject(name,data,offset,size);
+}
+
+void PackFileDataStore::ReadObject(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	const uint64_t hash = HashName(name);
+	const size_t head_size = sizeof(RecordHeader) + name.size();
+	std::vector<char> head, range;
+	
+	// The record is read without the lock, the name in it shows whether
+	// the bucket was the object's. Only after a hash collision are names
+	// checked while probing.
+	for(int attempt = 0; attempt < 2; attempt++) {
+		Bucket bucket;
+		SegmentFilePtr file;
+		uint64_t start, length;
+		{
+			ScopedLock lock(m_lock);
+			const Bucket *found = FindBucket(name,hash,attempt > 0);
+			if(!found) throw FileNotFoundException(name + ": No such object.");
+			bucket = *found;
+			
+			// the part of the data asked for which the object has
+			const uint64_t data_size = bucket.size > head_size ? bucket.size - head_size : 0;
+			start = std::min(offset,data_size);
+			length = size >= 0 ? std::min<uint64_t>(size,data_size - start) : data_size - start;
+			
+			head.resize(std::min<uint64_t>(head_size,bucket.size));
+			range.resize(length);
+			if(bucket.segment == m_active && bucket.offset >= m_buffer_offset) {
+				const char *record = &m_buffer[bucket.offset - m_buffer_offset];
+				memcpy(&head[0],record,head.size());
+				if(length) memcpy(&range[0],record + head_size + start,length);
+			} else {
+				file = m_segments.find(bucket.segment)->second.file;
+			}
+		}
+		if(file) {
+			const std::string path = GetSegmentPath(bucket.segment);
+			if(ReadFully(file->fd,&head[0],head.size(),bucket.offset,path) != head.size() ||
+			   (length && ReadFully(file->fd,&range[0],length,bucket.offset + head_size + start,path) != length)) {
+				throw ReadErrorException(name + ": Segment is cut short.");
+			}
+		}
+		
+		RecordHeader header;
+		memcpy(&header,&head[0],sizeof(header));
+		if(header.name_size == name.size() && !memcmp(&head[sizeof(RecordHeader)],name.data(),name.size())) {
+			if(length) memcpy(data,&range[0],length);
+			return;
+		}
+	}
+	throw ReadErrorException(name + ": Index does not match the segments.");
+}
+
+void PackFileDataStore::DeleteObject(const std::string& name)
+{
+	const uint64_t hash = HashName(name);
+	
+	ScopedLock lock(m_lock);
+	Bucket *bucket = FindBucket(name,hash,true);
+	if(!bucket) throw FileNotFoundException(name + ": No such object.");
+	
+	// the tombstone keeps a rebuilt index from bringing the object back
+	MarkDirty();
+	uint32_t segment;
+	uint64_t offset;
+	Append(name,RECORD_TOMBSTONE,NULL,0,&segment,&offset);
+	Remove(bucket);
+}
+
+// orders buckets by where their records are, so names are read in file order
+static bool CompareLocations(const std::pair<uint32_t,uint64_t>& a,const std::pair<uint32_t,uint64_t>& b)
+{
+	return a < b;
+}
+
+void PackFileDataStore::ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const
+{
+	// names are gathered first, the callback may well call back into the store
+	std::vector<std::string> names;
+	{
+		ScopedLock lock(m_lock);
+		std::vector<std::pair<uint32_t,uint64_t> > locations;
+		std::map<std::pair<uint32_t,uint64_t>,const Bucket *> buckets;
+		for(uint64_t i = 0; i < m_index->bucket_count; i++) {
+			if(m_buckets[i].hash < 2) continue;
+			const std::pair<uint32_t,uint64_t> location(m_buckets[i].segment,m_buckets[i].offset);
+			locations.push_back(location);
+			buckets[location] = &m_buckets[i];
+		}
+		std::sort(locations.begin(),locations.end(),CompareLocations);
+		
+		std::string name;
+		for(size_t i = 0; i < locations.size(); i++) {
+			if(ReadName(*buckets[locations[i]],name)) names.push_back(name);
+		}
+	}
+	
+	for(std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+		list_function(*it,userdata);
+	}
+}
+
+void PackFileDataStore::Flush()
+{
+	ScopedLock lock(m_lock);
+	
+	// the segments go first so a clean index never points past what is on disk
+	SyncSegments();
+	if(!m_index->clean) {
+		msync(m_index,m_index_size,MS_SYNC);
+		m_index->clean = 1;
+		msync(m_index,sizeof(IndexHeader),MS_SYNC);
+	}
+}
+
+void PackFileDataStore::GetStats(Stats *out_stats) const
+{
+	ScopedLock lock(m_lock);
+	memset(out_stats,0,sizeof(Stats));
+	out_stats->objects = m_index->used;
+	out_stats->segments = m_segments.size();
+	for(SegmentMap::const_iterator it = m_segments.begin(); it != m_segments.end(); ++it) {
+		out_stats->live_bytes += it->second.live;
+		out_stats->total_bytes += it->second.size;
+	}
+	out_stats->batches_written = m_batches_written;
+	out_stats->segments_compacted = m_segments_compacted;
+}
+
+int PackFileDataStore::Compact()
+{
+	std::vector<uint32_t> candidates;
+	{
+		ScopedLock lock(m_lock);
+		for(SegmentMap::const_iterator it = m_segments.begin(); it != m_segments.end(); ++it) {
+			if(it->first != m_active && it->second.live * 100 < it->second.size * m_compaction_threshold) {
+				candidates.push_back(it->first);
+			}
+		}
+	}
+	
+	int compacted = 0;
+	for(std::vector<uint32_t>::const_iterator it = candidates.begin(); it != candidates.end(); ++it) {
+		{
+			ScopedLock lock(m_lock);
+			if(m_shutdown) break;
+		}
+		if(CompactSegment(*it)) compacted++;
+	}
+	return compacted;
+}
+
+bool PackFileDataStore::CompactSegment(uint32_t id)
+{
+	SegmentFilePtr file;
+	uint64_t size;
+	{
+		ScopedLock lock(m_lock);
+		SegmentMap::const_iterator it = m_segments.find(id);
+		if(it == m_segments.end() || id == m_active) return false;
+		file = it->second.file;
+		size = it->second.size;
+	}
+	
+	// nothing is appended to the segment any more, so it is read without the lock
+	RecordScanner scanner(file->fd);
+	RecordHeader header;
+	const char *name, *data;
+	uint64_t offset;
+	while(scanner.Next(&header,&name,&data,&offset)) {
+		const std::string object(name,header.name_size);
+		const uint64_t hash = HashName(object);
+		
+		ScopedLock lock(m_lock);
+		Bucket *bucket = FindBucket(object,hash,true);
+		uint32_t new_segment;
+		uint64_t new_offset;
+		if(header.flags & RECORD_TOMBSTONE) {
+			// still needed while an older segment may hold the object
+			if(!bucket && m_segments.begin()->first < id) {
+				MarkDirty();
+				Append(object,RECORD_TOMBSTONE,NULL,0,&new_segment,&new_offset);
+			}
+		} else if(bucket && bucket->segment == id && bucket->offset == offset) {
+			MarkDirty();
+			Append(object,0,data,header.data_size,&new_segment,&new_offset);
+			m_segments[id].live -= bucket->size;
+			m_segments[new_segment].live += bucket->size;
+			bucket->segment = new_segment;
+			bucket->offset = new_offset;
+		}
+	}
+	
+	// keep a segment which could not be read through, it may hold live records
+	if(scanner.GetOffset() != size) return false;
+	
+	// the copies must be on disk before the originals go, unless another pass got there first
+	ScopedLock lock(m_lock);
+	if(m_segments.find(id) == m_segments.end()) return false;
+	SyncSegments();
+	if(unlink(GetSegmentPath(id).c_str()) != 0) {
+		throw FileIOException(GetSegmentPath(id) + ": " + strerror(errno));
+	}
+	m_segments.erase(id);
+	m_segments_compacted++;
+	return true;
+}
+
+void PackFileDataStore::CompactorThread(void *userdata)
+{
+	PackFileDataStore *store = (PackFileDataStore *)userdata;
+	
+	store->m_lock.Lock();
+	while(!store->m_shutdown) {
+		store->m_compact_cond.TimedWait(store->m_lock,COMPACTION_INTERVAL);
+		if(store->m_shutdown) break;
+		
+		store->m_lock.Unlock();
+		try {
+			store->Compact();
+		} catch(const std::runtime_error& ) {
+			// the segment is left as it is and tried again on the next pass
+		}
+		store->m_lock.Lock();
+	}
+	store->m_lock.Unlock();
+}
@@ -0,0 +1,203 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_PackFileDataStore_h
+#define __cloudblockfs_PackFileDataStore_h
+
+#include <inttypes.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * A data store which packs objects into a few large segment files
+	 * instead of keeping one file per object.
+	 *
+	 * Objects are appended to the newest segment as records holding the
+	 * name and the data. Appends are gathered in memory and written with a
+	 * single pwrite once a batch fills up or on Flush(). Deleting appends a
+	 * small tombstone. The index is a file mapped into memory holding an
+	 * open addressing hash table from a hash of each name to its record;
+	 * the name kept in the record settles hash collisions.
+	 *
+	 * Records which were overwritten or deleted are garbage. The live bytes
+	 * of each segment are counted, and a background thread copies the live
+	 * records out of segments which are mostly garbage and removes them.
+	 *
+	 * The index is marked clean on Flush() and when the store is closed. An
+	 * index found unclean on opening is rebuilt by scanning the segments,
+	 * oldest first, and a record cut short at the end of a segment is
+	 * dropped. A directory can only be open in one store at a time.
+	 */
+	class PackFileDataStore : public DataStore
+	{
+	public:
+		struct Stats
+		{
+			uint64_t objects;
+			uint64_t segments;
+			uint64_t live_bytes; // bytes of the records the index points to
+			uint64_t total_bytes; // bytes of all segments
+			uint64_t batches_written; // pwrite calls made for appends
+			uint64_t segments_compacted;
+		};
+	private:
+		// an open segment file, closed once the last reader lets go of it
+		struct SegmentFile
+		{
+			int fd;
+			SegmentFile(int fd) : fd(fd) { }
+			~SegmentFile();
+		};
+		typedef std::tr1::shared_ptr<SegmentFile> SegmentFilePtr;
+		
+		struct Segment
+		{
+			SegmentFilePtr file;
+			uint64_t size; // bytes appended, including those not written yet
+			uint64_t live; // bytes of the records the index points to
+		};
+		typedef std::map<uint32_t,Segment> SegmentMap;
+		
+		class RecordScanner;
+		
+		struct RecordHeader
+		{
+			char magic[4];
+			uint32_t flags;
+			uint32_t name_size;
+			uint32_t data_size;
+			uint64_t check; // hash of the fields above and the name
+		};
+		
+		struct IndexHeader
+		{
+			char magic[4];
+			uint32_t clean; // 0 while the buckets may differ from the segments
+			uint64_t bucket_count;
+			uint64_t used; // buckets holding an object
+			uint64_t removed; // buckets freed by a deletion, which do not end a probe
+		};
+		
+		// A hash of 0 marks a free bucket and 1 a removed one
+		struct Bucket
+		{
+			uint64_t hash;
+			uint64_t offset; // of the record
+			uint32_t segment;
+			uint32_t size; // of the record
+		};
+		
+		std::string m_path;
+		int m_dir_fd; // locked while the store is open
+		
+		mutable Mutex m_lock; // guards everything below
+		int m_index_fd;
+		IndexHeader *m_index;
+		Bucket *m_buckets;
+		size_t m_index_size; // bytes mapped
+		SegmentMap m_segments;
+		uint32_t m_active; // segment appended to
+		std::vector<char> m_buffer; // appends not written yet
+		uint64_t m_buffer_offset; // offset in the active segment the buffer goes to
+		std::set<uint32_t> m_unsynced; // segments written since the last Flush()
+		uint64_t m_segment_size;
+		int m_compaction_threshold; // percent
+		uint64_t m_batches_written;
+		uint64_t m_segments_compacted;
+		
+		bool m_shutdown;
+		Condition m_compact_cond;
+		std::auto_ptr<Thread> m_compactor;
+		
+		PackFileDataStore(const PackFileDataStore&);
+		PackFileDataStore& operator =(const PackFileDataStore&);
+		
+		static uint64_t HashName(const std::string& name);
+		static uint64_t CheckRecord(const RecordHeader& header,const char *name);
+		std::string GetSegmentPath(uint32_t id) const;
+		void OpenSegments();
+		void OpenIndex();
+		void MapIndex(int fd,uint64_t bucket_count,bool create);
+		void UnmapIndex();
+		void Rebuild();
+		void Resize(uint64_t bucket_count);
+		void MarkDirty();
+		Bucket *FindBucket(const std::string& name,uint64_t hash,bool verify) const;
+		bool ReadName(const Bucket& bucket,std::string& out_name) const;
+		void Insert(uint64_t hash,uint32_t segment,uint64_t offset,uint32_t size);
+		void Remove(Bucket *bucket);
+		void Append(const std::string& name,uint32_t flags,const void *data,uint32_t size,uint32_t *out_segment,uint64_t *out_offset);
+		void WriteBuffer();
+		void StartSegment();
+		void SyncSegments();
+		void ReadObject(const std::string& name,void *data,uint64_t offset,int size) const;
+		bool CompactSegment(uint32_t id);
+		static void CompactorThread(void *userdata);
+	public:
+		/**
+		 * Opens the store kept in a directory, which must exist.
+		 */
+		PackFileDataStore(const std::string& path);
+		
+		/**
+		 * Writes out pending appends and marks the index clean.
+		 */
+		virtual ~PackFileDataStore();
+		
+		/**
+		 * Sets the size a segment may grow to before a new one is started.
+		 */
+		void SetSegmentSize(uint64_t bytes) { ScopedLock lock(m_lock); m_segment_size = bytes; }
+		uint64_t GetSegmentSize() const { ScopedLock lock(m_lock); return m_segment_size; }
+		
+		/**
+		 * Sets the share of live bytes below which a segment is compacted.
+		 * @param percent Percentage of the segment's size, 0 disables compaction.
+		 */
+		void SetCompactionThreshold(int percent) { ScopedLock lock(m_lock); m_compaction_threshold = percent; }
+		int GetCompactionThreshold() const { ScopedLock lock(m_lock); return m_compaction_threshold; }
+		
+		/**
+		 * Compacts every segment which is below the threshold now rather
+		 * than waiting for the background thread.
+		 * @return Number of segments removed.
+		 */
+		int Compact();
+		
+		/**
+		 * Retrieves the counts for the store.
+		 */
+		void GetStats(Stats *out_stats) const;
+		
+		virtual void PutObject(const std::string& name,const void *data,int size);
+		virtual void GetObject(const std::string& name,void *data,int size) const;
+		virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const;
+		virtual void DeleteObject(const std::string& name);
+		virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const;
+		virtual void Flush();
+	};
+}
+
+#endif
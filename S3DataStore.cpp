@@ -0,0 +1,679 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "Exception.h"
+#include "S3DataStore.h"
+#include "Sha256.h"
+
+using namespace cloudblockfs;
+
+// bytes read from a connection at once, response headers must fit
+#define RECEIVE_BUFFER_SIZE 16384
+
+// seconds a connection may stall before the request fails
+#define SOCKET_TIMEOUT 60
+
+// keys asked for in each ListObjectsV2 request, the most S3 returns
+#define LIST_PAGE_SIZE 1000
+
+// keys removed by each multi-object delete, the most S3 takes
+#define DELETE_BATCH_SIZE 1000
+
+// retries of a request the server was too busy for, the first after
+// BACKOFF_DELAY seconds and each one after twice as long, up to MAX_BACKOFF_DELAY
+#define BACKOFF_RETRIES 5
+#define BACKOFF_DELAY 0.1
+#define MAX_BACKOFF_DELAY 5.0
+
+struct S3DataStore::Connection
+{
+	int fd;
+	std::vector<char> buffer;
+	size_t start, end; // received but not consumed yet
+	
+	Connection(int fd) : fd(fd), buffer(RECEIVE_BUFFER_SIZE), start(0), end(0) { }
+	~Connection() { close(fd); }
+};
+
+struct S3DataStore::Response
+{
+	int status;
+	bool keep_alive;
+	bool started; // some of the response arrived
+	uint64_t offset; // of the range asked for, skipped if the whole object comes
+	uint64_t skip;
+	int size; // bytes placed in the caller's buffer
+	std::string text; // the body otherwise
+	
+	Response() : status(0), keep_alive(false), started(false), offset(0), skip(0), size(0) { }
+};
+
+static std::string ToHex(const uint8_t *data,size_t size)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for(size_t i = 0; i < size; i++) {
+		hex += digits[data[i] >> 4];
+		hex += digits[data[i] & 15];
+	}
+	return hex;
+}
+
+static std::string HashHex(const void *data,size_t size)
+{
+	uint8_t digest[Sha256::DIGEST_SIZE];
+	Sha256::Hash(data,size,digest);
+	return ToHex(digest,sizeof(digest));
+}
+
+static std::string ToBase64(const uint8_t *data,size_t size)
+{
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string text;
+	for(size_t i = 0; i < size; i += 3) {
+		const uint32_t bits = (data[i] << 16) | (i + 1 < size ? data[i + 1] << 8 : 0) | (i + 2 < size ? data[i + 2] : 0);
+		text += digits[(bits >> 18) & 63];
+		text += digits[(bits >> 12) & 63];
+		text += i + 1 < size ? digits[(bits >> 6) & 63] : '=';
+		text += i + 2 < size ? digits[bits & 63] : '=';
+	}
+	return text;
+}
+
+static std::string EscapeXml(const std::string& text)
+{
+	std::string escaped;
+	for(size_t i = 0; i < text.size(); i++) {
+		switch(text[i]) {
+			case '&': escaped += "&amp;"; break;
+			case '<': escaped += "&lt;"; break;
+			case '>': escaped += "&gt;"; break;
+			default: escaped += text[i]; break;
+		}
+	}
+	return escaped;
+}
+
+static std::string GetXmlValue(const std::string& xml,const std::string& tag,size_t *pos)
+{
+	// the text of the next element with the tag, entities replaced
+	const std::string open = "<" + tag + ">", close = "</" + tag + ">";
+	const size_t start = xml.find(open,*pos);
+	const size_t end = start == std::string::npos ? start : xml.find(close,start);
+	if(end == std::string::npos) {
+		*pos = std::string::npos;
+		return std::string();
+	}
+	*pos = end + close.size();
+	
+	static const char *entities[][2] = { { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" } };
+	std::string value;
+	for(size_t i = start + open.size(); i < end; i++) {
+		size_t entity = 0;
+		while(entity < 5 && xml.compare(i,strlen(entities[entity][0]),entities[entity][0]) != 0) entity++;
+		if(entity < 5) {
+			value += entities[entity][1];
+			i += strlen(entities[entity][0]) - 1;
+		} else {
+			value += xml[i];
+		}
+	}
+	return value;
+}
+
+static std::string GetErrorMessage(const std::string& name,int status,const std::string& xml)
+{
+	char code[32];
+	sprintf(code,"HTTP %d",status);
+	size_t pos = 0;
+	std::string message = name + ": " + code;
+	const std::string error = GetXmlValue(xml,"Code",&pos);
+	if(!error.empty()) message += " " + error;
+	pos = 0;
+	const std::string text = GetXmlValue(xml,"Message",&pos);
+	if(!text.empty()) message += ": " + text;
+	return message;
+}
+
+S3DataStore::S3DataStore(const std::string& endpoint,const std::string& bucket,const std::string& access_key,
+	const std::string& secret_key,const std::string& region,int connections) :
+	m_access_key(access_key), m_secret_key(secret_key), m_region(region), m_connections(0),
+	m_max_connections(std::max(connections,1)), m_backoff_retries(BACKOFF_RETRIES), m_backoff_delay(BACKOFF_DELAY)
+{
+	std::string host = endpoint;
+	if(host.compare(0,7,"http://") == 0) host.erase(0,7);
+	if(!host.empty() && host[host.size() - 1] == '/') host.erase(host.size() - 1);
+	const size_t colon = host.rfind(':');
+	m_host = host.substr(0,colon);
+	m_port = colon == std::string::npos ? "80" : host.substr(colon + 1);
+	if(m_host.empty()) throw InvalidArgumentException(endpoint + ": Invalid endpoint");
+	
+	const size_t slash = bucket.find('/');
+	m_bucket = bucket.substr(0,slash);
+	if(slash != std::string::npos) m_prefix = bucket.substr(slash + 1);
+	if(!m_prefix.empty() && m_prefix[m_prefix.size() - 1] != '/') m_prefix += '/';
+	if(m_bucket.empty()) throw InvalidArgumentException(bucket + ": Invalid bucket");
+	
+	memset(&m_stats,0,sizeof(m_stats));
+}
+
+S3DataStore::~S3DataStore()
+{
+	for(std::vector<Connection *>::iterator it = m_idle.begin(); it != m_idle.end(); ++it) {
+		delete *it;
+	}
+}
+
+std::string S3DataStore::UriEncode(const std::string& text,bool keep_slash)
+{
+	std::string encoded;
+	for(size_t i = 0; i < text.size(); i++) {
+		const char c = text[i];
+		if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+		   c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keep_slash)) {
+			encoded += c;
+		} else {
+			char escape[4];
+			sprintf(escape,"%%%02X",(uint8_t)c);
+			encoded += escape;
+		}
+	}
+	return encoded;
+}
+
+std::string S3DataStore::GetAuthorization(const std::string& access_key,const std::string& secret_key,
+	const std::string& region,const std::string& timestamp,const std::string& method,const std::string& uri,
+	const std::string& query,const HeaderList& headers,const std::string& payload_hash)
+{
+	std::string canonical = method + "\n" + uri + "\n" + query + "\n";
+	std::string signed_headers;
+	for(HeaderList::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+		canonical += it->first + ":" + it->second + "\n";
+		if(!signed_headers.empty()) signed_headers += ";";
+		signed_headers += it->first;
+	}
+	canonical += "\n" + signed_headers + "\n" + payload_hash;
+	
+	const std::string scope = timestamp.substr(0,8) + "/" + region + "/s3/aws4_request";
+	const std::string string_to_sign = "AWS4-HMAC-SHA256\n" + timestamp + "\n" + scope + "\n" + HashHex(canonical.data(),canonical.size());
+	
+	// the key is derived from the secret through each part of the scope
+	const std::string secret = "AWS4" + secret_key;
+	const std::string parts[] = { timestamp.substr(0,8), region, "s3", "aws4_request" };
+	uint8_t key[Sha256::DIGEST_SIZE];
+	Sha256::Hmac(secret.data(),secret.size(),parts[0].data(),parts[0].size(),key);
+	for(int i = 1; i < 4; i++) {
+		Sha256::Hmac(key,sizeof(key),parts[i].data(),parts[i].size(),key);
+	}
+	uint8_t signature[Sha256::DIGEST_SIZE];
+	Sha256::Hmac(key,sizeof(key),string_to_sign.data(),string_to_sign.size(),signature);
+	
+	return "AWS4-HMAC-SHA256 Credential=" + access_key + "/" + scope + ",SignedHeaders=" + signed_headers +
+		",Signature=" + ToHex(signature,sizeof(signature));
+}
+
+S3DataStore::Connection *S3DataStore::Connect() const
+{
+	struct addrinfo hints, *addresses;
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	const int error = getaddrinfo(m_host.c_str(),m_port.c_str(),&hints,&addresses);
+	if(error) throw FileIOException(m_host + ": " + gai_strerror(error));
+	
+	int fd = -1, connect_errno = 0;
+	for(struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+		fd = socket(address->ai_family,address->ai_socktype,address->ai_protocol);
+		if(fd < 0) {
+			connect_errno = errno;
+		} else if(connect(fd,address->ai_addr,address->ai_addrlen) != 0) {
+			connect_errno = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if(fd < 0) throw FileIOException(m_host + ":" + m_port + ": " + strerror(connect_errno));
+	
+	// headers and small bodies go out at once, and a dead server does not hang a request forever
+	const int one = 1;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+	struct timeval timeout = { SOCKET_TIMEOUT, 0 };
+	setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+	setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+	return new Connection(fd);
+}
+
+S3DataStore::Connection *S3DataStore::AcquireConnection(bool *out_reused) const
+{
+	{
+		ScopedLock lock(m_lock);
+		while(m_idle.empty() && m_connections >= m_max_connections) {
+			m_connection_cond.Wait(m_lock);
+		}
+		if(!m_idle.empty()) {
+			Connection *connection = m_idle.back();
+			m_idle.pop_back();
+			*out_reused = true;
+			return connection;
+		}
+		m_connections++;
+		m_stats.connections_opened++;
+	}
+	
+	*out_reused = false;
+	try {
+		return Connect();
+	} catch(...) {
+		ScopedLock lock(m_lock);
+		m_connections--;
+		m_connection_cond.Signal();
+		throw;
+	}
+}
+
+void S3DataStore::ReleaseConnection(Connection *connection,bool keep) const
+{
+	if(!keep) delete connection;
+	ScopedLock lock(m_lock);
+	if(keep) m_idle.push_back(connection);
+	else m_connections--;
+	m_connection_cond.Signal();
+}
+
+void S3DataStore::Send(Connection *connection,const std::string& method,const std::string& path,const std::string& query,
+	const HeaderList& headers,const void *body,int body_size) const
+{
+	std::string request = method + " " + path + (query.empty() ? "" : "?" + query) + " HTTP/1.1\r\n";
+	for(HeaderList::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+		request += it->first + ": " + it->second + "\r\n";
+	}
+	if(body_size || method == "PUT") {
+		char length[32];
+		sprintf(length,"%d",body_size);
+		request += std::string("content-length: ") + length + "\r\n";
+	}
+	request += "\r\n";
+	
+	// the header and the body in as few calls as the socket takes them
+	struct iovec parts[2];
+	parts[0].iov_base = (void *)request.data();
+	parts[0].iov_len = request.size();
+	parts[1].iov_base = (void *)body;
+	parts[1].iov_len = body ? body_size : 0;
+	struct msghdr message;
+	memset(&message,0,sizeof(message));
+	message.msg_iov = parts;
+	message.msg_iovlen = 2;
+	while(parts[0].iov_len || parts[1].iov_len) {
+		const ssize_t sent = sendmsg(connection->fd,&message,MSG_NOSIGNAL);
+		if(sent < 0) {
+			if(errno == EINTR) continue;
+			throw FileIOException(m_host + ": " + strerror(errno));
+		}
+		size_t remaining = sent;
+		for(int i = 0; i < 2; i++) {
+			const size_t done = std::min(remaining,parts[i].iov_len);
+			parts[i].iov_base = (char *)parts[i].iov_base + done;
+			parts[i].iov_len -= done;
+			remaining -= done;
+		}
+		message.msg_iov = parts[0].iov_len ? parts : parts + 1;
+		message.msg_iovlen = parts[0].iov_len ? 2 : 1;
+	}
+}
+
+static ssize_t ReceiveSome(int fd,void *data,size_t size,const std::string& host)
+{
+	for(;;) {
+		const ssize_t received = recv(fd,data,size,0);
+		if(received >= 0) return received;
+		if(errno != EINTR) throw FileIOException(host + ": " + strerror(errno));
+	}
+}
+
+static bool FillBuffer(std::vector<char>& buffer,size_t *start,size_t *end,int fd,const std::string& host)
+{
+	// move what is left to the front to make room
+	if(*start) {
+		memmove(&buffer[0],&buffer[*start],*end - *start);
+		*end -= *start;
+		*start = 0;
+	}
+	if(*end == buffer.size()) throw FileIOException(host + ": Response line too long");
+	const ssize_t received = ReceiveSome(fd,&buffer[*end],buffer.size() - *end,host);
+	*end += received;
+	return received > 0;
+}
+
+static std::string ReadLine(std::vector<char>& buffer,size_t *start,size_t *end,int fd,const std::string& host)
+{
+	for(;;) {
+		const char *first = &buffer[0] + *start, *last = &buffer[0] + *end;
+		const char *eol = std::search(first,last,"\r\n","\r\n" + 2);
+		if(eol != last) {
+			*start += eol - first + 2;
+			return std::string(first,eol);
+		}
+		if(!FillBuffer(buffer,start,end,fd,host)) throw FileIOException(host + ": Connection closed");
+	}
+}
+
+void S3DataStore::Receive(Connection *connection,bool head,Response *out_response,void *data,int size) const
+{
+	std::vector<char>& buffer = connection->buffer;
+	size_t *start = &connection->start, *end = &connection->end;
+	
+	// the status line, nothing at all means the server closed the connection
+	if(*start == *end && !FillBuffer(buffer,start,end,connection->fd,m_host)) {
+		throw FileIOException(m_host + ": Connection closed");
+	}
+	out_response->started = true;
+	const std::string status = ReadLine(buffer,start,end,connection->fd,m_host);
+	if(status.compare(0,5,"HTTP/") != 0 || status.find(' ') == std::string::npos) {
+		throw FileIOException(m_host + ": Invalid response");
+	}
+	out_response->status = atoi(status.c_str() + status.find(' ') + 1);
+	out_response->keep_alive = status.compare(0,8,"HTTP/1.0") != 0;
+	
+	int64_t length = -1;
+	bool chunked = false;
+	for(;;) {
+		const std::string line = ReadLine(buffer,start,end,connection->fd,m_host);
+		if(line.empty()) break;
+		const size_t colon = line.find(':');
+		if(colon == std::string::npos) continue;
+		const size_t value_start = line.find_first_not_of(" \t",colon + 1);
+		std::string name = line.substr(0,colon);
+		std::string value = value_start == std::string::npos ? std::string() : line.substr(value_start);
+		std::transform(name.begin(),name.end(),name.begin(),::tolower);
+		std::transform(value.begin(),value.end(),value.begin(),::tolower);
+		if(name == "content-length") length = strtoll(value.c_str(),NULL,10);
+		else if(name == "transfer-encoding") chunked = value.find("chunked") != std::string::npos;
+		else if(name == "connection") out_response->keep_alive = value.find("close") == std::string::npos;
+	}
+	if(head || out_response->status == 204 || out_response->status == 304) length = 0;
+	
+	// a successful body goes to the caller's buffer, starting at the range asked for
+	if(out_response->status / 100 != 2) data = NULL;
+	out_response->skip = out_response->status == 200 ? out_response->offset : 0;
+	
+	bool more = true;
+	while(more) {
+		uint64_t remaining;
+		if(chunked) {
+			remaining = strtoull(ReadLine(buffer,start,end,connection->fd,m_host).c_str(),NULL,16);
+			if(!remaining) {
+				while(!ReadLine(buffer,start,end,connection->fd,m_host).empty()) { } // trailers
+				break;
+			}
+		} else if(length >= 0) {
+			remaining = length;
+			more = false;
+		} else {
+			// without a length the body ends with the connection
+			remaining = ~0ULL;
+			out_response->keep_alive = false;
+			more = false;
+		}
+		
+		while(remaining) {
+			if(*start == *end) {
+				// what goes to the caller's buffer is received straight into it
+				const uint64_t wanted = std::min<uint64_t>(remaining,data ? size - out_response->size : 0);
+				if(wanted && !out_response->skip) {
+					const ssize_t received = ReceiveSome(connection->fd,(char *)data + out_response->size,wanted,m_host);
+					if(!received && remaining == ~0ULL) break;
+					if(!received) throw FileIOException(m_host + ": Connection closed");
+					out_response->size += received;
+					remaining -= received;
+					continue;
+				}
+				if(!FillBuffer(buffer,start,end,connection->fd,m_host)) {
+					if(remaining == ~0ULL) break;
+					throw FileIOException(m_host + ": Connection closed");
+				}
+			}
+			
+			size_t count = std::min<uint64_t>(remaining,*end - *start);
+			const char *bytes = &buffer[*start];
+			*start += count;
+			remaining -= count;
+			const size_t skipped = std::min<uint64_t>(count,out_response->skip);
+			out_response->skip -= skipped;
+			bytes += skipped;
+			count -= skipped;
+			if(data) {
+				const size_t copied = std::min<size_t>(count,size - out_response->size);
+				memcpy((char *)data + out_response->size,bytes,copied);
+				out_response->size += copied;
+			} else {
+				out_response->text.append(bytes,count);
+			}
+		}
+		if(chunked) ReadLine(buffer,start,end,connection->fd,m_host);
+	}
+}
+
+void S3DataStore::Request(const std::string& method,const std::string& path,const std::string& query,const HeaderList& headers,
+	const void *body,int body_size,Response *out_response,void *data,int size) const
+{
+	char timestamp[32];
+	const time_t now = time(NULL);
+	struct tm utc;
+	gmtime_r(&now,&utc);
+	strftime(timestamp,sizeof(timestamp),"%Y%m%dT%H%M%SZ",&utc);
+	
+	const std::string payload_hash = HashHex(body,body ? body_size : 0);
+	HeaderList signed_headers(headers);
+	signed_headers.push_back(std::make_pair("host",m_port == "80" ? m_host : m_host + ":" + m_port));
+	signed_headers.push_back(std::make_pair("x-amz-content-sha256",payload_hash));
+	signed_headers.push_back(std::make_pair("x-amz-date",std::string(timestamp)));
+	std::sort(signed_headers.begin(),signed_headers.end());
+	HeaderList all_headers(signed_headers);
+	all_headers.push_back(std::make_pair("authorization",GetAuthorization(m_access_key,m_secret_key,m_region,timestamp,
+		method,path,query,signed_headers,payload_hash)));
+	
+	int backoffs = 0;
+	for(int attempt = 0; ; attempt++) {
+		bool reused;
+		Connection *connection = AcquireConnection(&reused);
+		int backoff_retries;
+		double backoff_delay;
+		{
+			ScopedLock lock(m_lock);
+			m_stats.requests++;
+			backoff_retries = m_backoff_retries;
+			backoff_delay = m_backoff_delay;
+		}
+		
+		const uint64_t offset = out_response->offset;
+		*out_response = Response();
+		out_response->offset = offset;
+		try {
+			Send(connection,method,path,query,all_headers,body,body_size);
+			Receive(connection,method == "HEAD",out_response,data,size);
+		} catch(const std::runtime_error& ) {
+			ReleaseConnection(connection,false);
+			
+			// the server may have closed a kept connection while it was idle
+			if(reused && !attempt && !out_response->started) {
+				ScopedLock lock(m_lock);
+				m_stats.retries++;
+				continue;
+			}
+			throw;
+		}
+		ReleaseConnection(connection,out_response->keep_alive);
+		
+		// a busy server is given longer each time to catch up
+		if((out_response->status == 500 || out_response->status == 503) && backoffs < backoff_retries) {
+			const double delay = std::min(backoff_delay * (1 << backoffs),MAX_BACKOFF_DELAY);
+			usleep((useconds_t)(delay * 1000000));
+			backoffs++;
+			ScopedLock lock(m_lock);
+			m_stats.backoffs++;
+			continue;
+		}
+		return;
+	}
+}
+
+void S3DataStore::SetBackoff(int retries,double delay)
+{
+	ScopedLock lock(m_lock);
+	m_backoff_retries = std::max(retries,0);
+	m_backoff_delay = std::max(delay,0.0);
+}
+
+std::string S3DataStore::GetObjectPath(const std::string& name) const
+{
+	return "/" + UriEncode(m_bucket,false) + "/" + UriEncode(m_prefix + name,true);
+}
+
+void S3DataStore::PutObject(const std::string& name,const void *data,int size)
+{
+	Response response;
+	Request("PUT",GetObjectPath(name),"",HeaderList(),data,std::max(size,0),&response,NULL,0);
+	if(response.status / 100 != 2) throw WriteErrorException(GetErrorMessage(name,response.status,response.text));
+}
+
+int S3DataStore::GetRange(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	HeaderList headers;
+	if(size > 0) {
+		char range[64];
+		sprintf(range,"bytes=%llu-%llu",(unsigned long long)offset,(unsigned long long)(offset + size - 1));
+		headers.push_back(std::make_pair("range",std::string(range)));
+	}
+	Response response;
+	response.offset = offset;
+	Request("GET",GetObjectPath(name),"",headers,NULL,0,&response,data,size);
+	
+	// a range past the end reads nothing, as it would from a file
+	if(response.status == 416) return 0;
+	if(response.status == 404) throw FileNotFoundException(GetErrorMessage(name,response.status,response.text));
+	if(response.status / 100 != 2) throw ReadErrorException(GetErrorMessage(name,response.status,response.text));
+	return response.size;
+}
+
+void S3DataStore::GetObject(const std::string& name,void *data,int size) const
+{
+	GetRange(name,data,0,size);
+}
+
+void S3DataStore::GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	GetRange(name,data,offset,size);
+}
+
+ObjectViewPtr S3DataStore::GetObjectView(const std::string& name,int size) const
+{
+	BufferObjectView *view = new BufferObjectView(size);
+	ObjectViewPtr ptr(view);
+	view->Resize(GetRange(name,view->GetBuffer(),0,size));
+	return ptr;
+}
+
+void S3DataStore::DeleteObject(const std::string& name)
+{
+	Response response;
+	Request("DELETE",GetObjectPath(name),"",HeaderList(),NULL,0,&response,NULL,0);
+	if(response.status == 404) throw FileNotFoundException(GetErrorMessage(name,response.status,response.text));
+	if(response.status / 100 != 2) throw WriteErrorException(GetErrorMessage(name,response.status,response.text));
+}
+
+void S3DataStore::DeleteObjects(const std::vector<std::string>& names)
+{
+	for(size_t i = 0; i < names.size(); i += DELETE_BATCH_SIZE) {
+		// quiet, so only the keys which could not be removed come back
+		std::string body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Delete><Quiet>true</Quiet>";
+		const size_t end = std::min(names.size(),i + DELETE_BATCH_SIZE);
+		for(size_t j = i; j < end; j++) body += "<Object><Key>" + EscapeXml(m_prefix + names[j]) + "</Key></Object>";
+		body += "</Delete>";
+		
+		// the body must carry a checksum, SHA-256 in place of Content-MD5
+		uint8_t digest[Sha256::DIGEST_SIZE];
+		Sha256::Hash(body.data(),body.size(),digest);
+		HeaderList headers;
+		headers.push_back(std::make_pair("x-amz-checksum-sha256",ToBase64(digest,sizeof(digest))));
+		headers.push_back(std::make_pair("x-amz-sdk-checksum-algorithm",std::string("SHA256")));
+		
+		Response response;
+		Request("POST","/" + UriEncode(m_bucket,false),"delete=",headers,body.data(),body.size(),&response,NULL,0);
+		if(response.status / 100 != 2) throw WriteErrorException(GetErrorMessage(m_bucket,response.status,response.text));
+		
+		// a key which is already gone is not an error
+		size_t pos = 0;
+		for(;;) {
+			const std::string error = GetXmlValue(response.text,"Error",&pos);
+			if(pos == std::string::npos) break;
+			size_t field = 0;
+			const std::string key = GetXmlValue(error,"Key",&field);
+			field = 0;
+			const std::string code = GetXmlValue(error,"Code",&field);
+			if(code == "NoSuchKey") continue;
+			field = 0;
+			const std::string message = GetXmlValue(error,"Message",&field);
+			throw WriteErrorException(key + ": " + code + (message.empty() ? "" : ": " + message));
+		}
+	}
+}
+
+void S3DataStore::ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const
+{
+	char page_size[16];
+	sprintf(page_size,"%d",LIST_PAGE_SIZE);
+	std::string token;
+	do {
+		// parameters in the order they are signed
+		std::string query;
+		if(!token.empty()) query += "continuation-token=" + UriEncode(token,false) + "&";
+		query += "list-type=2&max-keys=" + std::string(page_size);
+		if(!m_prefix.empty()) query += "&prefix=" + UriEncode(m_prefix,false);
+		
+		Response response;
+		Request("GET","/" + UriEncode(m_bucket,false),query,HeaderList(),NULL,0,&response,NULL,0);
+		if(response.status / 100 != 2) throw ReadErrorException(GetErrorMessage(m_bucket,response.status,response.text));
+		
+		// the next page is asked for after this one is handed out, so objects may be deleted as they are listed
+		size_t pos = 0;
+		const bool truncated = GetXmlValue(response.text,"IsTruncated",&pos) == "true";
+		pos = 0;
+		token = truncated ? GetXmlValue(response.text,"NextContinuationToken",&pos) : std::string();
+		pos = 0;
+		for(;;) {
+			const std::string key = GetXmlValue(response.text,"Key",&pos);
+			if(pos == std::string::npos) break;
+			if(key.compare(0,m_prefix.size(),m_prefix) == 0) list_function(key.substr(m_prefix.size()),userdata);
+		}
+	} while(!token.empty());
+}
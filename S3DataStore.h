@@ -0,0 +1,162 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_S3DataStore_h
+#define __cloudblockfs_S3DataStore_h
+
+#include <inttypes.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * A data store keeping objects in a bucket of an S3 compatible object
+	 * store, such as AWS S3 or MinIO, over plain HTTP.
+	 *
+	 * Requests are signed with AWS Signature Version 4 and addressed path
+	 * style, as /bucket/prefix/name. Connections are kept alive in a pool
+	 * and reused, and each request in flight holds one, so as many
+	 * requests run at once as there are connections. Callers beyond that
+	 * wait for one to come free. A request which fails on a connection the
+	 * server may have closed while it was idle is retried on a new one.
+	 *
+	 * Objects are read with ranged GETs, listed with ListObjectsV2 a page
+	 * at a time and removed in bulk with multi-object deletes. S3 answers
+	 * the removal of an object which does not exist as a success, a server
+	 * which answers 404 instead has DeleteObject() throw
+	 * FileNotFoundException, as the other stores do.
+	 *
+	 * A server which is busy and answers 500 or 503 (SlowDown) is asked
+	 * again after a delay which doubles each time, up to a few times.
+	 */
+	class S3DataStore : public DataStore
+	{
+	public:
+		typedef std::vector<std::pair<std::string,std::string> > HeaderList;
+		
+		struct Stats
+		{
+			uint64_t requests;
+			uint64_t connections_opened;
+			uint64_t retries; // requests sent again after a kept connection failed
+			uint64_t backoffs; // requests sent again after the server was busy
+		};
+	private:
+		struct Connection;
+		struct Response;
+		
+		std::string m_host;
+		std::string m_port;
+		std::string m_bucket;
+		std::string m_prefix; // prepended to object names, empty or ending in /
+		std::string m_access_key;
+		std::string m_secret_key;
+		std::string m_region;
+		
+		mutable Mutex m_lock; // guards everything below
+		mutable Condition m_connection_cond; // signalled when a connection comes free
+		mutable std::vector<Connection *> m_idle;
+		mutable int m_connections; // open, idle or in use
+		int m_max_connections;
+		mutable Stats m_stats;
+		int m_backoff_retries;
+		double m_backoff_delay; // seconds before the first retry
+		
+		Connection *Connect() const;
+		Connection *AcquireConnection(bool *out_reused) const;
+		void ReleaseConnection(Connection *connection,bool keep) const;
+		
+		/**
+		 * Makes a request and reads the response. The body of a successful
+		 * response goes to data if given, up to size bytes and the rest is
+		 * read past, otherwise to the response text.
+		 */
+		void Request(const std::string& method,const std::string& path,const std::string& query,const HeaderList& headers,
+			const void *body,int body_size,Response *out_response,void *data,int size) const;
+		void Send(Connection *connection,const std::string& method,const std::string& path,const std::string& query,
+			const HeaderList& headers,const void *body,int body_size) const;
+		void Receive(Connection *connection,bool head,Response *out_response,void *data,int size) const;
+		
+		std::string GetObjectPath(const std::string& name) const;
+		int GetRange(const std::string& name,void *data,uint64_t offset,int size) const;
+		
+		// not copyable
+		S3DataStore(const S3DataStore& );
+		S3DataStore& operator=(const S3DataStore& );
+	public:
+		/**
+		 * @param endpoint Host and port of the server, as host:port.
+		 * @param bucket Bucket name, optionally followed by a prefix the objects are kept under, as bucket/volume.
+		 * @param access_key Access key id.
+		 * @param secret_key Secret access key.
+		 * @param region Region the bucket is in, which requests are signed for.
+		 * @param connections Connections which may be open at once.
+		 */
+		S3DataStore(const std::string& endpoint,const std::string& bucket,const std::string& access_key,
+			const std::string& secret_key,const std::string& region = "us-east-1",int connections = 16);
+		
+		/**
+		 * Closes the connections. No request may be running.
+		 */
+		virtual ~S3DataStore();
+		
+		/**
+		 * Encodes a string as a URI component the way Signature Version 4
+		 * expects, leaving / alone if asked to.
+		 */
+		static std::string UriEncode(const std::string& text,bool keep_slash);
+		
+		/**
+		 * Computes the Authorization header of a request.
+		 * @param timestamp Time of the request, as x-amz-date (YYYYMMDDTHHMMSSZ).
+		 * @param uri Encoded path.
+		 * @param query Encoded query, parameters sorted by name.
+		 * @param headers Headers to sign, names lower case and sorted.
+		 * @param payload_hash Hex SHA-256 of the body, as x-amz-content-sha256.
+		 */
+		static std::string GetAuthorization(const std::string& access_key,const std::string& secret_key,
+			const std::string& region,const std::string& timestamp,const std::string& method,const std::string& uri,
+			const std::string& query,const HeaderList& headers,const std::string& payload_hash);
+		
+		/**
+		 * Retrieves the totals of the requests made so far.
+		 */
+		void GetStats(Stats *out_stats) const { ScopedLock lock(m_lock); *out_stats = m_stats; }
+		
+		/**
+		 * Sets how often a request the server was too busy for is made again.
+		 * @param retries Retries before the error is given up on, 0 for none.
+		 * @param delay Seconds before the first retry, each one after waits twice as long.
+		 */
+		void SetBackoff(int retries,double delay);
+		
+		virtual void PutObject(const std::string& name,const void *data,int size);
+		virtual void GetObject(const std::string& name,void *data,int size) const;
+		virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const;
+		virtual ObjectViewPtr GetObjectView(const std::string& name,int size) const;
+		virtual void DeleteObject(const std::string& name);
+		virtual void DeleteObjects(const std::vector<std::string>& names);
+		virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const;
+		virtual void Flush() { } // a put is durable once it has been answered
+	};
+}
+
+#endif
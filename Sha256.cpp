@@ -0,0 +1,153 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "Sha256.h"
+
+using namespace cloudblockfs;
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x,int n) { return (x >> n) | (x << (32 - n)); }
+
+Sha256::Sha256() : m_length(0)
+{
+	m_state[0] = 0x6a09e667;
+	m_state[1] = 0xbb67ae85;
+	m_state[2] = 0x3c6ef372;
+	m_state[3] = 0xa54ff53a;
+	m_state[4] = 0x510e527f;
+	m_state[5] = 0x9b05688c;
+	m_state[6] = 0x1f83d9ab;
+	m_state[7] = 0x5be0cd19;
+}
+
+void Sha256::Transform(const uint8_t *chunk)
+{
+	uint32_t w[64];
+	for(int i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)chunk[i * 4] << 24) | ((uint32_t)chunk[i * 4 + 1] << 16) |
+			((uint32_t)chunk[i * 4 + 2] << 8) | chunk[i * 4 + 3];
+	}
+	for(int i = 16; i < 64; i++) {
+		const uint32_t s0 = rotr(w[i - 15],7) ^ rotr(w[i - 15],18) ^ (w[i - 15] >> 3);
+		const uint32_t s1 = rotr(w[i - 2],17) ^ rotr(w[i - 2],19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	
+	uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+	uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+	for(int i = 0; i < 64; i++) {
+		const uint32_t t1 = h + (rotr(e,6) ^ rotr(e,11) ^ rotr(e,25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		const uint32_t t2 = (rotr(a,2) ^ rotr(a,13) ^ rotr(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+	m_state[4] += e;
+	m_state[5] += f;
+	m_state[6] += g;
+	m_state[7] += h;
+}
+
+void Sha256::Update(const void *data,size_t size)
+{
+	// empty input may come with a null pointer, which memcpy must not see
+	if(!size) return;
+	
+	const uint8_t *p = (const uint8_t *)data;
+	size_t used = m_length % 64;
+	m_length += size;
+	
+	// top up a partly filled chunk first, then hash whole chunks in place
+	if(used) {
+		const size_t n = size < 64 - used ? size : 64 - used;
+		memcpy(m_buffer + used,p,n);
+		p += n;
+		size -= n;
+		if(used + n < 64) return;
+		Transform(m_buffer);
+	}
+	for(; size >= 64; p += 64, size -= 64) Transform(p);
+	memcpy(m_buffer,p,size);
+}
+
+void Sha256::Final(uint8_t *digest)
+{
+	const uint64_t bits = m_length * 8;
+	uint8_t pad[72];
+	const size_t used = m_length % 64;
+	const size_t pad_size = (used < 56 ? 56 : 120) - used;
+	memset(pad,0,sizeof(pad));
+	pad[0] = 0x80;
+	for(int i = 0; i < 8; i++) pad[pad_size + i] = (uint8_t)(bits >> (56 - i * 8));
+	Update(pad,pad_size + 8);
+	
+	for(int i = 0; i < 8; i++) {
+		digest[i * 4] = (uint8_t)(m_state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t)(m_state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t)(m_state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t)m_state[i];
+	}
+}
+
+void Sha256::Hash(const void *data,size_t size,uint8_t *digest)
+{
+	Sha256 sha;
+	sha.Update(data,size);
+	sha.Final(digest);
+}
+
+void Sha256::Hmac(const void *key,size_t key_size,const void *data,size_t size,uint8_t *digest)
+{
+	// keys longer than a chunk are hashed first
+	uint8_t block[64];
+	memset(block,0,sizeof(block));
+	if(key_size > sizeof(block)) Hash(key,key_size,block);
+	else memcpy(block,key,key_size);
+	
+	uint8_t pad[64], inner[DIGEST_SIZE];
+	for(int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+	Sha256 sha;
+	sha.Update(pad,sizeof(pad));
+	sha.Update(data,size);
+	sha.Final(inner);
+	
+	for(int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5c;
+	Sha256 outer;
+	outer.Update(pad,sizeof(pad));
+	outer.Update(inner,sizeof(inner));
+	outer.Final(digest);
+}
@@ -0,0 +1,66 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_Sha256_h
+#define __cloudblockfs_Sha256_h
+
+#include <inttypes.h>
+#include <stddef.h>
+
+namespace cloudblockfs
+{
+	/**
+	 * SHA-256 message digest (FIPS 180-4).
+	 */
+	class Sha256
+	{
+	private:
+		uint32_t m_state[8];
+		uint64_t m_length; // bytes hashed so far
+		uint8_t m_buffer[64];
+		
+		void Transform(const uint8_t *chunk);
+	public:
+		enum { DIGEST_SIZE = 32 };
+		
+		Sha256();
+		
+		/**
+		 * Adds data to the message.
+		 */
+		void Update(const void *data,size_t size);
+		
+		/**
+		 * Finishes the message and stores its digest.
+		 * @param digest Receives DIGEST_SIZE bytes.
+		 */
+		void Final(uint8_t *digest);
+		
+		/**
+		 * Computes the digest of data in one go.
+		 */
+		static void Hash(const void *data,size_t size,uint8_t *digest);
+		
+		/**
+		 * Computes the HMAC-SHA256 (RFC 2104) of data under a key.
+		 * @param digest Receives DIGEST_SIZE bytes.
+		 */
+		static void Hmac(const void *key,size_t key_size,const void *data,size_t size,uint8_t *digest);
+	};
+}
+
+#endif
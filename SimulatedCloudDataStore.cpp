@@ -0,0 +1,199 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "Exception.h"
+#include "SimulatedCloudDataStore.h"
+
+using namespace cloudblockfs;
+
+// names a list or bulk delete request covers, as on S3
+#define NAMES_PER_REQUEST 1000
+
+static double Now()
+{
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+static uint64_t Mix(uint64_t x)
+{
+	// splitmix64 finalizer
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static double Uniform(uint64_t key,int draw)
+{
+	// in (0,1), so it can be taken the log of
+	return ((Mix(key + (draw + 1) * 0x9E3779B97F4A7C15ULL) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+SimulatedCloudDataStore::SimulatedCloudDataStore(DataStore *store,uint64_t seed) :
+	m_store(store), m_seed(seed), m_bandwidth(0), m_request_rate(0), m_burst(1), m_failure_rate(0),
+	m_connections(0), m_connections_used(0), m_throttle_time(0)
+{
+	memset(m_latency,0,sizeof(m_latency));
+	memset(&m_stats,0,sizeof(m_stats));
+}
+
+void SimulatedCloudDataStore::SetLatency(Request request,double median,double sigma)
+{
+	m_latency[request].median = median;
+	m_latency[request].sigma = sigma;
+}
+
+void SimulatedCloudDataStore::SetRequestRate(double rate,int burst)
+{
+	ScopedLock lock(m_lock);
+	m_request_rate = rate;
+	m_burst = std::max(burst,1);
+	m_throttle_time = 0;
+}
+
+void SimulatedCloudDataStore::ResetDraws()
+{
+	ScopedLock lock(m_lock);
+	for(int i = 0; i < REQUEST_COUNT; i++) {
+		CountMap counts;
+		m_counts[i].swap(counts);
+	}
+}
+
+void SimulatedCloudDataStore::Simulate(Request request,const std::string& name,uint64_t bytes) const
+{
+	const double start = Now();
+	double delay = 0;
+	uint64_t key;
+	{
+		ScopedLock lock(m_lock);
+		while(m_connections && m_connections_used >= m_connections) {
+			m_connection_cond.Wait(m_lock);
+		}
+		m_connections_used++;
+		m_stats.requests[request]++;
+		
+		// the draws for this request, FNV-1a of the name
+		uint64_t hash = 14695981039346656037ULL;
+		for(size_t i = 0; i < name.size(); i++) {
+			hash ^= (uint8_t)name[i];
+			hash *= 1099511628211ULL;
+		}
+		key = Mix(Mix(m_seed ^ hash) + ((uint64_t)request << 32) + m_counts[request][hash]++);
+		
+		// each request takes the next slot, up to a burst of them may be ahead of time
+		if(m_request_rate > 0) {
+			const double now = Now();
+			const double slot = std::max(m_throttle_time,now);
+			const double begin = std::max(now,slot - (m_burst - 1) / m_request_rate);
+			m_throttle_time = slot + 1 / m_request_rate;
+			if(begin > now) {
+				delay = begin - now;
+				m_stats.throttled++;
+			}
+		}
+	}
+	
+	// lognormal through Box-Muller
+	const Latency& latency = m_latency[request];
+	if(latency.median > 0) {
+		const double normal = sqrt(-2 * log(Uniform(key,0))) * cos(2 * M_PI * Uniform(key,1));
+		delay += latency.median * exp(latency.sigma * normal);
+	}
+	if(m_bandwidth > 0) delay += bytes / m_bandwidth;
+	const bool failed = m_failure_rate > 0 && Uniform(key,2) < m_failure_rate;
+	
+	if(delay > 0) usleep((useconds_t)(delay * 1000000));
+	
+	{
+		ScopedLock lock(m_lock);
+		m_connections_used--;
+		m_connection_cond.Signal();
+		m_stats.seconds += Now() - start;
+		if(failed) m_stats.failures++;
+	}
+	if(failed) {
+		if(request == REQUEST_GET || request == REQUEST_LIST) throw ReadErrorException(name + ": Simulated failure");
+		throw WriteErrorException(name + ": Simulated failure");
+	}
+}
+
+void SimulatedCloudDataStore::PutObject(const std::string& name,const void *data,int size)
+{
+	Simulate(REQUEST_PUT,name,std::max(size,0));
+	m_store->PutObject(name,data,size);
+}
+
+void SimulatedCloudDataStore::GetObject(const std::string& name,void *data,int size) const
+{
+	Simulate(REQUEST_GET,name,std::max(size,0));
+	m_store->GetObject(name,data,size);
+}
+
+void SimulatedCloudDataStore::GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const
+{
+	Simulate(REQUEST_GET,name,size);
+	m_store->GetObjectRange(name,data,offset,size);
+}
+
+ObjectViewPtr SimulatedCloudDataStore::GetObjectView(const std::string& name,int size) const
+{
+	Simulate(REQUEST_GET,name,size);
+	return m_store->GetObjectView(name,size);
+}
+
+void SimulatedCloudDataStore::DeleteObject(const std::string& name)
+{
+	Simulate(REQUEST_DELETE,name,0);
+	m_store->DeleteObject(name);
+}
+
+void SimulatedCloudDataStore::DeleteObjects(const std::vector<std::string>& names)
+{
+	for(size_t i = 0; i < names.size(); i += NAMES_PER_REQUEST) {
+		const std::vector<std::string> batch(names.begin() + i,names.begin() + std::min(names.size(),i + NAMES_PER_REQUEST));
+		Simulate(REQUEST_DELETE,batch[0],0);
+		m_store->DeleteObjects(batch);
+	}
+}
+
+void SimulatedCloudDataStore::CollectName(const std::string& name,void *userdata)
+{
+	((std::vector<std::string> *)userdata)->push_back(name);
+}
+
+void SimulatedCloudDataStore::ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const
+{
+	// names come a page at a time, an empty listing is still a request
+	std::vector<std::string> names;
+	m_store->ListObjects(CollectName,&names);
+	size_t i = 0;
+	do {
+		Simulate(REQUEST_LIST,"",0);
+		const size_t end = std::min(names.size(),i + NAMES_PER_REQUEST);
+		for(; i < end; i++) list_function(names[i],userdata);
+	} while(i < names.size());
+}
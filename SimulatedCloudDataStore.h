@@ -0,0 +1,167 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_SimulatedCloudDataStore_h
+#define __cloudblockfs_SimulatedCloudDataStore_h
+
+#include <inttypes.h>
+#include <memory>
+#include <string>
+#include <tr1/unordered_map>
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * Makes another data store behave like object storage reached over a
+	 * network, as a stand-in for benchmarks.
+	 *
+	 * Every request waits for a connection, for its turn under the request
+	 * rate, for a latency drawn from a lognormal distribution and for its
+	 * bytes to pass at the bandwidth of one connection. Requests may also
+	 * fail now and then. Listing and bulk deletes cost a request per 1000
+	 * names, as they do on S3.
+	 *
+	 * The random draws for a request depend only on the seed, the kind of
+	 * request, the object name and how many requests of that kind the name
+	 * has seen, so runs with the same seed and workload see the same
+	 * latencies and failures however their threads are scheduled. That
+	 * takes a counter for each name and kind of request, about 40 bytes,
+	 * kept until ResetDraws(). Everything is off until it is set, which
+	 * leaves a plain pass-through.
+	 */
+	class SimulatedCloudDataStore : public DataStore
+	{
+	public:
+		enum Request
+		{
+			REQUEST_PUT,
+			REQUEST_GET,
+			REQUEST_DELETE,
+			REQUEST_LIST,
+			REQUEST_COUNT
+		};
+		
+		struct Stats
+		{
+			uint64_t requests[REQUEST_COUNT];
+			uint64_t failures; // injected
+			uint64_t throttled; // held back by the request rate
+			double seconds; // spent waiting, summed over requests
+		};
+	private:
+		struct Latency
+		{
+			double median; // seconds
+			double sigma; // of the underlying normal, 0 for a fixed latency
+		};
+		
+		typedef std::tr1::unordered_map<uint64_t,uint32_t> CountMap; // by hash of the name
+		
+		std::auto_ptr<DataStore> m_store;
+		uint64_t m_seed;
+		Latency m_latency[REQUEST_COUNT];
+		double m_bandwidth;
+		double m_request_rate;
+		int m_burst;
+		double m_failure_rate;
+		int m_connections;
+		
+		mutable Mutex m_lock; // guards everything below
+		mutable Condition m_connection_cond;
+		mutable int m_connections_used;
+		mutable double m_throttle_time; // when the last request admitted by the rate goes
+		mutable CountMap m_counts[REQUEST_COUNT];
+		mutable Stats m_stats;
+		
+		static void CollectName(const std::string& name,void *userdata);
+		
+		/**
+		 * Delays the calling thread as the request would be, then fails it
+		 * if the draw says so.
+		 */
+		void Simulate(Request request,const std::string& name,uint64_t bytes) const;
+		
+		// not copyable
+		SimulatedCloudDataStore(const SimulatedCloudDataStore& );
+		SimulatedCloudDataStore& operator=(const SimulatedCloudDataStore& );
+	public:
+		/**
+		 * @param store Store to keep the objects in, owned by this object.
+		 * @param seed Seed for the latencies and failures.
+		 */
+		SimulatedCloudDataStore(DataStore *store,uint64_t seed = 1);
+		
+		/**
+		 * Sets the time to the first byte of a kind of request. Latencies are
+		 * lognormal, sigma 0.5 to 1 gives the long tail of object storage.
+		 * @param median Median latency in seconds.
+		 * @param sigma Spread, 0 makes every request take the median.
+		 */
+		void SetLatency(Request request,double median,double sigma);
+		
+		/**
+		 * Sets the rate each connection transfers object data at, in bytes
+		 * per second. 0 for no limit.
+		 */
+		void SetBandwidth(double bandwidth) { m_bandwidth = bandwidth; }
+		
+		/**
+		 * Sets the number of requests which may run at once, others wait
+		 * for one of them to finish. 0 for no limit.
+		 */
+		void SetConnections(int connections) { m_connections = connections; }
+		
+		/**
+		 * Limits the rate requests start at. Requests over the rate are held
+		 * back rather than rejected, since nothing here retries them.
+		 * @param rate Requests per second, 0 for no limit.
+		 * @param burst Requests which may start at once after a quiet spell.
+		 */
+		void SetRequestRate(double rate,int burst);
+		
+		/**
+		 * Sets the fraction of requests which fail, after their latency,
+		 * with a ReadErrorException or WriteErrorException. The request is
+		 * not passed on, so a failed put leaves the object as it was.
+		 */
+		void SetFailureRate(double rate) { m_failure_rate = rate; }
+		
+		/**
+		 * Retrieves the totals of the requests made so far.
+		 */
+		void GetStats(Stats *out_stats) const { ScopedLock lock(m_lock); *out_stats = m_stats; }
+		
+		/**
+		 * Forgets how many requests each name has seen, which frees their
+		 * counters. The requests which follow draw as if none came before.
+		 */
+		void ResetDraws();
+		
+		virtual void PutObject(const std::string& name,const void *data,int size);
+		virtual void GetObject(const std::string& name,void *data,int size) const;
+		virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const;
+		virtual ObjectViewPtr GetObjectView(const std::string& name,int size) const;
+		virtual void DeleteObject(const std::string& name);
+		virtual void DeleteObjects(const std::vector<std::string>& names);
+		virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const;
+		virtual void Flush() { m_store->Flush(); }
+	};
+}
+
+#endif
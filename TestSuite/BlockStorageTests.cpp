@@ -16,15 +16,25 @@
  along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <UnitTest++.h>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <vector>
 #include <math.h>
+#include <sys/time.h>
 #include <tr1/memory>
 #include "Exception.h"
 #include "BlockStorageDevice.h"
+#include "CountingDataStore.h"
+#include "FileDataStore.h"
+#include "MemoryDataStore.h"
+#include "Sha256.h"
+#include "SimulatedCloudDataStore.h"
+#include "Thread.h"
+#include "TmpDir.h"
 #include "TmpFileDataStore.h"
+#include "ZeroBlock.h"
 
 using namespace cloudblockfs;
 
@@ -40,18 +50,19 @@ public:
 		BlockStorageDevicePtr block;
 		
 		// format multiple disks with block sizes 1k, 4k, 16k, 64
-		// also format each with multiple tree levels
+		// also format each with multiple tree levels, in memory as the
+		// stores themselves are tested elsewhere
 		for(int i = 1; i <= 3; i++) {
-			block.reset(new BlockStorageDevice(new TmpFileDataStore()));
+			block.reset(new BlockStorageDevice(new MemoryDataStore()));
 			block->Format(1024,i);
 			m_block_devices.push_back(block);
-			block.reset(new BlockStorageDevice(new TmpFileDataStore()));
+			block.reset(new BlockStorageDevice(new MemoryDataStore()));
 			block->Format(4096,i);
 			m_block_devices.push_back(block);
-			block.reset(new BlockStorageDevice(new TmpFileDataStore()));
+			block.reset(new BlockStorageDevice(new MemoryDataStore()));
 			block->Format(16384,i);
 			m_block_devices.push_back(block);
-			block.reset(new BlockStorageDevice(new TmpFileDataStore()));
+			block.reset(new BlockStorageDevice(new MemoryDataStore()));
 			block->Format(65536,i);
 			m_block_devices.push_back(block);
 		}
@@ -66,6 +77,98 @@ public:
 	}
 };
 
+// a thread writing and reading back its own region of a shared device
+struct ConcurrentWriter
+{
+	BlockStorageDevice *block;
+	uint64_t base;
+	int region_size;
+	unsigned int seed;
+	bool failed;
+	
+	static void Run(void *userdata) {
+		ConcurrentWriter *writer = (ConcurrentWriter *)userdata;
+		std::vector<char> expect(writer->region_size), data;
+		writer->block->Read(&expect[0],writer->region_size,writer->base);
+		for(int i = 0; i < 100 && !writer->failed; i++) {
+			const int offset = rand_r(&writer->seed) % writer->region_size;
+			const int size = std::min(1 + (int)(rand_r(&writer->seed) % 20000),writer->region_size - offset);
+			for(int j = offset; j < offset + size; j++) expect[j] = (char)rand_r(&writer->seed);
+			writer->block->Write(&expect[offset],size,writer->base + offset);
+			
+			data.resize(writer->region_size);
+			writer->block->Read(&data[0],writer->region_size,writer->base);
+			writer->failed = memcmp(&data[0],&expect[0],writer->region_size) != 0;
+		}
+	}
+};
+
+static double Now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void CountObject(const std::string& name,void *userdata)
+{
+	(*(int *)userdata)++;
+}
+
+// copies every object of a store, as a crash would leave it
+static void CopyObject(const std::string& name,void *userdata)
+{
+	std::pair<DataStore *,DataStore *> *stores = (std::pair<DataStore *,DataStore *> *)userdata;
+	std::vector<char> object(65536);
+	stores->first->GetObject(name,&object[0],object.size());
+	stores->second->PutObject(name,&object[0],object.size());
+}
+
+static void CopyStore(const char *from,const char *to)
+{
+	FileDataStore source(from), target(to);
+	std::pair<DataStore *,DataStore *> stores(&source,&target);
+	source.ListObjects(CopyObject,&stores);
+}
+
+/**
+ * Forwards to another store, failing every PUT while told to.
+ */
+class FailingDataStore : public DataStore
+{
+private:
+	DataStore *m_store;
+	mutable Mutex m_lock;
+	bool m_failing;
+public:
+	FailingDataStore(DataStore *store) : m_store(store), m_failing(false) {}
+	virtual ~FailingDataStore() { delete m_store; }
+	
+	void SetFailing(bool failing) { ScopedLock lock(m_lock); m_failing = failing; }
+	
+	virtual void PutObject(const std::string& name,const void *data,int size) {
+		{
+			ScopedLock lock(m_lock);
+			if(m_failing) throw WriteErrorException(name + ": Write failed.");
+		}
+		m_store->PutObject(name,data,size);
+	}
+	virtual void GetObject(const std::string& name,void *data,int size) const { m_store->GetObject(name,data,size); }
+	virtual void DeleteObject(const std::string& name) { m_store->DeleteObject(name); }
+	virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const { m_store->ListObjects(list_function,userdata); }
+	virtual void Flush() { m_store->Flush(); }
+};
+
+static BlockID AllocateTestID(void *userdata)
+{
+	return (*(BlockID *)userdata)++;
+}
+
+static void RecordGCPhase(const GarbageCollector::Progress& progress,void *userdata)
+{
+	*(GarbageCollector::Phase *)userdata = progress.phase;
+}
+
 SUITE(BlockStorageTests)
 {
 	TEST_FIXTURE(BlockStorageFixture,BlockReadWriteTest)
@@ -216,4 +319,751 @@ SUITE(BlockStorageTests)
 			CHECK(false);
 		}
 	}
+	
+	TEST(SyncPersistsHeadTest)
+	{
+		TmpDir dir;
+		std::vector<char> expect(4096), data(4096);
+		for(int i = 0; i < 4096; i++) expect[i] = (char)i;
+		
+		BlockStorageDevice block(new FileDataStore(dir.GetPath()));
+		block.Format(4096,2);
+		block.Truncate(4096 * 8);
+		block.WriteBlock(3,&expect[0]);
+		block.Sync();
+		
+		// a second handle on the same store must see the synced head
+		BlockStorageDevice reopened(new FileDataStore(dir.GetPath()));
+		CHECK_EQUAL(4096 * 8,reopened.GetDiskSize());
+		CHECK_EQUAL(2,reopened.GetTreeDepth());
+		reopened.ReadBlock(3,&data[0]);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096);
+		
+		block.Delete();
+	}
+	
+	TEST(NodeCacheTest)
+	{
+		std::vector<char> data(1024,1); // a block of zeros would not be stored
+		CountingDataStore *store = new CountingDataStore(new TmpFileDataStore());
+		BlockStorageDevice block(store);
+		block.Format(1024,3);
+		block.WriteBlock(12345,&data[0]);
+		block.Sync();
+		
+		// the path to the block is cached, only the data object is fetched
+		store->Reset();
+		block.ReadBlock(12345,&data[0]);
+		block.GetDiskSize();
+		CHECK_EQUAL(1,store->gets);
+		
+		// without a cache every level of the tree is fetched
+		block.SetNodeCacheSize(0);
+		store->Reset();
+		block.ReadBlock(12345,&data[0]);
+		CHECK_EQUAL(4,store->gets);
+		
+		block.Delete();
+	}
+	
+	TEST(FailedCheckpointTest)
+	{
+		TmpDir dir;
+		std::vector<char> data(1024,3), read(1024);
+		{
+			FailingDataStore *store = new FailingDataStore(new FileDataStore(dir.GetPath()));
+			BlockStorageDevice block(store);
+			block.Format(1024,3);
+			block.WriteBlock(4321,&data[0]);
+			
+			// nodes of a checkpoint which could not be written are still found in memory
+			store->SetFailing(true);
+			CHECK_THROW(block.Sync(),WriteErrorException);
+			block.ReadBlock(4321,&read[0]);
+			CHECK_ARRAY_EQUAL(&data[0],&read[0],1024);
+			
+			// and the next checkpoint writes them
+			store->SetFailing(false);
+			block.Sync();
+		}
+		
+		BlockStorageDevice reopened(new FileDataStore(dir.GetPath()));
+		reopened.ReadBlock(4321,&read[0]);
+		CHECK_ARRAY_EQUAL(&data[0],&read[0],1024);
+		reopened.Delete();
+	}
+	
+	TEST(BatchedCommitTest)
+	{
+		std::vector<char> data(1024,1);
+		CountingDataStore *store = new CountingDataStore(new TmpFileDataStore());
+		BlockStorageDevice block(store);
+		block.Format(1024,3);
+		
+		// repeated updates within an epoch only write data
+		store->Reset();
+		for(int i = 0; i < 10; i++) block.WriteBlock(777,&data[0]);
+		CHECK_EQUAL(10,store->puts);
+		CHECK_EQUAL(0,store->deletes);
+		
+		// the commit writes the path, a deletion record and the head once,
+		// and queues the old path and the overwritten data for deletion
+		block.Sync();
+		CHECK_EQUAL(10 + 3 + 1 + 1,store->puts);
+		block.Reclaim();
+		CHECK_EQUAL(1 + 9,store->deletes);
+		
+		block.ReadBlock(777,&data[0]);
+		CHECK_EQUAL(1,data[0]);
+		
+		block.Delete();
+	}
+	
+	TEST(DeleteQueueTest)
+	{
+		TmpDir dir;
+		{
+			BlockStorageDevice block(new FileDataStore(dir.GetPath()));
+			block.Format(1024,2);
+		}
+		
+		// supersede 4 data objects and the root, then go away without removing them
+		std::vector<char> data(1024,1);
+		char object[32];
+		CountingDataStore store(new FileDataStore(dir.GetPath()));
+		{
+			BlockMeta meta(&store);
+			for(int i = 0; i < 5; i++) {
+				const BlockID id = meta.AllocateBlockID();
+				sprintf(object,"%.16llX",id);
+				store.PutObject(object,&data[0],1024);
+				meta.SetBlockIDForBlockNo(7,id);
+			}
+			meta.Sync();
+		}
+		
+		// the queue is on the store, a new handle reads the head, finds the
+		// journal empty, reads the deletion record and removes the objects
+		BlockMeta meta(&store);
+		store.Reset();
+		CHECK(meta.ReclaimObjects());
+		CHECK_EQUAL(3,store.gets);
+		CHECK_EQUAL(5,store.deletes);
+		
+		// the record itself goes once a head without it is written
+		meta.Sync();
+		CHECK(meta.ReclaimObjects());
+		CHECK_EQUAL(6,store.deletes);
+		CHECK(!meta.ReclaimObjects());
+		CHECK_EQUAL(6,store.deletes);
+	}
+	
+	TEST(JournalTest)
+	{
+		TmpDir dir, crashed, crashed_again;
+		std::vector<char> expect(1024 * 16), data(1024 * 16);
+		for(int i = 0; i < 1024 * 16; i++) expect[i] = (char)(i / 1024 + 1);
+		
+		CountingDataStore *store = new CountingDataStore(new FileDataStore(dir.GetPath()));
+		BlockStorageDevice block(store);
+		block.Format(1024,3);
+		block.Sync();
+		
+		// a flush writes the data and one log object instead of the paths to the blocks
+		store->Reset();
+		block.Truncate(1024 * 16);
+		block.Write(&expect[0],1024 * 8,0);
+		block.Flush();
+		CHECK_EQUAL(8 + 1,store->puts);
+		
+		// further flushes append to the journal
+		block.Write(&expect[1024 * 8],1024 * 8,1024 * 8);
+		block.Write(&expect[0],1024,1024 * 15);
+		block.Flush();
+		CHECK_EQUAL(8 + 1 + 9 + 1,store->puts);
+		memcpy(&expect[1024 * 15],&expect[0],1024);
+		
+		// a handle on what a crash would leave behind replays the journal
+		// and carries on appending to it
+		CopyStore(dir.GetPath(),crashed.GetPath());
+		{
+			CountingDataStore *reopened_store = new CountingDataStore(new FileDataStore(crashed.GetPath()));
+			BlockStorageDevice reopened(reopened_store);
+			CHECK_EQUAL(1024 * 16,reopened.GetDiskSize());
+			reopened.Write(&expect[1024 * 2],1024,0);
+			reopened.Flush();
+			CHECK_EQUAL(1 + 1,reopened_store->puts);
+			CopyStore(crashed.GetPath(),crashed_again.GetPath());
+		}
+		memcpy(&expect[0],&expect[1024 * 2],1024);
+		
+		// both parts of the journal come back on mount, and the checkpoint
+		// queues the journal and the overwritten blocks for deletion
+		BlockStorageDevice recovered(new FileDataStore(crashed_again.GetPath()));
+		recovered.Check();
+		CHECK_EQUAL(1024 * 16,recovered.GetDiskSize());
+		recovered.Read(&data[0],1024 * 16,0);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],1024 * 16);
+		
+		recovered.Reclaim();
+		recovered.Sync();
+		recovered.Reclaim();
+		CHECK_EQUAL(0,(int)recovered.GC());
+		
+		recovered.Delete();
+		block.Delete();
+	}
+	
+	TEST(GCTest)
+	{
+		TmpDir dir;
+		FileDataStore store(dir.GetPath());
+		std::vector<char> expect(1024 * 300), data(1024 * 300);
+		for(int i = 0; i < 1024 * 300; i++) expect[i] = (char)(i / 1024);
+		
+		BlockStorageDevice block(new FileDataStore(dir.GetPath()));
+		block.Format(1024,2);
+		block.Truncate(1024 * 300);
+		block.Write(&expect[0],1024 * 300,0);
+		block.Sync();
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		
+		int live = 0;
+		store.ListObjects(CountObject,&live);
+		
+		// objects leaked by a crash, and a file which is not ours
+		for(int i = 0; i < 20; i++) {
+			char object[32];
+			sprintf(object,"%.16llX",0xDEAD0000ULL + i);
+			store.PutObject(object,&expect[0],1024);
+		}
+		store.PutObject("README",&expect[0],10);
+		
+		GarbageCollector::Phase phase = GarbageCollector::GC_MARK;
+		block.SetGCProgressCallback(RecordGCPhase,&phase);
+		CHECK_EQUAL(20,(int)block.GC());
+		CHECK_EQUAL(GarbageCollector::GC_DONE,phase);
+		
+		int remaining = 0;
+		store.ListObjects(CountObject,&remaining);
+		CHECK_EQUAL(live + 1,remaining);
+		
+		block.Read(&data[0],1024 * 300,0);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],1024 * 300);
+		
+		// nothing is left to collect
+		CHECK_EQUAL(0,(int)block.GC());
+		block.Delete();
+	}
+	
+	TEST(TruncateTest)
+	{
+		TmpDir dir;
+		FileDataStore store(dir.GetPath());
+		std::vector<char> expect(1024 * 300), data(1024 * 300);
+		for(int i = 0; i < 1024 * 300; i++) expect[i] = (char)(i / 1024 + 1);
+		
+		CountingDataStore *counter = new CountingDataStore(new FileDataStore(dir.GetPath()));
+		BlockStorageDevice block(counter);
+		block.Format(1024,2);
+		block.Truncate(1024 * 300);
+		block.Write(&expect[0],1024 * 300,0);
+		block.Sync();
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		
+		// blocks 0-99 stay behind. The root and the 100 leaves holding them
+		// are rewritten in one commit along with 3 deletion records and the
+		// head, the leaves for 100-127 are dropped whole.
+		counter->Reset();
+		block.Truncate(1024 * 100);
+		CHECK_EQUAL(100 + 1 + 3 + 1,counter->puts);
+		CHECK_EQUAL(0,counter->deletes);
+		block.Sync();
+		CHECK_EQUAL(100 + 1 + 3 + 1,counter->puts);
+		
+		// everything past the cut is freed: the head, root, leaves and data remain
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		int remaining = 0;
+		store.ListObjects(CountObject,&remaining);
+		CHECK_EQUAL(1 + 1 + 100 + 100,remaining);
+		
+		block.Truncate(1024 * 300);
+		block.Read(&data[0],1024 * 300,0);
+		memset(&expect[1024 * 100],0,1024 * 200);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],1024 * 300);
+		
+		// sizes past 4GB
+		const int64_t offset = 4500000000LL;
+		block.Format(4096,3);
+		block.Truncate(5000000000LL);
+		CHECK_EQUAL(5000000000LL,block.GetDiskSize());
+		block.Write(&expect[0],4096,offset);
+		block.Read(&data[0],4096,offset);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096);
+		
+		block.Truncate(offset);
+		block.Truncate(5000000000LL);
+		block.Read(&data[0],4096,offset);
+		CHECK_EQUAL(4096,(int)std::count(data.begin(),data.begin() + 4096,0));
+		
+		block.Delete();
+	}
+	
+	TEST(ZeroBlockTest)
+	{
+		// a set byte anywhere, including the unvectorised tail, is found
+		std::vector<uint8_t> buffer(1000,0);
+		CHECK(IsZeroBlock(&buffer[0],buffer.size()));
+		for(size_t i = 0; i < buffer.size(); i++) {
+			buffer[i] = 0x80;
+			CHECK(!IsZeroBlock(&buffer[0],buffer.size()));
+			CHECK(IsZeroBlock(&buffer[0],i));
+			CHECK(IsZeroBlock(&buffer[i + 1],buffer.size() - i - 1));
+			buffer[i] = 0;
+		}
+		
+		TmpDir dir;
+		FileDataStore store(dir.GetPath());
+		std::vector<char> data(4096,1), zero(4096,0);
+		BlockStorageDevice block(new FileDataStore(dir.GetPath()));
+		block.Format(4096,1);
+		block.Truncate(4096 * 8);
+		block.Sync();
+		int empty = 0;
+		store.ListObjects(CountObject,&empty);
+		
+		// zeros written over data free the object
+		block.WriteBlock(3,&data[0]);
+		block.WriteBlock(3,&zero[0]);
+		block.Write(&zero[0],4096,4096 * 5);
+		block.Sync();
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		int remaining = 0;
+		store.ListObjects(CountObject,&remaining);
+		CHECK_EQUAL(empty,remaining);
+		
+		block.ReadBlock(3,&data[0]);
+		CHECK_ARRAY_EQUAL(&zero[0],&data[0],4096);
+		
+		// the write-back cache leaves holes for zero blocks too
+		block.SetCacheSize(4096 * 16);
+		block.Write(&zero[0],4096,4096 * 6);
+		block.Sync();
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		remaining = 0;
+		store.ListObjects(CountObject,&remaining);
+		CHECK_EQUAL(empty,remaining);
+		
+		block.Delete();
+	}
+	
+	TEST(Sha256Test)
+	{
+		static const uint8_t abc[] = {
+			0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+			0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+		};
+		static const uint8_t million[] = {
+			0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92, 0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+			0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e, 0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0
+		};
+		uint8_t digest[Sha256::DIGEST_SIZE];
+		Sha256::Hash("abc",3,digest);
+		CHECK_ARRAY_EQUAL(abc,digest,Sha256::DIGEST_SIZE);
+		
+		static const uint8_t empty[] = {
+			0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+			0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55
+		};
+		Sha256::Hash(NULL,0,digest);
+		CHECK_ARRAY_EQUAL(empty,digest,Sha256::DIGEST_SIZE);
+		
+		// fed in pieces which straddle the 64 byte chunks
+		std::vector<char> a(1000000,'a');
+		Sha256 sha;
+		for(size_t i = 0; i < a.size(); i += 999) sha.Update(&a[i],std::min<size_t>(999,a.size() - i));
+		sha.Final(digest);
+		CHECK_ARRAY_EQUAL(million,digest,Sha256::DIGEST_SIZE);
+		
+		// RFC 4231 test cases 2 and 6
+		static const uint8_t jefe[] = {
+			0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+			0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43
+		};
+		static const uint8_t long_key[] = {
+			0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f,
+			0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54
+		};
+		Sha256::Hmac("Jefe",4,"what do ya want for nothing?",28,digest);
+		CHECK_ARRAY_EQUAL(jefe,digest,Sha256::DIGEST_SIZE);
+		const std::vector<uint8_t> key(131,0xaa);
+		const char *text = "Test Using Larger Than Block-Size Key - Hash Key First";
+		Sha256::Hmac(&key[0],key.size(),text,strlen(text),digest);
+		CHECK_ARRAY_EQUAL(long_key,digest,Sha256::DIGEST_SIZE);
+	}
+	
+	TEST(DedupTest)
+	{
+		TmpDir dir;
+		FileDataStore store(dir.GetPath());
+		std::vector<char> data(1024), other(1024), zero(1024,0), read(1024);
+		for(int i = 0; i < 1024; i++) {
+			data[i] = (char)(i * 3 + 1);
+			other[i] = (char)(i * 5 + 2);
+		}
+		
+		int empty = 0;
+		{
+			CountingDataStore *counter = new CountingDataStore(new FileDataStore(dir.GetPath()));
+			BlockStorageDevice block(counter);
+			block.Format(1024,2);
+			block.Truncate(1024 * 64);
+			block.Sync();
+			store.ListObjects(CountObject,&empty);
+			
+			// the same contents written to 11 blocks are uploaded once
+			block.SetDedup(true);
+			counter->Reset();
+			for(int i = 0; i < 10; i++) block.WriteBlock(i,&data[0]);
+			block.Write(&data[0],1024,1024 * 10);
+			CHECK_EQUAL(1,counter->puts);
+			block.Sync();
+		}
+		
+		// the index is on the store
+		CountingDataStore *counter = new CountingDataStore(new FileDataStore(dir.GetPath()));
+		BlockStorageDevice block(counter);
+		block.SetDedup(true);
+		counter->Reset();
+		block.WriteBlock(20,&data[0]);
+		CHECK_EQUAL(0,counter->puts);
+		
+		// overwriting most of the blocks leaves the shared object in place
+		for(int i = 0; i < 11; i++) block.WriteBlock(i,&other[0]);
+		CHECK_EQUAL(1,counter->puts);
+		block.Sync();
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		CHECK_EQUAL(0,(int)block.GC());
+		block.ReadBlock(20,&read[0]);
+		CHECK_ARRAY_EQUAL(&data[0],&read[0],1024);
+		block.ReadBlock(7,&read[0]);
+		CHECK_ARRAY_EQUAL(&other[0],&read[0],1024);
+		
+		// with the last references gone the objects and the index go too
+		block.WriteBlock(20,&zero[0]);
+		block.Truncate(0);
+		block.Sync();
+		block.Reclaim();
+		block.Sync();
+		block.Reclaim();
+		int remaining = 0;
+		store.ListObjects(CountObject,&remaining);
+		CHECK_EQUAL(empty,remaining);
+		
+		block.Delete();
+	}
+	
+	TEST(DedupIndexTest)
+	{
+		// 1024 byte objects hold 21 records, so 30 ids in one bucket take two
+		const int block_size = 1024;
+		CountingDataStore counter(new MemoryDataStore());
+		DedupIndex index(&counter);
+		index.Open(0,block_size);
+		const size_t buckets = index.GetBucketCount();
+		
+		std::vector<DedupIndex::Hash> hashes(30);
+		for(size_t i = 0; i < hashes.size(); i++) {
+			hashes[i].words[0] = 5 + buckets * i;
+			hashes[i].words[1] = hashes[i].words[2] = hashes[i].words[3] = i;
+			CHECK(index.Insert(hashes[i],100 * buckets + 5 + buckets * i));
+		}
+		DedupIndex::Hash other = hashes[0];
+		other.words[0] = 7;
+		CHECK(index.Insert(other,100 * buckets + 7));
+		
+		// the caller writes what Commit() lays out
+		std::vector<BlockID> superseded;
+		std::map<BlockID,std::vector<uint64_t> > objects;
+		BlockID next_id = 1;
+		BlockID root = index.Commit(superseded,objects,AllocateTestID,&next_id);
+		CHECK(root != 0);
+		CHECK_EQUAL(0,(int)superseded.size());
+		CHECK_EQUAL(4,(int)objects.size());
+		char object[32];
+		for(std::map<BlockID,std::vector<uint64_t> >::const_iterator it = objects.begin(); it != objects.end(); ++it) {
+			sprintf(object,"%.16llX",it->first);
+			counter.PutObject(object,&it->second[0],block_size);
+		}
+		index.Written();
+		
+		// a lookup reads the root once and then only the bucket's first object
+		index.Open(root,block_size);
+		counter.Reset();
+		CHECK_EQUAL(100 * buckets + 7,index.Acquire(other));
+		CHECK_EQUAL(2,(int)counter.gets);
+		counter.Reset();
+		CHECK_EQUAL(100 * buckets + 5,index.Acquire(hashes[0]));
+		CHECK_EQUAL(2,(int)counter.gets);
+		CHECK_EQUAL(100 * buckets + 5 + buckets * 29,index.Acquire(hashes[29]));
+		CHECK_EQUAL(2,(int)counter.gets);
+		
+		// releasing everything empties the index
+		CHECK_EQUAL(1,(int)index.Release(100 * buckets + 7));
+		CHECK_EQUAL(0,(int)index.Release(100 * buckets + 7));
+		for(size_t i = 0; i < hashes.size(); i++) {
+			const BlockID id = 100 * buckets + 5 + buckets * i;
+			if(i == 0 || i == 29) CHECK_EQUAL(1,(int)index.Release(id));
+			CHECK_EQUAL(0,(int)index.Release(id));
+		}
+		CHECK_EQUAL(-1,(int)index.Release(100 * buckets + 5));
+		superseded.clear();
+		objects.clear();
+		CHECK_EQUAL(0,index.Commit(superseded,objects,AllocateTestID,&next_id));
+		CHECK_EQUAL(4,(int)superseded.size());
+		CHECK_EQUAL(0,(int)objects.size());
+	}
+	
+	TEST(WriteBackCacheTest)
+	{
+		std::vector<char> expect(4096 * 4), data(4096 * 4);
+		for(int i = 0; i < 4096 * 4; i++) expect[i] = (char)(i * 7);
+		
+		CountingDataStore *store = new CountingDataStore(new TmpFileDataStore());
+		BlockStorageDevice block(store);
+		block.Format(4096,2);
+		block.SetEpochInterval(3600);
+		block.SetCacheSize(1024 * 1024);
+		
+		// overwrites of the same blocks are absorbed by the cache
+		store->Reset();
+		for(int i = 0; i < 20; i++) {
+			block.Write(&expect[0],4096 * 4,4096 * 3 + 100);
+		}
+		block.Read(&data[0],4096 * 4,4096 * 3 + 100);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096 * 4);
+		CHECK_EQUAL(0,store->puts);
+		
+		// sync writes each of the 5 touched blocks once, then the root,
+		// the 5 leaves, the deletion record for the old root and the head
+		block.Sync();
+		CHECK_EQUAL(5 + 6 + 1 + 1,store->puts);
+		
+		// dropping the cache reads back the same data from the store
+		block.SetCacheSize(0);
+		block.Read(&data[0],4096 * 4,4096 * 3 + 100);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096 * 4);
+		
+		block.Delete();
+	}
+	
+	TEST(PartialBlockFetchTest)
+	{
+		std::vector<char> expect(65536 * 3), data(65536 * 3);
+		for(int i = 0; i < 65536 * 3; i++) expect[i] = (char)(i / 13 + i);
+		
+		CountingDataStore *store = new CountingDataStore(new TmpFileDataStore());
+		BlockStorageDevice block(store);
+		block.Format(65536,1);
+		block.Write(&expect[0],65536 * 3,0);
+		
+		// the partial first and last blocks are copied from views, the middle one is read in place
+		store->Reset();
+		block.Read(&data[0],65536 * 2,1000);
+		CHECK_ARRAY_EQUAL(&expect[1000],&data[0],65536 * 2);
+		CHECK_EQUAL(2,store->views);
+		CHECK_EQUAL(1,store->gets);
+		
+		// and go into the cache whole
+		block.SetCacheSize(1024 * 1024);
+		block.Read(&data[0],100,65536 * 2 + 500);
+		store->Reset();
+		block.Read(&data[0],65536,65536 * 2);
+		CHECK_ARRAY_EQUAL(&expect[65536 * 2],&data[0],65536);
+		CHECK_EQUAL(0,store->views + store->gets);
+		
+		block.Delete();
+		
+		// the views are taken in the same batch as the whole blocks, so a
+		// read costs a single round of requests
+		SimulatedCloudDataStore *cloud = new SimulatedCloudDataStore(new MemoryDataStore());
+		BlockStorageDevice remote(cloud);
+		remote.Format(65536,1);
+		remote.Write(&expect[0],65536 * 3,0);
+		cloud->SetLatency(SimulatedCloudDataStore::REQUEST_GET,0.1,0);
+		SimulatedCloudDataStore::Stats before, after;
+		cloud->GetStats(&before);
+		const double start = Now();
+		remote.Read(&data[0],65536 * 2,1000);
+		CHECK(Now() - start < 0.2);
+		CHECK_ARRAY_EQUAL(&expect[1000],&data[0],65536 * 2);
+		cloud->GetStats(&after);
+		CHECK_EQUAL(3,(int)(after.requests[SimulatedCloudDataStore::REQUEST_GET] - before.requests[SimulatedCloudDataStore::REQUEST_GET]));
+	}
+	
+	TEST(ReadAheadTest)
+	{
+		const int block_count = 64;
+		std::vector<char> expect(4096 * block_count), data(4096);
+		for(int i = 0; i < 4096 * block_count; i++) expect[i] = (char)(i / 4096 + i);
+		
+		CountingDataStore *store = new CountingDataStore(new TmpFileDataStore());
+		BlockStorageDevice block(store);
+		block.Format(4096,1);
+		block.Write(&expect[0],4096 * block_count,0);
+		block.Truncate(4096 * block_count);
+		block.Sync();
+		
+		block.SetCacheSize(1024 * 1024);
+		block.SetReadAhead(16);
+		store->Reset();
+		
+		// read sequentially a block at a time, overwriting one block ahead of the reader
+		for(int i = 0; i < block_count; i++) {
+			if(i == 20) {
+				memset(&expect[4096 * 30],0x5A,4096);
+				block.WriteBlock(30,&expect[4096 * 30]);
+			}
+			block.Read(&data[0],4096,4096 * i);
+			CHECK_ARRAY_EQUAL(&expect[4096 * i],&data[0],4096);
+		}
+		
+		// each block is fetched once, whether read ahead or on demand, and
+		// the overwritten block once more
+		CHECK(store->gets <= block_count + 1);
+		
+		block.SetReadAhead(0);
+		block.Delete();
+	}
+	
+	TEST(ParallelTransferTest)
+	{
+		const int size = 4096 * 40 + 1000;
+		const uint64_t offset = 4096 * 3 + 123;
+		std::vector<char> expect(size), data(size);
+		for(int i = 0; i < size; i++) expect[i] = (char)(i / 7 + i);
+		
+		CountingDataStore *store = new CountingDataStore(new TmpFileDataStore());
+		BlockStorageDevice block(store);
+		block.Format(4096,1);
+		block.Truncate(offset + size);
+		block.SetQueueDepth(8);
+		
+		// an unaligned write spanning 41 blocks writes each block once
+		store->Reset();
+		block.Write(&expect[0],size,offset);
+		CHECK_EQUAL(41,store->puts);
+		
+		// reads give the same data whichever way they are split
+		const int depths[] = { 1, 8, 64 };
+		for(int i = 0; i < 3; i++) {
+			block.SetQueueDepth(depths[i]);
+			memset(&data[0],0,size);
+			block.Read(&data[0],size,offset);
+			CHECK_ARRAY_EQUAL(&expect[0],&data[0],size);
+			block.Read(&data[0],100,offset + 4096 * 10);
+			CHECK_ARRAY_EQUAL(&expect[4096 * 10],&data[0],100);
+		}
+		
+		block.Delete();
+	}
+	
+	TEST(SegmentPackingTest)
+	{
+		const int block_count = 64;
+		std::vector<char> expect(4096 * block_count), data(4096 * block_count);
+		for(int i = 0; i < 4096 * block_count; i++) expect[i] = (char)(i / 4096 + i);
+		
+		TmpDir dir;
+		CountingDataStore *store = new CountingDataStore(new FileDataStore(dir.GetPath()));
+		BlockStorageDevice block(store);
+		block.Format(4096,1,16);
+		CHECK_EQUAL(16,block.GetSegmentBlocks());
+		block.SetEpochInterval(3600);
+		block.SetCacheSize(1024 * 1024);
+		block.Truncate(4096 * block_count);
+		
+		// flushing packs the blocks into 4 segments
+		store->Reset();
+		block.Write(&expect[0],4096 * block_count,0);
+		block.Sync();
+		CHECK(store->puts < 16);
+		
+		// neighbouring blocks come back with a ranged read per segment
+		block.SetCacheSize(0);
+		store->Reset();
+		block.Read(&data[0],4096 * block_count,0);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096 * block_count);
+		CHECK(store->ranged_gets > 0 && store->ranged_gets <= 4);
+		
+		// the last segment is emptied, the others are left with 2 live blocks each
+		block.SetCacheSize(1024 * 1024);
+		for(int i = 0; i < block_count; i++) {
+			if(i < 48 && i % 16 < 2) continue;
+			memset(&expect[4096 * i],0x40 + i,4096);
+			block.WriteBlock(i,&expect[4096 * i]);
+		}
+		block.Sync();
+		
+		CHECK_EQUAL(4,(int)block.Clean());
+		CHECK_EQUAL(0,(int)block.Clean());
+		block.Sync();
+		block.Reclaim();
+		
+		block.SetCacheSize(0);
+		block.Read(&data[0],4096 * block_count,0);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096 * block_count);
+		CHECK_EQUAL(0,(int)block.GC());
+		
+		BlockStorageDevice reopened(new FileDataStore(dir.GetPath()));
+		CHECK_EQUAL(16,reopened.GetSegmentBlocks());
+		reopened.Read(&data[0],4096 * block_count,0);
+		CHECK_ARRAY_EQUAL(&expect[0],&data[0],4096 * block_count);
+		
+		block.Delete();
+	}
+	
+	TEST(ConcurrentReadWriteTest)
+	{
+		const int threads = 4;
+		const int region_size = 4096 * 16;
+		
+		BlockStorageDevice block(new TmpFileDataStore());
+		block.Format(4096,2);
+		block.Truncate(region_size * threads);
+		
+		// once writing through, once through the cache
+		for(int pass = 0; pass < 2; pass++) {
+			if(pass) block.SetCacheSize(128 * 1024);
+			
+			ConcurrentWriter writers[threads];
+			std::vector<Thread *> running;
+			for(int i = 0; i < threads; i++) {
+				writers[i].block = &block;
+				writers[i].base = (uint64_t)region_size * i;
+				writers[i].region_size = region_size;
+				writers[i].seed = i + pass * threads;
+				writers[i].failed = false;
+				running.push_back(new Thread(ConcurrentWriter::Run,&writers[i]));
+			}
+			for(int i = 0; i < threads; i++) {
+				delete running[i];
+				CHECK(!writers[i].failed);
+			}
+		}
+		
+		block.Delete();
+	}
 }
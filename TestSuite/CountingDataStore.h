@@ -0,0 +1,68 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TestSuite_CountingDataStore_h
+#define __TestSuite_CountingDataStore_h
+
+#include "DataStore.h"
+#include "Thread.h"
+
+/**
+ * A count which background threads may bump while a test reads or resets
+ * it. Reads as an int.
+ */
+class CallCounter
+{
+private:
+	mutable cloudblockfs::Mutex m_lock;
+	int m_count;
+	
+	CallCounter(const CallCounter&);
+	CallCounter& operator =(const CallCounter&);
+public:
+	CallCounter() : m_count(0) {}
+	
+	void Increment() { cloudblockfs::ScopedLock lock(m_lock); m_count++; }
+	void Reset() { cloudblockfs::ScopedLock lock(m_lock); m_count = 0; }
+	operator int() const { cloudblockfs::ScopedLock lock(m_lock); return m_count; }
+};
+
+/**
+ * Forwards to another store and counts the calls made.
+ */
+class CountingDataStore : public cloudblockfs::DataStore
+{
+private:
+	cloudblockfs::DataStore *m_store;
+public:
+	mutable CallCounter puts, gets, ranged_gets, views, deletes;
+	
+	CountingDataStore(cloudblockfs::DataStore *store) : m_store(store) {}
+	virtual ~CountingDataStore() { delete m_store; }
+	
+	void Reset() { puts.Reset(); gets.Reset(); ranged_gets.Reset(); views.Reset(); deletes.Reset(); }
+	
+	virtual void PutObject(const std::string& name,const void *data,int size) { puts.Increment(); m_store->PutObject(name,data,size); }
+	virtual void GetObject(const std::string& name,void *data,int size) const { gets.Increment(); m_store->GetObject(name,data,size); }
+	virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const { ranged_gets.Increment(); m_store->GetObjectRange(name,data,offset,size); }
+	virtual cloudblockfs::ObjectViewPtr GetObjectView(const std::string& name,int size) const { views.Increment(); return m_store->GetObjectView(name,size); }
+	virtual void DeleteObject(const std::string& name) { deletes.Increment(); m_store->DeleteObject(name); }
+	virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const { m_store->ListObjects(list_function,userdata); }
+	virtual void Flush() { m_store->Flush(); }
+};
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TestSuite_MockS3Server_h
+#define __TestSuite_MockS3Server_h
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "S3DataStore.h"
+#include "Sha256.h"
+#include "Thread.h"
+
+/**
+ * A minimal S3 server on the loopback interface, keeping objects in memory.
+ * Handles PUT, ranged GET, DELETE, multi-object delete and ListObjectsV2,
+ * which is sent chunked, and checks the signature of every request against
+ * its secret key. It can be made to answer 503 SlowDown for a while.
+ */
+class MockS3Server
+{
+private:
+	struct Client
+	{
+		MockS3Server *server;
+		int fd;
+		cloudblockfs::Thread *thread;
+	};
+	
+	int m_listen_fd;
+	int m_port;
+	std::string m_access_key;
+	std::string m_secret_key;
+	std::auto_ptr<cloudblockfs::Thread> m_accept_thread;
+	
+	cloudblockfs::Mutex m_lock; // guards everything below
+	std::map<std::string,std::string> m_objects; // by bucket/key
+	std::vector<Client *> m_clients;
+	bool m_shutdown;
+	int m_connections;
+	int m_requests;
+	int m_bad_signatures;
+	int m_requests_per_connection;
+	int m_page_size;
+	int m_busy_requests; // answered with 503 SlowDown
+	int m_bulk_deletes;
+	
+	MockS3Server(const MockS3Server& );
+	MockS3Server& operator=(const MockS3Server& );
+	
+	static std::string Decode(const std::string& text) {
+		std::string decoded;
+		for(size_t i = 0; i < text.size(); i++) {
+			if(text[i] == '%' && i + 2 < text.size()) {
+				decoded += (char)strtol(text.substr(i + 1,2).c_str(),NULL,16);
+				i += 2;
+			} else {
+				decoded += text[i];
+			}
+		}
+		return decoded;
+	}
+	
+	static std::string Escape(const std::string& text) {
+		std::string escaped;
+		for(size_t i = 0; i < text.size(); i++) {
+			switch(text[i]) {
+				case '&': escaped += "&amp;"; break;
+				case '<': escaped += "&lt;"; break;
+				case '>': escaped += "&gt;"; break;
+				default: escaped += text[i]; break;
+			}
+		}
+		return escaped;
+	}
+	
+	static void SendAll(int fd,const std::string& data) {
+		for(size_t sent = 0; sent < data.size(); ) {
+			const ssize_t n = send(fd,data.data() + sent,data.size() - sent,MSG_NOSIGNAL);
+			if(n <= 0) return;
+			sent += n;
+		}
+	}
+	
+	static void Respond(int fd,int status,const std::string& body,bool chunked = false) {
+		char header[128];
+		if(chunked) {
+			sprintf(header,"HTTP/1.1 %d Mock\r\nTransfer-Encoding: chunked\r\n\r\n",status);
+			std::string response = header;
+			
+			// in small chunks, so they straddle reads
+			for(size_t i = 0; i < body.size(); i += 100) {
+				char size[16];
+				sprintf(size,"%x\r\n",(int)std::min<size_t>(100,body.size() - i));
+				response += size + body.substr(i,100) + "\r\n";
+			}
+			SendAll(fd,response + "0\r\n\r\n");
+		} else {
+			sprintf(header,"HTTP/1.1 %d Mock\r\nContent-Length: %d\r\n\r\n",status,(int)body.size());
+			SendAll(fd,header + body);
+		}
+	}
+	
+	static std::string Error(const std::string& code) {
+		return "<Error><Code>" + code + "</Code><Message>Mock &amp; error</Message></Error>";
+	}
+	
+	bool CheckSignature(const std::string& method,const std::string& path,const std::string& query,
+		const std::map<std::string,std::string>& headers,const std::string& body) {
+		std::map<std::string,std::string>::const_iterator authorization = headers.find("authorization");
+		std::map<std::string,std::string>::const_iterator hash = headers.find("x-amz-content-sha256");
+		std::map<std::string,std::string>::const_iterator date = headers.find("x-amz-date");
+		if(authorization == headers.end() || hash == headers.end() || date == headers.end()) return false;
+		
+		uint8_t digest[cloudblockfs::Sha256::DIGEST_SIZE];
+		cloudblockfs::Sha256::Hash(body.data(),body.size(),digest);
+		std::string hex;
+		for(int i = 0; i < cloudblockfs::Sha256::DIGEST_SIZE; i++) {
+			char byte[3];
+			sprintf(byte,"%02x",digest[i]);
+			hex += byte;
+		}
+		if(hex != hash->second) return false;
+		
+		// the headers the client says it signed, as they arrived
+		const size_t start = authorization->second.find("SignedHeaders=") + 14;
+		const std::string names = authorization->second.substr(start,authorization->second.find(',',start) - start);
+		cloudblockfs::S3DataStore::HeaderList signed_headers;
+		for(size_t pos = 0; pos < names.size(); ) {
+			size_t end = names.find(';',pos);
+			if(end == std::string::npos) end = names.size();
+			const std::string name = names.substr(pos,end - pos);
+			signed_headers.push_back(std::make_pair(name,headers.count(name) ? headers.find(name)->second : std::string()));
+			pos = end + 1;
+		}
+		
+		std::vector<std::string> parameters;
+		for(size_t pos = 0; pos < query.size(); ) {
+			size_t end = query.find('&',pos);
+			if(end == std::string::npos) end = query.size();
+			parameters.push_back(query.substr(pos,end - pos));
+			pos = end + 1;
+		}
+		std::sort(parameters.begin(),parameters.end());
+		std::string sorted;
+		for(size_t i = 0; i < parameters.size(); i++) sorted += (i ? "&" : "") + parameters[i];
+		
+		return authorization->second == cloudblockfs::S3DataStore::GetAuthorization(m_access_key,m_secret_key,
+			"us-east-1",date->second,method,path,sorted,signed_headers,hash->second);
+	}
+	
+	void List(int fd,const std::string& bucket,const std::map<std::string,std::string>& parameters) {
+		const std::string prefix = parameters.count("prefix") ? parameters.find("prefix")->second : std::string();
+		const std::string token = parameters.count("continuation-token") ? parameters.find("continuation-token")->second : std::string();
+		const int max_keys = std::min(m_page_size,atoi(parameters.find("max-keys")->second.c_str()));
+		
+		std::string keys, last;
+		int count = 0;
+		bool truncated = false;
+		{
+			cloudblockfs::ScopedLock lock(m_lock);
+			for(std::map<std::string,std::string>::const_iterator it = m_objects.upper_bound(bucket + "/" + token); it != m_objects.end(); ++it) {
+				if(it->first.compare(0,bucket.size() + 1 + prefix.size(),bucket + "/" + prefix) != 0) continue;
+				if(count == max_keys) {
+					truncated = true;
+					break;
+				}
+				last = it->first.substr(bucket.size() + 1);
+				keys += "<Contents><Key>" + Escape(last) + "</Key></Contents>";
+				count++;
+			}
+		}
+		std::string body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<ListBucketResult><Name>" + bucket + "</Name>";
+		body += truncated ? "<IsTruncated>true</IsTruncated><NextContinuationToken>" + Escape(last) + "</NextContinuationToken>" : "<IsTruncated>false</IsTruncated>";
+		Respond(fd,200,body + keys + "</ListBucketResult>",true);
+	}
+	
+	void Delete(int fd,const std::string& bucket,const std::map<std::string,std::string>& headers,const std::string& body) {
+		if(!headers.count("x-amz-checksum-sha256") && !headers.count("content-md5")) {
+			Respond(fd,400,Error("InvalidRequest"));
+			return;
+		}
+		cloudblockfs::ScopedLock lock(m_lock);
+		m_bulk_deletes++;
+		for(size_t pos = body.find("<Key>"); pos != std::string::npos; pos = body.find("<Key>",pos)) {
+			pos += 5;
+			std::string key = body.substr(pos,body.find("</Key>",pos) - pos);
+			static const char *entities[][2] = { { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" } };
+			for(int i = 0; i < 3; i++) {
+				for(size_t at = key.find(entities[i][0]); at != std::string::npos; at = key.find(entities[i][0],at + 1)) {
+					key.replace(at,strlen(entities[i][0]),entities[i][1]);
+				}
+			}
+			m_objects.erase(bucket + "/" + key);
+		}
+		Respond(fd,200,"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<DeleteResult></DeleteResult>");
+	}
+	
+	void Handle(int fd,const std::string& method,const std::string& target,const std::map<std::string,std::string>& headers,const std::string& body) {
+		{
+			cloudblockfs::ScopedLock lock(m_lock);
+			if(m_busy_requests) {
+				m_busy_requests--;
+				Respond(fd,503,Error("SlowDown"));
+				return;
+			}
+		}
+		
+		const size_t question = target.find('?');
+		const std::string path = target.substr(0,question);
+		const std::string query = question == std::string::npos ? std::string() : target.substr(question + 1);
+		if(!CheckSignature(method,path,query,headers,body)) {
+			cloudblockfs::ScopedLock lock(m_lock);
+			m_bad_signatures++;
+			Respond(fd,403,Error("SignatureDoesNotMatch"));
+			return;
+		}
+		
+		const std::string key = Decode(path.substr(1));
+		if(key.find('/') == std::string::npos && method == "POST" && query == "delete=") {
+			Delete(fd,key,headers,body);
+		} else if(key.find('/') == std::string::npos) {
+			std::map<std::string,std::string> parameters;
+			for(size_t pos = 0; pos < query.size(); ) {
+				size_t end = query.find('&',pos);
+				if(end == std::string::npos) end = query.size();
+				const std::string parameter = query.substr(pos,end - pos);
+				parameters[Decode(parameter.substr(0,parameter.find('=')))] = Decode(parameter.substr(parameter.find('=') + 1));
+				pos = end + 1;
+			}
+			List(fd,key,parameters);
+		} else if(method == "PUT") {
+			cloudblockfs::ScopedLock lock(m_lock);
+			m_objects[key] = body;
+			Respond(fd,200,"");
+		} else if(method == "DELETE") {
+			cloudblockfs::ScopedLock lock(m_lock);
+			m_objects.erase(key);
+			Respond(fd,204,"");
+		} else {
+			std::string object;
+			{
+				cloudblockfs::ScopedLock lock(m_lock);
+				if(!m_objects.count(key)) {
+					Respond(fd,404,Error("NoSuchKey"));
+					return;
+				}
+				object = m_objects[key];
+			}
+			std::map<std::string,std::string>::const_iterator range = headers.find("range");
+			if(range == headers.end()) {
+				Respond(fd,200,object);
+				return;
+			}
+			const unsigned long long first = strtoull(range->second.c_str() + 6,NULL,10);
+			const unsigned long long last = strtoull(range->second.c_str() + range->second.find('-') + 1,NULL,10);
+			if(first >= object.size()) Respond(fd,416,Error("InvalidRange"));
+			else Respond(fd,206,object.substr(first,std::min<unsigned long long>(last,object.size() - 1) - first + 1));
+		}
+	}
+	
+	void Serve(int fd) {
+		std::string buffer;
+		char data[4096];
+		int requests = 0;
+		for(;;) {
+			// a request with its body
+			size_t header_end;
+			while((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+				const ssize_t n = recv(fd,data,sizeof(data),0);
+				if(n <= 0) return;
+				buffer.append(data,n);
+			}
+			std::map<std::string,std::string> headers;
+			const std::string request_line = buffer.substr(0,buffer.find("\r\n"));
+			for(size_t pos = buffer.find("\r\n") + 2; pos < header_end; ) {
+				const size_t end = buffer.find("\r\n",pos);
+				const std::string line = buffer.substr(pos,end - pos);
+				std::string name = line.substr(0,line.find(':'));
+				std::transform(name.begin(),name.end(),name.begin(),::tolower);
+				headers[name] = line.substr(line.find(':') + 2);
+				pos = end + 2;
+			}
+			const size_t length = headers.count("content-length") ? atoi(headers["content-length"].c_str()) : 0;
+			while(buffer.size() < header_end + 4 + length) {
+				const ssize_t n = recv(fd,data,sizeof(data),0);
+				if(n <= 0) return;
+				buffer.append(data,n);
+			}
+			const std::string body = buffer.substr(header_end + 4,length);
+			buffer.erase(0,header_end + 4 + length);
+			
+			const size_t space = request_line.find(' ');
+			const std::string method = request_line.substr(0,space);
+			const std::string target = request_line.substr(space + 1,request_line.rfind(' ') - space - 1);
+			Handle(fd,method,target,headers,body);
+			
+			// dropped without notice, as a server's idle timeout would
+			cloudblockfs::ScopedLock lock(m_lock);
+			m_requests++;
+			if(m_requests_per_connection && ++requests >= m_requests_per_connection) return;
+		}
+	}
+	
+	static void ClientThread(void *userdata) {
+		Client *client = (Client *)userdata;
+		client->server->Serve(client->fd);
+		shutdown(client->fd,SHUT_RDWR);
+	}
+	
+	static void AcceptThread(void *userdata) {
+		MockS3Server *server = (MockS3Server *)userdata;
+		for(;;) {
+			const int fd = accept(server->m_listen_fd,NULL,NULL);
+			cloudblockfs::ScopedLock lock(server->m_lock);
+			if(server->m_shutdown) {
+				if(fd >= 0) close(fd);
+				return;
+			}
+			if(fd < 0) continue;
+			Client *client = new Client;
+			client->server = server;
+			client->fd = fd;
+			client->thread = new cloudblockfs::Thread(ClientThread,client);
+			server->m_clients.push_back(client);
+			server->m_connections++;
+		}
+	}
+public:
+	MockS3Server(const std::string& access_key,const std::string& secret_key) : m_port(0),
+		m_access_key(access_key), m_secret_key(secret_key), m_shutdown(false), m_connections(0),
+		m_requests(0), m_bad_signatures(0), m_requests_per_connection(0), m_page_size(1000), m_busy_requests(0),
+		m_bulk_deletes(0) {
+		m_listen_fd = socket(AF_INET,SOCK_STREAM,0);
+		struct sockaddr_in address;
+		memset(&address,0,sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t size = sizeof(address);
+		if(bind(m_listen_fd,(struct sockaddr *)&address,sizeof(address)) == 0 && listen(m_listen_fd,64) == 0 &&
+		   getsockname(m_listen_fd,(struct sockaddr *)&address,&size) == 0) {
+			m_port = ntohs(address.sin_port);
+		}
+		m_accept_thread.reset(new cloudblockfs::Thread(AcceptThread,this));
+	}
+	
+	~MockS3Server() {
+		{
+			cloudblockfs::ScopedLock lock(m_lock);
+			m_shutdown = true;
+			for(size_t i = 0; i < m_clients.size(); i++) shutdown(m_clients[i]->fd,SHUT_RDWR);
+		}
+		shutdown(m_listen_fd,SHUT_RDWR);
+		m_accept_thread.reset();
+		for(size_t i = 0; i < m_clients.size(); i++) {
+			delete m_clients[i]->thread;
+			close(m_clients[i]->fd);
+			delete m_clients[i];
+		}
+		close(m_listen_fd);
+	}
+	
+	std::string GetEndpoint() const {
+		char endpoint[32];
+		sprintf(endpoint,"127.0.0.1:%d",m_port);
+		return endpoint;
+	}
+	
+	/**
+	 * Closes each connection after so many requests, 0 to keep them open.
+	 */
+	void SetRequestsPerConnection(int requests) { cloudblockfs::ScopedLock lock(m_lock); m_requests_per_connection = requests; }
+	
+	/**
+	 * Sets the most keys a listing returns at once.
+	 */
+	void SetPageSize(int keys) { cloudblockfs::ScopedLock lock(m_lock); m_page_size = keys; }
+	
+	/**
+	 * Answers the next so many requests with 503 SlowDown.
+	 */
+	void SetBusy(int requests) { cloudblockfs::ScopedLock lock(m_lock); m_busy_requests = requests; }
+	
+	int GetConnections() { cloudblockfs::ScopedLock lock(m_lock); return m_connections; }
+	int GetRequests() { cloudblockfs::ScopedLock lock(m_lock); return m_requests; }
+	int GetBadSignatures() { cloudblockfs::ScopedLock lock(m_lock); return m_bad_signatures; }
+	int GetBulkDeletes() { cloudblockfs::ScopedLock lock(m_lock); return m_bulk_deletes; }
+};
+
+#endif
@@ -18,6 +18,7 @@
 #ifndef __TestSuite_TmpFileDataStore_h
 #define __TestSuite_TmpFileDataStore_h
 
+#include <stdexcept>
 #include "TmpDir.h"
 #include "DataStore.h"
 #include "FileDataStore.h"
@@ -28,12 +29,18 @@ private:
 	TmpDir m_tmp_dir;
 	cloudblockfs::FileDataStore m_store;
 public:
-	TmpFileDataStore() : m_store(m_tmp_dir.GetPath())
+	TmpFileDataStore(int levels = -1) : m_store(m_tmp_dir.GetPath(),levels)
 	{
 	}
-	virtual ~TmpFileDataStore() {}
+	virtual ~TmpFileDataStore() {
+		// flattening removes the directories objects were spread over
+		try { if(m_store.GetLevels()) m_store.Migrate(0); }
+		catch(const std::runtime_error& ) { }
+	}
 	virtual void PutObject(const std::string& name,const void *data,int size) { m_store.PutObject(name,data,size); }
 	virtual void GetObject(const std::string& name,void *data,int size) const { m_store.GetObject(name,data,size); }
+	virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const { m_store.GetObjectRange(name,data,offset,size); }
+	virtual cloudblockfs::ObjectViewPtr GetObjectView(const std::string& name,int size) const { return m_store.GetObjectView(name,size); }
 	virtual void DeleteObject(const std::string& name) { m_store.DeleteObject(name); }
 	virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const { m_store.ListObjects(list_function,userdata); }
 	virtual void Flush() { m_store.Flush(); }
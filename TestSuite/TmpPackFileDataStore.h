@@ -0,0 +1,55 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TestSuite_TmpPackFileDataStore_h
+#define __TestSuite_TmpPackFileDataStore_h
+
+#include <dirent.h>
+#include <memory>
+#include <unistd.h>
+#include "TmpDir.h"
+#include "DataStore.h"
+#include "PackFileDataStore.h"
+
+class TmpPackFileDataStore : public cloudblockfs::DataStore
+{
+private:
+	TmpDir m_tmp_dir;
+	std::auto_ptr<cloudblockfs::PackFileDataStore> m_store;
+public:
+	TmpPackFileDataStore() : m_store(new cloudblockfs::PackFileDataStore(m_tmp_dir.GetPath()))
+	{
+	}
+	virtual ~TmpPackFileDataStore() {
+		// the segments and index have to go before the directory can
+		m_store.reset();
+		DIR *dirp = opendir(m_tmp_dir.GetPath());
+		struct dirent *dp;
+		while(dirp && (dp = readdir(dirp)) != NULL) {
+			if(dp->d_name[0] != '.') unlink((std::string(m_tmp_dir.GetPath()) + "/" + dp->d_name).c_str());
+		}
+		if(dirp) closedir(dirp);
+	}
+	virtual void PutObject(const std::string& name,const void *data,int size) { m_store->PutObject(name,data,size); }
+	virtual void GetObject(const std::string& name,void *data,int size) const { m_store->GetObject(name,data,size); }
+	virtual void GetObjectRange(const std::string& name,void *data,uint64_t offset,int size) const { m_store->GetObjectRange(name,data,offset,size); }
+	virtual void DeleteObject(const std::string& name) { m_store->DeleteObject(name); }
+	virtual void ListObjects(void (*list_function)(const std::string& name,void *userdata),void *userdata) const { m_store->ListObjects(list_function,userdata); }
+	virtual void Flush() { m_store->Flush(); }
+};
+
+#endif
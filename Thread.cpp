@@ -0,0 +1,192 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include "Exception.h"
+#include "Thread.h"
+
+using namespace cloudblockfs;
+
+bool Condition::TimedWait(Mutex& mutex,int timeout)
+{
+	struct timeval now;
+	struct timespec abstime;
+	gettimeofday(&now,NULL);
+	
+	const long long nsec = (long long)now.tv_usec * 1000 + (long long)(timeout % 1000) * 1000000;
+	abstime.tv_sec = now.tv_sec + timeout / 1000 + nsec / 1000000000;
+	abstime.tv_nsec = nsec % 1000000000;
+	return pthread_cond_timedwait(&m_cond,&mutex.m_mutex,&abstime) != ETIMEDOUT;
+}
+
+void RangeLock::Lock(uint64_t first,uint64_t last,bool exclusive)
+{
+	Range range;
+	range.first = first;
+	range.last = last;
+	range.exclusive = exclusive;
+	
+	ScopedLock lock(m_lock);
+	const std::list<Range>::iterator self = m_waiting.insert(m_waiting.end(),range);
+	for(;;) {
+		// wait for conflicting holders and for conflicting requests which came first
+		bool conflict = false;
+		for(std::list<Range>::const_iterator it = m_held.begin(); it != m_held.end() && !conflict; ++it) {
+			conflict = Conflicts(range,*it);
+		}
+		for(std::list<Range>::const_iterator it = m_waiting.begin(); it != self && !conflict; ++it) {
+			conflict = Conflicts(range,*it);
+		}
+		if(!conflict) break;
+		m_cond.Wait(m_lock);
+	}
+	m_waiting.erase(self);
+	m_held.push_back(range);
+	
+	// requests queued behind this one may be able to go now
+	m_cond.Broadcast();
+}
+
+void RangeLock::Unlock(uint64_t first,uint64_t last,bool exclusive)
+{
+	ScopedLock lock(m_lock);
+	for(std::list<Range>::iterator it = m_held.begin(); it != m_held.end(); ++it) {
+		if(it->first == first && it->last == last && it->exclusive == exclusive) {
+			m_held.erase(it);
+			break;
+		}
+	}
+	m_cond.Broadcast();
+}
+
+struct ThreadStart
+{
+	void (*thread_function)(void *userdata);
+	void *userdata;
+};
+
+static void *ThreadMain(void *arg)
+{
+	ThreadStart start = *(ThreadStart *)arg;
+	delete (ThreadStart *)arg;
+	start.thread_function(start.userdata);
+	return NULL;
+}
+
+Thread::Thread(void (*thread_function)(void *userdata),void *userdata) : m_joined(false)
+{
+	ThreadStart *start = new ThreadStart;
+	start->thread_function = thread_function;
+	start->userdata = userdata;
+	
+	const int err = pthread_create(&m_thread,NULL,ThreadMain,start);
+	if(err != 0) {
+		delete start;
+		throw ThreadException(std::string("Could not create thread: ") + strerror(err));
+	}
+}
+
+void Thread::Join()
+{
+	if(!m_joined) {
+		pthread_join(m_thread,NULL);
+		m_joined = true;
+	}
+}
+
+ThreadPool::ThreadPool(int threads) : m_running(0), m_shutdown(false)
+{
+	try {
+		for(int i = 0; i < threads; i++) {
+			m_threads.push_back(new Thread(WorkerThread,this));
+		}
+	} catch(...) {
+		{
+			ScopedLock lock(m_lock);
+			m_shutdown = true;
+			m_job_cond.Broadcast();
+		}
+		for(std::vector<Thread *>::iterator it = m_threads.begin(); it != m_threads.end(); ++it) {
+			delete *it;
+		}
+		throw;
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		ScopedLock lock(m_lock);
+		m_shutdown = true;
+		m_job_cond.Broadcast();
+	}
+	for(std::vector<Thread *>::iterator it = m_threads.begin(); it != m_threads.end(); ++it) {
+		delete *it;
+	}
+	m_threads.clear();
+	for(std::deque<Job *>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+		delete *it;
+	}
+	m_jobs.clear();
+}
+
+void ThreadPool::Queue(Job *job)
+{
+	ScopedLock lock(m_lock);
+	m_jobs.push_back(job);
+	m_job_cond.Signal();
+}
+
+void ThreadPool::Wait()
+{
+	ScopedLock lock(m_lock);
+	while(!m_jobs.empty() || m_running) {
+		m_idle_cond.Wait(m_lock);
+	}
+}
+
+void ThreadPool::WorkerThread(void *userdata)
+{
+	ThreadPool *pool = (ThreadPool *)userdata;
+	
+	pool->m_lock.Lock();
+	for(;;) {
+		while(pool->m_jobs.empty() && !pool->m_shutdown) {
+			pool->m_job_cond.Wait(pool->m_lock);
+		}
+		if(pool->m_shutdown) break;
+		
+		Job *job = pool->m_jobs.front();
+		pool->m_jobs.pop_front();
+		pool->m_running++;
+		pool->m_lock.Unlock();
+		
+		try {
+			job->Run();
+		} catch(...) {
+			// jobs report their own errors
+		}
+		delete job;
+		
+		pool->m_lock.Lock();
+		pool->m_running--;
+		pool->m_idle_cond.Broadcast();
+	}
+	pool->m_lock.Unlock();
+}
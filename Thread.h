@@ -0,0 +1,233 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_Thread_h
+#define __cloudblockfs_Thread_h
+
+#include <pthread.h>
+#include <inttypes.h>
+#include <deque>
+#include <list>
+#include <vector>
+
+namespace cloudblockfs
+{
+	/**
+	 * Thin wrappers over pthreads.
+	 */
+	class Mutex
+	{
+	private:
+		pthread_mutex_t m_mutex;
+		
+		friend class Condition;
+		
+		Mutex(const Mutex&);
+		Mutex& operator =(const Mutex&);
+	public:
+		Mutex() { pthread_mutex_init(&m_mutex,NULL); }
+		~Mutex() { pthread_mutex_destroy(&m_mutex); }
+		
+		void Lock() { pthread_mutex_lock(&m_mutex); }
+		void Unlock() { pthread_mutex_unlock(&m_mutex); }
+	};
+	
+	/**
+	 * Holds a mutex for the lifetime of the object.
+	 */
+	class ScopedLock
+	{
+	private:
+		Mutex& m_mutex;
+		
+		ScopedLock(const ScopedLock&);
+		ScopedLock& operator =(const ScopedLock&);
+	public:
+		ScopedLock(Mutex& mutex) : m_mutex(mutex) { m_mutex.Lock(); }
+		~ScopedLock() { m_mutex.Unlock(); }
+	};
+	
+	class Condition
+	{
+	private:
+		pthread_cond_t m_cond;
+		
+		Condition(const Condition&);
+		Condition& operator =(const Condition&);
+	public:
+		Condition() { pthread_cond_init(&m_cond,NULL); }
+		~Condition() { pthread_cond_destroy(&m_cond); }
+		
+		/**
+		 * Waits to be signalled. Mutex must be held.
+		 */
+		void Wait(Mutex& mutex) { pthread_cond_wait(&m_cond,&mutex.m_mutex); }
+		
+		/**
+		 * Waits to be signalled or for the timeout to expire. Mutex must be held.
+		 * @param timeout Timeout in milliseconds.
+		 * @return False if the timeout expired.
+		 */
+		bool TimedWait(Mutex& mutex,int timeout);
+		
+		void Signal() { pthread_cond_signal(&m_cond); }
+		void Broadcast() { pthread_cond_broadcast(&m_cond); }
+	};
+	
+	/**
+	 * Reader/writer lock over ranges of numbers. Shared holders of
+	 * overlapping ranges may run together, an exclusive holder excludes
+	 * everyone overlapping its range. Requests are granted in the order
+	 * they arrive, so a steady stream of readers cannot starve a writer.
+	 */
+	class RangeLock
+	{
+	private:
+		struct Range
+		{
+			uint64_t first, last; // inclusive
+			bool exclusive;
+		};
+		std::list<Range> m_held;
+		std::list<Range> m_waiting; // oldest first
+		Mutex m_lock;
+		Condition m_cond;
+		
+		RangeLock(const RangeLock&);
+		RangeLock& operator =(const RangeLock&);
+		
+		static bool Conflicts(const Range& a,const Range& b) {
+			return a.first <= b.last && b.first <= a.last && (a.exclusive || b.exclusive);
+		}
+	public:
+		RangeLock() { }
+		
+		/**
+		 * Waits until no conflicting range is held and takes the range.
+		 */
+		void Lock(uint64_t first,uint64_t last,bool exclusive);
+		
+		/**
+		 * Releases a range taken with the same arguments.
+		 */
+		void Unlock(uint64_t first,uint64_t last,bool exclusive);
+	};
+	
+	/**
+	 * Holds a range of a range lock for the lifetime of the object.
+	 */
+	class ScopedRangeLock
+	{
+	private:
+		RangeLock& m_lock;
+		uint64_t m_first, m_last;
+		bool m_exclusive;
+		
+		ScopedRangeLock(const ScopedRangeLock&);
+		ScopedRangeLock& operator =(const ScopedRangeLock&);
+	public:
+		ScopedRangeLock(RangeLock& lock,uint64_t first,uint64_t last,bool exclusive) : 
+			m_lock(lock), m_first(first), m_last(last), m_exclusive(exclusive) { m_lock.Lock(first,last,exclusive); }
+		~ScopedRangeLock() { m_lock.Unlock(m_first,m_last,m_exclusive); }
+	};
+	
+	/**
+	 * A thread running a function until it returns.
+	 */
+	class Thread
+	{
+	private:
+		pthread_t m_thread;
+		bool m_joined;
+		
+		Thread(const Thread&);
+		Thread& operator =(const Thread&);
+	public:
+		/**
+		 * Starts a new thread.
+		 * @param thread_function Function to run.
+		 * @param userdata User defined data that is passed to thread_function.
+		 */
+		Thread(void (*thread_function)(void *userdata),void *userdata);
+		
+		/**
+		 * Joins the thread if it has not been joined already.
+		 */
+		~Thread() { Join(); }
+		
+		/**
+		 * Waits for the thread function to return.
+		 */
+		void Join();
+	};
+	
+	/**
+	 * A fixed set of threads running queued jobs in order.
+	 */
+	class ThreadPool
+	{
+	public:
+		/**
+		 * A unit of work. The pool deletes the job once it has run, or when
+		 * the pool is destroyed before it got to run.
+		 */
+		class Job
+		{
+		public:
+			virtual ~Job() { }
+			virtual void Run() = 0;
+		};
+	private:
+		std::vector<Thread *> m_threads;
+		std::deque<Job *> m_jobs;
+		Mutex m_lock;
+		Condition m_job_cond; // signalled when a job is queued
+		Condition m_idle_cond; // signalled when a job finishes
+		int m_running;
+		bool m_shutdown;
+		
+		ThreadPool(const ThreadPool&);
+		ThreadPool& operator =(const ThreadPool&);
+		
+		static void WorkerThread(void *userdata);
+	public:
+		/**
+		 * Starts the worker threads.
+		 * @param threads Number of threads.
+		 */
+		ThreadPool(int threads);
+		
+		/**
+		 * Drops any queued jobs and joins the threads once running jobs return.
+		 */
+		~ThreadPool();
+		
+		int GetThreadCount() const { return m_threads.size(); }
+		
+		/**
+		 * Queues a job. The pool takes ownership of the job.
+		 */
+		void Queue(Job *job);
+		
+		/**
+		 * Waits until the queue is empty and no job is running.
+		 */
+		void Wait();
+	};
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdexcept>
+#include "Exception.h"
+#include "ThreadPoolDataStore.h"
+
+using namespace cloudblockfs;
+
+class ThreadPoolDataStore::Operation : public ThreadPool::Job
+{
+public:
+	enum Type { PUT, GET, VIEW, DELETE };
+private:
+	DataStore *m_store;
+	Type m_type;
+	std::string m_name;
+	void *m_data;
+	int m_size;
+	ObjectViewPtr *m_view;
+	CompletionQueue *m_queue;
+	void *m_tag;
+public:
+	Operation(DataStore *store,Type type,const std::string& name,void *data,int size,CompletionQueue *queue,void *tag,
+		ObjectViewPtr *view = NULL) :
+		m_store(store), m_type(type), m_name(name), m_data(data), m_size(size), m_view(view), m_queue(queue), m_tag(tag) { }
+	
+	virtual void Run() {
+		CompletionQueue::Completion completion;
+		completion.tag = m_tag;
+		completion.status = CompletionQueue::COMPLETION_OK;
+		try {
+			switch(m_type) {
+				case PUT: m_store->PutObject(m_name,m_data,m_size); break;
+				case GET: m_store->GetObject(m_name,m_data,m_size); break;
+				case VIEW: *m_view = m_store->GetObjectView(m_name,m_size); break;
+				case DELETE: m_store->DeleteObject(m_name); break;
+			}
+		} catch(const FileNotFoundException& e) {
+			completion.status = CompletionQueue::COMPLETION_NOT_FOUND;
+			completion.error = e.what();
+		} catch(const std::exception& e) {
+			completion.status = CompletionQueue::COMPLETION_ERROR;
+			completion.error = e.what();
+		}
+		m_queue->Post(completion);
+	}
+};
+
+ThreadPoolDataStore::ThreadPoolDataStore(DataStore *store,int threads) : m_store(store), m_pool(threads)
+{
+}
+
+void ThreadPoolDataStore::PutObjectAsync(const std::string& name,const void *data,int size,CompletionQueue *queue,void *tag)
+{
+	m_pool.Queue(new Operation(m_store,Operation::PUT,name,const_cast<void *>(data),size,queue,tag));
+}
+
+void ThreadPoolDataStore::GetObjectAsync(const std::string& name,void *data,int size,CompletionQueue *queue,void *tag)
+{
+	m_pool.Queue(new Operation(m_store,Operation::GET,name,data,size,queue,tag));
+}
+
+void ThreadPoolDataStore::GetObjectViewAsync(const std::string& name,int size,ObjectViewPtr *out_view,CompletionQueue *queue,void *tag)
+{
+	m_pool.Queue(new Operation(m_store,Operation::VIEW,name,NULL,size,queue,tag,out_view));
+}
+
+void ThreadPoolDataStore::DeleteObjectAsync(const std::string& name,CompletionQueue *queue,void *tag)
+{
+	m_pool.Queue(new Operation(m_store,Operation::DELETE,name,NULL,0,queue,tag));
+}
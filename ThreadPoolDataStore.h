@@ -0,0 +1,59 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_ThreadPoolDataStore_h
+#define __cloudblockfs_ThreadPoolDataStore_h
+
+#include "AsyncDataStore.h"
+#include "DataStore.h"
+#include "Thread.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * Makes any data store asynchronous by running its blocking calls on a pool of threads.
+	 */
+	class ThreadPoolDataStore : public AsyncDataStore
+	{
+	private:
+		DataStore *m_store; // not owned
+		ThreadPool m_pool;
+		
+		class Operation;
+	public:
+		/**
+		 * @param store Blocking data store, must outlive this object.
+		 * @param threads Number of operations that may run at once.
+		 */
+		ThreadPoolDataStore(DataStore *store,int threads);
+		
+		/**
+		 * Waits for running operations. Operations which have not started are
+		 * dropped without posting a completion.
+		 */
+		virtual ~ThreadPoolDataStore() { }
+		
+		int GetThreadCount() const { return m_pool.GetThreadCount(); }
+		
+		virtual void PutObjectAsync(const std::string& name,const void *data,int size,CompletionQueue *queue,void *tag);
+		virtual void GetObjectAsync(const std::string& name,void *data,int size,CompletionQueue *queue,void *tag);
+		virtual void GetObjectViewAsync(const std::string& name,int size,ObjectViewPtr *out_view,CompletionQueue *queue,void *tag);
+		virtual void DeleteObjectAsync(const std::string& name,CompletionQueue *queue,void *tag);
+	};
+}
+
+#endif
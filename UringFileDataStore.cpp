@@ -0,0 +1,460 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "Exception.h"
+#include "UringFileDataStore.h"
+
+// io_uring is built in on Linux when the kernel headers know the features
+// used (those of 5.17), unless NO_IO_URING is defined
+#if defined(__linux__) && !defined(HAVE_IO_URING) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_CQE_SKIP
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+using namespace cloudblockfs;
+
+// threads running operations when there is no io_uring
+#define FALLBACK_THREADS 8
+
+#ifdef HAVE_IO_URING
+
+// what a completion is for, kept in the low bits of its user data
+#define STAGE_OPEN 1
+#define STAGE_TRANSFER 2
+#define STAGE_CLOSE 3
+#define STAGE_UNLINK 4
+#define STAGE_MASK 7ULL
+
+// the submission and completion queues shared with the kernel
+struct UringFileDataStore::Ring
+{
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sq_next; // tail including entries not yet handed to the kernel
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	std::vector<int> free_slots; // registered file slots not used by an operation
+	
+	Ring() : fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes((struct io_uring_sqe *)MAP_FAILED) { }
+	~Ring() { Close(); }
+	
+	bool Open(unsigned entries);
+	void Close();
+	int Enter(unsigned to_submit,unsigned min_complete,unsigned flags) {
+		return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,NULL,0);
+	}
+	unsigned GetFreeEntries() const { return sq_entries - (sq_next - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE)); }
+	
+	// the caller makes sure there is room, and fills in the entry before committing it
+	struct io_uring_sqe *NextEntry() {
+		struct io_uring_sqe *sqe = &sqes[sq_next & *sq_mask];
+		memset(sqe,0,sizeof(*sqe));
+		return sqe;
+	}
+	void CommitEntry() {
+		sq_array[sq_next & *sq_mask] = sq_next & *sq_mask;
+		sq_next++;
+		__atomic_store_n(sq_tail,sq_next,__ATOMIC_RELEASE);
+	}
+};
+
+bool UringFileDataStore::Ring::Open(unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params,0,sizeof(params));
+	fd = syscall(__NR_io_uring_setup,entries,&params);
+	if(fd < 0) return false;
+	
+	// skipping the completions of linked steps which succeed needs Linux 5.17
+	if(!(params.features & IORING_FEAT_CQE_SKIP) || !(params.features & IORING_FEAT_SINGLE_MMAP)) return false;
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sq_ring = mmap(NULL,std::max(sq_ring_size,cq_ring_size),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	if(sq_ring == MAP_FAILED) return false;
+	sq_ring_size = std::max(sq_ring_size,cq_ring_size);
+	cq_ring = sq_ring;
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL,sqes_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) return false;
+	
+	sq_head = (unsigned *)((char *)sq_ring + params.sq_off.head);
+	sq_tail = (unsigned *)((char *)sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned *)((char *)sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned *)((char *)sq_ring + params.sq_off.array);
+	sq_entries = params.sq_entries;
+	sq_next = *sq_tail;
+	cq_head = (unsigned *)((char *)cq_ring + params.cq_off.head);
+	cq_tail = (unsigned *)((char *)cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned *)((char *)cq_ring + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)((char *)cq_ring + params.cq_off.cqes);
+	
+	const int ops[] = { IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_UNLINKAT };
+	std::vector<char> buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe *probe = (struct io_uring_probe *)&buffer[0];
+	if(syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256) < 0) return false;
+	for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) return false;
+	}
+	
+	// a file is opened into a registered slot, so the read or write and
+	// close linked to the open can refer to it
+	std::vector<int> files(sq_entries / 2,-1);
+	if(syscall(__NR_io_uring_register,fd,IORING_REGISTER_FILES,&files[0],files.size()) < 0) return false;
+	for(int i = files.size() - 1; i >= 0; i--) free_slots.push_back(i);
+	return true;
+}
+
+void UringFileDataStore::Ring::Close()
+{
+	if(sqes != MAP_FAILED) munmap(sqes,sqes_size);
+	if(sq_ring != MAP_FAILED) munmap(sq_ring,sq_ring_size);
+	if(fd >= 0) close(fd);
+	sqes = (struct io_uring_sqe *)MAP_FAILED;
+	sq_ring = cq_ring = MAP_FAILED;
+	fd = -1;
+}
+
+struct UringFileDataStore::Operation
+{
+	enum Type { PUT, GET, DELETE };
+	
+	Type type;
+	std::string name;
+	std::string path; // read by the kernel, must not change while in flight
+	void *data;
+	int size;
+	CompletionQueue *queue;
+	void *tag;
+	int slot; // registered file slot, -1 if none
+	int result; // first error, 0 if none
+	int transferred; // bytes read or written
+	bool made_shards;
+	ObjectViewPtr view; // a BufferObjectView read into, handed to out_view when done
+	ObjectViewPtr *out_view;
+	
+	Operation(Type type,const std::string& name,const std::string& path,void *data,int size,CompletionQueue *queue,void *tag) :
+		type(type), name(name), path(path), data(data), size(size), queue(queue), tag(tag),
+		slot(-1), result(0), transferred(0), made_shards(false), out_view(NULL) { }
+};
+
+void UringFileDataStore::Start(Operation *op)
+{
+	ScopedLock lock(m_lock);
+	
+	// once every file slot is in use, wait for operations to finish
+	while(m_in_flight >= m_max_in_flight) {
+		SubmitLocked();
+		m_idle_cond.Wait(m_lock);
+	}
+	m_in_flight++;
+	if(op->type == Operation::DELETE) {
+		while(m_ring->GetFreeEntries() < 1) SubmitLocked();
+		struct io_uring_sqe *sqe = m_ring->NextEntry();
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)op->path.c_str();
+		sqe->user_data = (uintptr_t)op | STAGE_UNLINK;
+		m_ring->CommitEntry();
+		m_unsubmitted++;
+	} else {
+		op->slot = m_ring->free_slots.back();
+		m_ring->free_slots.pop_back();
+		QueueOpen(op);
+	}
+}
+
+void UringFileDataStore::QueueOpen(Operation *op)
+{
+	// Open, transfer and close go to the kernel as one chain. Each step
+	// runs whether or not the one before succeeded, and only the close, or
+	// a step which failed, posts a completion.
+	while(m_ring->GetFreeEntries() < 3) SubmitLocked();
+	struct io_uring_sqe *sqe = m_ring->NextEntry();
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)op->path.c_str();
+	if(op->type == Operation::PUT) {
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+		sqe->len = 0600;
+	} else {
+		sqe->open_flags = O_RDONLY;
+	}
+	sqe->file_index = op->slot + 1;
+	sqe->flags = IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = (uintptr_t)op | STAGE_OPEN;
+	m_ring->CommitEntry();
+	
+	sqe = m_ring->NextEntry();
+	sqe->opcode = op->type == Operation::PUT ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = op->slot;
+	sqe->addr = (uintptr_t)op->data;
+	sqe->len = op->size;
+	sqe->off = 0;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = (uintptr_t)op | STAGE_TRANSFER;
+	m_ring->CommitEntry();
+	
+	sqe = m_ring->NextEntry();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = op->slot + 1;
+	sqe->user_data = (uintptr_t)op | STAGE_CLOSE;
+	m_ring->CommitEntry();
+	m_unsubmitted += 3;
+}
+
+void UringFileDataStore::SubmitLocked()
+{
+	if(!m_unsubmitted) return;
+	const int submitted = m_ring->Enter(m_unsubmitted,0,0);
+	if(submitted > 0) m_unsubmitted -= submitted;
+	else if(submitted < 0 && errno != EINTR) sched_yield(); // out of resources for the moment
+}
+
+void UringFileDataStore::Advance(Operation *op,int stage,int result)
+{
+	switch(stage) {
+		case STAGE_OPEN:
+		case STAGE_TRANSFER:
+			// a failed open fails the rest of the chain, the first error tells why
+			if(result < 0 && !op->result) op->result = result;
+			if(stage == STAGE_TRANSFER && result >= 0) op->transferred = result;
+			
+			// a full disk shows up as a short write
+			if(stage == STAGE_TRANSFER && op->type == Operation::PUT && result >= 0 && result < op->size && !op->result) op->result = -ENOSPC;
+			return;
+		case STAGE_CLOSE:
+			if(result < 0 && !op->result) op->result = result;
+			break;
+		case STAGE_UNLINK:
+			op->result = result;
+			break;
+	}
+	
+	if(op->result == -ENOENT && op->type == Operation::PUT && GetLevels() && !op->made_shards) {
+		// directories are made the first time an object hashes to them
+		op->made_shards = true;
+		op->result = 0;
+		try {
+			MakeShards(op->name);
+		} catch(const std::runtime_error& ) {
+		}
+		QueueOpen(op);
+		return;
+	}
+	Finish(op,op->result);
+}
+
+void UringFileDataStore::Finish(Operation *op,int result)
+{
+	CompletionQueue::Completion completion;
+	completion.tag = op->tag;
+	completion.status = CompletionQueue::COMPLETION_OK;
+	if(result < 0) {
+		completion.status = result == -ENOENT && op->type != Operation::PUT ? CompletionQueue::COMPLETION_NOT_FOUND : CompletionQueue::COMPLETION_ERROR;
+		completion.error = op->name + ": " + strerror(-result);
+	} else if(op->type != Operation::GET) {
+		// noted once done, as PutObject() does after the close, so a flush
+		// which comes in the meantime cannot take the note and miss the data
+		AddUnsynced(op->name,op->type == Operation::DELETE);
+	} else if(op->out_view) {
+		// a view ends where the object does
+		static_cast<BufferObjectView *>(op->view.get())->Resize(op->transferred);
+		*op->out_view = op->view;
+	}
+	op->queue->Post(completion);
+	if(op->slot >= 0) m_ring->free_slots.push_back(op->slot);
+	delete op;
+	m_in_flight--;
+	m_idle_cond.Broadcast();
+}
+
+void UringFileDataStore::ReaperThread(void *userdata)
+{
+	UringFileDataStore *store = (UringFileDataStore *)userdata;
+	Ring *ring = store->m_ring.get();
+	
+	ScopedLock lock(store->m_lock);
+	while(!store->m_shutdown) {
+		store->m_lock.Unlock();
+		ring->Enter(0,1,IORING_ENTER_GETEVENTS);
+		store->m_lock.Lock();
+		
+		unsigned head = *ring->cq_head;
+		const unsigned tail = __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			if(!cqe->user_data) continue; // woken for shutdown
+			store->Advance((Operation *)(uintptr_t)(cqe->user_data & ~STAGE_MASK),cqe->user_data & STAGE_MASK,cqe->res);
+		}
+		__atomic_store_n(ring->cq_head,head,__ATOMIC_RELEASE);
+		store->SubmitLocked();
+	}
+}
+
+#else
+
+struct UringFileDataStore::Ring
+{
+};
+
+#endif
+
+UringFileDataStore::UringFileDataStore(const std::string& path,int levels,int entries) : FileDataStore(path,levels),
+	m_in_flight(0), m_max_in_flight(0), m_unsubmitted(0), m_shutdown(false)
+{
+#ifdef HAVE_IO_URING
+	std::auto_ptr<Ring> ring(new Ring);
+	if(ring->Open(entries)) {
+		// one operation per file slot, each posts at most three completions
+		// and the completion queue holds twice the entries
+		m_ring = ring;
+		m_max_in_flight = m_ring->free_slots.size();
+		m_reaper.reset(new Thread(ReaperThread,this));
+		return;
+	}
+#else
+	(void)entries;
+#endif
+	m_fallback.reset(new ThreadPoolDataStore(this,FALLBACK_THREADS));
+}
+
+UringFileDataStore::~UringFileDataStore()
+{
+	m_fallback.reset();
+#ifdef HAVE_IO_URING
+	if(m_ring.get()) {
+		{
+			ScopedLock lock(m_lock);
+			SubmitLocked();
+			while(m_in_flight) m_idle_cond.Wait(m_lock);
+			
+			// wake the reaper with an entry which completes straight away
+			m_shutdown = true;
+			while(m_ring->GetFreeEntries() < 1) SubmitLocked();
+			struct io_uring_sqe *sqe = m_ring->NextEntry();
+			sqe->opcode = IORING_OP_NOP;
+			m_ring->CommitEntry();
+			m_unsubmitted++;
+			SubmitLocked();
+		}
+		m_reaper.reset();
+	}
+#endif
+}
+
+void UringFileDataStore::PutObjectAsync(const std::string& name,const void *data,int size,CompletionQueue *queue,void *tag)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring.get()) {
+		Start(new Operation(Operation::PUT,name,GetObjectPath(name),const_cast<void *>(data),size,queue,tag));
+		return;
+	}
+#endif
+	m_fallback->PutObjectAsync(name,data,size,queue,tag);
+}
+
+void UringFileDataStore::GetObjectAsync(const std::string& name,void *data,int size,CompletionQueue *queue,void *tag)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring.get()) {
+		Start(new Operation(Operation::GET,name,GetObjectPath(name),data,size,queue,tag));
+		return;
+	}
+#endif
+	m_fallback->GetObjectAsync(name,data,size,queue,tag);
+}
+
+void UringFileDataStore::GetObjectViewAsync(const std::string& name,int size,ObjectViewPtr *out_view,CompletionQueue *queue,void *tag)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring.get()) {
+		// objects too small to map are read through the ring
+		if(size < GetMapThreshold()) {
+			BufferObjectView *view = new BufferObjectView(std::max(size,0));
+			Operation *op = new Operation(Operation::GET,name,GetObjectPath(name),view->GetBuffer(),std::max(size,0),queue,tag);
+			op->view.reset(view);
+			op->out_view = out_view;
+			Start(op);
+			return;
+		}
+		
+		// a mapping reads nothing until it is copied from, so it is made straight away
+		CompletionQueue::Completion completion;
+		completion.tag = tag;
+		completion.status = CompletionQueue::COMPLETION_OK;
+		try {
+			*out_view = GetObjectView(name,size);
+		} catch(const FileNotFoundException& e) {
+			completion.status = CompletionQueue::COMPLETION_NOT_FOUND;
+			completion.error = e.what();
+		} catch(const std::exception& e) {
+			completion.status = CompletionQueue::COMPLETION_ERROR;
+			completion.error = e.what();
+		}
+		queue->Post(completion);
+		return;
+	}
+#endif
+	m_fallback->GetObjectViewAsync(name,size,out_view,queue,tag);
+}
+
+void UringFileDataStore::DeleteObjectAsync(const std::string& name,CompletionQueue *queue,void *tag)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring.get()) {
+		Start(new Operation(Operation::DELETE,name,GetObjectPath(name),NULL,0,queue,tag));
+		return;
+	}
+#endif
+	m_fallback->DeleteObjectAsync(name,queue,tag);
+}
+
+void UringFileDataStore::Submit()
+{
+#ifdef HAVE_IO_URING
+	if(m_ring.get()) {
+		ScopedLock lock(m_lock);
+		SubmitLocked();
+		return;
+	}
+#endif
+	m_fallback->Submit();
+}
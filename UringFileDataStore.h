@@ -0,0 +1,98 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_UringFileDataStore_h
+#define __cloudblockfs_UringFileDataStore_h
+
+#include <memory>
+#include "AsyncDataStore.h"
+#include "FileDataStore.h"
+#include "Thread.h"
+#include "ThreadPoolDataStore.h"
+
+namespace cloudblockfs
+{
+	/**
+	 * A FileDataStore which runs its asynchronous operations on an io_uring.
+	 *
+	 * Each object is opened, written or read, and closed by a chain of
+	 * linked requests into a registered file slot, which the kernel runs
+	 * without a thread per operation and which posts a single completion.
+	 * Operations are held back until Submit(), so a batch of them costs one
+	 * system call. A view of an object too small to map is read the same
+	 * way, a larger one is mapped at once, since that reads nothing. A thread reaps the completions and posts them to their
+	 * queues. The blocking calls are those of FileDataStore.
+	 *
+	 * HAVE_IO_URING is defined on Linux when the kernel headers are new
+	 * enough, and NO_IO_URING leaves it out. Built without it, or on a
+	 * kernel older than Linux 5.17, the asynchronous operations run on a
+	 * pool of threads instead.
+	 */
+	class UringFileDataStore : public FileDataStore, public AsyncDataStore
+	{
+	private:
+		struct Ring;
+		struct Operation;
+		
+		std::auto_ptr<Ring> m_ring; // NULL when falling back to threads
+		std::auto_ptr<ThreadPoolDataStore> m_fallback;
+		
+		Mutex m_lock; // guards the submission queue and the counts below
+		Condition m_idle_cond; // signalled when an operation finishes
+		int m_in_flight; // operations started and not finished
+		int m_max_in_flight; // one per file slot, so completions never overflow the ring
+		unsigned m_unsubmitted; // entries queued since the last submit
+		bool m_shutdown;
+		std::auto_ptr<Thread> m_reaper;
+		
+		UringFileDataStore(const UringFileDataStore&);
+		UringFileDataStore& operator =(const UringFileDataStore&);
+		
+		static void ReaperThread(void *userdata);
+		void Start(Operation *op);
+		void QueueOpen(Operation *op);
+		void SubmitLocked();
+		void Advance(Operation *op,int stage,int result);
+		void Finish(Operation *op,int result);
+	public:
+		/**
+		 * Opens a store.
+		 * @param path Directory of the store.
+		 * @param levels Levels of directories, see FileDataStore.
+		 * @param entries Size of the submission queue, half as many operations may be in flight.
+		 */
+		UringFileDataStore(const std::string& path,int levels = -1,int entries = 128);
+		
+		/**
+		 * Waits for operations in flight.
+		 */
+		virtual ~UringFileDataStore();
+		
+		/**
+		 * Returns false if asynchronous operations fall back to threads.
+		 */
+		bool IsUsingRing() const { return m_ring.get() != NULL; }
+		
+		virtual void PutObjectAsync(const std::string& name,const void *data,int size,CompletionQueue *queue,void *tag);
+		virtual void GetObjectAsync(const std::string& name,void *data,int size,CompletionQueue *queue,void *tag);
+		virtual void GetObjectViewAsync(const std::string& name,int size,ObjectViewPtr *out_view,CompletionQueue *queue,void *tag);
+		virtual void DeleteObjectAsync(const std::string& name,CompletionQueue *queue,void *tag);
+		virtual void Submit();
+	};
+}
+
+#endif
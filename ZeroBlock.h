@@ -0,0 +1,72 @@
+/*
+ This file is part of CloudBlockFS.
+ Copyright (c) 2009 Sound <sound -at- sagaforce -dot- com>
+ 
+ WifiPad is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ WifiPad is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with WifiPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __cloudblockfs_ZeroBlock_h
+#define __cloudblockfs_ZeroBlock_h
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace cloudblockfs
+{
+	/**
+	 * Returns true if every byte of data is zero. The bulk of the buffer is
+	 * scanned with AVX2 or SSE2 when the compiler targets them, several
+	 * vectors at a time, and the scan stops at the first chunk with a set
+	 * bit so ordinary data is rejected almost straight away.
+	 * @param data Buffer to scan, no alignment needed.
+	 * @param size Size in bytes.
+	 */
+	static inline bool IsZeroBlock(const void *data,size_t size)
+	{
+		const uint8_t *p = (const uint8_t *)data;
+		const uint8_t *end = p + size;
+#if defined(__AVX2__)
+		for(; end - p >= 128; p += 128) {
+			const __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p),_mm256_loadu_si256((const __m256i *)(p + 32)));
+			const __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 64)),_mm256_loadu_si256((const __m256i *)(p + 96)));
+			const __m256i acc = _mm256_or_si256(a,b);
+			if(!_mm256_testz_si256(acc,acc)) return false;
+		}
+#elif defined(__SSE2__)
+		for(; end - p >= 64; p += 64) {
+			const __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p),_mm_loadu_si128((const __m128i *)(p + 16)));
+			const __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),_mm_loadu_si128((const __m128i *)(p + 48)));
+			const __m128i acc = _mm_or_si128(a,b);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc,_mm_setzero_si128())) != 0xFFFF) return false;
+		}
+#endif
+		// whatever the vector loop left over, or everything on other targets
+		for(; end - p >= 8; p += 8) {
+			uint64_t word;
+			memcpy(&word,p,sizeof(word));
+			if(word) return false;
+		}
+		for(; p < end; p++) {
+			if(*p) return false;
+		}
+		return true;
+	}
+}
+
+#endif